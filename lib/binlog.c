@@ -0,0 +1,568 @@
+/* binlog.c -- Compact binary log files
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "binlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+
+/* Frames are collected in memory, and written once this many bytes
+   are waiting, or when flushed explicitly. */
+#define UL_BINLOG_FLUSH_SIZE (64 * 1024)
+
+/* Strings are looked up by address, and verified by content, much like
+   compiled formats are. When the table is full, strings are stored in
+   the records themselves. */
+#define UL_BINLOG_STRINGS   4096 /* Must be a power of two. */
+#define UL_BINLOG_MAX_PROBE 16
+
+static void
+_ul_binlog_abi (ul_binlog_abi_t *abi)
+{
+  memset (abi, 0, sizeof (*abi));
+  abi->byte_order = 0x01020304;
+  abi->sizes[0] = sizeof (int);
+  abi->sizes[1] = sizeof (long);
+  abi->sizes[2] = sizeof (long long);
+  abi->sizes[3] = sizeof (intmax_t);
+  abi->sizes[4] = sizeof (size_t);
+  abi->sizes[5] = sizeof (ptrdiff_t);
+  abi->sizes[6] = sizeof (double);
+  abi->sizes[7] = sizeof (long double);
+  abi->sizes[8] = sizeof (wint_t);
+  abi->sizes[9] = sizeof (void *);
+}
+
+static inline size_t
+_ul_varint_size (uint64_t value)
+{
+  size_t size = 1;
+
+  while (value >= 0x80)
+    {
+      value >>= 7;
+      size++;
+    }
+  return size;
+}
+
+static inline char *
+_ul_varint_write (char *p, uint64_t value)
+{
+  while (value >= 0x80)
+    {
+      *p++ = (char)(value | 0x80);
+      value >>= 7;
+    }
+  *p++ = (char)value;
+  return p;
+}
+
+int
+ul_binlog_put_varint (ul_buffer_t *buffer, uint64_t value)
+{
+  if (ul_buffer_reserve (buffer, 10) != 0)
+    return -1;
+  buffer->ptr = _ul_varint_write (buffer->ptr, value);
+  return 0;
+}
+
+/* Append a complete frame to the output. */
+static int
+_ul_binlog_frame (ul_binlog_t *log, int type, uint64_t id,
+                  const char *payload, size_t len)
+{
+  ul_buffer_t *out = &log->out;
+  size_t id_len = (id != 0) ? _ul_varint_size (id) : 0;
+
+  if (ul_buffer_reserve (out, 1 + 10 + id_len + len) != 0)
+    return -1;
+  *out->ptr++ = (char)type;
+  out->ptr = _ul_varint_write (out->ptr, id_len + len);
+  if (id != 0)
+    out->ptr = _ul_varint_write (out->ptr, id);
+  memcpy (out->ptr, payload, len);
+  out->ptr += len;
+
+  if ((size_t)(out->ptr - out->msg) >= UL_BINLOG_FLUSH_SIZE)
+    return ul_binlog_flush (log);
+  return 0;
+}
+
+static void
+_ul_binlog_reset (ul_binlog_t *log)
+{
+  size_t i;
+
+  for (i = 0; i < UL_BINLOG_STRINGS; i++)
+    {
+      free (log->strings[i].copy);
+      log->strings[i].copy = NULL;
+      log->strings[i].ptr = NULL;
+    }
+  log->next_id = 1;
+  log->last_ns = 0;
+  log->context_valid = 0;
+  free ((char *)log->context.host);
+  free ((char *)log->context.program);
+  log->context.host = NULL;
+  log->context.program = NULL;
+}
+
+static int
+_ul_binlog_header (ul_binlog_t *log)
+{
+  ul_binlog_abi_t abi;
+  char header[sizeof (UL_BINLOG_MAGIC) + sizeof (abi)];
+
+  /* The magic is followed by the version instead of its NUL. */
+  _ul_binlog_abi (&abi);
+  memcpy (header, UL_BINLOG_MAGIC, sizeof (UL_BINLOG_MAGIC) - 1);
+  header[sizeof (UL_BINLOG_MAGIC) - 1] = UL_BINLOG_VERSION;
+  memcpy (header + sizeof (UL_BINLOG_MAGIC), &abi, sizeof (abi));
+  return _ul_binlog_frame (log, UL_BINLOG_HEADER, 0,
+                           header, sizeof (header));
+}
+
+/* WRITTEN bytes of the buffer made it to the file, possibly ending in
+   the middle of a frame: those are cut off, if the file can be
+   truncated, and the rest is dropped. Only async-signal-safe calls are
+   made. */
+static void
+_ul_binlog_drop (ul_binlog_t *log, size_t written)
+{
+  int saved_errno = errno;
+  off_t end;
+
+  if (written != 0 && (end = lseek (log->fd, 0, SEEK_CUR)) != -1 &&
+      ftruncate (log->fd, end - written) != 0)
+    {
+      /* Nothing more can be done about it. */
+    }
+
+  log->out.ptr = log->out.msg;
+  errno = saved_errno;
+}
+
+/* Strings, the context and the timestamp base that could not be
+   written are still what everything that follows refers to: start a
+   new session instead, as if the file was opened again, so that the
+   next record defines what it needs. */
+static void
+_ul_binlog_write_failed (ul_binlog_t *log, size_t written)
+{
+  int saved_errno = errno;
+
+  _ul_binlog_drop (log, written);
+  _ul_binlog_reset (log);
+  log->session++;
+  _ul_binlog_header (log);
+  errno = saved_errno;
+}
+
+ul_binlog_t *
+ul_binlog_open (const char *path)
+{
+  ul_binlog_t *log;
+  int saved_errno;
+
+  log = calloc (1, sizeof (*log));
+  if (log == NULL)
+    return NULL;
+  log->fd = -1;
+  log->strings = calloc (UL_BINLOG_STRINGS, sizeof (ul_binlog_string_t));
+  if (log->strings == NULL)
+    goto err;
+  _ul_binlog_reset (log);
+
+  log->fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+  if (log->fd == -1)
+    goto err;
+
+  if (_ul_binlog_header (log) != 0 || ul_binlog_flush (log) != 0 ||
+      ul_buffer_reserve (&log->out, UL_BINLOG_CRASH_SIZE) != 0)
+    goto err;
+
+  return log;
+
+ err:
+  saved_errno = errno;
+  if (log->fd != -1)
+    close (log->fd);
+  if (log->strings != NULL)
+    _ul_binlog_reset (log);
+  free (log->strings);
+  free (log->out.msg);
+  free (log);
+  errno = saved_errno;
+  return NULL;
+}
+
+/* Write out the buffer; returns how much of it made it to the file if
+   that failed, or -1 if it was all written. */
+static ssize_t
+_ul_binlog_write (ul_binlog_t *log)
+{
+  const char *p = log->out.msg;
+
+  while (p < log->out.ptr)
+    {
+      ssize_t n = write (log->fd, p, log->out.ptr - p);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return p - log->out.msg;
+        }
+      p += n;
+    }
+  log->out.ptr = log->out.msg;
+  return -1;
+}
+
+int
+ul_binlog_flush (ul_binlog_t *log)
+{
+  ssize_t written = _ul_binlog_write (log);
+
+  if (written < 0)
+    return 0;
+  /* Drop what could not be written, instead of retrying it with every
+     record from now on. */
+  _ul_binlog_write_failed (log, written);
+  return -1;
+}
+
+/* Like ul_binlog_flush(), from a crash handler: what could not be
+   written is dropped, but no new session is started, as that would
+   free and allocate. The 'J' frames written from there do not refer to
+   anything the session defined. */
+int
+ul_binlog_crash_flush (ul_binlog_t *log)
+{
+  ssize_t written = _ul_binlog_write (log);
+
+  if (written < 0)
+    return 0;
+  _ul_binlog_drop (log, written);
+  return -1;
+}
+
+/* Forget about anything not written yet. */
+void
+ul_binlog_discard (ul_binlog_t *log)
+{
+  log->out.ptr = log->out.msg;
+}
+
+int
+ul_binlog_close (ul_binlog_t *log)
+{
+  int ret;
+
+  if (log == NULL)
+    return 0;
+
+  ret = ul_binlog_flush (log);
+  if (close (log->fd) != 0)
+    ret = -1;
+  _ul_binlog_reset (log);
+  free (log->strings);
+  free (log->out.msg);
+  free (log->record.msg);
+  free (log);
+
+  return ret;
+}
+
+static inline int
+_ul_str_changed (const char *old, const char *new)
+{
+  if (old == NULL || new == NULL)
+    return old != new;
+  return strcmp (old, new) != 0;
+}
+
+static int
+_ul_binlog_put_bytes (ul_buffer_t *buffer, const char *str, size_t len)
+{
+  if (ul_binlog_put_varint (buffer, len) != 0)
+    return -1;
+  return ul_buffer_append_raw (buffer, str, len) ? 0 : -1;
+}
+
+/* Write a context frame, if CTX differs from the current one. Must not
+   be called while a frame is being built. */
+int
+ul_binlog_set_context (ul_binlog_t *log, const ul_binlog_context_t *ctx)
+{
+  ul_binlog_context_t *cur = &log->context;
+  ul_buffer_t *buffer;
+
+  if (log->context_valid &&
+      cur->flags == ctx->flags && cur->fields == ctx->fields &&
+      cur->facility == ctx->facility &&
+      cur->timestamp_mode == ctx->timestamp_mode &&
+      cur->gmtoff == ctx->gmtoff &&
+      cur->pid == ctx->pid && cur->uid == ctx->uid && cur->gid == ctx->gid &&
+      !_ul_str_changed (cur->host, ctx->host) &&
+      !_ul_str_changed (cur->program, ctx->program))
+    return 0;
+
+  free ((char *)cur->host);
+  free ((char *)cur->program);
+  *cur = *ctx;
+  cur->host = strdup (ctx->host);
+  cur->program = ctx->program ? strdup (ctx->program) : NULL;
+  log->context_valid = (cur->host != NULL &&
+                        (cur->program != NULL) == (ctx->program != NULL));
+
+  buffer = ul_binlog_begin (log);
+  if (ul_binlog_put_varint (buffer, ctx->flags) != 0 ||
+      ul_binlog_put_varint (buffer, ctx->facility) != 0 ||
+      ul_binlog_put_varint (buffer, ctx->timestamp_mode) != 0 ||
+      ul_binlog_put_varint (buffer, ctx->pid) != 0 ||
+      ul_binlog_put_varint (buffer, ctx->uid) != 0 ||
+      ul_binlog_put_varint (buffer, ctx->gid) != 0 ||
+      _ul_binlog_put_bytes (buffer, ctx->host, strlen (ctx->host)) != 0)
+    return -1;
+  if (ctx->program == NULL)
+    {
+      if (ul_binlog_put_varint (buffer, 0) != 0)
+        return -1;
+    }
+  else
+    {
+      size_t len = strlen (ctx->program);
+
+      if (ul_binlog_put_varint (buffer, len + 1) != 0 ||
+          ul_buffer_append_raw (buffer, ctx->program, len) == NULL)
+        return -1;
+    }
+  if (ul_binlog_put_varint (buffer, ctx->fields) != 0 ||
+      ul_binlog_put_varint (buffer, ((uint64_t)ctx->gmtoff << 1) ^
+                            (uint64_t)((int64_t)ctx->gmtoff >> 63)) != 0)
+    return -1;
+
+  return ul_binlog_end (log, UL_BINLOG_CONTEXT);
+}
+
+ul_buffer_t *
+ul_binlog_begin (ul_binlog_t *log)
+{
+  log->record.ptr = log->record.msg;
+  log->frame_session = log->session;
+  return &log->record;
+}
+
+/* Frames that may refer to anything from before a new session was
+   started are dropped, with errno set to EIO. */
+int
+ul_binlog_end (ul_binlog_t *log, int type)
+{
+  if (log->frame_session != log->session)
+    {
+      errno = EIO;
+      return -1;
+    }
+  return _ul_binlog_frame (log, type, 0, log->record.msg,
+                           log->record.ptr - log->record.msg);
+}
+
+/* Append a 'J' frame from a crash handler, without allocating: if it
+   does not fit even after a flush, it is dropped, with errno set to
+   ENOBUFS. */
+int
+ul_binlog_crash_json (ul_binlog_t *log, int priority, const char *msg,
+                      size_t len)
+{
+  ul_buffer_t *out = &log->out;
+  size_t payload = _ul_varint_size (priority) + len;
+  size_t size = 1 + _ul_varint_size (payload) + payload;
+
+  if ((size_t)(out->alloc_end - out->ptr) < size &&
+      ul_binlog_crash_flush (log) != 0)
+    return -1;
+  if ((size_t)(out->alloc_end - out->ptr) < size)
+    {
+      errno = ENOBUFS;
+      return -1;
+    }
+
+  *out->ptr++ = UL_BINLOG_JSON;
+  out->ptr = _ul_varint_write (out->ptr, payload);
+  out->ptr = _ul_varint_write (out->ptr, priority);
+  memcpy (out->ptr, msg, len);
+  out->ptr += len;
+  return 0;
+}
+
+static inline ul_binlog_string_t *
+_ul_binlog_string_lookup (ul_binlog_t *log, const char *str, size_t len)
+{
+  uintptr_t h = (uintptr_t)str;
+  size_t i;
+
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+
+  for (i = 0; i < UL_BINLOG_MAX_PROBE; i++)
+    {
+      ul_binlog_string_t *s =
+        &log->strings[(h + i) & (UL_BINLOG_STRINGS - 1)];
+
+      if (s->ptr == NULL)
+        {
+          s->copy = malloc (len ? len : 1);
+          if (s->copy == NULL)
+            return NULL;
+          memcpy (s->copy, str, len);
+          s->ptr = str;
+          s->len = len;
+          s->id = log->next_id++;
+          if (_ul_binlog_frame (log, UL_BINLOG_STRING, s->id,
+                                str, len) != 0)
+            return NULL;
+          return s;
+        }
+      if (s->ptr == str && s->len == len && memcmp (s->copy, str, len) == 0)
+        return s;
+    }
+  return NULL;
+}
+
+/* Append a reference to STR, defining it first, if need be. */
+int
+ul_binlog_put_string (ul_binlog_t *log, ul_buffer_t *buffer,
+                      const char *str, size_t len)
+{
+  ul_binlog_string_t *s = _ul_binlog_string_lookup (log, str, len);
+
+  if (s != NULL)
+    return ul_binlog_put_varint (buffer, s->id);
+
+  if (ul_binlog_put_varint (buffer, 0) != 0)
+    return -1;
+  return _ul_binlog_put_bytes (buffer, str, len);
+}
+
+int
+ul_binlog_put_timestamp (ul_binlog_t *log, ul_buffer_t *buffer,
+                         const struct timespec *ts)
+{
+  int64_t ns = (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+  int64_t delta = ns - log->last_ns;
+
+  log->last_ns = ns;
+  return ul_binlog_put_varint (buffer, ((uint64_t)delta << 1) ^
+                               (uint64_t)(delta >> 63));
+}
+
+int
+ul_binlog_get_varint (const char **p, const char *end, uint64_t *value)
+{
+  uint64_t v = 0;
+  int shift;
+
+  for (shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+      unsigned char c = (unsigned char)*(*p)++;
+
+      v |= (uint64_t)(c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+        {
+          *value = v;
+          return 0;
+        }
+    }
+  return -1;
+}
+
+/* Read the next frame into FRAME, which will hold the payload only.
+   Returns 1 if there was a frame, 0 at the end of the file, and -1 if
+   the file is truncated or corrupt. */
+int
+ul_binlog_read_frame (FILE *in, ul_buffer_t *frame, int *type)
+{
+  uint64_t len = 0;
+  int c, shift;
+
+  c = getc (in);
+  if (c == EOF)
+    return 0;
+  *type = c;
+
+  for (shift = 0; ; shift += 7)
+    {
+      if (shift >= 64 || (c = getc (in)) == EOF)
+        return -1;
+      len |= (uint64_t)(c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+        break;
+    }
+  if (len > UINT32_MAX)
+    return -1;
+
+  frame->ptr = frame->msg;
+  if (ul_buffer_reserve (frame, len + 1) != 0)
+    return -1;
+  if (fread (frame->ptr, 1, len, in) != len)
+    return -1;
+  frame->ptr += len;
+  /* Makes string payloads easier to deal with. */
+  *frame->ptr = '\0';
+
+  return 1;
+}
+
+/* Returns zero if the header is one we can decode. */
+int
+ul_binlog_check_header (const char *payload, size_t len)
+{
+  ul_binlog_abi_t abi;
+
+  if (len != sizeof (UL_BINLOG_MAGIC) + sizeof (abi) ||
+      memcmp (payload, UL_BINLOG_MAGIC, sizeof (UL_BINLOG_MAGIC) - 1) != 0 ||
+      payload[sizeof (UL_BINLOG_MAGIC) - 1] != UL_BINLOG_VERSION)
+    return -1;
+
+  _ul_binlog_abi (&abi);
+  if (memcmp (payload + sizeof (UL_BINLOG_MAGIC), &abi, sizeof (abi)) != 0)
+    return -1;
+  return 0;
+}
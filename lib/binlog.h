@@ -0,0 +1,173 @@
+/* binlog.h -- Compact binary log files
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_BINLOG_H
+#define UMBERLOG_BINLOG_H 1
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "buffer.h"
+
+/* A binary log is a sequence of frames: a type byte, the length of
+   the payload, and the payload. Numbers are unsigned LEB128 varints,
+   signed ones are zigzag-encoded first.
+
+   'H' Header: "ULBL", the format version, and the ABI the arguments
+       were captured with (see ul_binlog_abi_t). Starts every session,
+       and resets the strings, the context and the timestamp base. A
+       new session is started after a failed write, too.
+   'C' Context: flags, default facility, timestamp mode, pid, uid,
+       gid, the host (length and bytes), the program (length plus
+       one and bytes, or zero if there is none), the implicit fields
+       (LOG_UL_FIELD_*; all of them when missing, as in files written
+       before there was a choice), and the offset of local time from
+       UTC in seconds, signed (when missing, local timestamps are
+       rendered in the local time of the reader). Applies to the
+       records that follow it.
+   'S' String: ID, and the bytes of the string (the rest of the
+       payload).
+   'R' Record: priority, timestamp (nanoseconds since the previous
+       record, signed), sample rate, errno, number of fields, then for
+       every field: the key (except for the first field, the message),
+       the format, and the arguments as captured by ul_fmt_capture().
+       If the context has LOG_UL_THREADINFO set, and LOG_UL_NOIMPLICIT
+       unset, the rendered thread information, and the sequence number
+       follow.
+   'J' JSON: priority, and a message that was formatted already.
+
+   Keys, formats and thread information are string references: the ID
+   of a previously defined string, or zero, followed by the length and
+   the bytes of the string. */
+#define UL_BINLOG_MAGIC   "ULBL"
+#define UL_BINLOG_VERSION 1
+
+#define UL_BINLOG_HEADER  'H'
+#define UL_BINLOG_CONTEXT 'C'
+#define UL_BINLOG_STRING  'S'
+#define UL_BINLOG_RECORD  'R'
+#define UL_BINLOG_JSON    'J'
+
+/* Room the output buffer always has, after a flush, for a 'J' frame
+   from ul_binlog_crash_json(), which cannot allocate. */
+#define UL_BINLOG_CRASH_SIZE 4096
+
+/* Captured arguments are stored in their native representation, so a
+   file can only be decoded where that is the same. */
+typedef struct
+{
+  uint32_t byte_order;  /* 0x01020304, as stored natively */
+  uint8_t sizes[10];    /* int, long, long long, intmax_t, size_t,
+                           ptrdiff_t, double, long double, wint_t,
+                           and void * */
+} ul_binlog_abi_t;
+
+typedef struct
+{
+  int flags;
+  int fields;
+  int facility;
+  int timestamp_mode;
+  long gmtoff;           /* Zero unless timestamp_mode is local */
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+  const char *host;
+  const char *program;   /* NULL if there is none */
+} ul_binlog_context_t;
+
+typedef struct
+{
+  const char *ptr;  /* What the string was looked up with */
+  size_t len;
+  char *copy;
+  uint64_t id;
+} ul_binlog_string_t;
+
+typedef struct
+{
+  int fd;
+  ul_buffer_t out;      /* Frames not written yet */
+  ul_buffer_t record;   /* Payload of the frame being built */
+
+  ul_binlog_string_t *strings;
+  uint64_t next_id;
+
+  int64_t last_ns;
+
+  int context_valid;
+  ul_binlog_context_t context;
+
+  /* Bumped whenever a failed write starts a new session; frames begun
+     before that are dropped. */
+  unsigned int session;
+  unsigned int frame_session;
+} ul_binlog_t;
+
+/* Writing. None of these do any locking. */
+ul_binlog_t *ul_binlog_open (const char *path)
+  __attribute__((visibility("hidden")));
+int ul_binlog_close (ul_binlog_t *log)
+  __attribute__((visibility("hidden")));
+int ul_binlog_flush (ul_binlog_t *log)
+  __attribute__((visibility("hidden")));
+int ul_binlog_crash_flush (ul_binlog_t *log)
+  __attribute__((visibility("hidden")));
+void ul_binlog_discard (ul_binlog_t *log)
+  __attribute__((visibility("hidden")));
+
+int ul_binlog_set_context (ul_binlog_t *log, const ul_binlog_context_t *ctx)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_binlog_begin (ul_binlog_t *log)
+  __attribute__((visibility("hidden")));
+int ul_binlog_end (ul_binlog_t *log, int type)
+  __attribute__((visibility("hidden")));
+int ul_binlog_crash_json (ul_binlog_t *log, int priority, const char *msg,
+                          size_t len)
+  __attribute__((visibility("hidden")));
+
+int ul_binlog_put_varint (ul_buffer_t *buffer, uint64_t value)
+  __attribute__((visibility("hidden")));
+int ul_binlog_put_string (ul_binlog_t *log, ul_buffer_t *buffer,
+                          const char *str, size_t len)
+  __attribute__((visibility("hidden")));
+int ul_binlog_put_timestamp (ul_binlog_t *log, ul_buffer_t *buffer,
+                             const struct timespec *ts)
+  __attribute__((visibility("hidden")));
+
+/* Reading. */
+int ul_binlog_read_frame (FILE *in, ul_buffer_t *frame, int *type)
+  __attribute__((visibility("hidden")));
+int ul_binlog_get_varint (const char **p, const char *end, uint64_t *value)
+  __attribute__((visibility("hidden")));
+int ul_binlog_check_header (const char *payload, size_t len)
+  __attribute__((visibility("hidden")));
+
+#endif
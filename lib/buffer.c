@@ -31,6 +31,9 @@
 #include "buffer.h"
 
 #include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -59,20 +62,72 @@ _ul_buffer_reserve_size (ul_buffer_t *buffer, size_t size)
   return 0;
 }
 
+/* The number of bytes escaping a character adds, zero if it needs no
+   escaping.
+   Assumes ASCII!  Keep in sync with the switch in _ul_str_escape! */
+static const unsigned char json_exceptions[UCHAR_MAX + 1] =
+  {
+    [0x01] = 5, [0x02] = 5, [0x03] = 5, [0x04] = 5, [0x05] = 5, [0x06] = 5,
+    [0x07] = 5, [0x08] = 1, [0x09] = 1, [0x0a] = 1, [0x0b] = 5, [0x0c] = 5,
+    [0x0d] = 1, [0x0e] = 5, [0x0f] = 5, [0x10] = 5, [0x11] = 5, [0x12] = 5,
+    [0x13] = 5, [0x14] = 5, [0x15] = 5, [0x16] = 5, [0x17] = 5, [0x18] = 5,
+    [0x19] = 5, [0x1a] = 5, [0x1b] = 5, [0x1c] = 5, [0x1d] = 5, [0x1e] = 5,
+    [0x1f] = 5, ['\\'] = 1, ['"'] = 1
+  };
+
+/* Keys are almost always string literals without anything to escape,
+   so we keep a small, per-thread, direct-mapped cache of their
+   rendered ("key":") form, indexed by the key pointer. The pointer
+   alone is not trusted, as callers may reuse the same buffer for
+   different keys: a hit is only a hit if the contents match too. */
+#define UL_KEY_CACHE_SIZE  64 /* Must be a power of two. */
+#define UL_KEY_CACHE_WIDTH 48
+
+typedef struct
+{
+  const char *key;
+  size_t key_len;
+  size_t len;
+  char rendered[UL_KEY_CACHE_WIDTH];
+} ul_key_cache_entry_t;
+
+static __thread ul_key_cache_entry_t ul_key_cache[UL_KEY_CACHE_SIZE];
+
+static inline ul_key_cache_entry_t *
+_ul_key_cache_lookup (const char *key)
+{
+  uintptr_t h = (uintptr_t)key;
+
+  return &ul_key_cache[(h ^ (h >> 7)) & (UL_KEY_CACHE_SIZE - 1)];
+}
+
+static int
+_ul_key_cache_fill (ul_key_cache_entry_t *entry, const char *key)
+{
+  size_t i, key_len;
+
+  entry->key = NULL;
+
+  key_len = strlen (key);
+  if (key_len + 4 > UL_KEY_CACHE_WIDTH)
+    return -1;
+  for (i = 0; i < key_len; i++)
+    if (json_exceptions[(unsigned char)key[i]] != 0)
+      return -1;
+
+  entry->rendered[0] = '"';
+  memcpy (entry->rendered + 1, key, key_len);
+  memcpy (entry->rendered + 1 + key_len, "\":\"", 3);
+  entry->key_len = key_len;
+  entry->len = key_len + 4;
+  entry->key = key;
+
+  return 0;
+}
+
 static inline int
 _ul_str_escape (ul_buffer_t *dest, const char *str)
 {
-  /* Assumes ASCII!  Keep in sync with the switch! */
-  static const unsigned char json_exceptions[UCHAR_MAX + 1] =
-    {
-      [0x01] = 1, [0x02] = 1, [0x03] = 1, [0x04] = 1, [0x05] = 1, [0x06] = 1,
-      [0x07] = 1, [0x08] = 1, [0x09] = 1, [0x0a] = 1, [0x0b] = 1, [0x0c] = 1,
-      [0x0d] = 1, [0x0e] = 1, [0x0f] = 1, [0x10] = 1, [0x11] = 1, [0x12] = 1,
-      [0x13] = 1, [0x14] = 1, [0x15] = 1, [0x16] = 1, [0x17] = 1, [0x18] = 1,
-      [0x19] = 1, [0x1a] = 1, [0x1b] = 1, [0x1c] = 1, [0x1d] = 1, [0x1e] = 1,
-      [0x1f] = 1, ['\\'] = 1, ['"'] = 1
-    };
-
   const unsigned char *p;
   char *q, *end;
 
@@ -170,10 +225,55 @@ _ul_str_escape (ul_buffer_t *dest, const char *str)
   return 0;
 }
 
+static inline int
+_ul_buffer_append_key (ul_buffer_t *buffer, const char *key)
+{
+  ul_key_cache_entry_t *entry;
+
+  if (!key)
+    return -1;
+
+  entry = _ul_key_cache_lookup (key);
+  if ((entry->key == key &&
+       strncmp (entry->rendered + 1, key, entry->key_len) == 0 &&
+       key[entry->key_len] == '\0') ||
+      _ul_key_cache_fill (entry, key) == 0)
+    {
+      if (_ul_buffer_reserve_size (buffer, entry->len) != 0)
+        return -1;
+      memcpy (buffer->ptr, entry->rendered, entry->len);
+      buffer->ptr += entry->len;
+      return 0;
+    }
+
+  /* Not cacheable: too long, or needs escaping. */
+  if (_ul_buffer_reserve_size (buffer, 1) != 0)
+    return -1;
+  *buffer->ptr++ = '"';
+
+  if (_ul_str_escape (buffer, key) != 0)
+    return -1;
+
+  if (_ul_buffer_reserve_size (buffer, 3) != 0)
+    return -1;
+  memcpy (buffer->ptr, "\":\"", 3);
+  buffer->ptr += 3;
+
+  return 0;
+}
+
 int
 ul_buffer_reset (ul_buffer_t *buffer)
 {
   buffer->ptr = buffer->msg;
+  return ul_buffer_begin (buffer);
+}
+
+/* Start a message after whatever the buffer holds already, so that
+   several can be formatted back to back. */
+int
+ul_buffer_begin (ul_buffer_t *buffer)
+{
   if (_ul_buffer_reserve_size (buffer, 512) != 0)
     return -1;
   *buffer->ptr++ = '{';
@@ -185,22 +285,156 @@ ul_buffer_append (ul_buffer_t *buffer, const char *key, const char *value)
 {
   size_t orig_len = buffer->ptr - buffer->msg;
 
-  /* Append the key to the buffer */
-  if (_ul_buffer_reserve_size (buffer, 1) != 0)
+  if (_ul_buffer_append_key (buffer, key) != 0)
     goto err;
-  *buffer->ptr++ = '"';
 
-  if (_ul_str_escape (buffer, key) != 0)
+  /* Append the value to the buffer */
+  if (_ul_str_escape (buffer, value) != 0)
     goto err;
 
-  if (_ul_buffer_reserve_size (buffer, 3) != 0)
+  if (_ul_buffer_reserve_size (buffer, 2) != 0)
     goto err;
-  memcpy (buffer->ptr, "\":\"", 3);
-  buffer->ptr += 3;
+  memcpy (buffer->ptr, "\",", 2);
+  buffer->ptr += 2;
 
-  /* Append the value to the buffer */
-  if (_ul_str_escape (buffer, value) != 0)
+  return buffer;
+
+ err:
+  buffer->ptr = buffer->msg + orig_len;
+  return NULL;
+}
+
+/* Makes sure there are at least SIZE bytes available at ptr. */
+int
+ul_buffer_reserve (ul_buffer_t *buffer, size_t size)
+{
+  return _ul_buffer_reserve_size (buffer, size);
+}
+
+/* Appends pre-rendered key-value pairs, including the trailing comma. */
+ul_buffer_t *
+ul_buffer_append_raw (ul_buffer_t *buffer, const char *data, size_t len)
+{
+  if (_ul_buffer_reserve_size (buffer, len) != 0)
+    return NULL;
+  memcpy (buffer->ptr, data, len);
+  buffer->ptr += len;
+
+  return buffer;
+}
+
+/* Appends STR escaped for use inside a JSON string, without a key or
+   quotes, so that values can be built piece by piece. */
+ul_buffer_t *
+ul_buffer_append_escaped (ul_buffer_t *buffer, const char *str)
+{
+  size_t orig_len = buffer->ptr - buffer->msg;
+
+  if (_ul_str_escape (buffer, str) != 0)
+    {
+      buffer->ptr = buffer->msg + orig_len;
+      return NULL;
+    }
+  return buffer;
+}
+
+/* Escape the LEN bytes at the append point, in place, making room for
+   the EXTRA bytes that takes. Works from the end backwards, so that
+   nothing is overwritten before it was read. */
+static int
+_ul_str_escape_in_place (ul_buffer_t *buffer, size_t len, size_t extra)
+{
+  static const char json_hex_chars[16] = "0123456789abcdef";
+  char *p, *q;
+
+  if (_ul_buffer_reserve_size (buffer, len + extra) != 0)
+    return -1;
+
+  p = buffer->ptr + len;
+  q = p + extra;
+  while (p != q)
+    {
+      unsigned char c = *--p;
+
+      switch (json_exceptions[c] == 0 ? 0 : c)
+        {
+        case 0:
+          *--q = c;
+          break;
+        case '\b':
+          q -= 2;
+          memcpy (q, "\\b", 2);
+          break;
+        case '\n':
+          q -= 2;
+          memcpy (q, "\\n", 2);
+          break;
+        case '\r':
+          q -= 2;
+          memcpy (q, "\\r", 2);
+          break;
+        case '\t':
+          q -= 2;
+          memcpy (q, "\\t", 2);
+          break;
+        case '\\':
+          q -= 2;
+          memcpy (q, "\\\\", 2);
+          break;
+        case '"':
+          q -= 2;
+          memcpy (q, "\\\"", 2);
+          break;
+        default:
+          q -= 6;
+          memcpy (q, "\\u00", 4);
+          q[4] = json_hex_chars[c >> 4];
+          q[5] = json_hex_chars[c & 0xf];
+          break;
+        }
+    }
+
+  return 0;
+}
+
+/* Append KEY with a value formatted according to FMT, printing it
+   straight into the buffer, and escaping it there. Like every other
+   value, it ends at the first NUL byte. AP is left untouched. */
+ul_buffer_t *
+ul_buffer_append_vprintf (ul_buffer_t *buffer, const char *key,
+                          const char *fmt, va_list ap)
+{
+  size_t orig_len = buffer->ptr - buffer->msg;
+  size_t avail, len, extra, i;
+  va_list aq;
+  int n;
+
+  if (_ul_buffer_append_key (buffer, key) != 0)
+    goto err;
+
+  avail = buffer->alloc_end - buffer->ptr;
+  va_copy (aq, ap);
+  n = vsnprintf (buffer->ptr, avail, fmt, aq);
+  va_end (aq);
+  if (n < 0)
+    goto err;
+  if ((size_t)n >= avail)
+    {
+      if (_ul_buffer_reserve_size (buffer, (size_t)n + 1) != 0)
+        goto err;
+      va_copy (aq, ap);
+      n = vsnprintf (buffer->ptr, (size_t)n + 1, fmt, aq);
+      va_end (aq);
+      if (n < 0)
+        goto err;
+    }
+
+  len = strlen (buffer->ptr);
+  for (extra = 0, i = 0; i < len; i++)
+    extra += json_exceptions[(unsigned char)buffer->ptr[i]];
+  if (extra != 0 && _ul_str_escape_in_place (buffer, len, extra) != 0)
     goto err;
+  buffer->ptr += len + extra;
 
   if (_ul_buffer_reserve_size (buffer, 2) != 0)
     goto err;
@@ -214,6 +448,113 @@ ul_buffer_append (ul_buffer_t *buffer, const char *key, const char *value)
   return NULL;
 }
 
+/* Renders VALUE in decimal, two digits at a time, ending at END.
+   Returns the start of the digits. */
+static inline char *
+_ul_utoa (char *end, uintmax_t value)
+{
+  static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+  char *p = end;
+
+  while (value >= 100)
+    {
+      unsigned int i = (value % 100) * 2;
+
+      value /= 100;
+      p -= 2;
+      memcpy (p, digit_pairs + i, 2);
+    }
+  if (value >= 10)
+    {
+      p -= 2;
+      memcpy (p, digit_pairs + value * 2, 2);
+    }
+  else
+    *--p = '0' + value;
+
+  return p;
+}
+
+static inline ul_buffer_t *
+_ul_buffer_append_digits (ul_buffer_t *buffer, const char *key,
+                          uintmax_t value, int negative, int quoted)
+{
+  size_t orig_len = buffer->ptr - buffer->msg;
+  char digits[sizeof (uintmax_t) * 3 + 4], *end, *p;
+
+  if (_ul_buffer_append_key (buffer, key) != 0)
+    goto err;
+
+  end = digits + sizeof (digits);
+  if (quoted)
+    {
+      memcpy (end - 2, "\",", 2);
+      p = _ul_utoa (end - 2, value);
+    }
+  else
+    {
+      /* Drop the opening quote of the value, added along with the key. */
+      buffer->ptr--;
+      end[-1] = ',';
+      p = _ul_utoa (end - 1, value);
+    }
+  if (negative)
+    *--p = '-';
+
+  if (_ul_buffer_reserve_size (buffer, end - p) != 0)
+    goto err;
+  memcpy (buffer->ptr, p, end - p);
+  buffer->ptr += end - p;
+
+  return buffer;
+
+ err:
+  buffer->ptr = buffer->msg + orig_len;
+  return NULL;
+}
+
+ul_buffer_t *
+ul_buffer_append_int (ul_buffer_t *buffer, const char *key, intmax_t value)
+{
+  if (value < 0)
+    return _ul_buffer_append_digits (buffer, key, -(uintmax_t)value, 1, 1);
+  return _ul_buffer_append_digits (buffer, key, value, 0, 1);
+}
+
+ul_buffer_t *
+ul_buffer_append_uint (ul_buffer_t *buffer, const char *key, uintmax_t value)
+{
+  return _ul_buffer_append_digits (buffer, key, value, 0, 1);
+}
+
+/* Appends the decimal digits of VALUE, preceded by a minus sign if
+   NEGATIVE, without a key or quotes. */
+ul_buffer_t *
+ul_buffer_append_decimal (ul_buffer_t *buffer, uintmax_t value, int negative)
+{
+  char digits[sizeof (uintmax_t) * 3 + 2], *end, *p;
+
+  end = digits + sizeof (digits);
+  p = _ul_utoa (end, value);
+  if (negative)
+    *--p = '-';
+
+  return ul_buffer_append_raw (buffer, p, end - p);
+}
+
+/* Like ul_buffer_append_uint(), but the value is a JSON number, not a
+   string. */
+ul_buffer_t *
+ul_buffer_append_number (ul_buffer_t *buffer, const char *key,
+                         uintmax_t value)
+{
+  return _ul_buffer_append_digits (buffer, key, value, 0, 0);
+}
+
 char *
 ul_buffer_finalize (ul_buffer_t *buffer)
 {
@@ -28,7 +28,9 @@
 #ifndef UMBERLOG_BUFFER_H
 #define UMBERLOG_BUFFER_H 1
 
+#include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef struct
 {
@@ -39,9 +41,33 @@ typedef struct
 
 int ul_buffer_reset (ul_buffer_t *buffer)
   __attribute__((visibility("hidden")));
+int ul_buffer_begin (ul_buffer_t *buffer)
+  __attribute__((visibility("hidden")));
+int ul_buffer_reserve (ul_buffer_t *buffer, size_t size)
+  __attribute__((visibility("hidden")));
 ul_buffer_t *ul_buffer_append (ul_buffer_t *buffer,
                                const char *key, const char *value)
   __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_raw (ul_buffer_t *buffer,
+                                   const char *data, size_t len)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_escaped (ul_buffer_t *buffer, const char *str)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_vprintf (ul_buffer_t *buffer, const char *key,
+                                       const char *fmt, va_list ap)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_decimal (ul_buffer_t *buffer,
+                                       uintmax_t value, int negative)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_int (ul_buffer_t *buffer,
+                                   const char *key, intmax_t value)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_uint (ul_buffer_t *buffer,
+                                    const char *key, uintmax_t value)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_buffer_append_number (ul_buffer_t *buffer,
+                                      const char *key, uintmax_t value)
+  __attribute__((visibility("hidden")));
 char *ul_buffer_finalize (ul_buffer_t *buffer)
   __attribute__((visibility("hidden")));
 
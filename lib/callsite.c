@@ -0,0 +1,213 @@
+/* callsite.c -- Call site descriptors
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "callsite.h"
+#include "buffer.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The call sites of every object that has any, registered by the
+   object itself when it is loaded, and unregistered when it is
+   unloaded. Every translation unit of an object registers the same
+   range, which is counted. Walking the ranges only takes the lock for
+   reading; sites are still logged from without it. */
+typedef struct ul_callsite_range
+{
+  ul_callsite_t *start;
+  ul_callsite_t *stop;
+  unsigned int refs;
+  struct ul_callsite_range *next;
+} ul_callsite_range_t;
+
+static pthread_rwlock_t ul_callsite_lock = PTHREAD_RWLOCK_INITIALIZER;
+static ul_callsite_range_t *ul_callsite_ranges;
+
+void
+ul_callsite_register (ul_callsite_t *start, ul_callsite_t *stop)
+{
+  ul_callsite_range_t *range;
+
+  if (start == NULL || start >= stop)
+    return;
+
+  pthread_rwlock_wrlock (&ul_callsite_lock);
+  for (range = ul_callsite_ranges; range != NULL; range = range->next)
+    if (range->start == start)
+      {
+        range->refs++;
+        goto out;
+      }
+
+  range = malloc (sizeof (*range));
+  if (range == NULL)
+    goto out;
+  range->start = start;
+  range->stop = stop;
+  range->refs = 1;
+  range->next = ul_callsite_ranges;
+  ul_callsite_ranges = range;
+
+ out:
+  pthread_rwlock_unlock (&ul_callsite_lock);
+}
+
+/* Forget about the sites of an object being unloaded, once the last
+   of its translation units unregistered them, and free what was
+   rendered for them. */
+void
+ul_callsite_unregister (ul_callsite_t *start, ul_callsite_t *stop)
+{
+  ul_callsite_range_t **prev, *range;
+  ul_callsite_t *site;
+
+  (void)stop;
+
+  pthread_rwlock_wrlock (&ul_callsite_lock);
+  for (prev = &ul_callsite_ranges; (range = *prev) != NULL;
+       prev = &range->next)
+    if (range->start == start)
+      break;
+  if (range != NULL && --range->refs == 0)
+    {
+      *prev = range->next;
+      for (site = range->start; site < range->stop; site++)
+        {
+          free ((char *)site->fragment);
+          site->fragment = NULL;
+        }
+      free (range);
+    }
+  pthread_rwlock_unlock (&ul_callsite_lock);
+}
+
+/* No object is loaded or unloaded while forking: the child gets the
+   ranges as they are. */
+void
+ul_callsite_atfork_prepare (void)
+{
+  pthread_rwlock_wrlock (&ul_callsite_lock);
+}
+
+void
+ul_callsite_atfork_parent (void)
+{
+  pthread_rwlock_unlock (&ul_callsite_lock);
+}
+
+/* The lock was taken for writing by a thread the child does not have,
+   and cannot be released from there. */
+void
+ul_callsite_atfork_child (void)
+{
+  pthread_rwlock_init (&ul_callsite_lock, NULL);
+}
+
+/* Call FUNC for every call site, until it returns non-zero; returns
+   what it returned last. */
+int
+ul_callsite_foreach (ul_callsite_func_t func, void *user_data)
+{
+  ul_callsite_range_t *range;
+  ul_callsite_t *site;
+  int ret = 0;
+
+  pthread_rwlock_rdlock (&ul_callsite_lock);
+  for (range = ul_callsite_ranges; range != NULL && ret == 0;
+       range = range->next)
+    for (site = range->start; site < range->stop; site++)
+      if ((ret = func (site, user_data)) != 0)
+        break;
+  pthread_rwlock_unlock (&ul_callsite_lock);
+  return ret;
+}
+
+/* Sites match FILE if it is their file, or the last component of it,
+   and any file if it is NULL; they match LINE if it is their line, or
+   zero. Returns the number of sites changed. */
+int
+ul_callsite_set (const char *file, unsigned int line, int enable)
+{
+  ul_callsite_range_t *range;
+  ul_callsite_t *site;
+  int count = 0;
+
+  pthread_rwlock_rdlock (&ul_callsite_lock);
+  for (range = ul_callsite_ranges; range != NULL; range = range->next)
+    for (site = range->start; site < range->stop; site++)
+      {
+        const char *base = strrchr (site->file, '/');
+
+        if (line != 0 && site->line != line)
+          continue;
+        if (file != NULL && strcmp (site->file, file) != 0 &&
+            (base == NULL || strcmp (base + 1, file) != 0))
+          continue;
+        __atomic_store_n (&site->enabled, enable != 0, __ATOMIC_RELAXED);
+        count++;
+      }
+  pthread_rwlock_unlock (&ul_callsite_lock);
+  return count;
+}
+
+/* Returns the file and line fields of SITE, rendered the first time
+   they are needed, and kept in the site, or NULL if that failed. */
+const char *
+ul_callsite_fragment (ul_callsite_t *site, size_t *len)
+{
+  const char *fragment, *expected = NULL;
+  ul_buffer_t buffer = { NULL, NULL, NULL };
+
+  fragment = __atomic_load_n (&site->fragment, __ATOMIC_ACQUIRE);
+  if (fragment != NULL)
+    {
+      *len = __atomic_load_n (&site->fragment_len, __ATOMIC_RELAXED);
+      return fragment;
+    }
+
+  if (ul_buffer_append (&buffer, "file", site->file) == NULL ||
+      ul_buffer_append_uint (&buffer, "line", site->line) == NULL)
+    {
+      free (buffer.msg);
+      return NULL;
+    }
+
+  /* Racing threads render the same fragment, so either length will
+     do; only one of the fragments is kept. */
+  *len = buffer.ptr - buffer.msg;
+  __atomic_store_n (&site->fragment_len, *len, __ATOMIC_RELAXED);
+  if (__atomic_compare_exchange_n (&site->fragment, &expected, buffer.msg,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return buffer.msg;
+  free (buffer.msg);
+  return expected;
+}
@@ -0,0 +1,53 @@
+/* callsite.h -- Call site descriptors
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_CALLSITE_H
+#define UMBERLOG_CALLSITE_H 1
+
+#include <stddef.h>
+
+#include "umberlog.h"
+
+void ul_callsite_register (ul_callsite_t *start, ul_callsite_t *stop)
+  __attribute__((visibility("hidden")));
+void ul_callsite_unregister (ul_callsite_t *start, ul_callsite_t *stop)
+  __attribute__((visibility("hidden")));
+void ul_callsite_atfork_prepare (void)
+  __attribute__((visibility("hidden")));
+void ul_callsite_atfork_parent (void)
+  __attribute__((visibility("hidden")));
+void ul_callsite_atfork_child (void)
+  __attribute__((visibility("hidden")));
+int ul_callsite_foreach (ul_callsite_func_t func, void *user_data)
+  __attribute__((visibility("hidden")));
+int ul_callsite_set (const char *file, unsigned int line, int enable)
+  __attribute__((visibility("hidden")));
+const char *ul_callsite_fragment (ul_callsite_t *site, size_t *len)
+  __attribute__((visibility("hidden")));
+
+#endif
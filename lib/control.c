@@ -0,0 +1,446 @@
+/* control.c -- Runtime configuration from a control file
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "control.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+typedef struct
+{
+  const char *name;
+  int value;
+} ul_control_name_t;
+
+static const ul_control_name_t ul_control_priorities[] =
+  {
+    { "emerg", LOG_EMERG },
+    { "alert", LOG_ALERT },
+    { "crit", LOG_CRIT },
+    { "err", LOG_ERR },
+    { "error", LOG_ERR },
+    { "warning", LOG_WARNING },
+    { "warn", LOG_WARNING },
+    { "notice", LOG_NOTICE },
+    { "info", LOG_INFO },
+    { "debug", LOG_DEBUG },
+    { NULL, 0 }
+  };
+
+static const ul_control_name_t ul_control_flag_names[] =
+  {
+    { "all", LOG_UL_ALL },
+    { "noimplicit", LOG_UL_NOIMPLICIT },
+    { "nocache", LOG_UL_NOCACHE },
+    { "nocache_uid", LOG_UL_NOCACHE_UID },
+    { "notime", LOG_UL_NOTIME },
+    { "threadinfo", LOG_UL_THREADINFO },
+    { NULL, 0 }
+  };
+
+static const ul_control_name_t ul_control_timestamp_modes[] =
+  {
+    { "local", LOG_UL_TIME_LOCAL },
+    { "utc", LOG_UL_TIME_UTC },
+    { "epoch_s", LOG_UL_TIME_EPOCH_S },
+    { "epoch_ms", LOG_UL_TIME_EPOCH_MS },
+    { "epoch_ns", LOG_UL_TIME_EPOCH_NS },
+    { NULL, 0 }
+  };
+
+static const ul_control_name_t ul_control_queue_policies[] =
+  {
+    { "sync", LOG_UL_QUEUE_SYNC },
+    { "block", LOG_UL_QUEUE_BLOCK },
+    { "drop_newest", LOG_UL_QUEUE_DROP_NEWEST },
+    { "drop_oldest", LOG_UL_QUEUE_DROP_OLDEST },
+    { "drop_priority", LOG_UL_QUEUE_DROP_PRIORITY },
+    { NULL, 0 }
+  };
+
+static const ul_control_name_t ul_control_field_names[] =
+  {
+    { "all", LOG_UL_FIELD_ALL },
+    { "pid", LOG_UL_FIELD_PID },
+    { "facility", LOG_UL_FIELD_FACILITY },
+    { "priority", LOG_UL_FIELD_PRIORITY },
+    { "uid", LOG_UL_FIELD_UID },
+    { "gid", LOG_UL_FIELD_GID },
+    { "host", LOG_UL_FIELD_HOST },
+    { "program", LOG_UL_FIELD_PROGRAM },
+    { "timestamp", LOG_UL_FIELD_TIMESTAMP },
+    { NULL, 0 }
+  };
+
+#define UL_CONTROL_SEPARATORS " \t,|"
+
+static int
+_ul_control_lookup (const ul_control_name_t *names, const char *name,
+                    size_t len)
+{
+  int i;
+
+  for (i = 0; names[i].name != NULL; i++)
+    if (strlen (names[i].name) == len &&
+        strncasecmp (name, names[i].name, len) == 0)
+      return i;
+  return -1;
+}
+
+/* Returns the priority called NAME, or -1. */
+int
+ul_control_priority (const char *name)
+{
+  int i = _ul_control_lookup (ul_control_priorities, name, strlen (name));
+
+  return (i < 0) ? -1 : ul_control_priorities[i].value;
+}
+
+/* Returns the LOG_UL_QUEUE_* policy called NAME, or -1. */
+int
+ul_control_queue_policy (const char *name)
+{
+  int i = _ul_control_lookup (ul_control_queue_policies, name,
+                              strlen (name));
+
+  return (i < 0) ? -1 : ul_control_queue_policies[i].value;
+}
+
+/* Parses a list of the NAMES, optionally prefixed with PREFIX, and
+   separated by commas, bars or spaces, into the bits they stand for. */
+static int
+_ul_control_bits (const ul_control_name_t *names, const char *prefix,
+                  const char *str, int *bits)
+{
+  size_t len, prefix_len = strlen (prefix);
+  const char *p = str;
+  int result = 0, i;
+
+  for (p += strspn (p, UL_CONTROL_SEPARATORS); *p != '\0';
+       p += strspn (p, UL_CONTROL_SEPARATORS))
+    {
+      len = strcspn (p, UL_CONTROL_SEPARATORS);
+      if (len > prefix_len && strncasecmp (p, prefix, prefix_len) == 0)
+        {
+          p += prefix_len;
+          len -= prefix_len;
+        }
+      i = _ul_control_lookup (names, p, len);
+      if (i < 0)
+        {
+          errno = EINVAL;
+          return -1;
+        }
+      result |= names[i].value;
+      p += len;
+    }
+
+  *bits = result;
+  return 0;
+}
+
+/* Parses a list of LOG_UL_* flag names, with or without the prefix. */
+int
+ul_control_flags (const char *str, int *flags)
+{
+  return _ul_control_bits (ul_control_flag_names, "LOG_UL_", str, flags);
+}
+
+/* Parses a list of implicit field names, or LOG_UL_FIELD_* constants. */
+int
+ul_control_fields (const char *str, int *fields)
+{
+  return _ul_control_bits (ul_control_field_names, "LOG_UL_FIELD_", str,
+                           fields);
+}
+
+/* Parses a timestamp mode name, optionally followed by "coarse", into
+   a mode for ul_set_timestamp_mode(). */
+int
+ul_control_timestamp_mode (const char *str, int *mode)
+{
+  const char *p = str;
+  int result = -1, coarse = 0, i;
+  size_t len;
+
+  for (p += strspn (p, UL_CONTROL_SEPARATORS); *p != '\0';
+       p += strspn (p, UL_CONTROL_SEPARATORS))
+    {
+      len = strcspn (p, UL_CONTROL_SEPARATORS);
+      if (len == 6 && strncasecmp (p, "coarse", 6) == 0)
+        coarse = LOG_UL_TIME_COARSE;
+      else if (result == -1 &&
+               (i = _ul_control_lookup (ul_control_timestamp_modes, p,
+                                        len)) >= 0)
+        result = ul_control_timestamp_modes[i].value;
+      else
+        {
+          errno = EINVAL;
+          return -1;
+        }
+      p += len;
+    }
+
+  *mode = ((result == -1) ? LOG_UL_TIME_LOCAL : result) | coarse;
+  return 0;
+}
+
+int
+ul_control_uint (const char *str, unsigned int *value)
+{
+  unsigned long v;
+  char *end;
+
+  if (!isdigit ((unsigned char)*str))
+    return -1;
+  errno = 0;
+  v = strtoul (str, &end, 10);
+  if (errno != 0 || *end != '\0' || v > (unsigned int)-1)
+    return -1;
+  *value = v;
+  return 0;
+}
+
+/* Parses a size in bytes, with an optional k, M or G suffix. */
+int
+ul_control_size (const char *str, size_t *size)
+{
+  unsigned long long v;
+  int shift = 0;
+  char *end;
+
+  if (!isdigit ((unsigned char)*str))
+    return -1;
+  errno = 0;
+  v = strtoull (str, &end, 10);
+  if (errno != 0)
+    return -1;
+  switch (*end)
+    {
+    case 'k': case 'K':
+      shift = 10;
+      break;
+    case 'm': case 'M':
+      shift = 20;
+      break;
+    case 'g': case 'G':
+      shift = 30;
+      break;
+    case '\0':
+      break;
+    default:
+      return -1;
+    }
+  if (shift != 0 && *++end != '\0')
+    return -1;
+  if (v > (SIZE_MAX >> shift))
+    return -1;
+  *size = (size_t)v << shift;
+  return 0;
+}
+
+/* Splits VALUE at the first run of blanks; returns the rest, or an
+   empty string. */
+static char *
+_ul_control_word (char *value)
+{
+  char *rest = value + strcspn (value, " \t");
+
+  if (*rest != '\0')
+    {
+      *rest++ = '\0';
+      rest += strspn (rest, " \t");
+    }
+  return rest;
+}
+
+static int
+_ul_control_site (ul_control_t *control, char *value)
+{
+  ul_control_site_t *sites, *site;
+  char *state = _ul_control_word (value), *colon;
+  unsigned int line = 0;
+  int enable;
+
+  if (strcasecmp (state, "on") == 0)
+    enable = 1;
+  else if (strcasecmp (state, "off") == 0)
+    enable = 0;
+  else
+    return -1;
+
+  colon = strrchr (value, ':');
+  if (colon != NULL)
+    {
+      *colon = '\0';
+      if (ul_control_uint (colon + 1, &line) != 0)
+        return -1;
+    }
+  if (*value == '\0')
+    return -1;
+
+  sites = realloc (control->sites,
+                   (control->nsites + 1) * sizeof (*control->sites));
+  if (sites == NULL)
+    return -1;
+  control->sites = sites;
+  site = &sites[control->nsites];
+  site->file = strdup (value);
+  if (site->file == NULL)
+    return -1;
+  site->line = line;
+  site->enable = enable;
+  control->nsites++;
+  return 0;
+}
+
+/* Handles one KEY = VALUE setting, with VALUE stripped. */
+static int
+_ul_control_setting (ul_control_t *control, const char *key, char *value)
+{
+  char *rest;
+  int pri;
+
+  if (strcmp (key, "mask") == 0)
+    {
+      pri = ul_control_priority (value);
+      if (pri < 0)
+        return -1;
+      control->has_mask = 1;
+      control->mask = LOG_UPTO (pri);
+    }
+  else if (strcmp (key, "flags") == 0)
+    {
+      if (ul_control_flags (value, &control->flags) != 0)
+        return -1;
+      control->has_flags = 1;
+    }
+  else if (strcmp (key, "fields") == 0)
+    {
+      if (ul_control_fields (value, &control->fields) != 0)
+        return -1;
+      control->has_fields = 1;
+    }
+  else if (strcmp (key, "sample") == 0)
+    {
+      rest = _ul_control_word (value);
+      pri = ul_control_priority (value);
+      if (pri < 0 || ul_control_uint (rest, &control->sample[pri]) != 0)
+        return -1;
+      control->sample_set |= 1 << pri;
+    }
+  else if (strcmp (key, "rate_limit") == 0)
+    {
+      rest = _ul_control_word (value);
+      control->burst = 0;
+      if (ul_control_uint (value, &control->rate) != 0 ||
+          (*rest != '\0' && ul_control_uint (rest, &control->burst) != 0))
+        return -1;
+      control->has_rate_limit = 1;
+    }
+  else if (strcmp (key, "site") == 0)
+    return _ul_control_site (control, value);
+  else
+    return -1;
+
+  return 0;
+}
+
+/* Reads the control file at PATH: lines of KEY = VALUE, with blank
+   lines and those starting with # ignored. Nothing is returned unless
+   the whole file is valid. */
+int
+ul_control_read (const char *path, ul_control_t *control)
+{
+  char *line = NULL, *key, *value, *end;
+  size_t size = 0;
+  ssize_t len;
+  FILE *in;
+  int ret = 0;
+
+  memset (control, 0, sizeof (*control));
+
+  in = fopen (path, "re");
+  if (in == NULL)
+    return -1;
+
+  while (ret == 0 && (len = getline (&line, &size, in)) != -1)
+    {
+      for (end = line + len; end > line && isspace ((unsigned char)end[-1]);
+           end--)
+        ;
+      *end = '\0';
+      key = line + strspn (line, " \t");
+      if (*key == '\0' || *key == '#')
+        continue;
+
+      value = strchr (key, '=');
+      if (value == NULL)
+        {
+          ret = -1;
+          break;
+        }
+      for (end = value; end > key && isspace ((unsigned char)end[-1]); end--)
+        ;
+      *end = '\0';
+      value++;
+      value += strspn (value, " \t");
+
+      ret = _ul_control_setting (control, key, value);
+    }
+  if (ret == 0 && ferror (in))
+    ret = -1;
+  else if (ret != 0)
+    errno = EINVAL;
+
+  free (line);
+  fclose (in);
+  if (ret != 0)
+    ul_control_free (control);
+  return ret;
+}
+
+void
+ul_control_free (ul_control_t *control)
+{
+  size_t i;
+
+  for (i = 0; i < control->nsites; i++)
+    free (control->sites[i].file);
+  free (control->sites);
+  control->sites = NULL;
+  control->nsites = 0;
+}
@@ -0,0 +1,80 @@
+/* control.h -- Runtime configuration from a control file
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_CONTROL_H
+#define UMBERLOG_CONTROL_H 1
+
+#include <stddef.h>
+
+#include "umberlog.h"
+
+typedef struct
+{
+  char *file;
+  unsigned int line;       /* Zero for every line */
+  int enable;
+} ul_control_site_t;
+
+/* The settings a control file changes; anything it does not mention
+   is left alone. */
+typedef struct
+{
+  int has_mask;
+  int mask;
+  int has_flags;
+  int flags;
+  int has_fields;
+  int fields;
+  int sample_set;          /* Bit for each priority in SAMPLE */
+  unsigned int sample[LOG_DEBUG + 1];
+  int has_rate_limit;
+  unsigned int rate, burst;
+  ul_control_site_t *sites;
+  size_t nsites;
+} ul_control_t;
+
+int ul_control_priority (const char *name)
+  __attribute__((visibility("hidden")));
+int ul_control_flags (const char *str, int *flags)
+  __attribute__((visibility("hidden")));
+int ul_control_fields (const char *str, int *fields)
+  __attribute__((visibility("hidden")));
+int ul_control_timestamp_mode (const char *str, int *mode)
+  __attribute__((visibility("hidden")));
+int ul_control_queue_policy (const char *name)
+  __attribute__((visibility("hidden")));
+int ul_control_uint (const char *str, unsigned int *value)
+  __attribute__((visibility("hidden")));
+int ul_control_size (const char *str, size_t *size)
+  __attribute__((visibility("hidden")));
+int ul_control_read (const char *path, ul_control_t *control)
+  __attribute__((visibility("hidden")));
+void ul_control_free (ul_control_t *control)
+  __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,970 @@
+/* fmt.c -- Compiled printf-style formats
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "fmt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* Parse a single conversion specification starting at the '%' at
+   P. Returns the length of the specification, or zero if it is one we
+   do not support: positional arguments, %n, wide strings, and
+   anything we do not know. */
+static size_t
+_ul_fmt_parse_conversion (const char *p, ul_fmt_segment_t *seg)
+{
+  const char *start = p;
+  int length = 0; /* 'H' for hh, 'h', 'l', 'q' for ll, 'L', 'j', 'z', 't' */
+
+  seg->nstars = 0;
+  seg->precision = UL_FMT_PRECISION_NONE;
+
+  p++;
+  /* Flags */
+  while (*p && strchr ("-+ #0'I", *p))
+    p++;
+
+  /* Field width */
+  if (*p == '*')
+    {
+      seg->nstars++;
+      p++;
+    }
+  else
+    while (*p >= '0' && *p <= '9')
+      p++;
+  if (*p == '$')
+    return 0;
+
+  /* Precision */
+  if (*p == '.')
+    {
+      p++;
+      if (*p == '*')
+        {
+          seg->nstars++;
+          seg->precision = UL_FMT_PRECISION_STAR;
+          p++;
+        }
+      else
+        {
+          int precision = 0;
+
+          while (*p >= '0' && *p <= '9')
+            {
+              if (precision < INT_MAX / 10)
+                precision = precision * 10 + (*p - '0');
+              p++;
+            }
+          seg->precision = precision;
+        }
+      if (*p == '$')
+        return 0;
+    }
+
+  /* Length modifier */
+  switch (*p)
+    {
+    case 'h':
+      length = (p[1] == 'h') ? 'H' : 'h';
+      p += (length == 'H') ? 2 : 1;
+      break;
+    case 'l':
+      length = (p[1] == 'l') ? 'q' : 'l';
+      p += (length == 'q') ? 2 : 1;
+      break;
+    case 'q':
+    case 'L':
+      length = 'q';
+      if (*p == 'L')
+        length = 'L';
+      p++;
+      break;
+    case 'j':
+    case 't':
+      length = *p++;
+      break;
+    case 'z':
+    case 'Z':
+      length = 'z';
+      p++;
+      break;
+    }
+
+  seg->conversion = *p;
+  switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      switch (length)
+        {
+        case 'l':
+          seg->type = UL_ARG_LONG;
+          break;
+        case 'q':
+        case 'L':
+          seg->type = UL_ARG_LLONG;
+          break;
+        case 'j':
+          seg->type = UL_ARG_INTMAX;
+          break;
+        case 'z':
+          seg->type = UL_ARG_SIZE;
+          break;
+        case 't':
+          seg->type = UL_ARG_PTRDIFF;
+          break;
+        default:
+          /* Also handles h, hh, which are promoted to int */
+          seg->type = UL_ARG_INT;
+          break;
+        }
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      seg->type = (length == 'L' || length == 'q') ?
+        UL_ARG_LDOUBLE : UL_ARG_DOUBLE;
+      break;
+    case 'c':
+      seg->type = (length == 'l') ? UL_ARG_WINT : UL_ARG_INT;
+      break;
+    case 's':
+      if (length == 'l')
+        return 0;
+      seg->type = UL_ARG_STRING;
+      break;
+    case 'p':
+      seg->type = UL_ARG_POINTER;
+      break;
+    case 'm':
+      if (seg->nstars > 0)
+        return 0;
+      seg->type = UL_ARG_ERRNO;
+      break;
+    default:
+      /* %n, %C, %S, user-defined conversions, or garbage. */
+      return 0;
+    }
+
+  return p - start + 1;
+}
+
+static int
+_ul_fmt_add_segment (ul_fmt_t *fmt, const char *text, size_t len,
+                     const ul_fmt_segment_t *conv)
+{
+  ul_fmt_segment_t *seg = &fmt->segments[fmt->nsegments];
+
+  if (conv)
+    {
+      *seg = *conv;
+      seg->escaped = NULL;
+      seg->escaped_len = 0;
+    }
+  else
+    {
+      memset (seg, 0, sizeof (*seg));
+      seg->precision = UL_FMT_PRECISION_NONE;
+    }
+
+  seg->text = malloc (len + 1);
+  if (seg->text == NULL)
+    return -1;
+  memcpy (seg->text, text, len);
+  seg->text[len] = '\0';
+  seg->len = len;
+
+  if (conv)
+    seg->plain = (strspn (text + 1, "lqLjztZ") == len - 2);
+  else
+    {
+      ul_buffer_t escaped = { NULL, NULL, NULL };
+
+      if (ul_buffer_append_escaped (&escaped, seg->text) == NULL)
+        {
+          free (escaped.msg);
+          return -1;
+        }
+      seg->escaped = escaped.msg;
+      seg->escaped_len = escaped.ptr - escaped.msg;
+    }
+
+  /* %m is rendered as the string strerror() returns. */
+  if (conv && conv->type == UL_ARG_ERRNO)
+    seg->text[len - 1] = 's';
+
+  fmt->nsegments++;
+  if (conv)
+    fmt->nargs += conv->nstars + (conv->type != UL_ARG_ERRNO);
+  return 0;
+}
+
+ul_fmt_t *
+ul_fmt_compile (const char *format)
+{
+  ul_fmt_t *fmt;
+  const char *p, *lit;
+  size_t max_segments = 1;
+
+  /* Every '%' can end a literal, and start a conversion. */
+  for (p = format; *p; p++)
+    if (*p == '%')
+      max_segments += 2;
+
+  fmt = calloc (1, sizeof (ul_fmt_t) +
+                max_segments * sizeof (ul_fmt_segment_t));
+  if (fmt == NULL)
+    return NULL;
+  fmt->format = strdup (format);
+  if (fmt->format == NULL)
+    goto err;
+
+  lit = p = format;
+  while (*p)
+    {
+      ul_fmt_segment_t conv;
+      size_t len;
+
+      if (*p != '%')
+        {
+          p++;
+          continue;
+        }
+
+      if (p[1] == '%')
+        {
+          /* Literal '%': keep the first one as part of the literal. */
+          if (_ul_fmt_add_segment (fmt, lit, p + 1 - lit, NULL) != 0)
+            goto err;
+          p += 2;
+          lit = p;
+          continue;
+        }
+
+      len = _ul_fmt_parse_conversion (p, &conv);
+      if (len == 0)
+        goto err;
+
+      if (p > lit && _ul_fmt_add_segment (fmt, lit, p - lit, NULL) != 0)
+        goto err;
+      if (_ul_fmt_add_segment (fmt, p, len, &conv) != 0)
+        goto err;
+      p += len;
+      lit = p;
+    }
+  if (p > lit && _ul_fmt_add_segment (fmt, lit, p - lit, NULL) != 0)
+    goto err;
+
+  fmt->trivial_string = (strcmp (format, "%s") == 0);
+
+  return fmt;
+
+ err:
+  ul_fmt_free (fmt);
+  return NULL;
+}
+
+void
+ul_fmt_free (ul_fmt_t *fmt)
+{
+  size_t i;
+
+  if (fmt == NULL)
+    return;
+  for (i = 0; i < fmt->nsegments; i++)
+    {
+      free (fmt->segments[i].text);
+      free (fmt->segments[i].escaped);
+    }
+  free (fmt->format);
+  free (fmt);
+}
+
+/* Compiled formats are cached by address, and verified against their
+   contents, much like keys are in buffer.c. Entries are never freed,
+   so a compiled format may be used long after it was looked up. */
+#define UL_FMT_CACHE_SIZE 1024 /* Must be a power of two. */
+#define UL_FMT_MAX_PROBE  8
+
+static struct
+{
+  const char *key;
+  ul_fmt_t *fmt;
+} ul_fmt_cache[UL_FMT_CACHE_SIZE];
+
+/* Returns the compiled form of FORMAT, or NULL if the format is not
+   supported, or could not be cached. */
+const ul_fmt_t *
+ul_fmt_get (const char *format)
+{
+  uintptr_t h = (uintptr_t)format;
+  ul_fmt_t *fmt = NULL;
+  size_t i, slot;
+
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+
+  for (i = 0; i < UL_FMT_MAX_PROBE; i++)
+    {
+      const char *key;
+      ul_fmt_t *cached;
+
+      slot = (h + i) & (UL_FMT_CACHE_SIZE - 1);
+      key = __atomic_load_n (&ul_fmt_cache[slot].key, __ATOMIC_ACQUIRE);
+      if (key == NULL)
+        {
+          const char *expected = NULL;
+
+          if (fmt == NULL && (fmt = ul_fmt_compile (format)) == NULL)
+            return NULL;
+          /* Claim the slot, then publish the compiled format. */
+          if (__atomic_compare_exchange_n (&ul_fmt_cache[slot].key,
+                                           &expected, format, 0,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+            {
+              __atomic_store_n (&ul_fmt_cache[slot].fmt, fmt,
+                                __ATOMIC_RELEASE);
+              return fmt;
+            }
+          key = expected;
+        }
+      if (key != format)
+        continue;
+
+      cached = __atomic_load_n (&ul_fmt_cache[slot].fmt, __ATOMIC_ACQUIRE);
+      ul_fmt_free (fmt);
+      /* Claimed, but not published yet, or reused for a different
+         format at the same address. */
+      if (cached == NULL || strcmp (cached->format, format) != 0)
+        return NULL;
+      return cached;
+    }
+
+  ul_fmt_free (fmt);
+  return NULL;
+}
+
+/* Captured arguments are stored back to back, in their own size;
+   strings are stored as a length (UINT32_MAX for NULL), followed by
+   the string and a terminating NUL. */
+static inline size_t
+_ul_arg_size (ul_arg_type_t type)
+{
+  switch (type)
+    {
+    case UL_ARG_INT:
+      return sizeof (int);
+    case UL_ARG_LONG:
+      return sizeof (long);
+    case UL_ARG_LLONG:
+      return sizeof (long long);
+    case UL_ARG_INTMAX:
+      return sizeof (intmax_t);
+    case UL_ARG_SIZE:
+      return sizeof (size_t);
+    case UL_ARG_PTRDIFF:
+      return sizeof (ptrdiff_t);
+    case UL_ARG_DOUBLE:
+      return sizeof (double);
+    case UL_ARG_LDOUBLE:
+      return sizeof (long double);
+    case UL_ARG_WINT:
+      return sizeof (wint_t);
+    case UL_ARG_POINTER:
+      return sizeof (void *);
+    default:
+      return 0;
+    }
+}
+
+/* Copy STR, or at most PRECISION bytes of it if that is not negative,
+   to OUT. */
+int
+ul_fmt_capture_string (const char *str, int precision, ul_buffer_t *out)
+{
+  uint32_t len;
+
+  if (str == NULL)
+    {
+      len = UINT32_MAX;
+      return ul_buffer_append_raw (out, (const char *)&len,
+                                   sizeof (len)) ? 0 : -1;
+    }
+
+  len = (precision >= 0) ? strnlen (str, precision) : strlen (str);
+  if (ul_buffer_reserve (out, sizeof (len) + len + 1) != 0)
+    return -1;
+  memcpy (out->ptr, &len, sizeof (len));
+  memcpy (out->ptr + sizeof (len), str, len);
+  out->ptr[sizeof (len) + len] = '\0';
+  out->ptr += sizeof (len) + len + 1;
+  return 0;
+}
+
+/* Copy the arguments FMT uses from PAP to OUT, advancing PAP. */
+int
+ul_fmt_capture (const ul_fmt_t *fmt, va_list *pap, ul_buffer_t *out)
+{
+  size_t i;
+
+  for (i = 0; i < fmt->nsegments; i++)
+    {
+      const ul_fmt_segment_t *seg = &fmt->segments[i];
+      int stars[2] = { 0, 0 }, s;
+      ul_arg_t arg;
+
+      if (!seg->conversion || seg->type == UL_ARG_ERRNO)
+        continue;
+
+      for (s = 0; s < seg->nstars; s++)
+        stars[s] = va_arg (*pap, int);
+      if (seg->nstars > 0 &&
+          ul_buffer_append_raw (out, (const char *)stars,
+                                seg->nstars * sizeof (int)) == NULL)
+        return -1;
+
+      switch (seg->type)
+        {
+        case UL_ARG_STRING:
+          {
+            int precision = seg->precision;
+
+            if (precision == UL_FMT_PRECISION_STAR)
+              precision = stars[seg->nstars - 1];
+            if (ul_fmt_capture_string (va_arg (*pap, const char *),
+                                        precision, out) != 0)
+              return -1;
+            continue;
+          }
+        case UL_ARG_INT:
+          arg.i = va_arg (*pap, int);
+          break;
+        case UL_ARG_LONG:
+          arg.l = va_arg (*pap, long);
+          break;
+        case UL_ARG_LLONG:
+          arg.ll = va_arg (*pap, long long);
+          break;
+        case UL_ARG_INTMAX:
+          arg.j = va_arg (*pap, intmax_t);
+          break;
+        case UL_ARG_SIZE:
+          arg.z = va_arg (*pap, size_t);
+          break;
+        case UL_ARG_PTRDIFF:
+          arg.t = va_arg (*pap, ptrdiff_t);
+          break;
+        case UL_ARG_DOUBLE:
+          arg.d = va_arg (*pap, double);
+          break;
+        case UL_ARG_LDOUBLE:
+          /* Do not leak the padding. */
+          memset (&arg, 0, sizeof (arg));
+          arg.ld = va_arg (*pap, long double);
+          break;
+        case UL_ARG_WINT:
+          arg.wc = va_arg (*pap, wint_t);
+          break;
+        case UL_ARG_POINTER:
+          arg.p = va_arg (*pap, void *);
+          break;
+        default:
+          return -1;
+        }
+      if (ul_buffer_append_raw (out, (const char *)&arg,
+                                _ul_arg_size (seg->type)) == NULL)
+        return -1;
+    }
+
+  return 0;
+}
+
+/* Returns the captured string at *CURSOR, and advances the cursor. */
+const char *
+ul_fmt_captured_string (const char **cursor)
+{
+  uint32_t len;
+  const char *str;
+
+  memcpy (&len, *cursor, sizeof (len));
+  *cursor += sizeof (len);
+  if (len == UINT32_MAX)
+    return NULL;
+  str = *cursor;
+  *cursor += len + 1;
+  return str;
+}
+
+/* Returns the size of the arguments captured for FMT at P, or -1 if
+   they would extend past END. */
+ssize_t
+ul_fmt_captured_size (const ul_fmt_t *fmt, const char *p, const char *end)
+{
+  const char *start = p;
+  size_t i;
+
+  for (i = 0; i < fmt->nsegments; i++)
+    {
+      const ul_fmt_segment_t *seg = &fmt->segments[i];
+      size_t size;
+
+      if (!seg->conversion || seg->type == UL_ARG_ERRNO)
+        continue;
+
+      size = seg->nstars * sizeof (int);
+      if ((size_t)(end - p) < size)
+        return -1;
+      p += size;
+
+      if (seg->type == UL_ARG_STRING)
+        {
+          uint32_t len;
+
+          if ((size_t)(end - p) < sizeof (len))
+            return -1;
+          memcpy (&len, p, sizeof (len));
+          p += sizeof (len);
+          if (len == UINT32_MAX)
+            continue;
+          if ((size_t)(end - p) < (size_t)len + 1 || p[len] != '\0')
+            return -1;
+          p += len + 1;
+          continue;
+        }
+
+      size = _ul_arg_size (seg->type);
+      if ((size_t)(end - p) < size)
+        return -1;
+      p += size;
+    }
+
+  return p - start;
+}
+
+#define UL_FMT_SNPRINTF(buf, size, seg, stars, value)                   \
+  ((seg)->nstars == 0 ? snprintf ((buf), (size), (seg)->text, value) :  \
+   (seg)->nstars == 1 ? snprintf ((buf), (size), (seg)->text,           \
+                                  (stars)[0], value) :                  \
+   snprintf ((buf), (size), (seg)->text, (stars)[0], (stars)[1], value))
+
+/* Format a single conversion SEG of ARG, or STR for strings and %m,
+   with snprintf(). */
+static int
+_ul_fmt_snprintf (char *buf, size_t size, const ul_fmt_segment_t *seg,
+                  const int *stars, const ul_arg_t *arg, const char *str)
+{
+  switch (seg->type)
+    {
+    case UL_ARG_STRING:
+    case UL_ARG_ERRNO:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, str);
+    case UL_ARG_INT:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->i);
+    case UL_ARG_LONG:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->l);
+    case UL_ARG_LLONG:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->ll);
+    case UL_ARG_INTMAX:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->j);
+    case UL_ARG_SIZE:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->z);
+    case UL_ARG_PTRDIFF:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->t);
+    case UL_ARG_DOUBLE:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->d);
+    case UL_ARG_LDOUBLE:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->ld);
+    case UL_ARG_WINT:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->wc);
+    case UL_ARG_POINTER:
+      return UL_FMT_SNPRINTF (buf, size, seg, stars, arg->p);
+    default:
+      return -1;
+    }
+}
+
+/* Render FMT into OUT as plain, NUL-terminated text, using the
+   arguments captured at *CURSOR, and advance the cursor past them.
+   OUT->ptr is left pointing at the terminating NUL. */
+int
+ul_fmt_render (const ul_fmt_t *fmt, const char **cursor, int saved_errno,
+               ul_buffer_t *out)
+{
+  size_t i;
+
+  for (i = 0; i < fmt->nsegments; i++)
+    {
+      const ul_fmt_segment_t *seg = &fmt->segments[i];
+      const char *p = *cursor;
+      int stars[2] = { 0, 0 };
+      const char *str = NULL;
+      char errbuf[128];
+      ul_arg_t arg;
+      size_t avail;
+      int n;
+
+      if (!seg->conversion)
+        {
+          if (ul_buffer_append_raw (out, seg->text, seg->len) == NULL)
+            return -1;
+          continue;
+        }
+
+      memcpy (stars, p, seg->nstars * sizeof (int));
+      p += seg->nstars * sizeof (int);
+
+      if (seg->type == UL_ARG_STRING)
+        str = ul_fmt_captured_string (&p);
+      else if (seg->type == UL_ARG_ERRNO)
+        str = strerror_r (saved_errno, errbuf, sizeof (errbuf));
+      else
+        {
+          memcpy (&arg, p, _ul_arg_size (seg->type));
+          p += _ul_arg_size (seg->type);
+        }
+
+      /* Try with whatever room there is, and retry with enough if that
+         was not enough. */
+      if (ul_buffer_reserve (out, 64) != 0)
+        return -1;
+      for (;;)
+        {
+          avail = out->alloc_end - out->ptr;
+          n = _ul_fmt_snprintf (out->ptr, avail, seg, stars, &arg, str);
+          if (n < 0)
+            return -1;
+          if ((size_t)n < avail)
+            break;
+          if (ul_buffer_reserve (out, n + 1) != 0)
+            return -1;
+        }
+      out->ptr += n;
+      *cursor = p;
+    }
+
+  if (ul_buffer_reserve (out, 1) != 0)
+    return -1;
+  *out->ptr = '\0';
+
+  return 0;
+}
+
+/* Render FMT as the contents of a JSON string into OUT, taking the
+   arguments straight from PAP, and advancing it. Literal text was
+   escaped when the format was compiled, strings and decimal integers
+   without flags or width are appended directly, and only the rest goes
+   through snprintf(). */
+int
+ul_fmt_vrender_json (const ul_fmt_t *fmt, va_list *pap, int saved_errno,
+                     ul_buffer_t *out)
+{
+  size_t i;
+
+  for (i = 0; i < fmt->nsegments; i++)
+    {
+      const ul_fmt_segment_t *seg = &fmt->segments[i];
+      int stars[2] = { 0, 0 }, s, n, negative = 0;
+      const char *str = NULL;
+      char small[128], *text;
+      uintmax_t value = 0;
+      ul_arg_t arg;
+
+      if (!seg->conversion)
+        {
+          if (ul_buffer_append_raw (out, seg->escaped,
+                                    seg->escaped_len) == NULL)
+            return -1;
+          continue;
+        }
+
+      for (s = 0; s < seg->nstars; s++)
+        stars[s] = va_arg (*pap, int);
+
+      switch (seg->type)
+        {
+        case UL_ARG_ERRNO:
+          str = strerror_r (saved_errno, small, sizeof (small));
+          if (ul_buffer_append_escaped (out, str) == NULL)
+            return -1;
+          continue;
+        case UL_ARG_STRING:
+          str = va_arg (*pap, const char *);
+          if (seg->plain)
+            {
+              if (ul_buffer_append_escaped (out, str ? str : "(null)") == NULL)
+                return -1;
+              continue;
+            }
+          break;
+        case UL_ARG_INT:
+          arg.i = va_arg (*pap, int);
+          if (seg->conversion == 'u')
+            value = (unsigned int)arg.i;
+          else
+            {
+              negative = (arg.i < 0);
+              value = negative ? -(uintmax_t)arg.i : (uintmax_t)arg.i;
+            }
+          break;
+        case UL_ARG_LONG:
+          arg.l = va_arg (*pap, long);
+          if (seg->conversion == 'u')
+            value = (unsigned long)arg.l;
+          else
+            {
+              negative = (arg.l < 0);
+              value = negative ? -(uintmax_t)arg.l : (uintmax_t)arg.l;
+            }
+          break;
+        case UL_ARG_LLONG:
+          arg.ll = va_arg (*pap, long long);
+          if (seg->conversion == 'u')
+            value = (unsigned long long)arg.ll;
+          else
+            {
+              negative = (arg.ll < 0);
+              value = negative ? -(uintmax_t)arg.ll : (uintmax_t)arg.ll;
+            }
+          break;
+        case UL_ARG_INTMAX:
+          arg.j = va_arg (*pap, intmax_t);
+          if (seg->conversion == 'u')
+            value = (uintmax_t)arg.j;
+          else
+            {
+              negative = (arg.j < 0);
+              value = negative ? -(uintmax_t)arg.j : (uintmax_t)arg.j;
+            }
+          break;
+        case UL_ARG_SIZE:
+          arg.z = va_arg (*pap, size_t);
+          if (seg->conversion == 'u')
+            value = arg.z;
+          else
+            {
+              negative = ((ssize_t)arg.z < 0);
+              value = negative ? -(uintmax_t)(ssize_t)arg.z : arg.z;
+            }
+          break;
+        case UL_ARG_PTRDIFF:
+          arg.t = va_arg (*pap, ptrdiff_t);
+          if (seg->conversion == 'u')
+            value = (size_t)arg.t;
+          else
+            {
+              negative = (arg.t < 0);
+              value = negative ? -(uintmax_t)arg.t : (uintmax_t)arg.t;
+            }
+          break;
+        case UL_ARG_DOUBLE:
+          arg.d = va_arg (*pap, double);
+          break;
+        case UL_ARG_LDOUBLE:
+          arg.ld = va_arg (*pap, long double);
+          break;
+        case UL_ARG_WINT:
+          arg.wc = va_arg (*pap, wint_t);
+          break;
+        case UL_ARG_POINTER:
+          arg.p = va_arg (*pap, void *);
+          break;
+        default:
+          return -1;
+        }
+
+      if (seg->plain && (seg->conversion == 'd' || seg->conversion == 'i' ||
+                         seg->conversion == 'u'))
+        {
+          if (ul_buffer_append_decimal (out, value, negative) == NULL)
+            return -1;
+          continue;
+        }
+
+      /* Anything else is formatted separately, as it may need
+         escaping. */
+      text = small;
+      n = _ul_fmt_snprintf (small, sizeof (small), seg, stars, &arg, str);
+      if (n < 0)
+        return -1;
+      if ((size_t)n >= sizeof (small))
+        {
+          text = malloc (n + 1);
+          if (text == NULL)
+            return -1;
+          _ul_fmt_snprintf (text, n + 1, seg, stars, &arg, str);
+        }
+      out = ul_buffer_append_escaped (out, text);
+      if (text != small)
+        free (text);
+      if (out == NULL)
+        return -1;
+    }
+
+  return 0;
+}
+
+/* Like ul_fmt_render(), but escaped, into a fixed buffer, and
+   async-signal-safe. Only strings, characters and integers without
+   flags or width can be rendered that way: anything else is rendered
+   as its conversion specification, and %m as the errno value. */
+void
+ul_fmt_render_safe (const ul_fmt_t *fmt, const char **cursor,
+                    int saved_errno, ul_safe_buffer_t *out)
+{
+  size_t i;
+
+  for (i = 0; i < fmt->nsegments; i++)
+    {
+      const ul_fmt_segment_t *seg = &fmt->segments[i];
+      const char *p = *cursor, *str;
+      ul_arg_t arg;
+      int plain;
+      intmax_t value;
+      char c;
+
+      if (!seg->conversion)
+        {
+          ul_safe_append_escaped (out, seg->text, seg->len);
+          continue;
+        }
+
+      p += seg->nstars * sizeof (int);
+
+      if (seg->type == UL_ARG_ERRNO)
+        {
+          ul_safe_append_int (out, saved_errno);
+          continue;
+        }
+      if (seg->type == UL_ARG_STRING)
+        {
+          /* The precision was applied when capturing. */
+          str = ul_fmt_captured_string (&p);
+          *cursor = p;
+          if (strspn (seg->text + 1, ".0123456789*") == seg->len - 2)
+            ul_safe_append_escaped (out, str ? str : "(null)",
+                                    str ? strlen (str) : 6);
+          else
+            ul_safe_append_escaped (out, seg->text, seg->len);
+          continue;
+        }
+
+      memcpy (&arg, p, _ul_arg_size (seg->type));
+      *cursor = p + _ul_arg_size (seg->type);
+
+      plain = (strspn (seg->text + 1, "hlqLjztZ") == seg->len - 2);
+      switch (seg->type)
+        {
+        case UL_ARG_INT:
+          value = arg.i;
+          if (strncmp (seg->text, "%hh", 3) == 0)
+            value = (seg->conversion == 'd' || seg->conversion == 'i') ?
+              (signed char)arg.i : (unsigned char)arg.i;
+          else if (seg->text[1] == 'h')
+            value = (seg->conversion == 'd' || seg->conversion == 'i') ?
+              (short)arg.i : (unsigned short)arg.i;
+          else if (seg->conversion != 'd' && seg->conversion != 'i')
+            value = (unsigned int)arg.i;
+          break;
+        case UL_ARG_LONG:
+          value = (seg->conversion == 'd' || seg->conversion == 'i') ?
+            arg.l : (intmax_t)(unsigned long)arg.l;
+          break;
+        case UL_ARG_LLONG:
+          value = arg.ll;
+          break;
+        case UL_ARG_INTMAX:
+          value = arg.j;
+          break;
+        case UL_ARG_SIZE:
+          value = arg.z;
+          break;
+        case UL_ARG_PTRDIFF:
+          value = arg.t;
+          break;
+        case UL_ARG_POINTER:
+          value = (uintptr_t)arg.p;
+          break;
+        default:
+          plain = 0;
+          value = 0;
+          break;
+        }
+
+      if (!plain)
+        {
+          ul_safe_append_escaped (out, seg->text, seg->len);
+          continue;
+        }
+
+      switch (seg->conversion)
+        {
+        case 'd':
+        case 'i':
+          ul_safe_append_int (out, value);
+          break;
+        case 'u':
+          ul_safe_append_uint (out, value);
+          break;
+        case 'o':
+          ul_safe_append_base (out, value, 8, 0);
+          break;
+        case 'x':
+        case 'X':
+          ul_safe_append_base (out, value, 16, seg->conversion == 'X');
+          break;
+        case 'p':
+          ul_safe_append (out, "0x", 2);
+          ul_safe_append_base (out, value, 16, 0);
+          break;
+        case 'c':
+          c = (char)value;
+          ul_safe_append_escaped (out, &c, 1);
+          break;
+        default:
+          ul_safe_append_escaped (out, seg->text, seg->len);
+          break;
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/* fmt.h -- Compiled printf-style formats
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_FMT_H
+#define UMBERLOG_FMT_H 1
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <wchar.h>
+
+#include "buffer.h"
+#include "safe.h"
+
+/* A printf-style format, split into literal text and conversions, and
+   annotated with the type of each argument, so that the arguments can
+   be captured from a va_list, and rendered later, without the va_list
+   being around anymore. */
+typedef enum
+{
+  UL_ARG_ERRNO,    /* %m: no argument, uses the captured errno */
+  UL_ARG_INT,
+  UL_ARG_LONG,
+  UL_ARG_LLONG,
+  UL_ARG_INTMAX,
+  UL_ARG_SIZE,
+  UL_ARG_PTRDIFF,
+  UL_ARG_DOUBLE,
+  UL_ARG_LDOUBLE,
+  UL_ARG_WINT,
+  UL_ARG_POINTER,
+  UL_ARG_STRING
+} ul_arg_type_t;
+
+typedef union
+{
+  int i;
+  long l;
+  long long ll;
+  intmax_t j;
+  size_t z;
+  ptrdiff_t t;
+  double d;
+  long double ld;
+  wint_t wc;
+  const void *p;
+} ul_arg_t;
+
+#define UL_FMT_PRECISION_NONE -1
+#define UL_FMT_PRECISION_STAR -2
+
+typedef struct
+{
+  char *text;          /* Literal text, or a single conversion */
+  size_t len;
+  int conversion;      /* Zero for literal text */
+  ul_arg_type_t type;
+  int nstars;          /* Number of '*' int arguments before the value */
+  int precision;       /* For strings, see UL_FMT_PRECISION_* */
+  int plain;           /* No flags, width, precision, or h/hh */
+  char *escaped;       /* Literal text, escaped for JSON */
+  size_t escaped_len;
+} ul_fmt_segment_t;
+
+typedef struct
+{
+  char *format;        /* Our own copy of the format */
+  size_t nsegments;
+  size_t nargs;        /* Number of arguments, including '*' ones */
+  int trivial_string;  /* The format is exactly "%s" */
+  ul_fmt_segment_t segments[];
+} ul_fmt_t;
+
+ul_fmt_t *ul_fmt_compile (const char *format)
+  __attribute__((visibility("hidden")));
+void ul_fmt_free (ul_fmt_t *fmt)
+  __attribute__((visibility("hidden")));
+const ul_fmt_t *ul_fmt_get (const char *format)
+  __attribute__((visibility("hidden")));
+
+int ul_fmt_capture_string (const char *str, int precision, ul_buffer_t *out)
+  __attribute__((visibility("hidden")));
+int ul_fmt_capture (const ul_fmt_t *fmt, va_list *pap, ul_buffer_t *out)
+  __attribute__((visibility("hidden")));
+int ul_fmt_render (const ul_fmt_t *fmt, const char **cursor,
+                   int saved_errno, ul_buffer_t *out)
+  __attribute__((visibility("hidden")));
+ssize_t ul_fmt_captured_size (const ul_fmt_t *fmt, const char *p,
+                              const char *end)
+  __attribute__((visibility("hidden")));
+const char *ul_fmt_captured_string (const char **cursor)
+  __attribute__((visibility("hidden")));
+int ul_fmt_vrender_json (const ul_fmt_t *fmt, va_list *pap,
+                         int saved_errno, ul_buffer_t *out)
+  __attribute__((visibility("hidden")));
+void ul_fmt_render_safe (const ul_fmt_t *fmt, const char **cursor,
+                         int saved_errno, ul_safe_buffer_t *out)
+  __attribute__((visibility("hidden")));
+
+#endif
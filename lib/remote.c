@@ -0,0 +1,483 @@
+/* remote.c -- Sending messages to a remote collector
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "remote.h"
+#include "safe.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How long the thread keeps writing, before it looks for more
+   messages to send along. */
+#define UL_REMOTE_WRITE_TIMEOUT 1000
+
+static inline uint64_t
+_ul_remote_now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Parse the frame at P: returns its size, and the message in it. */
+static inline size_t
+_ul_remote_frame (const char *p, const char **msg, size_t *len)
+{
+  const char *s = p;
+  size_t n = 0;
+
+  while (*s != ' ')
+    n = n * 10 + (*s++ - '0');
+  *msg = s + 1;
+  *len = n;
+  return (*msg - p) + n;
+}
+
+static unsigned long
+_ul_remote_count_frames (const char *p, const char *end)
+{
+  unsigned long count = 0;
+  const char *msg;
+  size_t len;
+
+  while (p < end)
+    {
+      p += _ul_remote_frame (p, &msg, &len);
+      count++;
+    }
+  return count;
+}
+
+/* The start of the frame the byte at SENT is in. */
+static size_t
+_ul_remote_frame_start (const char *out, size_t sent)
+{
+  size_t pos = 0, frame;
+  const char *msg;
+  size_t len;
+
+  for (;;)
+    {
+      frame = _ul_remote_frame (out + pos, &msg, &len);
+      if (pos + frame > sent)
+        return pos;
+      pos += frame;
+    }
+}
+
+/* Returns non-zero if the connection was lost. */
+static int
+_ul_remote_send_stream (ul_remote_t *remote, ul_buffer_t *out, size_t *sent,
+                        int timeout_ms)
+{
+  size_t len = out->ptr - out->msg;
+  ssize_t n;
+
+  n = ul_sink_write (&remote->sink, out->msg + *sent, len - *sent,
+                     timeout_ms);
+  if (n >= 0)
+    {
+      if (n > 0)
+        ul_sink_connected (&remote->sink);
+      *sent += n;
+      return 0;
+    }
+
+  /* The part of the message that was sent is lost with the
+     connection: send all of it again on the next one. */
+  *sent = _ul_remote_frame_start (out->msg, *sent);
+  ul_sink_failed (&remote->sink);
+  return 1;
+}
+
+static void
+_ul_remote_send_dgram (ul_remote_t *remote, ul_buffer_t *out, size_t *sent,
+                       int timeout_ms)
+{
+  struct iovec iov;
+  const char *msg;
+  size_t frame;
+
+  while (out->msg + *sent < out->ptr)
+    {
+      frame = _ul_remote_frame (out->msg + *sent, &msg, &iov.iov_len);
+      iov.iov_base = (void *)msg;
+      if (ul_sink_send (&remote->sink, &iov, 1, timeout_ms) != 0)
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+          __atomic_fetch_add (&remote->dropped, 1, __ATOMIC_RELAXED);
+        }
+      *sent += frame;
+    }
+}
+
+/* Take the connection and the batch for a round of sending, unless a
+   crash handler took them over. */
+static int
+_ul_remote_claim (ul_remote_t *remote, int writer)
+{
+  int expected = UL_REMOTE_WRITER_NONE;
+
+  return __atomic_compare_exchange_n (&remote->writer, &expected, writer, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void
+_ul_remote_release (ul_remote_t *remote)
+{
+  __atomic_store_n (&remote->writer, UL_REMOTE_WRITER_NONE,
+                    __ATOMIC_RELEASE);
+}
+
+static void *
+_ul_remote_thread (void *data)
+{
+  ul_remote_t *remote = data;
+  ul_buffer_t *out = &remote->out, swap;
+  struct timespec deadline;
+  int connected = 0, timeout;
+  uint64_t now, wait;
+
+  pthread_mutex_lock (&remote->lock);
+  for (;;)
+    {
+      /* The process is crashing, and the handler is sending what is
+         left: keep off. */
+      if (!_ul_remote_claim (remote, UL_REMOTE_WRITER_THREAD))
+        {
+          pthread_mutex_unlock (&remote->lock);
+          return NULL;
+        }
+
+      /* Everything collected while the last batch was being sent goes
+         out in one go. */
+      if (out->ptr == out->msg + remote->sent &&
+          remote->pending.ptr != remote->pending.msg)
+        {
+          swap = *out;
+          *out = remote->pending;
+          remote->pending = swap;
+          remote->pending.ptr = remote->pending.msg;
+          remote->sent = 0;
+        }
+      if (out->ptr == out->msg + remote->sent)
+        {
+          if (remote->stop)
+            break;
+          _ul_remote_release (remote);
+          remote->idle = 1;
+          pthread_cond_wait (&remote->cond, &remote->lock);
+          remote->idle = 0;
+          continue;
+        }
+
+      now = _ul_remote_now_ms ();
+      timeout = UL_REMOTE_WRITE_TIMEOUT;
+      if (remote->stop)
+        {
+          if (now >= remote->stop_deadline)
+            break;
+          if (remote->stop_deadline - now < (uint64_t)timeout)
+            timeout = remote->stop_deadline - now;
+        }
+
+      /* Wait for the backoff delay, unless asked to stop. */
+      if (!connected && remote->sink.retry_at > now)
+        {
+          if (remote->stop)
+            break;
+          _ul_remote_release (remote);
+          wait = remote->sink.retry_at - now;
+          clock_gettime (CLOCK_REALTIME, &deadline);
+          deadline.tv_sec += wait / 1000;
+          deadline.tv_nsec += (wait % 1000) * 1000000;
+          if (deadline.tv_nsec >= 1000000000)
+            {
+              deadline.tv_sec++;
+              deadline.tv_nsec -= 1000000000;
+            }
+          pthread_cond_timedwait (&remote->cond, &remote->lock, &deadline);
+          continue;
+        }
+      pthread_mutex_unlock (&remote->lock);
+
+      if (!connected)
+        {
+          __atomic_fetch_add (&remote->connects, 1, __ATOMIC_RELAXED);
+          connected = (ul_sink_connect (&remote->sink) == 0);
+        }
+      if (connected)
+        {
+          if (remote->sink.type == SOCK_STREAM)
+            connected = !_ul_remote_send_stream (remote, out, &remote->sent,
+                                                 timeout);
+          else
+            _ul_remote_send_dgram (remote, out, &remote->sent, timeout);
+        }
+
+      /* Between two rounds, a crash handler may take over. */
+      _ul_remote_release (remote);
+      pthread_mutex_lock (&remote->lock);
+    }
+  pthread_mutex_unlock (&remote->lock);
+
+  /* Whatever could not be sent by the deadline is lost. */
+  __atomic_fetch_add (&remote->dropped,
+                      _ul_remote_count_frames (out->msg + remote->sent,
+                                               out->ptr),
+                      __ATOMIC_RELAXED);
+  free (out->msg);
+  out->msg = out->ptr = out->alloc_end = NULL;
+  remote->sent = 0;
+  _ul_remote_release (remote);
+
+  return NULL;
+}
+
+/* Must be called with the remote locked. */
+static int
+_ul_remote_start (ul_remote_t *remote)
+{
+  sigset_t all, old;
+  int ret;
+
+  /* Signals are for the threads of the application to handle. */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  ret = pthread_create (&remote->thread, NULL, _ul_remote_thread, remote);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (ret != 0)
+    {
+      errno = ret;
+      return -1;
+    }
+  remote->running = 1;
+  return 0;
+}
+
+int
+ul_remote_open (ul_remote_t *remote, const char *host, const char *port,
+                int type, size_t size)
+{
+  if ((type != SOCK_STREAM && type != SOCK_DGRAM) || size == 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  if (ul_sink_set_inet (&remote->sink, host, port, type) != 0)
+    return -1;
+
+  pthread_mutex_lock (&remote->lock);
+  remote->size = size;
+  remote->closed = 0;
+  pthread_mutex_unlock (&remote->lock);
+
+  return 0;
+}
+
+/* Collect a message, made up of the pieces in IOV. Returns -1 if it
+   was dropped, which it is once the remote is being closed: a message
+   from a thread that did not see it disabled in time must not start
+   the thread again. */
+int
+ul_remote_send (ul_remote_t *remote, const struct iovec *iov, int iovcnt)
+{
+  char prefix[24];
+  size_t len = 0, plen;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  plen = snprintf (prefix, sizeof (prefix), "%zu ", len);
+
+  pthread_mutex_lock (&remote->lock);
+  if (remote->closed ||
+      (!remote->running && _ul_remote_start (remote) != 0))
+    goto err;
+  if ((size_t)(remote->pending.ptr - remote->pending.msg) + plen + len >
+      remote->size ||
+      ul_buffer_reserve (&remote->pending, plen + len) != 0)
+    goto err;
+
+  memcpy (remote->pending.ptr, prefix, plen);
+  remote->pending.ptr += plen;
+  for (i = 0; i < iovcnt; i++)
+    {
+      memcpy (remote->pending.ptr, iov[i].iov_base, iov[i].iov_len);
+      remote->pending.ptr += iov[i].iov_len;
+    }
+
+  if (remote->idle)
+    pthread_cond_signal (&remote->cond);
+  pthread_mutex_unlock (&remote->lock);
+  return 0;
+
+ err:
+  __atomic_fetch_add (&remote->dropped, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&remote->lock);
+  return -1;
+}
+
+/* Stop the thread once everything collected is sent, or TIMEOUT_MS
+   milliseconds passed, and close the connection. */
+void
+ul_remote_close (ul_remote_t *remote, int timeout_ms)
+{
+  pthread_t thread;
+
+  pthread_mutex_lock (&remote->lock);
+  remote->closed = 1;
+  if (!remote->running)
+    {
+      pthread_mutex_unlock (&remote->lock);
+      goto out;
+    }
+  remote->stop = 1;
+  remote->stop_deadline = _ul_remote_now_ms () + timeout_ms;
+  thread = remote->thread;
+  pthread_cond_signal (&remote->cond);
+  pthread_mutex_unlock (&remote->lock);
+
+  pthread_join (thread, NULL);
+
+  pthread_mutex_lock (&remote->lock);
+  __atomic_fetch_add (&remote->dropped,
+                      _ul_remote_count_frames (remote->pending.msg,
+                                               remote->pending.ptr),
+                      __ATOMIC_RELAXED);
+  remote->pending.ptr = remote->pending.msg;
+  remote->running = 0;
+  remote->stop = 0;
+  pthread_mutex_unlock (&remote->lock);
+
+ out:
+  ul_sink_close (&remote->sink);
+}
+
+/* Write out what was collected, from a crash handler: without
+   locking, or waiting for longer than TIMEOUT_MS. On a stream, the
+   thread may be in the middle of a frame: wait for it to finish its
+   write, then take the connection over, send the rest of its batch,
+   and what was collected since. If it does not finish in time,
+   nothing is written, rather than a frame cut in two. Returns 0 if
+   more can be sent with ul_remote_crash_send(), -1 otherwise. */
+int
+ul_remote_crash_flush (ul_remote_t *remote, int timeout_ms)
+{
+  const char *p = remote->pending.msg, *end = remote->pending.ptr;
+  const char *msg;
+  size_t len;
+  struct timespec pause = { 0, 1000000 };
+  int waited;
+
+  if (remote->sink.type == SOCK_STREAM)
+    {
+      for (waited = 0; !_ul_remote_claim (remote, UL_REMOTE_WRITER_CRASH);
+           waited++)
+        {
+          if (waited >= timeout_ms)
+            return -1;
+          nanosleep (&pause, NULL);
+        }
+      if (remote->sink.fd == -1)
+        return -1;
+
+      if (remote->out.msg != NULL &&
+          remote->out.msg + remote->sent < remote->out.ptr)
+        ul_sink_write (&remote->sink, remote->out.msg + remote->sent,
+                       remote->out.ptr - remote->out.msg - remote->sent,
+                       timeout_ms);
+      if (p != NULL)
+        ul_sink_write (&remote->sink, p, end - p, timeout_ms);
+      return 0;
+    }
+
+  if (remote->sink.fd == -1)
+    return -1;
+  while (p != NULL && p < end)
+    {
+      p += _ul_remote_frame (p, &msg, &len);
+      send (remote->sink.fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+  return 0;
+}
+
+/* Send MSG, with its header, from a crash handler, once
+   ul_remote_crash_flush() returned 0. Nothing follows a frame that
+   could not be written whole. */
+void
+ul_remote_crash_send (ul_remote_t *remote, const char *msg, size_t len,
+                      int timeout_ms)
+{
+  char prefix[24];
+  ul_safe_buffer_t b = { prefix, prefix + sizeof (prefix), 0 };
+  ssize_t plen;
+
+  if (remote->sink.fd == -1)
+    return;
+  if (remote->sink.type != SOCK_STREAM)
+    {
+      send (remote->sink.fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+      return;
+    }
+
+  ul_safe_append_uint (&b, len);
+  ul_safe_append (&b, " ", 1);
+  plen = b.ptr - prefix;
+  if (ul_sink_write (&remote->sink, prefix, plen, timeout_ms) != plen ||
+      ul_sink_write (&remote->sink, msg, len, timeout_ms) != (ssize_t)len)
+    {
+      close (remote->sink.fd);
+      remote->sink.fd = -1;
+    }
+}
+
+/* The thread is gone in the child, and what was collected is the
+   parent's to send. Called with the remote locked. */
+void
+ul_remote_atfork_child (ul_remote_t *remote)
+{
+  remote->pending.ptr = remote->pending.msg;
+  remote->out.ptr = remote->out.msg;
+  remote->sent = 0;
+  remote->writer = UL_REMOTE_WRITER_NONE;
+  remote->running = 0;
+  remote->stop = 0;
+  remote->idle = 0;
+}
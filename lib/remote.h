@@ -0,0 +1,98 @@
+/* remote.h -- Sending messages to a remote collector
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+#ifndef UMBERLOG_REMOTE_H
+#define UMBERLOG_REMOTE_H 1
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "buffer.h"
+#include "sink.h"
+
+/* Messages to a remote collector are framed with their length (RFC
+   6587 octet counting), and collected in a bounded buffer, which a
+   thread of the remote's own sends. Everything collected while the
+   thread was busy sending is sent in one go, and while the collector
+   cannot be reached, messages that do not fit are dropped. Over UDP,
+   the length is stripped, and every message is a datagram of its
+   own. */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;     /* Signalled when there are messages, or on stop */
+  pthread_t thread;
+  int running;
+  int stop;
+  int closed;              /* By ul_remote_close(), until opened again */
+  int idle;                /* The thread is waiting on cond */
+  uint64_t stop_deadline;  /* CLOCK_MONOTONIC milliseconds */
+
+  ul_sink_t sink;
+  size_t size;             /* Bytes the buffer may hold */
+  ul_buffer_t pending;
+
+  unsigned long dropped;
+  unsigned long connects;
+
+  /* The batch the thread is sending, and how much of it was sent. */
+  ul_buffer_t out;
+  size_t sent;
+  /* Who may touch the connection and the batch: the thread takes it
+     for every round, a crash handler takes it for good. */
+  int writer;
+} ul_remote_t;
+
+#define UL_REMOTE_WRITER_NONE   0
+#define UL_REMOTE_WRITER_THREAD 1
+#define UL_REMOTE_WRITER_CRASH  2
+
+#define UL_REMOTE_INITIALIZER                                           \
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, \
+    0, UL_SINK_INITIALIZER, 0, { NULL, NULL, NULL }, 0, 0,              \
+    { NULL, NULL, NULL }, 0, UL_REMOTE_WRITER_NONE }
+
+int ul_remote_open (ul_remote_t *remote, const char *host, const char *port,
+                    int type, size_t size)
+  __attribute__((visibility("hidden")));
+int ul_remote_send (ul_remote_t *remote, const struct iovec *iov, int iovcnt)
+  __attribute__((visibility("hidden")));
+void ul_remote_close (ul_remote_t *remote, int timeout_ms)
+  __attribute__((visibility("hidden")));
+int ul_remote_crash_flush (ul_remote_t *remote, int timeout_ms)
+  __attribute__((visibility("hidden")));
+void ul_remote_crash_send (ul_remote_t *remote, const char *msg, size_t len,
+                           int timeout_ms)
+  __attribute__((visibility("hidden")));
+void ul_remote_atfork_child (ul_remote_t *remote)
+  __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,174 @@
+/* ring.c -- Bounded rings of variable-sized records
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "ring.h"
+
+#include <string.h>
+
+typedef struct
+{
+  uint32_t len;
+  uint32_t tag;
+} ul_ring_header_t;
+
+/* A length that marks the rest of the ring as unused: the next record
+   is at the start. */
+#define UL_RING_WRAP ((uint32_t)-1)
+
+#define UL_RING_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/* Bytes allocated for all rings of the process. */
+static size_t ul_ring_allocated;
+
+int
+ul_ring_init (ul_ring_t *ring, size_t size)
+{
+  size = UL_RING_ALIGN (size);
+  ring->data = malloc (size);
+  if (ring->data == NULL)
+    return -1;
+  ring->size = size;
+  ul_ring_clear (ring);
+  __atomic_fetch_add (&ul_ring_allocated, size, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void
+ul_ring_free (ul_ring_t *ring)
+{
+  free (ring->data);
+  __atomic_fetch_sub (&ul_ring_allocated, ring->size, __ATOMIC_RELAXED);
+  ring->data = NULL;
+  ring->size = 0;
+  ul_ring_clear (ring);
+}
+
+void
+ul_ring_clear (ul_ring_t *ring)
+{
+  ring->head = ring->tail = 0;
+  ring->used = ring->count = 0;
+}
+
+/* Reserve room for a record of LEN bytes, and return a pointer to
+   it, or NULL if the ring does not have enough contiguous room. */
+void *
+ul_ring_push (ul_ring_t *ring, size_t len, uint32_t tag)
+{
+  size_t need = UL_RING_ALIGN (sizeof (ul_ring_header_t) + len);
+  ul_ring_header_t *hdr;
+
+  if (len >= UL_RING_WRAP || need > ring->size - ring->used)
+    return NULL;
+
+  if (ring->count == 0)
+    ring->head = ring->tail = 0;
+
+  if (ring->head >= ring->tail)
+    {
+      /* Free space is at the end, and possibly at the start. */
+      if (ring->size - ring->head < need)
+        {
+          if (ring->tail < need)
+            return NULL;
+          if (ring->size - ring->head >= sizeof (ul_ring_header_t))
+            ((ul_ring_header_t *)(ring->data + ring->head))->len =
+              UL_RING_WRAP;
+          ring->used += ring->size - ring->head;
+          ring->head = 0;
+        }
+    }
+  else if (ring->tail - ring->head < need)
+    return NULL;
+
+  hdr = (ul_ring_header_t *)(ring->data + ring->head);
+  hdr->len = len;
+  hdr->tag = tag;
+  ring->head += need;
+  ring->used += need;
+  ring->count++;
+
+  return hdr + 1;
+}
+
+static inline void
+_ul_ring_skip_wrap (ul_ring_t *ring)
+{
+  if (ring->tail != 0 &&
+      (ring->size - ring->tail < sizeof (ul_ring_header_t) ||
+       ((ul_ring_header_t *)(ring->data + ring->tail))->len == UL_RING_WRAP))
+    {
+      ring->used -= ring->size - ring->tail;
+      ring->tail = 0;
+    }
+}
+
+/* Return the oldest record, or NULL if the ring is empty. */
+void *
+ul_ring_front (ul_ring_t *ring, size_t *len, uint32_t *tag)
+{
+  ul_ring_header_t *hdr;
+
+  if (ring->count == 0)
+    return NULL;
+
+  _ul_ring_skip_wrap (ring);
+  hdr = (ul_ring_header_t *)(ring->data + ring->tail);
+  if (len)
+    *len = hdr->len;
+  if (tag)
+    *tag = hdr->tag;
+  return hdr + 1;
+}
+
+void
+ul_ring_pop (ul_ring_t *ring)
+{
+  ul_ring_header_t *hdr;
+  size_t need;
+
+  if (ring->count == 0)
+    return;
+
+  _ul_ring_skip_wrap (ring);
+  hdr = (ul_ring_header_t *)(ring->data + ring->tail);
+  need = UL_RING_ALIGN (sizeof (ul_ring_header_t) + hdr->len);
+  ring->tail += need;
+  ring->used -= need;
+  if (--ring->count == 0)
+    ul_ring_clear (ring);
+}
+
+size_t
+ul_ring_memory (void)
+{
+  return __atomic_load_n (&ul_ring_allocated, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+/* ring.h -- Bounded rings of variable-sized records
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_RING_H
+#define UMBERLOG_RING_H 1
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* A fixed-size ring of variable-sized records. Records are stored
+   contiguously, prefixed with their length and a tag the user can
+   use freely. The ring itself does no locking. */
+typedef struct
+{
+  char *data;
+  size_t size;   /* Allocated bytes */
+  size_t head;   /* Offset where the next record goes */
+  size_t tail;   /* Offset of the oldest record */
+  size_t used;   /* Bytes in use, including padding */
+  size_t count;  /* Number of records */
+} ul_ring_t;
+
+int ul_ring_init (ul_ring_t *ring, size_t size)
+  __attribute__((visibility("hidden")));
+void ul_ring_free (ul_ring_t *ring)
+  __attribute__((visibility("hidden")));
+void ul_ring_clear (ul_ring_t *ring)
+  __attribute__((visibility("hidden")));
+void *ul_ring_push (ul_ring_t *ring, size_t len, uint32_t tag)
+  __attribute__((visibility("hidden")));
+void *ul_ring_front (ul_ring_t *ring, size_t *len, uint32_t *tag)
+  __attribute__((visibility("hidden")));
+void ul_ring_pop (ul_ring_t *ring)
+  __attribute__((visibility("hidden")));
+size_t ul_ring_memory (void)
+  __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,350 @@
+/* safe.c -- Async-signal-safe formatting
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "safe.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+void
+ul_safe_append (ul_safe_buffer_t *buffer, const char *data, size_t len)
+{
+  if ((size_t)(buffer->end - buffer->ptr) < len)
+    {
+      len = buffer->end - buffer->ptr;
+      buffer->truncated = 1;
+    }
+  memcpy (buffer->ptr, data, len);
+  buffer->ptr += len;
+}
+
+void
+ul_safe_append_str (ul_safe_buffer_t *buffer, const char *str)
+{
+  ul_safe_append (buffer, str, strlen (str));
+}
+
+/* Escapes like the JSON formatter does. */
+void
+ul_safe_append_escaped (ul_safe_buffer_t *buffer, const char *str,
+                        size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p = (const unsigned char *)str;
+  char esc[6];
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      switch (p[i])
+        {
+        case '\b':
+          ul_safe_append (buffer, "\\b", 2);
+          break;
+        case '\n':
+          ul_safe_append (buffer, "\\n", 2);
+          break;
+        case '\r':
+          ul_safe_append (buffer, "\\r", 2);
+          break;
+        case '\t':
+          ul_safe_append (buffer, "\\t", 2);
+          break;
+        case '\f':
+          ul_safe_append (buffer, "\\f", 2);
+          break;
+        case '"':
+          ul_safe_append (buffer, "\\\"", 2);
+          break;
+        case '\\':
+          ul_safe_append (buffer, "\\\\", 2);
+          break;
+        default:
+          if (p[i] < 0x20)
+            {
+              memcpy (esc, "\\u00", 4);
+              esc[4] = hex[p[i] >> 4];
+              esc[5] = hex[p[i] & 0xf];
+              ul_safe_append (buffer, esc, 6);
+            }
+          else
+            ul_safe_append (buffer, (const char *)p + i, 1);
+          break;
+        }
+    }
+}
+
+void
+ul_safe_append_base (ul_safe_buffer_t *buffer, uintmax_t value,
+                     unsigned int base, int upper)
+{
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char tmp[sizeof (uintmax_t) * 3 + 1];
+  char *p = tmp + sizeof (tmp);
+
+  do
+    {
+      *--p = digits[value % base];
+      value /= base;
+    }
+  while (value != 0);
+
+  ul_safe_append (buffer, p, tmp + sizeof (tmp) - p);
+}
+
+void
+ul_safe_append_uint (ul_safe_buffer_t *buffer, uintmax_t value)
+{
+  ul_safe_append_base (buffer, value, 10, 0);
+}
+
+void
+ul_safe_append_int (ul_safe_buffer_t *buffer, intmax_t value)
+{
+  if (value < 0)
+    {
+      ul_safe_append (buffer, "-", 1);
+      ul_safe_append_base (buffer, -(uintmax_t)value, 10, 0);
+    }
+  else
+    ul_safe_append_base (buffer, value, 10, 0);
+}
+
+static void
+_ul_safe_append_padded (ul_safe_buffer_t *buffer, unsigned int value,
+                        int width)
+{
+  char tmp[10];
+  int i;
+
+  for (i = width - 1; i >= 0; i--)
+    {
+      tmp[i] = '0' + value % 10;
+      value /= 10;
+    }
+  ul_safe_append (buffer, tmp, width);
+}
+
+/* An ISO 8601 timestamp in UTC, like LOG_UL_TIME_UTC, computed by
+   hand, as gmtime_r() is not async-signal-safe. DIGITS is the number
+   of digits of the fraction of a second, at most 9. */
+void
+ul_safe_append_utc (ul_safe_buffer_t *buffer, const struct timespec *ts,
+                    int digits)
+{
+  unsigned int frac = ts->tv_nsec;
+  int i;
+
+  int64_t days = ts->tv_sec / 86400, secs = ts->tv_sec % 86400;
+  int64_t era, z;
+  unsigned int doe, yoe, doy, mp, day, month;
+  int64_t year;
+
+  if (secs < 0)
+    {
+      secs += 86400;
+      days--;
+    }
+
+  /* Civil date from days since the epoch, after Howard Hinnant. */
+  z = days + 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = (unsigned int)(z - era * 146097);
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  year = (int64_t)yoe + era * 400;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  if (month <= 2)
+    year++;
+
+  _ul_safe_append_padded (buffer, (unsigned int)year, 4);
+  ul_safe_append (buffer, "-", 1);
+  _ul_safe_append_padded (buffer, month, 2);
+  ul_safe_append (buffer, "-", 1);
+  _ul_safe_append_padded (buffer, day, 2);
+  ul_safe_append (buffer, "T", 1);
+  _ul_safe_append_padded (buffer, secs / 3600, 2);
+  ul_safe_append (buffer, ":", 1);
+  _ul_safe_append_padded (buffer, secs / 60 % 60, 2);
+  ul_safe_append (buffer, ":", 1);
+  _ul_safe_append_padded (buffer, secs % 60, 2);
+  ul_safe_append (buffer, ".", 1);
+  for (i = digits; i < 9; i++)
+    frac /= 10;
+  _ul_safe_append_padded (buffer, frac, digits);
+  ul_safe_append (buffer, "Z", 1);
+}
+
+/* A printf() subset: %s, %c, and integers (%d, %i, %u, %x, %X, with
+   the hh, h, l, ll, j, z and t modifiers), without flags, width or
+   precision, and %%. The output is escaped. Returns -1, with the
+   arguments in an unknown state, if FORMAT has anything else. */
+int
+ul_safe_vformat (ul_safe_buffer_t *buffer, const char *format, va_list *pap)
+{
+  const char *p = format, *lit;
+  uintmax_t u;
+  intmax_t i;
+  const char *s;
+  char c;
+  int mod;
+
+  enum { MOD_NONE, MOD_HH, MOD_H, MOD_L, MOD_LL, MOD_J, MOD_Z, MOD_T };
+
+  while (*p)
+    {
+      for (lit = p; *p && *p != '%'; p++)
+        ;
+      ul_safe_append_escaped (buffer, lit, p - lit);
+      if (*p == '\0')
+        break;
+      p++;
+
+      mod = MOD_NONE;
+      switch (*p)
+        {
+        case 'h':
+          mod = (p[1] == 'h') ? MOD_HH : MOD_H;
+          p += (mod == MOD_HH) ? 2 : 1;
+          break;
+        case 'l':
+          mod = (p[1] == 'l') ? MOD_LL : MOD_L;
+          p += (mod == MOD_LL) ? 2 : 1;
+          break;
+        case 'j':
+          mod = MOD_J;
+          p++;
+          break;
+        case 'z':
+          mod = MOD_Z;
+          p++;
+          break;
+        case 't':
+          mod = MOD_T;
+          p++;
+          break;
+        }
+
+      switch (*p)
+        {
+        case '%':
+          if (mod != MOD_NONE)
+            return -1;
+          ul_safe_append (buffer, "%", 1);
+          break;
+        case 's':
+          if (mod != MOD_NONE)
+            return -1;
+          s = va_arg (*pap, const char *);
+          if (s == NULL)
+            s = "(null)";
+          ul_safe_append_escaped (buffer, s, strlen (s));
+          break;
+        case 'c':
+          if (mod != MOD_NONE)
+            return -1;
+          c = (char)va_arg (*pap, int);
+          ul_safe_append_escaped (buffer, &c, 1);
+          break;
+        case 'd':
+        case 'i':
+          switch (mod)
+            {
+            case MOD_HH:
+              i = (signed char)va_arg (*pap, int);
+              break;
+            case MOD_H:
+              i = (short)va_arg (*pap, int);
+              break;
+            case MOD_L:
+              i = va_arg (*pap, long);
+              break;
+            case MOD_LL:
+              i = va_arg (*pap, long long);
+              break;
+            case MOD_J:
+              i = va_arg (*pap, intmax_t);
+              break;
+            case MOD_Z:
+              i = va_arg (*pap, ssize_t);
+              break;
+            case MOD_T:
+              i = va_arg (*pap, ptrdiff_t);
+              break;
+            default:
+              i = va_arg (*pap, int);
+              break;
+            }
+          ul_safe_append_int (buffer, i);
+          break;
+        case 'u':
+        case 'x':
+        case 'X':
+          switch (mod)
+            {
+            case MOD_HH:
+              u = (unsigned char)va_arg (*pap, unsigned int);
+              break;
+            case MOD_H:
+              u = (unsigned short)va_arg (*pap, unsigned int);
+              break;
+            case MOD_L:
+              u = va_arg (*pap, unsigned long);
+              break;
+            case MOD_LL:
+              u = va_arg (*pap, unsigned long long);
+              break;
+            case MOD_J:
+              u = va_arg (*pap, uintmax_t);
+              break;
+            case MOD_Z:
+              u = va_arg (*pap, size_t);
+              break;
+            case MOD_T:
+              u = (uintmax_t)va_arg (*pap, ptrdiff_t);
+              break;
+            default:
+              u = va_arg (*pap, unsigned int);
+              break;
+            }
+          ul_safe_append_base (buffer, u, (*p == 'u') ? 10 : 16, *p == 'X');
+          break;
+        default:
+          return -1;
+        }
+      p++;
+    }
+
+  return 0;
+}
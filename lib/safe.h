@@ -0,0 +1,69 @@
+/* safe.h -- Async-signal-safe formatting
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+#ifndef UMBERLOG_SAFE_H
+#define UMBERLOG_SAFE_H 1
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Formatting into a fixed buffer, with nothing but async-signal-safe
+   code: no allocation, no locks, no locale. What does not fit is cut
+   off, and the buffer marked as truncated. */
+typedef struct
+{
+  char *ptr;
+  char *end;
+  int truncated;
+} ul_safe_buffer_t;
+
+void ul_safe_append (ul_safe_buffer_t *buffer, const char *data, size_t len)
+  __attribute__((visibility("hidden")));
+void ul_safe_append_str (ul_safe_buffer_t *buffer, const char *str)
+  __attribute__((visibility("hidden")));
+void ul_safe_append_escaped (ul_safe_buffer_t *buffer, const char *str,
+                             size_t len)
+  __attribute__((visibility("hidden")));
+void ul_safe_append_base (ul_safe_buffer_t *buffer, uintmax_t value,
+                          unsigned int base, int upper)
+  __attribute__((visibility("hidden")));
+void ul_safe_append_uint (ul_safe_buffer_t *buffer, uintmax_t value)
+  __attribute__((visibility("hidden")));
+void ul_safe_append_int (ul_safe_buffer_t *buffer, intmax_t value)
+  __attribute__((visibility("hidden")));
+void ul_safe_append_utc (ul_safe_buffer_t *buffer, const struct timespec *ts,
+                         int digits)
+  __attribute__((visibility("hidden")));
+int ul_safe_vformat (ul_safe_buffer_t *buffer, const char *format,
+                     va_list *pap)
+  __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,453 @@
+/* sink.c -- Sending messages over sockets
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Bounds of the delay before reconnecting, in milliseconds. */
+#define UL_SINK_BACKOFF_MIN 100
+#define UL_SINK_BACKOFF_MAX 10000
+
+static inline uint64_t
+_ul_sink_now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+ul_sink_set_unix (ul_sink_t *sink, const char *path)
+{
+  struct sockaddr_un *sun = (struct sockaddr_un *)&sink->addr;
+
+  if (strlen (path) >= sizeof (sun->sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  pthread_mutex_lock (&sink->lock);
+  memset (&sink->addr, 0, sizeof (sink->addr));
+  sun->sun_family = AF_UNIX;
+  strcpy (sun->sun_path, path);
+  sink->addrlen = sizeof (*sun);
+  sink->type = SOCK_DGRAM;
+  sink->retry_at = 0;
+  sink->backoff = 0;
+  pthread_mutex_unlock (&sink->lock);
+
+  return 0;
+}
+
+int
+ul_sink_set_inet (ul_sink_t *sink, const char *host, const char *port,
+                  int type)
+{
+  struct addrinfo hints, *res;
+  int ret;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  ret = getaddrinfo (host, port, &hints, &res);
+  if (ret != 0)
+    {
+      if (ret != EAI_SYSTEM)
+        errno = EHOSTUNREACH;
+      return -1;
+    }
+
+  pthread_mutex_lock (&sink->lock);
+  memcpy (&sink->addr, res->ai_addr, res->ai_addrlen);
+  sink->addrlen = res->ai_addrlen;
+  sink->type = type;
+  sink->retry_at = 0;
+  sink->backoff = 0;
+  pthread_mutex_unlock (&sink->lock);
+
+  freeaddrinfo (res);
+  return 0;
+}
+
+/* Must be called with the sink locked. */
+static int
+_ul_sink_connect_locked (ul_sink_t *sink)
+{
+  int fd, saved_errno, connected, retried = 0;
+
+  for (;;)
+    {
+      fd = socket (sink->addr.ss_family,
+                   sink->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd == -1)
+        goto err;
+      connected = (connect (fd, (struct sockaddr *)&sink->addr,
+                            sink->addrlen) == 0);
+      if (connected || errno == EINPROGRESS)
+        break;
+
+      saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+
+      /* The syslog socket may be of either kind, like glibc, try
+         both. */
+      if (errno != EPROTOTYPE || sink->addr.ss_family != AF_UNIX || retried)
+        goto err;
+      sink->type = (sink->type == SOCK_DGRAM) ? SOCK_STREAM : SOCK_DGRAM;
+      retried = 1;
+    }
+
+  /* Senders may be using the old descriptor: replace it, instead of
+     closing it. */
+  if (sink->fd == -1)
+    __atomic_store_n (&sink->fd, fd, __ATOMIC_RELEASE);
+  else
+    {
+      if (dup3 (fd, sink->fd, O_CLOEXEC) == -1)
+        {
+          saved_errno = errno;
+          close (fd);
+          errno = saved_errno;
+          goto err;
+        }
+      close (fd);
+    }
+  /* Whether a connection that is still being established works out
+     is only known once something is sent on it. */
+  if (connected)
+    ul_sink_connected (sink);
+  return 0;
+
+ err:
+  ul_sink_failed (sink);
+  return -1;
+}
+
+/* Note that the connection works, or that it failed, and should only
+   be re-established after a delay. */
+void
+ul_sink_connected (ul_sink_t *sink)
+{
+  sink->retry_at = 0;
+  sink->backoff = 0;
+}
+
+void
+ul_sink_failed (ul_sink_t *sink)
+{
+  if (sink->backoff == 0)
+    sink->backoff = UL_SINK_BACKOFF_MIN;
+  else if (sink->backoff < UL_SINK_BACKOFF_MAX / 2)
+    sink->backoff *= 2;
+  else
+    sink->backoff = UL_SINK_BACKOFF_MAX;
+  sink->retry_at = _ul_sink_now_ms () + sink->backoff;
+}
+
+int
+ul_sink_connect (ul_sink_t *sink)
+{
+  int ret;
+
+  pthread_mutex_lock (&sink->lock);
+  ret = _ul_sink_connect_locked (sink);
+  pthread_mutex_unlock (&sink->lock);
+
+  return ret;
+}
+
+/* Connect again, unless the last attempt failed too recently. Keeps
+   errno. */
+static void
+_ul_sink_reconnect (ul_sink_t *sink, int locked)
+{
+  int saved_errno = errno;
+
+  if (!locked)
+    pthread_mutex_lock (&sink->lock);
+  if (sink->retry_at == 0 || _ul_sink_now_ms () >= sink->retry_at)
+    _ul_sink_connect_locked (sink);
+  if (!locked)
+    pthread_mutex_unlock (&sink->lock);
+
+  errno = saved_errno;
+}
+
+/* Skip the first N bytes sent. Returns non-zero when everything
+   was. */
+static inline int
+_ul_sink_advance (struct msghdr *msg, size_t n)
+{
+  while (msg->msg_iovlen > 0 && n >= msg->msg_iov->iov_len)
+    {
+      n -= msg->msg_iov->iov_len;
+      msg->msg_iov++;
+      msg->msg_iovlen--;
+    }
+  if (msg->msg_iovlen == 0)
+    return 1;
+  msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + n;
+  msg->msg_iov->iov_len -= n;
+  return 0;
+}
+
+static int
+_ul_sink_send (ul_sink_t *sink, struct iovec *iov, int iovcnt,
+               int timeout_ms, int locked)
+{
+  struct msghdr msg;
+  struct pollfd pfd;
+  uint64_t now, deadline = 0;
+  int fd, partial = 0, reconnected = 0;
+  ssize_t n;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  for (;;)
+    {
+      fd = __atomic_load_n (&sink->fd, __ATOMIC_ACQUIRE);
+      n = sendmsg (fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n >= 0)
+        {
+          /* Datagrams are sent whole, or not at all. */
+          if (sink->type == SOCK_DGRAM || _ul_sink_advance (&msg, n))
+            return 0;
+          partial = 1;
+          continue;
+        }
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          /* The other end went away, or was restarted. */
+          if (partial || reconnected)
+            goto err;
+          _ul_sink_reconnect (sink, locked);
+          reconnected = 1;
+          continue;
+        }
+
+      /* A zero timeout means trying only once. */
+      if (timeout_ms <= 0)
+        goto err;
+      now = _ul_sink_now_ms ();
+      if (deadline == 0)
+        deadline = now + timeout_ms;
+      if (now >= deadline)
+        goto err;
+
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      poll (&pfd, 1, (int)(deadline - now));
+    }
+
+ err:
+  /* The rest of a partially sent message would be taken for the start
+     of a new one: start over on a new connection instead. */
+  if (partial)
+    {
+      int saved_errno = errno;
+
+      if (!locked)
+        pthread_mutex_lock (&sink->lock);
+      _ul_sink_connect_locked (sink);
+      if (!locked)
+        pthread_mutex_unlock (&sink->lock);
+      errno = saved_errno;
+    }
+  return -1;
+}
+
+int
+ul_sink_send (ul_sink_t *sink, struct iovec *iov, int iovcnt, int timeout_ms)
+{
+  int ret;
+
+  if (sink->type == SOCK_DGRAM)
+    return _ul_sink_send (sink, iov, iovcnt, timeout_ms, 0);
+
+  pthread_mutex_lock (&sink->lock);
+  ret = _ul_sink_send (sink, iov, iovcnt, timeout_ms, 1);
+  pthread_mutex_unlock (&sink->lock);
+  return ret;
+}
+
+/* Send the datagrams in MSGS with as few system calls as possible,
+   without waiting. Returns how many of them were sent: the rest are
+   for the caller to retry with ul_sink_send(). */
+unsigned int
+ul_sink_send_many (ul_sink_t *sink, struct mmsghdr *msgs, unsigned int count)
+{
+  unsigned int done = 0;
+  int fd = __atomic_load_n (&sink->fd, __ATOMIC_ACQUIRE);
+  int n;
+
+  while (done < count)
+    {
+#ifdef HAVE_SENDMMSG
+      n = sendmmsg (fd, msgs + done, count - done,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+      n = (sendmsg (fd, &msgs[done].msg_hdr,
+                    MSG_DONTWAIT | MSG_NOSIGNAL) < 0) ? -1 : 1;
+#endif
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      done += n;
+    }
+  return done;
+}
+
+/* Write as much of DATA to a stream socket as possible by the
+   deadline. Returns the number of bytes written, or -1 if there was
+   an error before any were. Unlike ul_sink_send(), this neither locks
+   nor reconnects the sink. */
+ssize_t
+ul_sink_write (ul_sink_t *sink, const char *data, size_t len, int timeout_ms)
+{
+  struct pollfd pfd;
+  uint64_t now, deadline = 0;
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len)
+    {
+      n = send (sink->fd, data + done, len - done,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n >= 0)
+        {
+          done += n;
+          continue;
+        }
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return (done > 0) ? (ssize_t)done : -1;
+
+      if (timeout_ms <= 0)
+        break;
+      now = _ul_sink_now_ms ();
+      if (deadline == 0)
+        deadline = now + timeout_ms;
+      if (now >= deadline)
+        break;
+
+      pfd.fd = sink->fd;
+      pfd.events = POLLOUT;
+      poll (&pfd, 1, (int)(deadline - now));
+    }
+
+  return done;
+}
+
+void
+ul_sink_close (ul_sink_t *sink)
+{
+  pthread_mutex_lock (&sink->lock);
+  if (sink->fd != -1)
+    close (sink->fd);
+  sink->fd = -1;
+  pthread_mutex_unlock (&sink->lock);
+}
+
+/* The header syslog() would put before the message: priority,
+   timestamp, and the program, with its pid, if any. Not localized,
+   unlike strftime(). */
+size_t
+ul_sink_format_rfc3164 (char *buf, size_t size, int priority,
+                        const char *ident, pid_t pid, time_t now)
+{
+  static const char months[12][4] =
+    {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+  struct tm tm;
+  int len;
+
+  localtime_r (&now, &tm);
+  if (pid > 0)
+    len = snprintf (buf, size, "<%d>%s %2d %02d:%02d:%02d %s[%d]: ",
+                    priority, months[tm.tm_mon], tm.tm_mday,
+                    tm.tm_hour, tm.tm_min, tm.tm_sec, ident, (int)pid);
+  else
+    len = snprintf (buf, size, "<%d>%s %2d %02d:%02d:%02d %s: ",
+                    priority, months[tm.tm_mon], tm.tm_mday,
+                    tm.tm_hour, tm.tm_min, tm.tm_sec, ident);
+
+  if (len < 0)
+    return 0;
+  if ((size_t)len >= size)
+    return size - 1;
+  return len;
+}
+
+/* The RFC 5424 header, for remote collectors, which need to know the
+   host, and are better off with timestamps in UTC. */
+size_t
+ul_sink_format_rfc5424 (char *buf, size_t size, int priority,
+                        const char *hostname, const char *ident,
+                        pid_t pid, const struct timespec *now)
+{
+  struct tm tm;
+  int len;
+
+  gmtime_r (&now->tv_sec, &tm);
+  len = snprintf (buf, size,
+                  "<%d>1 %04d-%02d-%02dT%02d:%02d:%02d.%06ldZ %s %s %d - - ",
+                  priority, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                  tm.tm_hour, tm.tm_min, tm.tm_sec, now->tv_nsec / 1000,
+                  (hostname && hostname[0]) ? hostname : "-",
+                  (ident && ident[0]) ? ident : "-", (int)pid);
+
+  if (len < 0)
+    return 0;
+  if ((size_t)len >= size)
+    return size - 1;
+  return len;
+}
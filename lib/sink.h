@@ -0,0 +1,93 @@
+/* sink.h -- Sending messages over sockets
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+
+#ifndef UMBERLOG_SINK_H
+#define UMBERLOG_SINK_H 1
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/* A socket messages are sent to, without ever blocking for longer
+   than a deadline. The descriptor is replaced in place when the sink
+   reconnects, so senders may use it without locking; the lock only
+   serializes connecting, and sending on stream sockets, where a
+   message may go out in several writes. */
+typedef struct
+{
+  pthread_mutex_t lock;
+  int fd;
+  int type;                     /* SOCK_DGRAM or SOCK_STREAM */
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  /* A failed connection is only retried after a delay, which doubles
+     with every failure in a row. */
+  uint64_t retry_at;            /* CLOCK_MONOTONIC milliseconds */
+  unsigned int backoff;         /* Milliseconds */
+} ul_sink_t;
+
+#define UL_SINK_INITIALIZER \
+  { PTHREAD_MUTEX_INITIALIZER, -1, 0, { 0, }, 0, 0, 0 }
+
+int ul_sink_set_unix (ul_sink_t *sink, const char *path)
+  __attribute__((visibility("hidden")));
+int ul_sink_set_inet (ul_sink_t *sink, const char *host, const char *port,
+                      int type)
+  __attribute__((visibility("hidden")));
+int ul_sink_connect (ul_sink_t *sink)
+  __attribute__((visibility("hidden")));
+void ul_sink_connected (ul_sink_t *sink)
+  __attribute__((visibility("hidden")));
+void ul_sink_failed (ul_sink_t *sink)
+  __attribute__((visibility("hidden")));
+int ul_sink_send (ul_sink_t *sink, struct iovec *iov, int iovcnt,
+                  int timeout_ms)
+  __attribute__((visibility("hidden")));
+unsigned int ul_sink_send_many (ul_sink_t *sink, struct mmsghdr *msgs,
+                                unsigned int count)
+  __attribute__((visibility("hidden")));
+ssize_t ul_sink_write (ul_sink_t *sink, const char *data, size_t len,
+                       int timeout_ms)
+  __attribute__((visibility("hidden")));
+void ul_sink_close (ul_sink_t *sink)
+  __attribute__((visibility("hidden")));
+
+size_t ul_sink_format_rfc3164 (char *buf, size_t size, int priority,
+                               const char *ident, pid_t pid, time_t now)
+  __attribute__((visibility("hidden")));
+size_t ul_sink_format_rfc5424 (char *buf, size_t size, int priority,
+                               const char *hostname, const char *ident,
+                               pid_t pid, const struct timespec *now)
+  __attribute__((visibility("hidden")));
+
+#endif
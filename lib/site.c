@@ -0,0 +1,130 @@
+/* site.c -- Per-call-site state
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "site.h"
+
+#include <stddef.h>
+
+/* Open addressing, with a bounded probe: if a site does not find a
+   slot, it simply does not get any per-site treatment. */
+#define UL_SITE_TABLE_SIZE 1024 /* Must be a power of two. */
+#define UL_SITE_MAX_PROBE  16
+
+static ul_site_t ul_sites[UL_SITE_TABLE_SIZE];
+
+ul_site_t *
+ul_site_lookup (const void *key)
+{
+  uintptr_t h = (uintptr_t)key;
+  size_t i, slot;
+
+  h ^= h >> 15;
+  h *= 0x2c1b3c6dU;
+  h ^= h >> 12;
+
+  for (i = 0; i < UL_SITE_MAX_PROBE; i++)
+    {
+      const void *expected = NULL;
+
+      slot = (h + i) & (UL_SITE_TABLE_SIZE - 1);
+      if (__atomic_load_n (&ul_sites[slot].key, __ATOMIC_ACQUIRE) == key)
+        return &ul_sites[slot];
+      if (__atomic_compare_exchange_n (&ul_sites[slot].key, &expected, key,
+                                       0, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE) ||
+          expected == key)
+        return &ul_sites[slot];
+    }
+  return NULL;
+}
+
+/* Call FUNC for every site in use. */
+void
+ul_site_foreach (ul_site_func_t func, void *data)
+{
+  size_t slot;
+
+  for (slot = 0; slot < UL_SITE_TABLE_SIZE; slot++)
+    if (__atomic_load_n (&ul_sites[slot].key, __ATOMIC_ACQUIRE) != NULL)
+      func (&ul_sites[slot], data);
+}
+
+/* Returns non-zero if the site may log now, and takes a token from
+   its bucket if so. RATE is in tokens per second, and must not be
+   zero. */
+int
+ul_site_take_token (ul_site_t *site, unsigned int rate, unsigned int burst,
+                    uint64_t now_ms)
+{
+  uint64_t old, new;
+  int allowed;
+
+  if (burst > UL_SITE_MAX_BURST)
+    burst = UL_SITE_MAX_BURST;
+
+  old = __atomic_load_n (&site->bucket, __ATOMIC_RELAXED);
+  do
+    {
+      uint64_t stamp = old >> 24, tokens = old & UL_SITE_MAX_BURST;
+
+      if (old == 0 || now_ms - stamp >= (uint64_t)burst * 1000 / rate + 1000)
+        {
+          /* First use, or idle for long enough to refill completely. */
+          stamp = now_ms;
+          tokens = burst;
+        }
+      else if (now_ms > stamp)
+        {
+          uint64_t refill = (now_ms - stamp) * rate / 1000;
+
+          if (tokens + refill >= burst)
+            {
+              tokens = burst;
+              stamp = now_ms;
+            }
+          else
+            {
+              /* Keep the remainder for the next refill. */
+              tokens += refill;
+              stamp += refill * 1000 / rate;
+            }
+        }
+
+      allowed = tokens > 0;
+      if (allowed)
+        tokens--;
+      new = (stamp << 24) | tokens;
+    }
+  while (!__atomic_compare_exchange_n (&site->bucket, &old, new, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return allowed;
+}
@@ -0,0 +1,71 @@
+/* site.h -- Per-call-site state
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_SITE_H
+#define UMBERLOG_SITE_H 1
+
+#include <stdint.h>
+
+/* State kept for each call site, keyed by the address of something
+   unique to the call site, usually its format string. Sites are
+   never freed, and all fields are accessed atomically, so threads
+   logging from the same site never serialize on a lock. */
+typedef struct
+{
+  const void *key;
+
+  /* Token bucket: milliseconds of the last refill in the upper 40
+     bits, the number of tokens in the lower 24. Zero when unused. */
+  uint64_t bucket;
+  unsigned long suppressed;
+  /* The priority of the last message suppressed, and how many were
+     suppressed when the site was last swept, for the summaries. */
+  int suppressed_priority;
+  unsigned long swept;
+  /* A copy of the format, made when the site first had a message
+     suppressed: by the time the site is swept, the format the key
+     points to may have been freed. */
+  char *format;
+
+  /* Keep one in this many messages; zero if not set for the site. */
+  unsigned int sample_rate;
+} ul_site_t;
+
+#define UL_SITE_MAX_BURST 0xffffff
+
+ul_site_t *ul_site_lookup (const void *key)
+  __attribute__((visibility("hidden")));
+typedef void (*ul_site_func_t) (ul_site_t *site, void *data);
+
+void ul_site_foreach (ul_site_func_t func, void *data)
+  __attribute__((visibility("hidden")));
+int ul_site_take_token (ul_site_t *site, unsigned int rate,
+                        unsigned int burst, uint64_t now_ms)
+  __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,209 @@
+/* stats.c -- Statistics shared with other processes
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define UL_STATS_NAME_MAX 32
+
+/* The counters are copied one word at a time, with relaxed atomics,
+   as they may be written while being read. */
+#define UL_STATS_WORDS (sizeof (ul_stats_counters_t) / sizeof (uint64_t))
+
+#define UL_STATS_READ_TRIES 1000
+
+static void
+_ul_stats_name (char *name, pid_t pid)
+{
+  snprintf (name, UL_STATS_NAME_MAX, "/umberlog.%d", (int)pid);
+}
+
+ul_stats_shm_t *
+ul_stats_create (pid_t pid, unsigned int interval_ms)
+{
+  char name[UL_STATS_NAME_MAX];
+  ul_stats_shm_t *shm;
+  int fd, saved_errno;
+
+  /* The name is predictable: a segment left behind by an earlier
+     process with the same pid, or planted by someone else, is removed
+     rather than taken over, and only one this process created is
+     used. */
+  _ul_stats_name (name, pid);
+  shm_unlink (name);
+  fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return NULL;
+  if (ftruncate (fd, sizeof (ul_stats_shm_t)) != 0)
+    goto err;
+  shm = mmap (NULL, sizeof (ul_stats_shm_t), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED)
+    goto err;
+  close (fd);
+
+  memset (shm, 0, sizeof (*shm));
+  shm->version = UL_STATS_VERSION;
+  shm->interval_ms = interval_ms;
+  shm->pid = pid;
+  __atomic_store_n (&shm->magic, UL_STATS_MAGIC, __ATOMIC_RELEASE);
+
+  return shm;
+
+ err:
+  saved_errno = errno;
+  close (fd);
+  shm_unlink (name);
+  errno = saved_errno;
+  return NULL;
+}
+
+ul_stats_shm_t *
+ul_stats_attach (pid_t pid)
+{
+  char name[UL_STATS_NAME_MAX];
+  ul_stats_shm_t *shm;
+  struct stat st;
+  int fd;
+
+  _ul_stats_name (name, pid);
+  fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &st) != 0 || (size_t)st.st_size < sizeof (ul_stats_shm_t))
+    {
+      close (fd);
+      errno = EPROTO;
+      return NULL;
+    }
+  shm = mmap (NULL, sizeof (ul_stats_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (shm == MAP_FAILED)
+    return NULL;
+
+  if (__atomic_load_n (&shm->magic, __ATOMIC_ACQUIRE) != UL_STATS_MAGIC ||
+      shm->version != UL_STATS_VERSION)
+    {
+      ul_stats_detach (shm);
+      errno = EPROTO;
+      return NULL;
+    }
+  return shm;
+}
+
+void
+ul_stats_detach (ul_stats_shm_t *shm)
+{
+  if (shm != NULL)
+    munmap (shm, sizeof (ul_stats_shm_t));
+}
+
+void
+ul_stats_remove (pid_t pid)
+{
+  char name[UL_STATS_NAME_MAX];
+
+  _ul_stats_name (name, pid);
+  shm_unlink (name);
+}
+
+/* There is a single writer per segment. */
+void
+ul_stats_publish (ul_stats_shm_t *shm, const ul_stats_counters_t *counters)
+{
+  const uint64_t *src = (const uint64_t *)counters;
+  uint64_t *dst = (uint64_t *)&shm->counters;
+  uint32_t seq = __atomic_load_n (&shm->seq, __ATOMIC_RELAXED);
+  struct timespec now;
+  size_t i;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  __atomic_store_n (&shm->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  for (i = 0; i < UL_STATS_WORDS; i++)
+    __atomic_store_n (&dst[i], src[i], __ATOMIC_RELAXED);
+  __atomic_store_n (&shm->updated_ns,
+                    (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+                    __ATOMIC_RELAXED);
+  __atomic_store_n (&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* The writer may have been stopped, or have died, in the middle of an
+   update: after UL_STATS_READ_TRIES attempts, the counters are left
+   as they were last read, which may be inconsistent, and -1 is
+   returned, with errno set to EAGAIN. */
+int
+ul_stats_read (const ul_stats_shm_t *shm, ul_stats_counters_t *counters,
+               uint64_t *updated_ns)
+{
+  const uint64_t *src = (const uint64_t *)&shm->counters;
+  uint64_t *dst = (uint64_t *)counters;
+  uint32_t before, after;
+  unsigned int tries;
+  size_t i;
+
+  for (tries = 0; tries < UL_STATS_READ_TRIES; tries++)
+    {
+      before = __atomic_load_n (&shm->seq, __ATOMIC_ACQUIRE);
+      for (i = 0; i < UL_STATS_WORDS; i++)
+        dst[i] = __atomic_load_n (&src[i], __ATOMIC_RELAXED);
+      *updated_ns = __atomic_load_n (&shm->updated_ns, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      after = __atomic_load_n (&shm->seq, __ATOMIC_RELAXED);
+      if (before == after && !(before & 1))
+        return 0;
+      sched_yield ();
+    }
+  errno = EAGAIN;
+  return -1;
+}
+
+unsigned int
+ul_stats_latency_bucket (uint64_t ns)
+{
+  unsigned int bits = (ns == 0) ? 0 : 64 - __builtin_clzll (ns);
+
+  if (bits <= UL_STATS_LATENCY_SHIFT)
+    return 0;
+  if (bits - UL_STATS_LATENCY_SHIFT >= UL_STATS_LATENCY_BUCKETS)
+    return UL_STATS_LATENCY_BUCKETS - 1;
+  return bits - UL_STATS_LATENCY_SHIFT;
+}
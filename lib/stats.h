@@ -0,0 +1,103 @@
+/* stats.h -- Statistics shared with other processes
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_STATS_H
+#define UMBERLOG_STATS_H 1
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* The counters a process publishes in a shared memory segment of its
+   own, named after its pid, for ulstat(1) to read. The layout only
+   ever grows at the end, with the version bumped. */
+#define UL_STATS_MAGIC   0x554c5354 /* "ULST" */
+#define UL_STATS_VERSION 1
+
+/* Call latencies are counted in buckets of powers of two nanoseconds:
+   the first one is below 2^UL_STATS_LATENCY_SHIFT, the last one
+   everything from 2^(UL_STATS_LATENCY_SHIFT + BUCKETS - 2) up. */
+#define UL_STATS_LATENCY_BUCKETS 16
+#define UL_STATS_LATENCY_SHIFT   8
+
+enum
+{
+  UL_STATS_SINK_HANDLER,  /* ul_set_output_handler() */
+  UL_STATS_SINK_REMOTE,   /* ul_set_remote() */
+  UL_STATS_SINK_SOCKET,   /* ul_set_syslog_socket() */
+  UL_STATS_SINK_SYSLOG,   /* syslog() */
+  UL_STATS_SINK_BINLOG,   /* ul_set_binary_log() */
+  UL_STATS_SINKS
+};
+
+typedef struct
+{
+  uint64_t messages[8];          /* Sent, per priority */
+  uint64_t sinks[UL_STATS_SINKS];
+  uint64_t bytes;                /* Of formatted messages */
+  uint64_t suppressed;           /* By rate limiting */
+  uint64_t sampled_out;
+  uint64_t dropped;              /* By the queue policy */
+  uint64_t blocked;              /* Waits for room in the queue */
+  uint64_t send_failed;          /* Not sent to the syslog socket */
+  uint64_t remote_dropped;
+  uint64_t latency[UL_STATS_LATENCY_BUCKETS];
+  uint64_t ring_memory;          /* Bytes held by queues and rings */
+} ul_stats_counters_t;
+
+/* SEQ is odd while the counters are being written: readers retry
+   until they see the same even value before and after reading, or
+   give up after a while. */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t interval_ms;
+  uint64_t pid;
+  uint64_t updated_ns;           /* CLOCK_MONOTONIC */
+  ul_stats_counters_t counters;
+} ul_stats_shm_t;
+
+ul_stats_shm_t *ul_stats_create (pid_t pid, unsigned int interval_ms)
+  __attribute__((visibility("hidden")));
+ul_stats_shm_t *ul_stats_attach (pid_t pid)
+  __attribute__((visibility("hidden")));
+void ul_stats_detach (ul_stats_shm_t *shm)
+  __attribute__((visibility("hidden")));
+void ul_stats_remove (pid_t pid)
+  __attribute__((visibility("hidden")));
+void ul_stats_publish (ul_stats_shm_t *shm,
+                       const ul_stats_counters_t *counters)
+  __attribute__((visibility("hidden")));
+int ul_stats_read (const ul_stats_shm_t *shm,
+                   ul_stats_counters_t *counters, uint64_t *updated_ns)
+  __attribute__((visibility("hidden")));
+unsigned int ul_stats_latency_bucket (uint64_t ns)
+  __attribute__((visibility("hidden")));
+
+#endif
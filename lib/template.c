@@ -0,0 +1,157 @@
+/* template.c -- Precompiled messages
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+#include "template.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int
+_ul_template_add_field (ul_template_t *template, const char *key,
+                        const char *format)
+{
+  ul_template_field_t *field = &template->fields[template->nfields];
+  ul_buffer_t prefix = { NULL, NULL, NULL };
+
+  if (key == NULL || format == NULL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  field->fmt = ul_fmt_get (format);
+  if (field->fmt == NULL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  /* Render "key":"", and keep all but the closing quote and comma. */
+  if (ul_buffer_append (&prefix, key, "") == NULL)
+    goto err;
+  field->prefix = prefix.msg;
+  field->prefix_len = prefix.ptr - prefix.msg - 2;
+
+  if (template->nfields > 0 && (field->key = strdup (key)) == NULL)
+    goto err;
+
+  template->nfields++;
+  return 0;
+
+ err:
+  free (prefix.msg);
+  field->prefix = NULL;
+  errno = ENOMEM;
+  return -1;
+}
+
+ul_template_t *
+ul_template_compile (int priority, const char *msg_format, va_list ap_orig)
+{
+  ul_template_t *template;
+  size_t nfields = 1;
+  const char *key;
+  va_list ap;
+
+  va_copy (ap, ap_orig);
+  while ((key = va_arg (ap, const char *)) != NULL)
+    {
+      va_arg (ap, const char *);
+      nfields++;
+    }
+  va_end (ap);
+
+  template = calloc (1, sizeof (ul_template_t) +
+                     nfields * sizeof (ul_template_field_t));
+  if (template == NULL)
+    return NULL;
+  template->priority = priority;
+  template->msg_format = msg_format;
+
+  if (_ul_template_add_field (template, "msg", msg_format) != 0)
+    goto err;
+
+  va_copy (ap, ap_orig);
+  while ((key = va_arg (ap, const char *)) != NULL)
+    if (_ul_template_add_field (template, key,
+                                va_arg (ap, const char *)) != 0)
+      {
+        va_end (ap);
+        goto err;
+      }
+  va_end (ap);
+
+  return template;
+
+ err:
+  ul_template_destroy (template);
+  return NULL;
+}
+
+void
+ul_template_destroy (ul_template_t *template)
+{
+  int saved_errno = errno;
+  size_t i;
+
+  if (template == NULL)
+    return;
+  for (i = 0; i < template->nfields; i++)
+    {
+      free (template->fields[i].key);
+      free (template->fields[i].prefix);
+    }
+  free (template);
+  errno = saved_errno;
+}
+
+/* Append every field of TEMPLATE to BUFFER, with the values taken from
+   PAP. Nothing is parsed, and nothing but the arguments is escaped. */
+ul_buffer_t *
+ul_template_append (ul_buffer_t *buffer, const ul_template_t *template,
+                    va_list *pap, int saved_errno)
+{
+  size_t i;
+
+  for (i = 0; i < template->nfields; i++)
+    {
+      const ul_template_field_t *field = &template->fields[i];
+
+      if (ul_buffer_append_raw (buffer, field->prefix,
+                                field->prefix_len) == NULL ||
+          ul_fmt_vrender_json (field->fmt, pap, saved_errno, buffer) != 0 ||
+          ul_buffer_append_raw (buffer, "\",", 2) == NULL)
+        return NULL;
+    }
+
+  return buffer;
+}
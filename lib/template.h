@@ -0,0 +1,70 @@
+/* template.h -- Precompiled messages
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef UMBERLOG_TEMPLATE_H
+#define UMBERLOG_TEMPLATE_H 1
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "umberlog.h"
+#include "buffer.h"
+#include "fmt.h"
+
+/* A message compiled in advance: the key of every field is rendered
+   and escaped already, and the formats come from the cache in fmt.c,
+   so they outlive the template, and records captured with them can
+   still be rendered after the template is freed. The first field is
+   the message itself. */
+typedef struct
+{
+  char *key;           /* NULL for the message */
+  char *prefix;        /* "key":" */
+  size_t prefix_len;
+  const ul_fmt_t *fmt;
+} ul_template_field_t;
+
+struct ul_template
+{
+  int priority;
+  const char *msg_format; /* Identifies the call site */
+  size_t nfields;
+  ul_template_field_t fields[];
+};
+
+ul_template_t *ul_template_compile (int priority, const char *msg_format,
+                                    va_list ap)
+  __attribute__((visibility("hidden")));
+void ul_template_destroy (ul_template_t *template)
+  __attribute__((visibility("hidden")));
+ul_buffer_t *ul_template_append (ul_buffer_t *buffer,
+                                 const ul_template_t *template,
+                                 va_list *pap, int saved_errno)
+  __attribute__((visibility("hidden")));
+
+#endif
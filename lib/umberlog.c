@@ -43,13 +43,37 @@
 #include <limits.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <wchar.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_PARSE_PRINTF_FORMAT
 #include <printf.h>
 #endif
 
 #include "umberlog.h"
 #include "buffer.h"
+#include "site.h"
+#include "ring.h"
+#include "fmt.h"
+#include "binlog.h"
+#include "sink.h"
+#include "remote.h"
+#include "safe.h"
+#include "template.h"
+#include "callsite.h"
+#include "stats.h"
+#include "control.h"
 
 static void (*old_syslog) (int priority, const char *message, ...);
 static void (*old_vsyslog) (int priority, const char *message, va_list ap);
@@ -59,6 +83,11 @@ static void (*old_closelog) (void);
 static void ul_init (void) __attribute__((constructor));
 static void ul_finish (void) __attribute__((destructor));
 
+typedef ul_buffer_t *(*ul_timestamp_func_t) (ul_buffer_t *buffer,
+                                             const struct timespec *ts);
+static ul_buffer_t *_ul_timestamp_local (ul_buffer_t *buffer,
+                                         const struct timespec *ts);
+
 static struct
 {
   /* The lock is used only to serialize writes; we assume that reads are safe
@@ -66,7 +95,10 @@ static struct
      the BSD syslog does the same thing). */
   pthread_mutex_t lock;
   int flags;
+  /* The implicit fields to add, unless LOG_UL_NOIMPLICIT is set. */
+  int fields;
   int facility;
+  int option;
   const char *ident;
 
   /* Cached data.
@@ -75,6 +107,37 @@ static struct
   uid_t uid;
   gid_t gid;
   char hostname[_POSIX_HOST_NAME_MAX + 1];
+
+  /* Timestamp settings, chosen by ul_set_timestamp_mode(). */
+  clockid_t timestamp_clock;
+  ul_timestamp_func_t timestamp_func;
+
+  /* Per-call-site rate limiting; a zero rate means no limit. */
+  unsigned int ratelimit_rate;
+  unsigned int ratelimit_burst;
+
+  /* Sampling: keep one in this many messages of each priority (zero
+     or one keeps all of them), unless the call site has its own rate
+     set, which is only checked if any site has. */
+  unsigned int sample_rate[LOG_DEBUG + 1];
+  int site_sampling;
+
+  /* Flight recorder: messages less important than the threshold are
+     kept in a per-thread ring of this many bytes, instead of being
+     sent. Zero size means it is turned off. */
+  int flight_threshold;
+  size_t flight_size;
+
+  /* Size of the per-thread rings messages are queued in when they are
+     formatted in the background; zero means they are not. What to do
+     when a ring is full is decided by the queue policy. */
+  size_t async_size;
+  int queue_policy;
+  unsigned int queue_timeout;
+
+  /* Where finalized messages go; syslog() if NULL. */
+  ul_output_handler_t output_handler;
+  void *output_data;
 } ul_process_data =
   {
     PTHREAD_MUTEX_INITIALIZER,
@@ -83,13 +146,518 @@ static struct
 #else
     LOG_UL_ALL,
 #endif
-    LOG_USER, NULL,
-    -1, (uid_t)-1, (gid_t)-1, { 0, }
+    LOG_UL_FIELD_ALL,
+    LOG_USER, 0, NULL,
+    -1, (uid_t)-1, (gid_t)-1, { 0, },
+    CLOCK_REALTIME, _ul_timestamp_local,
+    0, 0,
+    { 0, }, 0,
+    LOG_DEBUG, 0,
+    0, LOG_UL_QUEUE_SYNC, 0,
+    NULL, NULL
   };
 
 static __thread ul_buffer_t ul_buffer;
 static __thread int ul_recurse;
 
+/* The UL_SYSLOG() call site of the message being logged, if any. */
+static __thread ul_callsite_t *ul_callsite_current;
+
+static __thread ul_ring_t ul_flight_ring;
+
+/* Per-thread resources are released by the destructor of this key,
+   which is set for threads that allocate any. */
+static pthread_key_t ul_thread_key;
+static int ul_thread_key_valid;
+
+/* State of the per-thread PRNG used for sampling; zero until seeded. */
+static __thread uint64_t ul_prng_state;
+
+/* Per-thread implicit fields. Everything but the sequence number is
+   rendered once per thread, and re-rendered only when the thread is
+   renamed, or after a fork(). */
+#define UL_THREAD_FRAGMENT_SIZE 160
+
+static __thread struct
+{
+  int valid;
+  unsigned long seq;
+  size_t fragment_len;
+  char fragment[UL_THREAD_FRAGMENT_SIZE];
+} ul_thread_data;
+
+/* Deferred formatting: callers only capture their arguments into a
+   ring of their own, and a background thread renders and sends them.
+   Every queue has a ring per lane, and the background thread always
+   sends records from the most urgent lane first, so that errors are
+   not stuck behind a backlog of debug messages.
+   Queues are never freed: when their thread exits, they are kept on
+   the list, and reused by the next thread that needs one. */
+#define UL_ASYNC_LANES 3
+
+typedef struct ul_async_queue
+{
+  pthread_mutex_t lock;
+  ul_ring_t lanes[UL_ASYNC_LANES];
+  int in_use;
+  struct ul_async_queue *next;
+} ul_async_queue_t;
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  /* Signalled when there is work, or on stop */
+  pthread_cond_t space; /* Signalled when records were taken off a queue */
+  pthread_t thread;
+  int running;
+  int stop;
+  int sleeping;         /* The thread is waiting on cond */
+  int waiters;          /* Threads waiting on space */
+  unsigned long pending; /* Queued, but not yet rendered records */
+  unsigned long lane_pending[UL_ASYNC_LANES]; /* Records in each lane */
+  ul_async_queue_t *queues;
+
+  /* Counters of dropped records, and the number of those that were
+     not reported in a message yet. */
+  ul_queue_stats_t stats;
+  unsigned long unreported;
+} ul_async =
+  {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0, 0, 0, 0, 0, 0, { 0, 0, 0 }, NULL,
+    { 0, 0, 0, 0, 0 }, 0
+  };
+
+/* When a binary log is open, messages are written there, instead of
+   being formatted. */
+static struct
+{
+  pthread_mutex_t lock;
+  ul_binlog_t *log;
+} ul_binlog = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/* When enabled, messages are sent to the syslog daemon over a socket
+   of our own, instead of with syslog(): a non-blocking one, so that a
+   stalled daemon cannot stall the program too. Messages that cannot
+   be sent by the deadline are passed to the fallback handler, if
+   any. */
+static struct
+{
+  int enabled;
+  int timeout;
+  ul_output_handler_t fallback;
+  void *fallback_data;
+  ul_send_stats_t stats;
+  ul_sink_t sink;
+} ul_send = { 0, 0, NULL, NULL, { 0, 0, 0, 0 }, UL_SINK_INITIALIZER };
+
+/* Or to a remote collector, instead. When stopping, messages still
+   waiting to be sent get this many milliseconds to go out. */
+#define UL_REMOTE_CLOSE_TIMEOUT 1000
+
+static struct
+{
+  pthread_mutex_t lock;    /* Serializes ul_set_remote() */
+  int enabled;
+  ul_remote_t remote;
+} ul_remote = { PTHREAD_MUTEX_INITIALIZER, 0, UL_REMOTE_INITIALIZER };
+
+/* When exported, counters are kept by the logging threads, and copied
+   to a shared memory segment every interval by a thread of our own,
+   for ulstat(1) to read. */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  /* Signalled on stop */
+  pthread_t thread;
+  int enabled;          /* Counting; read without the lock */
+  int stop;
+  unsigned int interval_ms;
+  pid_t pid;            /* The segment is named after it */
+  ul_stats_shm_t *shm;
+  ul_stats_counters_t counters;
+} ul_stats = { .lock = PTHREAD_MUTEX_INITIALIZER,
+               .cond = PTHREAD_COND_INITIALIZER };
+
+/* A control file, watched by a thread of our own, which applies it
+   whenever it changes. The lock is held by ul_set_control_file() only:
+   the thread is the only one to apply the file after that. */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_t thread;
+  int running;
+  int wake[2];          /* Written to, to stop the thread */
+  int watch_fd;         /* inotify, or -1 to check every second */
+  char *path;
+  const char *name;     /* The last component of PATH */
+  struct stat st;       /* When not using inotify */
+} ul_control = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Sites that had messages suppressed by rate limiting, and then went
+   quiet, get their summary from a thread of our own, which sweeps the
+   sites every UL_RATELIMIT_SWEEP_MS. It is started by the first
+   suppressed message. */
+#define UL_RATELIMIT_SWEEP_MS 1000
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  /* Signalled on stop */
+  pthread_t thread;
+  int running;          /* Read without the lock */
+  int stop;
+} ul_ratelimit = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                   .cond = PTHREAD_COND_INITIALIZER };
+
+#if __UL_PRELOAD__
+/* The binary log, statistics and control file set from the environment
+   come with a file, a segment or a thread of their own, which a child
+   does not inherit: rather than at startup, they are set up by the
+   first message of every process, so that daemons, which fork before
+   logging anything, keep them. */
+static struct
+{
+  int pending;           /* Set them up with the next message */
+  char *binary_log;
+  pid_t binary_log_pid;  /* Of the process that opened the file */
+  unsigned int stats_ms;
+  char *control;
+} ul_env;
+#endif
+
+static __thread ul_async_queue_t *ul_async_queue;
+/* Arguments are captured here first, then copied to the ring. */
+static __thread ul_buffer_t ul_async_scratch;
+
+/* Queues are pushed without a lock, so one may be pushed while
+   forking: only the queues locked before forking, from this one on,
+   are unlocked after. */
+static ul_async_queue_t *ul_atfork_queues;
+
+static void
+ul_atfork_prepare (void)
+{
+  ul_async_queue_t *queue;
+
+  pthread_mutex_lock (&ul_control.lock);
+  ul_callsite_atfork_prepare ();
+  pthread_mutex_lock (&ul_process_data.lock);
+  pthread_mutex_lock (&ul_async.lock);
+  ul_atfork_queues = __atomic_load_n (&ul_async.queues, __ATOMIC_ACQUIRE);
+  for (queue = ul_atfork_queues; queue != NULL; queue = queue->next)
+    pthread_mutex_lock (&queue->lock);
+  pthread_mutex_lock (&ul_binlog.lock);
+  pthread_mutex_lock (&ul_send.sink.lock);
+  pthread_mutex_lock (&ul_remote.remote.lock);
+  pthread_mutex_lock (&ul_remote.remote.sink.lock);
+  pthread_mutex_lock (&ul_stats.lock);
+  pthread_mutex_lock (&ul_ratelimit.lock);
+}
+
+static void
+ul_atfork_parent (void)
+{
+  ul_async_queue_t *queue;
+
+  pthread_mutex_unlock (&ul_ratelimit.lock);
+  pthread_mutex_unlock (&ul_stats.lock);
+  pthread_mutex_unlock (&ul_remote.remote.sink.lock);
+  pthread_mutex_unlock (&ul_remote.remote.lock);
+  pthread_mutex_unlock (&ul_send.sink.lock);
+  pthread_mutex_unlock (&ul_binlog.lock);
+  for (queue = ul_atfork_queues; queue != NULL; queue = queue->next)
+    pthread_mutex_unlock (&queue->lock);
+  pthread_mutex_unlock (&ul_async.lock);
+  pthread_mutex_unlock (&ul_process_data.lock);
+  ul_callsite_atfork_parent ();
+  pthread_mutex_unlock (&ul_control.lock);
+}
+
+/* The child inherits our caches, but not our pid: refresh what needs
+   refreshing, so caching can stay enabled in programs that fork. Only
+   the forking thread survives, so this is also the place to reset any
+   per-thread state that would be stale in the child. */
+static void
+ul_atfork_child (void)
+{
+  ul_async_queue_t *queue;
+  int lane, locked = 0;
+
+  if (ul_process_data.pid != -1)
+    ul_process_data.pid = getpid ();
+  ul_recurse = 0;
+
+  /* The sweeping thread is restarted when needed. */
+  ul_ratelimit.running = 0;
+  ul_ratelimit.stop = 0;
+  pthread_mutex_unlock (&ul_ratelimit.lock);
+#if __UL_PRELOAD__
+  ul_env.pending = (ul_env.binary_log != NULL || ul_env.stats_ms != 0 ||
+                    ul_env.control != NULL);
+#endif
+  ul_thread_data.valid = 0;
+  ul_thread_data.seq = 0;
+  ul_prng_state = 0;
+  ul_ring_clear (&ul_flight_ring);
+
+  /* Queued messages are the parent's to send, and the background
+     thread is gone: it is restarted when needed. Queues pushed while
+     forking may be locked by threads the child does not have. */
+  for (queue = ul_async.queues; queue != NULL; queue = queue->next)
+    {
+      if (queue == ul_atfork_queues)
+        locked = 1;
+      for (lane = 0; lane < UL_ASYNC_LANES; lane++)
+        ul_ring_clear (&queue->lanes[lane]);
+      queue->in_use = (queue == ul_async_queue);
+      if (locked)
+        pthread_mutex_unlock (&queue->lock);
+      else
+        pthread_mutex_init (&queue->lock, NULL);
+    }
+  ul_async.running = 0;
+  ul_async.stop = 0;
+  ul_async.sleeping = 0;
+  ul_async.waiters = 0;
+  ul_async.pending = 0;
+  memset (ul_async.lane_pending, 0, sizeof (ul_async.lane_pending));
+  ul_async.unreported = 0;
+  pthread_mutex_unlock (&ul_async.lock);
+
+  /* The strings of a binary log are defined once per file, which only
+     works with a single writer: the child goes back to syslog(), and
+     leaves writing out what was buffered to the parent. */
+  if (ul_binlog.log != NULL)
+    {
+      ul_binlog_discard (ul_binlog.log);
+      ul_binlog_close (ul_binlog.log);
+      ul_binlog.log = NULL;
+    }
+  pthread_mutex_unlock (&ul_binlog.lock);
+  pthread_mutex_unlock (&ul_send.sink.lock);
+
+  ul_remote_atfork_child (&ul_remote.remote);
+  pthread_mutex_unlock (&ul_remote.remote.sink.lock);
+  pthread_mutex_unlock (&ul_remote.remote.lock);
+  /* Not taken while forking, as closing waits for the thread: it may
+     be held by a thread the child does not have. */
+  pthread_mutex_init (&ul_remote.lock, NULL);
+
+  /* The segment is the parent's, and so is the thread updating it. */
+  if (ul_stats.shm != NULL)
+    {
+      ul_stats_detach (ul_stats.shm);
+      ul_stats.shm = NULL;
+      ul_stats.enabled = 0;
+    }
+  pthread_mutex_unlock (&ul_stats.lock);
+
+  pthread_mutex_unlock (&ul_process_data.lock);
+  ul_callsite_atfork_child ();
+
+  /* So is the control file: the child does not watch it. */
+  if (ul_control.running)
+    {
+      close (ul_control.wake[0]);
+      close (ul_control.wake[1]);
+      if (ul_control.watch_fd != -1)
+        close (ul_control.watch_fd);
+      free (ul_control.path);
+      ul_control.path = NULL;
+      ul_control.running = 0;
+    }
+  pthread_mutex_unlock (&ul_control.lock);
+}
+
+static void
+ul_thread_cleanup (void *data)
+{
+  (void)data;
+
+  ul_ring_free (&ul_flight_ring);
+
+  /* Whatever is still queued is sent by the background thread. */
+  if (ul_async_queue != NULL)
+    {
+      __atomic_store_n (&ul_async_queue->in_use, 0, __ATOMIC_RELEASE);
+      ul_async_queue = NULL;
+    }
+  free (ul_async_scratch.msg);
+  ul_async_scratch.msg = NULL;
+}
+
+#if __UL_PRELOAD__
+/* Copies the variable NAME to BUFFER, split at the first comma: REST
+   points to what follows it, or to an empty string. */
+static char *
+_ul_env (const char *name, char *buffer, size_t size, char **rest)
+{
+  const char *value = getenv (name);
+  char *comma;
+
+  if (value == NULL || *value == '\0' || strlen (value) >= size)
+    return NULL;
+  strcpy (buffer, value);
+
+  comma = strchr (buffer, ',');
+  if (comma != NULL)
+    *comma++ = '\0';
+  *rest = (comma != NULL) ? comma : buffer + strlen (buffer);
+  return buffer;
+}
+
+/* Parses UL_REMOTE: tcp: or udp:, the host, with IPv6 addresses in
+   brackets, a colon and the port. */
+static void
+_ul_init_env_remote (char *value, const char *size_str)
+{
+  char *host, *port;
+  size_t size = 65536;
+  int type;
+
+  if (strncasecmp (value, "tcp:", 4) == 0)
+    type = SOCK_STREAM;
+  else if (strncasecmp (value, "udp:", 4) == 0)
+    type = SOCK_DGRAM;
+  else
+    return;
+  host = value + 4;
+
+  if (*host == '[')
+    {
+      port = strchr (++host, ']');
+      if (port == NULL || port[1] != ':')
+        return;
+      *port++ = '\0';
+    }
+  else
+    port = strrchr (host, ':');
+  if (port == NULL || *host == '\0')
+    return;
+  *port++ = '\0';
+
+  if (*size_str != '\0' && ul_control_size (size_str, &size) != 0)
+    return;
+  ul_set_remote (host, port, type, size);
+}
+
+/* Programs we are preloaded into can only be configured from the
+   environment, read once, at startup. Settings that do not parse are
+   ignored. */
+static void
+_ul_init_env (void)
+{
+  char buffer[PATH_MAX + 64], *value, *rest, *item, *save, *colon;
+  unsigned int rate, burst, timeout;
+  size_t size;
+  int bits, pri;
+
+  if ((value = getenv ("UL_FLAGS")) != NULL &&
+      ul_control_flags (value, &bits) == 0)
+    ul_set_log_flags (bits);
+  if ((value = getenv ("UL_FIELDS")) != NULL &&
+      ul_control_fields (value, &bits) == 0)
+    ul_set_implicit_fields (bits);
+  if ((value = getenv ("UL_TIMESTAMP")) != NULL &&
+      ul_control_timestamp_mode (value, &bits) == 0)
+    ul_set_timestamp_mode (bits);
+  if ((value = getenv ("UL_MASK")) != NULL &&
+      (pri = ul_control_priority (value)) >= 0)
+    setlogmask (LOG_UPTO (pri));
+
+  if ((value = _ul_env ("UL_RATE_LIMIT", buffer, sizeof (buffer), &rest)) &&
+      ul_control_uint (value, &rate) == 0 &&
+      (*rest == '\0' || ul_control_uint (rest, &burst) == 0))
+    ul_set_rate_limit (rate, *rest == '\0' ? 0 : burst);
+  if ((value = getenv ("UL_SAMPLE")) != NULL &&
+      strlen (value) < sizeof (buffer))
+    {
+      strcpy (buffer, value);
+      for (item = strtok_r (buffer, ",", &save); item != NULL;
+           item = strtok_r (NULL, ",", &save))
+        if ((colon = strchr (item, ':')) != NULL)
+          {
+            *colon = '\0';
+            if ((pri = ul_control_priority (item)) >= 0 &&
+                ul_control_uint (colon + 1, &rate) == 0)
+              ul_set_sample_rate (pri, rate);
+          }
+    }
+  if ((value = _ul_env ("UL_FLIGHT_RECORDER", buffer, sizeof (buffer),
+                        &rest)) &&
+      (pri = ul_control_priority (value)) >= 0 &&
+      ul_control_size (rest, &size) == 0)
+    ul_set_flight_recorder (pri, size);
+
+  if ((value = _ul_env ("UL_SOCKET", buffer, sizeof (buffer), &rest)) &&
+      (*rest == '\0' || ul_control_uint (rest, &timeout) == 0))
+    ul_set_syslog_socket (value, *rest == '\0' ? 0 : (int)timeout);
+  if ((value = _ul_env ("UL_REMOTE", buffer, sizeof (buffer), &rest)))
+    _ul_init_env_remote (value, rest);
+  if ((value = getenv ("UL_BINARY_LOG")) != NULL && *value != '\0')
+    ul_env.binary_log = strdup (value);
+
+  if ((value = _ul_env ("UL_QUEUE_POLICY", buffer, sizeof (buffer), &rest)) &&
+      (pri = ul_control_queue_policy (value)) >= 0 &&
+      (*rest == '\0' || ul_control_uint (rest, &timeout) == 0))
+    ul_set_queue_policy (pri, *rest == '\0' ? 0 : timeout);
+  if ((value = getenv ("UL_ASYNC")) != NULL &&
+      ul_control_size (value, &size) == 0)
+    ul_set_async (size);
+
+  if ((value = getenv ("UL_STATS")) != NULL &&
+      ul_control_uint (value, &timeout) == 0)
+    ul_env.stats_ms = timeout;
+  if ((value = getenv ("UL_CONTROL")) != NULL && *value != '\0')
+    ul_env.control = strdup (value);
+  ul_env.pending = (ul_env.binary_log != NULL || ul_env.stats_ms != 0 ||
+                    ul_env.control != NULL);
+}
+
+/* Set up the sinks of the environment in this process. A binary log
+   only has one writer: the children of the process that opened it
+   write to a file of their own, with their pid appended to the
+   path. */
+static void
+_ul_env_setup (void)
+{
+  char path[PATH_MAX + 32];
+  pid_t pid = getpid ();
+
+  if (ul_env.binary_log != NULL)
+    {
+      if (ul_env.binary_log_pid == 0)
+        {
+          if (ul_set_binary_log (ul_env.binary_log) == 0)
+            ul_env.binary_log_pid = pid;
+        }
+      else if (snprintf (path, sizeof (path), "%s.%d", ul_env.binary_log,
+                         (int)pid) < (int)sizeof (path))
+        ul_set_binary_log (path);
+    }
+  if (ul_env.stats_ms != 0)
+    ul_set_stats_export (ul_env.stats_ms);
+  /* Last, so that it has the last word. */
+  if (ul_env.control != NULL)
+    ul_set_control_file (ul_env.control);
+}
+
+static inline void
+_ul_env_check (void)
+{
+  if (__atomic_load_n (&ul_env.pending, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n (&ul_env.pending, 0, __ATOMIC_ACQ_REL))
+    _ul_env_setup ();
+}
+#else
+static inline void
+_ul_env_check (void)
+{
+}
+#endif
+
 static void
 ul_init (void)
 {
@@ -97,12 +665,36 @@ ul_init (void)
   old_vsyslog = dlsym (RTLD_NEXT, "vsyslog");
   old_openlog = dlsym (RTLD_NEXT, "openlog");
   old_closelog = dlsym (RTLD_NEXT, "closelog");
+
+  pthread_atfork (ul_atfork_prepare, ul_atfork_parent, ul_atfork_child);
+
+  if (pthread_key_create (&ul_thread_key, ul_thread_cleanup) == 0)
+    ul_thread_key_valid = 1;
+
+#if __UL_PRELOAD__
+  _ul_init_env ();
+#endif
 }
 
+static int _ul_async_stop (void);
+static void _ul_stats_stop (void);
+static void _ul_control_stop (void);
+static void _ul_ratelimit_stop (void);
+
 static void
 ul_finish (void)
 {
+  _ul_ratelimit_stop ();
+  _ul_async_stop ();
+  _ul_stats_stop ();
+  _ul_control_stop ();
+  ul_binlog_close (ul_binlog.log);
+  ul_binlog.log = NULL;
+  ul_sink_close (&ul_send.sink);
+  ul_remote_close (&ul_remote.remote, UL_REMOTE_CLOSE_TIMEOUT);
   free (ul_buffer.msg);
+  free (ul_async_scratch.msg);
+  ul_ring_free (&ul_flight_ring);
 }
 
 /* Must be called with ul_process_data.lock held. */
@@ -117,7 +709,6 @@ _ul_reset_caches_locked (void)
       ul_process_data.gid = -1;
       ul_process_data.uid = -1;
       ul_process_data.hostname[0] = '\0';
-      pthread_mutex_unlock (&ul_process_data.lock);
       return;
     }
 
@@ -148,6 +739,22 @@ ul_set_log_flags (int flags)
   pthread_mutex_unlock (&ul_process_data.lock);
 }
 
+int
+ul_set_implicit_fields (int fields)
+{
+  if (fields & ~LOG_UL_FIELD_ALL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.fields = fields;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  return 0;
+}
+
 void
 ul_openlog (const char *ident, int option, int facility)
 {
@@ -155,6 +762,7 @@ ul_openlog (const char *ident, int option, int facility)
 
   pthread_mutex_lock (&ul_process_data.lock);
   ul_process_data.facility = facility;
+  ul_process_data.option = option;
   ul_process_data.ident = ident;
 
   _ul_reset_caches_locked ();
@@ -253,6 +861,58 @@ _get_hostname (char *hostname_buffer)
   return hostname_buffer;
 }
 
+static void
+_ul_thread_data_refresh (void)
+{
+  ul_buffer_t tmp = { NULL, NULL, NULL };
+  ul_buffer_t *buffer = &tmp;
+  size_t len;
+
+  ul_thread_data.fragment_len = 0;
+  ul_thread_data.valid = 1;
+
+  if (ul_buffer_reset (buffer) != 0)
+    return;
+
+#ifdef SYS_gettid
+  buffer = ul_buffer_append_int (buffer, "tid", syscall (SYS_gettid));
+#endif
+#ifdef HAVE_PTHREAD_GETNAME_NP
+  if (buffer != NULL)
+    {
+      char name[16];
+
+      if (pthread_getname_np (pthread_self (), name, sizeof (name)) == 0)
+        buffer = ul_buffer_append (buffer, "thread", name);
+    }
+#endif
+
+  if (buffer != NULL)
+    {
+      /* Skip the opening brace ul_buffer_reset() added. */
+      len = buffer->ptr - buffer->msg - 1;
+      if (len <= sizeof (ul_thread_data.fragment))
+        {
+          memcpy (ul_thread_data.fragment, buffer->msg + 1, len);
+          ul_thread_data.fragment_len = len;
+        }
+    }
+  free (tmp.msg);
+}
+
+static inline ul_buffer_t *
+_ul_discover_thread (ul_buffer_t *buffer)
+{
+  if (!ul_thread_data.valid)
+    _ul_thread_data_refresh ();
+
+  buffer = ul_buffer_append_raw (buffer, ul_thread_data.fragment,
+                                 ul_thread_data.fragment_len);
+  if (buffer == NULL)
+    return NULL;
+  return ul_buffer_append_uint (buffer, "seq", ++ul_thread_data.seq);
+}
+
 static inline const char *
 _get_ident (void)
 {
@@ -492,6 +1152,87 @@ _ul_vasprintf_and_advance (const char *fmt, va_list *pap)
   return res;
 }
 
+/* Append KEY with a value formatted according to FMT, and advance PAP
+   past the arguments used.
+
+   The vast majority of formats are a single, trivial conversion, or
+   no conversion at all: those are written directly into the buffer,
+   everything else goes through vasprintf(). */
+static inline ul_buffer_t *
+_ul_json_vappend_value (ul_buffer_t *buffer, const char *key,
+                        const char *fmt, va_list *pap)
+{
+  char *value;
+
+  if (fmt[0] == '%')
+    {
+      switch (fmt[1])
+        {
+        case 's':
+          if (fmt[2] == '\0')
+            {
+              const char *str = va_arg (*pap, const char *);
+
+              return ul_buffer_append (buffer, key, str ? str : "(null)");
+            }
+          break;
+        case 'd':
+          if (fmt[2] == '\0')
+            return ul_buffer_append_int (buffer, key, va_arg (*pap, int));
+          break;
+        case 'u':
+          if (fmt[2] == '\0')
+            return ul_buffer_append_uint (buffer, key,
+                                          va_arg (*pap, unsigned int));
+          break;
+        case 'l':
+          if (fmt[2] == 'd' && fmt[3] == '\0')
+            return ul_buffer_append_int (buffer, key, va_arg (*pap, long));
+          if (fmt[2] == 'u' && fmt[3] == '\0')
+            return ul_buffer_append_uint (buffer, key,
+                                          va_arg (*pap, unsigned long));
+          break;
+        case 'z':
+          if (fmt[2] == 'u' && fmt[3] == '\0')
+            return ul_buffer_append_uint (buffer, key,
+                                          va_arg (*pap, size_t));
+          break;
+        }
+    }
+  else if (strchr (fmt, '%') == NULL)
+    return ul_buffer_append (buffer, key, fmt);
+
+  value = _ul_vasprintf_and_advance (fmt, pap);
+  if (!value)
+    return NULL;
+  buffer = ul_buffer_append (buffer, key, value);
+  free (value);
+
+  return buffer;
+}
+
+/* Append the message of a legacy syslog() call. Nothing follows its
+   arguments, so there is no need to step past them: the message is
+   printed straight into the buffer, in one pass. */
+static inline ul_buffer_t *
+_ul_json_vappend_message (ul_buffer_t *buffer, const char *fmt, va_list ap)
+{
+  if (fmt[0] == '%' && fmt[1] == 's' && fmt[2] == '\0')
+    {
+      const char *str;
+      va_list aq;
+
+      va_copy (aq, ap);
+      str = va_arg (aq, const char *);
+      va_end (aq);
+      return ul_buffer_append (buffer, "msg", str ? str : "(null)");
+    }
+  if (strchr (fmt, '%') == NULL)
+    return ul_buffer_append (buffer, "msg", fmt);
+
+  return ul_buffer_append_vprintf (buffer, "msg", fmt, ap);
+}
+
 static inline ul_buffer_t *
 _ul_json_vappend (ul_buffer_t *buffer, va_list ap_orig)
 {
@@ -503,14 +1244,8 @@ _ul_json_vappend (ul_buffer_t *buffer, va_list ap_orig)
   while ((key = (char *)va_arg (ap, char *)) != NULL)
     {
       char *fmt = (char *)va_arg (ap, char *);
-      char *value;
-
-      value = _ul_vasprintf_and_advance (fmt, &ap);
-      if (!value)
-        goto err;
-      buffer = ul_buffer_append (buffer, key, value);
-      free (value);
 
+      buffer = _ul_json_vappend_value (buffer, key, fmt, &ap);
       if (buffer == NULL)
         goto err;
     }
@@ -535,85 +1270,258 @@ _ul_json_append (ul_buffer_t *buffer, ...)
   return buffer;
 }
 
-static inline ul_buffer_t *
-_ul_json_append_timestamp (ul_buffer_t *buffer)
+/* Both the local and UTC timestamps only change their date and time
+   part once a second, so that is rendered once a second per thread,
+   and only the fraction is rendered for every message. */
+typedef struct
 {
-  struct timespec ts;
-  struct tm *tm;
-  char stamp[64], zone[16];
+  time_t sec;
+  int valid;
+  char stamp[32];
+  char zone[8];
+  long gmtoff;      /* Seconds east of UTC */
+} ul_timestamp_cache_t;
 
-  clock_gettime (CLOCK_REALTIME, &ts);
+static __thread ul_timestamp_cache_t ul_timestamp_cache_local;
+static __thread ul_timestamp_cache_t ul_timestamp_cache_utc;
 
-  tm = localtime (&ts.tv_sec);
+static inline ul_buffer_t *
+_ul_timestamp_render (ul_buffer_t *buffer, const struct timespec *ts,
+                      const ul_timestamp_cache_t *cache)
+{
+  char stamp[64], *p;
+  size_t len;
+  unsigned long frac;
+  int i;
 
-  strftime (stamp, sizeof (stamp), "%FT%T", tm);
-  strftime (zone, sizeof (zone), "%z", tm);
+  len = strlen (cache->stamp);
+  memcpy (stamp, cache->stamp, len);
+  p = stamp + len;
+
+  *p++ = '.';
+  frac = ts->tv_nsec;
+  for (i = 8; i >= 0; i--)
+    {
+      p[i] = '0' + frac % 10;
+      frac /= 10;
+    }
+  p += 9;
+  strcpy (p, cache->zone);
 
-  return _ul_json_append (buffer, "timestamp", "%s.%09lu%s",
-                          stamp, ts.tv_nsec, zone,
-                          NULL);
+  return ul_buffer_append (buffer, "timestamp", stamp);
 }
 
-static inline ul_buffer_t *
-_ul_discover (ul_buffer_t *buffer, int priority)
+static const ul_timestamp_cache_t *
+_ul_timestamp_local_cache (time_t sec)
 {
-  char hostname_buffer[_POSIX_HOST_NAME_MAX + 1];
-  const char *ident;
+  ul_timestamp_cache_t *cache = &ul_timestamp_cache_local;
 
-  if (ul_process_data.flags & LOG_UL_NOIMPLICIT)
-    return buffer;
+  if (!cache->valid || cache->sec != sec)
+    {
+      struct tm tm;
 
-  buffer = _ul_json_append (buffer,
-                            "pid", "%d", _find_pid (),
-                            "facility", "%s", _find_facility (priority),
-                            "priority", "%s", _find_prio (priority),
-                            "uid", "%d", _get_uid (),
-                            "gid", "%d", _get_gid (),
-                            "host", "%s", _get_hostname (hostname_buffer),
-                            NULL);
-  if (buffer == NULL)
-    return buffer;
+      if (localtime_r (&sec, &tm) == NULL)
+        return NULL;
+      strftime (cache->stamp, sizeof (cache->stamp), "%FT%T", &tm);
+      strftime (cache->zone, sizeof (cache->zone), "%z", &tm);
+#ifdef HAVE_STRUCT_TM_TM_GMTOFF
+      cache->gmtoff = tm.tm_gmtoff;
+#else
+      cache->gmtoff = (cache->zone[0] == '-' ? -1 : 1) *
+        (((cache->zone[1] - '0') * 10 + cache->zone[2] - '0') * 3600 +
+         ((cache->zone[3] - '0') * 10 + cache->zone[4] - '0') * 60);
+#endif
+      cache->sec = sec;
+      cache->valid = 1;
+    }
 
-  ident = _get_ident ();
-  if (ident != NULL)
-    buffer = _ul_json_append (buffer, "program", "%s", ident, NULL);
+  return cache;
+}
 
-  if (ul_process_data.flags & LOG_UL_NOTIME || !buffer)
-    return buffer;
+static ul_buffer_t *
+_ul_timestamp_local (ul_buffer_t *buffer, const struct timespec *ts)
+{
+  const ul_timestamp_cache_t *cache = _ul_timestamp_local_cache (ts->tv_sec);
 
-  return _ul_json_append_timestamp (buffer);
+  if (cache == NULL)
+    return NULL;
+  return _ul_timestamp_render (buffer, ts, cache);
 }
 
-static inline ul_buffer_t *
-_ul_vformat (ul_buffer_t *buffer, int format_version,
-             int priority, const char *msg_format,
-             va_list ap_orig)
+static ul_buffer_t *
+_ul_timestamp_utc (ul_buffer_t *buffer, const struct timespec *ts)
 {
-  char *value;
-  va_list ap;
+  ul_timestamp_cache_t *cache = &ul_timestamp_cache_utc;
+
+  if (!cache->valid || cache->sec != ts->tv_sec)
+    {
+      struct tm tm;
+
+      if (gmtime_r (&ts->tv_sec, &tm) == NULL)
+        return NULL;
+      strftime (cache->stamp, sizeof (cache->stamp), "%FT%T", &tm);
+      strcpy (cache->zone, "Z");
+      cache->sec = ts->tv_sec;
+      cache->valid = 1;
+    }
+
+  return _ul_timestamp_render (buffer, ts, cache);
+}
+
+static ul_buffer_t *
+_ul_timestamp_epoch_s (ul_buffer_t *buffer, const struct timespec *ts)
+{
+  return ul_buffer_append_number (buffer, "timestamp", ts->tv_sec);
+}
+
+static ul_buffer_t *
+_ul_timestamp_epoch_ms (ul_buffer_t *buffer, const struct timespec *ts)
+{
+  return ul_buffer_append_number (buffer, "timestamp",
+                                  (uintmax_t)ts->tv_sec * 1000 +
+                                  ts->tv_nsec / 1000000);
+}
+
+static ul_buffer_t *
+_ul_timestamp_epoch_ns (ul_buffer_t *buffer, const struct timespec *ts)
+{
+  return ul_buffer_append_number (buffer, "timestamp",
+                                  (uintmax_t)ts->tv_sec * 1000000000 +
+                                  ts->tv_nsec);
+}
+
+/* TS is the time the message was captured at, or NULL for now. */
+static inline ul_buffer_t *
+_ul_json_append_timestamp (ul_buffer_t *buffer, const struct timespec *ts)
+{
+  struct timespec now;
+
+  if (ts == NULL)
+    {
+      clock_gettime (ul_process_data.timestamp_clock, &now);
+      ts = &now;
+    }
+
+  return ul_process_data.timestamp_func (buffer, ts);
+}
+
+static inline ul_buffer_t *
+_ul_discover_head (ul_buffer_t *buffer, int priority)
+{
+  int fields = ul_process_data.fields;
+
+  if ((fields & LOG_UL_FIELD_PID &&
+       (buffer = ul_buffer_append_int (buffer, "pid",
+                                       _find_pid ())) == NULL) ||
+      (fields & LOG_UL_FIELD_FACILITY &&
+       (buffer = ul_buffer_append (buffer, "facility",
+                                   _find_facility (priority))) == NULL) ||
+      (fields & LOG_UL_FIELD_PRIORITY &&
+       (buffer = ul_buffer_append (buffer, "priority",
+                                   _find_prio (priority))) == NULL))
+    return NULL;
+  return buffer;
+}
+
+/* The implicit fields that do not depend on the priority. */
+static inline ul_buffer_t *
+_ul_discover_tail (ul_buffer_t *buffer, const struct timespec *ts,
+                   const char *thread_info, size_t thread_info_len)
+{
+  char hostname_buffer[_POSIX_HOST_NAME_MAX + 1];
+  int fields = ul_process_data.fields;
+  const char *ident;
+
+  if ((fields & LOG_UL_FIELD_UID &&
+       (buffer = ul_buffer_append_uint (buffer, "uid",
+                                        _get_uid ())) == NULL) ||
+      (fields & LOG_UL_FIELD_GID &&
+       (buffer = ul_buffer_append_uint (buffer, "gid",
+                                        _get_gid ())) == NULL) ||
+      (fields & LOG_UL_FIELD_HOST &&
+       (buffer = ul_buffer_append (buffer, "host",
+                                   _get_hostname (hostname_buffer))) == NULL))
+    return NULL;
+
+  if (thread_info != NULL)
+    {
+      if ((buffer = ul_buffer_append_raw (buffer, thread_info,
+                                          thread_info_len)) == NULL)
+        return NULL;
+    }
+  else if (ul_process_data.flags & LOG_UL_THREADINFO &&
+           (buffer = _ul_discover_thread (buffer)) == NULL)
+    return NULL;
+
+  ident = (fields & LOG_UL_FIELD_PROGRAM) ? _get_ident () : NULL;
+  if (ident != NULL)
+    buffer = ul_buffer_append (buffer, "program", ident);
+
+  if (ul_process_data.flags & LOG_UL_NOTIME ||
+      !(fields & LOG_UL_FIELD_TIMESTAMP) || !buffer)
+    return buffer;
+
+  return _ul_json_append_timestamp (buffer, ts);
+}
+
+/* Messages formatted in the background pass the time, and the
+   rendered thread information they were captured with, in TS and
+   THREAD_INFO; both are NULL when formatting in the calling thread. */
+static inline ul_buffer_t *
+_ul_discover (ul_buffer_t *buffer, int priority, const struct timespec *ts,
+              const char *thread_info, size_t thread_info_len)
+{
+  if (ul_process_data.flags & LOG_UL_NOIMPLICIT)
+    return buffer;
+
+  if ((buffer = _ul_discover_head (buffer, priority)) == NULL)
+    return NULL;
+  return _ul_discover_tail (buffer, ts, thread_info, thread_info_len);
+}
+
+static inline ul_buffer_t *
+_ul_callsite_append (ul_buffer_t *buffer, ul_callsite_t *site)
+{
+  const char *fragment;
+  size_t len;
+
+  if (site == NULL)
+    return buffer;
+  fragment = ul_callsite_fragment (site, &len);
+  if (fragment == NULL)
+    return NULL;
+  return ul_buffer_append_raw (buffer, fragment, len);
+}
+
+static inline ul_buffer_t *
+_ul_vformat (ul_buffer_t *buffer, int format_version,
+             int priority, const char *msg_format,
+             va_list ap_orig)
+{
+  va_list ap;
 
   /* "&ap" may not be possible for function parameters, so make a copy. */
   va_copy (ap, ap_orig);
   if (ul_buffer_reset (buffer) != 0)
     goto err;
 
-  value = _ul_vasprintf_and_advance (msg_format, &ap);
-  if (!value)
-    goto err;
-  buffer = ul_buffer_append (buffer, "msg", value);
-  free (value);
-
-  if (buffer == NULL)
-    goto err;
-
   if (format_version > 0)
-    buffer = _ul_json_vappend (buffer, ap);
+    {
+      buffer = _ul_json_vappend_value (buffer, "msg", msg_format, &ap);
+      if (buffer == NULL)
+        goto err;
+      buffer = _ul_json_vappend (buffer, ap);
+    }
+  else
+    buffer = _ul_json_vappend_message (buffer, msg_format, ap);
 
+  if (buffer)
+    buffer = _ul_callsite_append (buffer, ul_callsite_current);
   if (!buffer)
     goto err;
 
   va_end (ap);
-  return _ul_discover (buffer, priority);
+  return _ul_discover (buffer, priority, NULL, NULL, 0);
 
  err:
   va_end (ap);
@@ -633,6 +1541,26 @@ _ul_vformat_str (ul_buffer_t *buffer, int format_version,
   return ul_buffer_finalize (buffer);
 }
 
+/* Like _ul_vformat(), for a message compiled in advance. */
+static inline ul_buffer_t *
+_ul_template_vformat (ul_buffer_t *buffer, const ul_template_t *template,
+                      va_list ap_orig)
+{
+  int saved_errno = errno;
+  va_list ap;
+
+  if (ul_buffer_reset (buffer) != 0)
+    return NULL;
+
+  va_copy (ap, ap_orig);
+  buffer = ul_template_append (buffer, template, &ap, saved_errno);
+  va_end (ap);
+  if (!buffer)
+    return NULL;
+
+  return _ul_discover (buffer, template->priority, NULL, NULL, 0);
+}
+
 /** Public API **/
 char *
 ul_format (int priority, const char *msg_format, ...)
@@ -666,69 +1594,3117 @@ ul_vformat (int priority, const char *msg_format, va_list ap)
 }
 
 static inline int
-_ul_vsyslog (int format_version, int priority,
-             const char *msg_format, va_list ap)
+_ul_timestamp_mode (void)
 {
-  ul_buffer_t *buffer = &ul_buffer;
+  ul_timestamp_func_t func = ul_process_data.timestamp_func;
 
-  if (!(setlogmask (0) & LOG_MASK (LOG_PRI (priority))))
-    return 0;
+  if (func == _ul_timestamp_utc)
+    return LOG_UL_TIME_UTC;
+  if (func == _ul_timestamp_epoch_s)
+    return LOG_UL_TIME_EPOCH_S;
+  if (func == _ul_timestamp_epoch_ms)
+    return LOG_UL_TIME_EPOCH_MS;
+  if (func == _ul_timestamp_epoch_ns)
+    return LOG_UL_TIME_EPOCH_NS;
+  return LOG_UL_TIME_LOCAL;
+}
 
-  buffer = _ul_vformat (buffer, format_version, priority, msg_format, ap);
-  if (buffer == NULL)
-    return -1;
+/* Must be called with ul_binlog.lock held. Local timestamps are
+   rendered with the UTC offset at TS, the time of the record. */
+static int
+_ul_binlog_context (ul_binlog_t *log, const struct timespec *ts)
+{
+  char hostname_buffer[_POSIX_HOST_NAME_MAX + 1];
+  const ul_timestamp_cache_t *cache;
+  ul_binlog_context_t ctx;
 
-  old_syslog (priority, "@cee:%s", ul_buffer_finalize (buffer));
+  ctx.flags = ul_process_data.flags;
+  ctx.fields = ul_process_data.fields;
+  ctx.facility = ul_process_data.facility;
+  ctx.timestamp_mode = _ul_timestamp_mode ();
+  ctx.gmtoff = 0;
+  if (ctx.timestamp_mode == LOG_UL_TIME_LOCAL)
+    {
+      if ((cache = _ul_timestamp_local_cache (ts->tv_sec)) == NULL)
+        return -1;
+      ctx.gmtoff = cache->gmtoff;
+    }
+  ctx.pid = _find_pid ();
+  ctx.uid = _get_uid ();
+  ctx.gid = _get_gid ();
+  ctx.host = _get_hostname (hostname_buffer);
+  ctx.program = _get_ident ();
 
-  return 0;
+  return ul_binlog_set_context (log, &ctx);
 }
 
-int
-ul_syslog (int priority, const char *msg_format, ...)
+static inline int
+_ul_binlog_put_field (ul_binlog_t *log, ul_buffer_t *buffer,
+                      const char *key, const char *format, va_list *pap)
+{
+  const ul_fmt_t *fmt;
+
+  if (format == NULL || (fmt = ul_fmt_get (format)) == NULL)
+    return -1;
+
+  if (key != NULL &&
+      ul_binlog_put_string (log, buffer, key, strlen (key)) != 0)
+    return -1;
+  if (ul_binlog_put_string (log, buffer, fmt->format,
+                            strlen (fmt->format)) != 0)
+    return -1;
+  return ul_fmt_capture (fmt, pap, buffer);
+}
+
+/* Write the message to the binary log, with its arguments captured,
+   instead of formatted. Returns non-zero if that was not possible, and
+   the message needs to be formatted instead. */
+static int
+_ul_binlog_record (int format_version, int priority,
+                   const char *msg_format, va_list ap_orig,
+                   unsigned int sample_rate)
 {
+  int saved_errno = errno;
+  ul_buffer_t *buffer;
+  unsigned int nfields = 1;
+  struct timespec ts;
+  ul_binlog_t *log;
+  const char *key;
+  size_t nfields_at;
   va_list ap;
-  int status;
+  int ret = -1;
 
-  va_start (ap, msg_format);
-  status = ul_vsyslog (priority, msg_format, ap);
+  clock_gettime (ul_process_data.timestamp_clock, &ts);
+
+  pthread_mutex_lock (&ul_binlog.lock);
+  log = ul_binlog.log;
+  if (log == NULL || _ul_binlog_context (log, &ts) != 0)
+    goto out;
+
+  buffer = ul_binlog_begin (log);
+  if (ul_binlog_put_varint (buffer, priority) != 0 ||
+      ul_binlog_put_timestamp (log, buffer, &ts) != 0 ||
+      ul_binlog_put_varint (buffer, sample_rate) != 0 ||
+      ul_binlog_put_varint (buffer, saved_errno) != 0)
+    goto out;
+
+  /* The number of fields is only known at the end; a single byte is
+     reserved for it, which is enough for up to 127 fields. */
+  if (ul_buffer_reserve (buffer, 1) != 0)
+    goto out;
+  nfields_at = buffer->ptr++ - buffer->msg;
+
+  va_copy (ap, ap_orig);
+  if (_ul_binlog_put_field (log, buffer, NULL, msg_format, &ap) != 0)
+    goto out_va;
+  if (format_version > 0)
+    while ((key = va_arg (ap, const char *)) != NULL)
+      {
+        const char *fmt = va_arg (ap, const char *);
+
+        if (nfields == 127 ||
+            _ul_binlog_put_field (log, buffer, key, fmt, &ap) != 0)
+          goto out_va;
+        nfields++;
+      }
   va_end (ap);
 
-  return status;
+  /* Call sites add their file and line as fields of their own. */
+  if (ul_callsite_current != NULL)
+    {
+      unsigned int line = ul_callsite_current->line;
+
+      if (nfields > 125 ||
+          ul_binlog_put_string (log, buffer, "file", 4) != 0 ||
+          ul_binlog_put_string (log, buffer, "%s", 2) != 0 ||
+          ul_fmt_capture_string (ul_callsite_current->file, -1,
+                                 buffer) != 0 ||
+          ul_binlog_put_string (log, buffer, "line", 4) != 0 ||
+          ul_binlog_put_string (log, buffer, "%u", 2) != 0 ||
+          ul_buffer_append_raw (buffer, (const char *)&line,
+                                sizeof (line)) == NULL)
+        goto out;
+      nfields += 2;
+    }
+  buffer->msg[nfields_at] = nfields;
+
+  if ((log->context.flags & (LOG_UL_THREADINFO | LOG_UL_NOIMPLICIT)) ==
+      LOG_UL_THREADINFO)
+    {
+      if (!ul_thread_data.valid)
+        _ul_thread_data_refresh ();
+      if (ul_binlog_put_string (log, buffer, ul_thread_data.fragment,
+                                ul_thread_data.fragment_len) != 0 ||
+          ul_binlog_put_varint (buffer, ++ul_thread_data.seq) != 0)
+        goto out;
+    }
+
+  ret = ul_binlog_end (log, UL_BINLOG_RECORD);
+  if (ret == 0 && LOG_PRI (priority) <= LOG_ERR)
+    ul_binlog_flush (log);
+  goto out;
+
+ out_va:
+  va_end (ap);
+ out:
+  pthread_mutex_unlock (&ul_binlog.lock);
+  return ret;
 }
 
-int
-ul_vsyslog (int priority, const char *msg_format, va_list ap)
+/* Write an already formatted message to the binary log. */
+static int
+_ul_binlog_json (int priority, const char *msg)
 {
-  return _ul_vsyslog (1, priority, msg_format, ap);
+  ul_buffer_t *buffer;
+  ul_binlog_t *log;
+  int ret = -1;
+
+  pthread_mutex_lock (&ul_binlog.lock);
+  log = ul_binlog.log;
+  if (log == NULL)
+    goto out;
+
+  buffer = ul_binlog_begin (log);
+  if (ul_binlog_put_varint (buffer, priority) != 0 ||
+      ul_buffer_append_raw (buffer, msg, strlen (msg)) == NULL)
+    goto out;
+  ret = ul_binlog_end (log, UL_BINLOG_JSON);
+  if (ret == 0 && LOG_PRI (priority) <= LOG_ERR)
+    ul_binlog_flush (log);
+
+ out:
+  pthread_mutex_unlock (&ul_binlog.lock);
+  return ret;
 }
 
-void
-ul_legacy_vsyslog (int priority, const char *msg_format, va_list ap)
+/* The header syslog() would put before the message, in HEADER, which
+   should have room for UL_SEND_HEADER_SIZE bytes. PRIORITY must
+   include the facility. */
+#define UL_SEND_HEADER_SIZE (64 + NAME_MAX)
+
+static inline size_t
+_ul_send_header (char *header, int priority, time_t now)
 {
-  if (ul_recurse)
+  const char *ident = _get_ident ();
+
+  if (ident == NULL)
+    ident = "";
+  return ul_sink_format_rfc3164 (header, UL_SEND_HEADER_SIZE, priority,
+                                 ident,
+                                 (ul_process_data.option & LOG_PID) ?
+                                 _find_pid () : 0,
+                                 now);
+}
+
+/* Count a message that could not be sent, and give it to the fallback
+   handler, if any. */
+static void
+_ul_send_failed (int priority, const char *msg)
+{
+  ul_output_handler_t fallback;
+
+  __atomic_fetch_add (&ul_send.stats.failed, 1, __ATOMIC_RELAXED);
+  fallback = ul_send.fallback;
+  if (fallback != NULL)
     {
-      old_vsyslog (priority, msg_format, ap);
+      fallback (priority, msg, ul_send.fallback_data);
+      __atomic_fetch_add (&ul_send.stats.diverted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Send the message to the syslog socket, formatted the way syslog()
+   would, and give it to the fallback handler if that fails. */
+static void
+_ul_send (int priority, const char *msg)
+{
+  char header[UL_SEND_HEADER_SIZE];
+  struct iovec iov[4];
+  int iovcnt = 3;
+  size_t len;
+
+  if ((priority & LOG_FACMASK) == 0)
+    priority |= ul_process_data.facility;
+  len = _ul_send_header (header, priority, time (NULL));
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = len;
+  iov[1].iov_base = (void *)"@cee:";
+  iov[1].iov_len = 5;
+  iov[2].iov_base = (void *)msg;
+  iov[2].iov_len = strlen (msg);
+  /* Like syslog(), terminate messages on stream sockets with a NUL. */
+  if (ul_send.sink.type == SOCK_STREAM)
+    {
+      iov[3].iov_base = (void *)"";
+      iov[3].iov_len = 1;
+      iovcnt++;
+    }
+
+  if (ul_sink_send (&ul_send.sink, iov, iovcnt, ul_send.timeout) != 0)
+    _ul_send_failed (priority, msg);
+}
+
+/* Collect the message for the remote collector, with an RFC 5424
+   header. */
+static void
+_ul_remote_output (int priority, const char *msg)
+{
+  char hostname[_POSIX_HOST_NAME_MAX + 1];
+  char header[128 + _POSIX_HOST_NAME_MAX + NAME_MAX];
+  const char *ident = _get_ident ();
+  struct timespec now;
+  struct iovec iov[3];
+
+  if ((priority & LOG_FACMASK) == 0)
+    priority |= ul_process_data.facility;
+  clock_gettime (CLOCK_REALTIME, &now);
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = ul_sink_format_rfc5424 (header, sizeof (header), priority,
+                                           _get_hostname (hostname), ident,
+                                           _find_pid (), &now);
+  iov[1].iov_base = (void *)"@cee:";
+  iov[1].iov_len = 5;
+  iov[2].iov_base = (void *)msg;
+  iov[2].iov_len = strlen (msg);
+
+  ul_remote_send (&ul_remote.remote, iov, 3);
+}
+
+static inline void
+_ul_stats_count (int priority, int sink, size_t len)
+{
+  __atomic_fetch_add (&ul_stats.counters.messages[LOG_PRI (priority)], 1,
+                      __ATOMIC_RELAXED);
+  __atomic_fetch_add (&ul_stats.counters.sinks[sink], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&ul_stats.counters.bytes, len, __ATOMIC_RELAXED);
+}
+
+static inline void
+_ul_output (int priority, const char *msg)
+{
+  ul_output_handler_t handler = ul_process_data.output_handler;
+  int sink;
+
+  if (ul_binlog.log != NULL && _ul_binlog_json (priority, msg) == 0)
+    sink = UL_STATS_SINK_BINLOG;
+  else if (handler != NULL)
+    {
+      handler (priority, msg, ul_process_data.output_data);
+      sink = UL_STATS_SINK_HANDLER;
+    }
+  else if (__atomic_load_n (&ul_remote.enabled, __ATOMIC_RELAXED))
+    {
+      _ul_remote_output (priority, msg);
+      sink = UL_STATS_SINK_REMOTE;
+    }
+  else if (ul_send.enabled)
+    {
+      _ul_send (priority, msg);
+      sink = UL_STATS_SINK_SOCKET;
     }
   else
     {
-      ul_recurse = 1;
-      _ul_vsyslog (0, priority, msg_format, ap);
-      ul_recurse = 0;
+      old_syslog (priority, "@cee:%s", msg);
+      sink = UL_STATS_SINK_SYSLOG;
     }
+
+  if (__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+    _ul_stats_count (priority, sink, strlen (msg));
 }
 
-void
-ul_legacy_syslog (int priority, const char *msg_format, ...)
+/* Finish the message formatted into BUFFER, and send it. SAMPLE_RATE
+   is recorded in the message if it is more than one. */
+static inline int
+_ul_buffer_output (ul_buffer_t *buffer, int priority,
+                   unsigned int sample_rate)
+{
+  const char *msg;
+
+  if (sample_rate > 1 &&
+      (buffer = ul_buffer_append_uint (buffer, "sample_rate",
+                                       sample_rate)) == NULL)
+    return -1;
+
+  msg = ul_buffer_finalize (buffer);
+  if (msg == NULL)
+    return -1;
+
+  _ul_output (priority, msg);
+
+  return 0;
+}
+
+static inline int
+_ul_vsyslog_output (int format_version, int priority,
+                    const char *msg_format, va_list ap,
+                    unsigned int sample_rate)
+{
+  ul_buffer_t *buffer = &ul_buffer;
+
+  buffer = _ul_vformat (buffer, format_version, priority, msg_format, ap);
+  if (buffer == NULL)
+    return -1;
+
+  return _ul_buffer_output (buffer, priority, sample_rate);
+}
+
+/* For messages the library itself emits. */
+static int
+_ul_syslog_internal (int priority, const char *msg_format, ...)
 {
   va_list ap;
+  int status;
 
   va_start (ap, msg_format);
-  ul_legacy_vsyslog (priority, msg_format, ap);
+  status = _ul_vsyslog_output (1, priority, msg_format, ap, 1);
   va_end (ap);
+
+  return status;
 }
 
-int
-ul_setlogmask (int mask)
+static inline uint64_t
+_ul_now_ms (void)
 {
-  return setlogmask (mask);
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+#endif
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void
+_ul_ratelimit_summary (int priority, const char *msg_format,
+                       unsigned long suppressed)
+{
+  _ul_syslog_internal (priority,
+                       "%lu messages suppressed by rate limiting",
+                       suppressed,
+                       "suppressed", "%lu", suppressed,
+                       "suppressed_format", "%s", msg_format,
+                       NULL);
+}
+
+/* Sites still being suppressed report when they get through again:
+   only those that had nothing suppressed for a whole sweep are
+   reported here. */
+static void
+_ul_ratelimit_sweep_site (ul_site_t *site, void *data)
+{
+  unsigned long suppressed;
+
+  (void)data;
+
+  suppressed = __atomic_load_n (&site->suppressed, __ATOMIC_RELAXED);
+  if (suppressed == 0 || suppressed != site->swept)
+    {
+      site->swept = suppressed;
+      return;
+    }
+
+  site->swept = 0;
+  suppressed = __atomic_exchange_n (&site->suppressed, 0, __ATOMIC_RELAXED);
+  if (suppressed != 0)
+    _ul_ratelimit_summary (__atomic_load_n (&site->suppressed_priority,
+                                            __ATOMIC_RELAXED),
+                           __atomic_load_n (&site->format, __ATOMIC_ACQUIRE),
+                           suppressed);
+}
+
+static void *
+_ul_ratelimit_thread (void *data)
+{
+  struct timespec deadline;
+
+  (void)data;
+
+  pthread_mutex_lock (&ul_ratelimit.lock);
+  while (!ul_ratelimit.stop)
+    {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += UL_RATELIMIT_SWEEP_MS / 1000;
+      deadline.tv_nsec += (UL_RATELIMIT_SWEEP_MS % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+      while (!ul_ratelimit.stop &&
+             pthread_cond_timedwait (&ul_ratelimit.cond, &ul_ratelimit.lock,
+                                     &deadline) != ETIMEDOUT)
+        ;
+      if (ul_ratelimit.stop)
+        break;
+
+      pthread_mutex_unlock (&ul_ratelimit.lock);
+      ul_site_foreach (_ul_ratelimit_sweep_site, NULL);
+      pthread_mutex_lock (&ul_ratelimit.lock);
+    }
+  pthread_mutex_unlock (&ul_ratelimit.lock);
+
+  return NULL;
+}
+
+static void
+_ul_ratelimit_start (void)
+{
+  sigset_t all, old;
+
+  pthread_mutex_lock (&ul_ratelimit.lock);
+  if (!ul_ratelimit.running)
+    {
+      sigfillset (&all);
+      pthread_sigmask (SIG_SETMASK, &all, &old);
+      if (pthread_create (&ul_ratelimit.thread, NULL, _ul_ratelimit_thread,
+                          NULL) == 0)
+        __atomic_store_n (&ul_ratelimit.running, 1, __ATOMIC_RELEASE);
+      pthread_sigmask (SIG_SETMASK, &old, NULL);
+    }
+  pthread_mutex_unlock (&ul_ratelimit.lock);
+}
+
+static void
+_ul_ratelimit_stop (void)
+{
+  pthread_mutex_lock (&ul_ratelimit.lock);
+  if (ul_ratelimit.running)
+    {
+      ul_ratelimit.stop = 1;
+      pthread_cond_signal (&ul_ratelimit.cond);
+      pthread_mutex_unlock (&ul_ratelimit.lock);
+      pthread_join (ul_ratelimit.thread, NULL);
+      pthread_mutex_lock (&ul_ratelimit.lock);
+      ul_ratelimit.stop = 0;
+      ul_ratelimit.running = 0;
+    }
+  pthread_mutex_unlock (&ul_ratelimit.lock);
+}
+
+/* Returns non-zero if a message from the call site identified by
+   MSG_FORMAT may be sent. If the site had messages suppressed since it
+   last got through, a summary of those is sent first; sites that stop
+   logging are summarized by the sweeping thread. */
+static inline int
+_ul_ratelimit (int priority, const char *msg_format)
+{
+  unsigned int rate = ul_process_data.ratelimit_rate;
+  unsigned long suppressed;
+  ul_site_t *site;
+  char *format, *none = NULL;
+
+  if (rate == 0 || msg_format == NULL)
+    return 1;
+
+  site = ul_site_lookup (msg_format);
+  if (site == NULL)
+    return 1;
+
+  if (!ul_site_take_token (site, rate, ul_process_data.ratelimit_burst,
+                           _ul_now_ms ()))
+    {
+      if (__atomic_load_n (&site->format, __ATOMIC_ACQUIRE) == NULL &&
+          (format = strdup (msg_format)) != NULL &&
+          !__atomic_compare_exchange_n (&site->format, &none, format, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        free (format);
+      __atomic_store_n (&site->suppressed_priority, priority,
+                        __ATOMIC_RELAXED);
+      __atomic_fetch_add (&site->suppressed, 1, __ATOMIC_RELAXED);
+      if (__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+        __atomic_fetch_add (&ul_stats.counters.suppressed, 1,
+                            __ATOMIC_RELAXED);
+      if (!__atomic_load_n (&ul_ratelimit.running, __ATOMIC_ACQUIRE))
+        _ul_ratelimit_start ();
+      return 0;
+    }
+
+  if (__atomic_load_n (&site->suppressed, __ATOMIC_RELAXED) != 0 &&
+      (suppressed = __atomic_exchange_n (&site->suppressed, 0,
+                                         __ATOMIC_RELAXED)) != 0)
+    _ul_ratelimit_summary (priority, msg_format, suppressed);
+  return 1;
+}
+
+/* Keep the finalized message MSG, LEN bytes with its terminating NUL,
+   in the flight recorder ring of the thread, dropping the oldest
+   messages if there is not enough room. */
+static int
+_ul_flight_push (int priority, const char *msg, size_t len)
+{
+  ul_ring_t *ring = &ul_flight_ring;
+  size_t size = ul_process_data.flight_size;
+  void *dst;
+
+  if (ring->size != size)
+    {
+      ul_ring_free (ring);
+      if (ul_ring_init (ring, size) != 0)
+        return -1;
+      if (ul_thread_key_valid)
+        pthread_setspecific (ul_thread_key, ring);
+    }
+
+  while ((dst = ul_ring_push (ring, len, priority)) == NULL)
+    {
+      if (ring->count == 0)
+        return -1;
+      ul_ring_pop (ring);
+    }
+  memcpy (dst, msg, len);
+
+  return 0;
+}
+
+/* Format the message into the flight recorder ring of the thread. */
+static int
+_ul_flight_record (int format_version, int priority,
+                   const char *msg_format, va_list ap)
+{
+  ul_buffer_t *buffer = &ul_buffer;
+  const char *msg;
+
+  buffer = _ul_vformat (buffer, format_version, priority, msg_format, ap);
+  if (buffer == NULL)
+    return -1;
+  msg = ul_buffer_finalize (buffer);
+  if (msg == NULL)
+    return -1;
+
+  return _ul_flight_push (priority, msg, buffer->ptr - buffer->msg);
+}
+
+static void
+_ul_flight_flush (void)
+{
+  ul_ring_t *ring = &ul_flight_ring;
+  const char *msg;
+  uint32_t priority;
+
+  while ((msg = ul_ring_front (ring, NULL, &priority)) != NULL)
+    {
+      _ul_output (priority, msg);
+      ul_ring_pop (ring);
+    }
+}
+
+/* xorshift64* */
+static inline uint64_t
+_ul_prng_next (void)
+{
+  uint64_t x = ul_prng_state;
+
+  if (x == 0)
+    {
+      struct timespec ts;
+
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      x = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^
+        ((uint64_t)getpid () << 16) ^ (uintptr_t)&ul_prng_state;
+      if (x == 0)
+        x = 0x9e3779b97f4a7c15ULL;
+    }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  ul_prng_state = x;
+
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Returns the sampling rate that applies to a message, or zero if the
+   message is to be dropped. */
+static inline unsigned int
+_ul_sample (int priority, const char *msg_format)
+{
+  unsigned int rate = ul_process_data.sample_rate[LOG_PRI (priority)];
+
+  if (ul_process_data.site_sampling && msg_format != NULL)
+    {
+      ul_site_t *site = ul_site_lookup (msg_format);
+
+      if (site != NULL && site->sample_rate != 0)
+        rate = site->sample_rate;
+    }
+
+  if (rate <= 1)
+    return 1;
+  if ((_ul_prng_next () >> 32) % rate != 0)
+    {
+      if (__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+        __atomic_fetch_add (&ul_stats.counters.sampled_out, 1,
+                            __ATOMIC_RELAXED);
+      return 0;
+    }
+  return rate;
+}
+
+/* Deferred formatting.
+
+   A queued record starts with this header, followed by the fields,
+   and the rendered thread information. Every field but the first one
+   (the message) starts with its captured key, followed by the address
+   of the compiled format, and the captured arguments. */
+typedef struct
+{
+  int priority;
+  int saved_errno;
+  unsigned int sample_rate;
+  unsigned int nfields;
+  struct timespec ts;
+  ul_callsite_t *site;
+  size_t thread_info_len;
+} ul_async_header_t;
+
+static inline int
+_ul_async_capture_fmt (ul_buffer_t *out, const char *key,
+                       const ul_fmt_t *fmt, va_list *pap)
+{
+  if (key != NULL && ul_fmt_capture_string (key, -1, out) != 0)
+    return -1;
+  if (ul_buffer_append_raw (out, (const char *)&fmt, sizeof (fmt)) == NULL)
+    return -1;
+  return ul_fmt_capture (fmt, pap, out);
+}
+
+static inline int
+_ul_async_capture_field (ul_buffer_t *out, const char *key,
+                         const char *format, va_list *pap)
+{
+  const ul_fmt_t *fmt;
+
+  if (format == NULL || (fmt = ul_fmt_get (format)) == NULL)
+    return -1;
+  return _ul_async_capture_fmt (out, key, fmt, pap);
+}
+
+/* Capture everything the message needs into OUT. Messages from a
+   template are captured with the formats compiled for it. */
+static int
+_ul_async_capture (ul_buffer_t *out, int format_version, int priority,
+                   const char *msg_format, const ul_template_t *template,
+                   va_list ap_orig, unsigned int sample_rate)
+{
+  ul_async_header_t header;
+  const char *key;
+  char *thread_info;
+  va_list ap;
+
+  header.saved_errno = errno;
+  header.priority = priority;
+  header.sample_rate = sample_rate;
+  header.nfields = 0;
+  header.site = ul_callsite_current;
+  clock_gettime (ul_process_data.timestamp_clock, &header.ts);
+
+  /* The header is filled in once everything else is captured. */
+  out->ptr = out->msg;
+  if (ul_buffer_append_raw (out, (const char *)&header,
+                            sizeof (header)) == NULL)
+    return -1;
+
+  va_copy (ap, ap_orig);
+  if (template != NULL)
+    {
+      const ul_template_field_t *field = template->fields;
+
+      for (; field < template->fields + template->nfields; field++)
+        {
+          if (_ul_async_capture_fmt (out, field->key, field->fmt, &ap) != 0)
+            goto err;
+          header.nfields++;
+        }
+      format_version = 0;
+    }
+  else
+    {
+      if (_ul_async_capture_field (out, NULL, msg_format, &ap) != 0)
+        goto err;
+      header.nfields++;
+    }
+
+  if (format_version > 0)
+    while ((key = va_arg (ap, const char *)) != NULL)
+      {
+        const char *fmt = va_arg (ap, const char *);
+
+        if (_ul_async_capture_field (out, key, fmt, &ap) != 0)
+          goto err;
+        header.nfields++;
+      }
+  va_end (ap);
+
+  thread_info = out->ptr;
+  if ((ul_process_data.flags & (LOG_UL_THREADINFO | LOG_UL_NOIMPLICIT)) ==
+      LOG_UL_THREADINFO)
+    {
+      size_t offset = thread_info - out->msg;
+
+      if (_ul_discover_thread (out) == NULL)
+        return -1;
+      thread_info = out->msg + offset;
+    }
+  header.thread_info_len = out->ptr - thread_info;
+
+  memcpy (out->msg, &header, sizeof (header));
+  return 0;
+
+ err:
+  va_end (ap);
+  return -1;
+}
+
+/* Render a captured record into a message, and send it. TEXT is used
+   for formatting values, before they are escaped. */
+static int
+_ul_async_render (const char *record, ul_buffer_t *text)
+{
+  ul_buffer_t *buffer = &ul_buffer;
+  ul_async_header_t header;
+  const char *p, *msg;
+  unsigned int i;
+
+  memcpy (&header, record, sizeof (header));
+  p = record + sizeof (header);
+
+  if (ul_buffer_reset (buffer) != 0)
+    return -1;
+
+  for (i = 0; i < header.nfields; i++)
+    {
+      const char *key = "msg";
+      const ul_fmt_t *fmt;
+
+      if (i > 0)
+        key = ul_fmt_captured_string (&p);
+      memcpy (&fmt, p, sizeof (fmt));
+      p += sizeof (fmt);
+
+      if (fmt->trivial_string)
+        {
+          const char *str = ul_fmt_captured_string (&p);
+
+          buffer = ul_buffer_append (buffer, key, str ? str : "(null)");
+        }
+      else
+        {
+          text->ptr = text->msg;
+          if (ul_fmt_render (fmt, &p, header.saved_errno, text) != 0)
+            return -1;
+          buffer = ul_buffer_append (buffer, key, text->msg);
+        }
+      if (buffer == NULL)
+        return -1;
+    }
+
+  buffer = _ul_callsite_append (buffer, header.site);
+  if (buffer == NULL)
+    return -1;
+
+  buffer = _ul_discover (buffer, header.priority, &header.ts,
+                         p, header.thread_info_len);
+  if (buffer == NULL)
+    return -1;
+
+  if (header.sample_rate > 1 &&
+      (buffer = ul_buffer_append_uint (buffer, "sample_rate",
+                                       header.sample_rate)) == NULL)
+    return -1;
+
+  msg = ul_buffer_finalize (buffer);
+  if (msg == NULL)
+    return -1;
+
+  _ul_output (header.priority, msg);
+
+  return 0;
+}
+
+static inline int
+_ul_async_lane (int priority)
+{
+  if (LOG_PRI (priority) <= LOG_ERR)
+    return 0;
+  if (LOG_PRI (priority) < LOG_DEBUG)
+    return 1;
+  return 2;
+}
+
+/* Copy the oldest record of LANE to RECORD, and take it off its queue.
+   Queues take turns, starting with *CURSOR. Returns zero if there are
+   no records in the lane, and -1 on error. */
+static int
+_ul_async_take (int lane, ul_async_queue_t **cursor, ul_buffer_t *record)
+{
+  ul_async_queue_t *head = __atomic_load_n (&ul_async.queues,
+                                            __ATOMIC_ACQUIRE);
+  ul_async_queue_t *queue, *start;
+  const char *data;
+  size_t len;
+
+  queue = start = (*cursor != NULL) ? *cursor : head;
+  if (queue == NULL)
+    return 0;
+  do
+    {
+      pthread_mutex_lock (&queue->lock);
+      data = ul_ring_front (&queue->lanes[lane], &len, NULL);
+      if (data != NULL)
+        {
+          record->ptr = record->msg;
+          if (ul_buffer_append_raw (record, data, len) == NULL)
+            {
+              pthread_mutex_unlock (&queue->lock);
+              return -1;
+            }
+          ul_ring_pop (&queue->lanes[lane]);
+          __atomic_fetch_sub (&ul_async.lane_pending[lane], 1,
+                              __ATOMIC_SEQ_CST);
+          pthread_mutex_unlock (&queue->lock);
+          *cursor = queue->next;
+          return 1;
+        }
+      pthread_mutex_unlock (&queue->lock);
+      queue = (queue->next != NULL) ? queue->next : head;
+    }
+  while (queue != start);
+
+  return 0;
+}
+
+/* Render and send everything queued, from the calling thread, most
+   urgent lane first: the lanes are looked at again after every
+   record, so an error waits for at most one less urgent record.
+   Records are copied out of the queue first, so the queue is not
+   locked while they are being sent. */
+static void
+_ul_async_drain (ul_buffer_t *record, ul_buffer_t *text)
+{
+  ul_async_queue_t *cursors[UL_ASYNC_LANES] = { NULL };
+  int lane;
+
+  for (;;)
+    {
+      for (lane = 0; lane < UL_ASYNC_LANES; lane++)
+        if (__atomic_load_n (&ul_async.lane_pending[lane],
+                             __ATOMIC_SEQ_CST) != 0)
+          break;
+      if (lane == UL_ASYNC_LANES ||
+          _ul_async_take (lane, &cursors[lane], record) <= 0)
+        return;
+
+      if (__atomic_load_n (&ul_async.waiters, __ATOMIC_SEQ_CST) != 0)
+        {
+          pthread_mutex_lock (&ul_async.lock);
+          pthread_cond_broadcast (&ul_async.space);
+          pthread_mutex_unlock (&ul_async.lock);
+        }
+
+      _ul_async_render (record->msg, text);
+      __atomic_fetch_sub (&ul_async.pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void *
+_ul_async_thread (void *data)
+{
+  ul_buffer_t record = { NULL, NULL, NULL };
+  ul_buffer_t text = { NULL, NULL, NULL };
+
+  (void)data;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&ul_async.lock);
+      while (__atomic_load_n (&ul_async.pending, __ATOMIC_SEQ_CST) == 0 &&
+             !ul_async.stop)
+        {
+          struct timespec deadline;
+
+          /* Producers only signal if we said we were going to sleep,
+             so check for work once more after saying that. The
+             timeout is only a safety net. */
+          __atomic_store_n (&ul_async.sleeping, 1, __ATOMIC_SEQ_CST);
+          if (__atomic_load_n (&ul_async.pending, __ATOMIC_SEQ_CST) != 0)
+            break;
+          clock_gettime (CLOCK_REALTIME, &deadline);
+          deadline.tv_sec++;
+          pthread_cond_timedwait (&ul_async.cond, &ul_async.lock, &deadline);
+        }
+      __atomic_store_n (&ul_async.sleeping, 0, __ATOMIC_SEQ_CST);
+      if (ul_async.stop &&
+          __atomic_load_n (&ul_async.pending, __ATOMIC_SEQ_CST) == 0)
+        {
+          pthread_mutex_unlock (&ul_async.lock);
+          break;
+        }
+      pthread_mutex_unlock (&ul_async.lock);
+
+      _ul_async_drain (&record, &text);
+
+      /* Pressure is over once everything queued is sent: that is when
+         drops are reported. */
+      if (__atomic_load_n (&ul_async.pending, __ATOMIC_SEQ_CST) == 0 &&
+          __atomic_load_n (&ul_async.unreported, __ATOMIC_RELAXED) != 0)
+        {
+          unsigned long dropped =
+            __atomic_exchange_n (&ul_async.unreported, 0, __ATOMIC_RELAXED);
+
+          _ul_syslog_internal (LOG_WARNING,
+                               "%lu queued messages dropped", dropped,
+                               "dropped", "%lu", dropped,
+                               NULL);
+        }
+    }
+
+  free (record.msg);
+  free (text.msg);
+  free (ul_buffer.msg);
+  ul_buffer.msg = NULL;
+
+  return NULL;
+}
+
+static int
+_ul_async_start (void)
+{
+  sigset_t all, old;
+  int ret = 0;
+
+  pthread_mutex_lock (&ul_async.lock);
+  if (!ul_async.running)
+    {
+      /* Signals are for the threads of the application to handle. */
+      sigfillset (&all);
+      pthread_sigmask (SIG_SETMASK, &all, &old);
+      ret = pthread_create (&ul_async.thread, NULL, _ul_async_thread, NULL);
+      pthread_sigmask (SIG_SETMASK, &old, NULL);
+      if (ret == 0)
+        __atomic_store_n (&ul_async.running, 1, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&ul_async.lock);
+
+  if (ret != 0)
+    {
+      errno = ret;
+      return -1;
+    }
+  return 0;
+}
+
+/* Stop the background thread, once it sent everything queued. */
+static int
+_ul_async_stop (void)
+{
+  pthread_t thread;
+
+  pthread_mutex_lock (&ul_async.lock);
+  if (!ul_async.running)
+    {
+      pthread_mutex_unlock (&ul_async.lock);
+      return 0;
+    }
+  if (pthread_equal (ul_async.thread, pthread_self ()))
+    {
+      pthread_mutex_unlock (&ul_async.lock);
+      errno = EDEADLK;
+      return -1;
+    }
+  ul_async.stop = 1;
+  thread = ul_async.thread;
+  pthread_cond_signal (&ul_async.cond);
+  pthread_mutex_unlock (&ul_async.lock);
+
+  pthread_join (thread, NULL);
+
+  pthread_mutex_lock (&ul_async.lock);
+  ul_async.stop = 0;
+  __atomic_store_n (&ul_async.running, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&ul_async.lock);
+
+  return 0;
+}
+
+static ul_async_queue_t *
+_ul_async_get_queue (void)
+{
+  ul_async_queue_t *queue;
+
+  if (ul_async_queue != NULL)
+    return ul_async_queue;
+
+  /* Reuse the queue of a thread that exited, if there is one. */
+  for (queue = __atomic_load_n (&ul_async.queues, __ATOMIC_ACQUIRE);
+       queue != NULL; queue = queue->next)
+    {
+      int expected = 0;
+
+      if (__atomic_compare_exchange_n (&queue->in_use, &expected, 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        break;
+    }
+
+  if (queue == NULL)
+    {
+      queue = calloc (1, sizeof (*queue));
+      if (queue == NULL)
+        return NULL;
+      pthread_mutex_init (&queue->lock, NULL);
+      queue->in_use = 1;
+      queue->next = __atomic_load_n (&ul_async.queues, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&ul_async.queues, &queue->next,
+                                           queue, 1, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+
+  ul_async_queue = queue;
+  if (ul_thread_key_valid)
+    pthread_setspecific (ul_thread_key, queue);
+  return queue;
+}
+
+static inline void
+_ul_async_count_drop (unsigned long *counter)
+{
+  __atomic_fetch_add (counter, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&ul_async.unreported, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop the oldest record of a lane. Must be called with the queue
+   locked. */
+static inline void
+_ul_async_evict (ul_async_queue_t *queue, int lane, unsigned long *counter)
+{
+  ul_ring_pop (&queue->lanes[lane]);
+  __atomic_fetch_sub (&ul_async.lane_pending[lane], 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_sub (&ul_async.pending, 1, __ATOMIC_SEQ_CST);
+  _ul_async_count_drop (counter);
+}
+
+/* Wait for the background thread to make room for LEN bytes, for at
+   most the configured timeout. */
+static int
+_ul_async_wait_for_room (ul_async_queue_t *queue, size_t len, int priority,
+                         void **dst)
+{
+  ul_ring_t *ring = &queue->lanes[_ul_async_lane (priority)];
+  unsigned int timeout = ul_process_data.queue_timeout;
+  struct timespec deadline;
+  int ret = 0;
+
+  /* The background thread would wait for itself. */
+  if (pthread_equal (ul_async.thread, pthread_self ()))
+    {
+      _ul_async_count_drop (&ul_async.stats.dropped_timeout);
+      return 1;
+    }
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  __atomic_fetch_add (&ul_async.stats.blocked, 1, __ATOMIC_RELAXED);
+
+  /* Space is signalled with ul_async.lock held, so as long as we hold
+     it between finding the queue full, and waiting, we cannot miss
+     it. */
+  pthread_mutex_lock (&ul_async.lock);
+  __atomic_fetch_add (&ul_async.waiters, 1, __ATOMIC_SEQ_CST);
+  for (;;)
+    {
+      pthread_mutex_lock (&queue->lock);
+      if ((*dst = ul_ring_push (ring, len, priority)) != NULL)
+        break;
+      if (ring->count == 0)
+        {
+          /* Too large to ever fit. */
+          ret = -1;
+          pthread_mutex_unlock (&queue->lock);
+          break;
+        }
+      pthread_mutex_unlock (&queue->lock);
+
+      if (timeout == 0)
+        pthread_cond_wait (&ul_async.space, &ul_async.lock);
+      else if (pthread_cond_timedwait (&ul_async.space, &ul_async.lock,
+                                       &deadline) == ETIMEDOUT)
+        {
+          _ul_async_count_drop (&ul_async.stats.dropped_timeout);
+          ret = 1;
+          break;
+        }
+    }
+  __atomic_fetch_sub (&ul_async.waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&ul_async.lock);
+
+  return ret;
+}
+
+/* Find room for a LEN bytes long record of PRIORITY in a full queue,
+   according to the queue policy. Returns zero if there is room at
+   *DST, in which case the queue is locked; one if the record is to be
+   dropped; and -1 if it should be sent right away. */
+static int
+_ul_async_make_room (ul_async_queue_t *queue, size_t len, int priority,
+                     void **dst)
+{
+  int lane = _ul_async_lane (priority);
+  ul_ring_t *ring = &queue->lanes[lane];
+  uint32_t oldest;
+
+  switch (ul_process_data.queue_policy)
+    {
+    case LOG_UL_QUEUE_BLOCK:
+      return _ul_async_wait_for_room (queue, len, priority, dst);
+
+    case LOG_UL_QUEUE_DROP_NEWEST:
+      _ul_async_count_drop (&ul_async.stats.dropped_newest);
+      return 1;
+
+    case LOG_UL_QUEUE_DROP_OLDEST:
+      pthread_mutex_lock (&queue->lock);
+      while ((*dst = ul_ring_push (ring, len, priority)) == NULL &&
+             ring->count > 0)
+        _ul_async_evict (queue, lane, &ul_async.stats.dropped_oldest);
+      break;
+
+    case LOG_UL_QUEUE_DROP_PRIORITY:
+      /* Only records at the head of the queue can be evicted, and only
+         as long as they are less important than the new one. */
+      pthread_mutex_lock (&queue->lock);
+      while ((*dst = ul_ring_push (ring, len, priority)) == NULL &&
+             ul_ring_front (ring, NULL, &oldest) != NULL &&
+             LOG_PRI (oldest) > LOG_PRI (priority))
+        _ul_async_evict (queue, lane, &ul_async.stats.dropped_priority);
+      if (*dst == NULL && ring->count > 0)
+        {
+          pthread_mutex_unlock (&queue->lock);
+          _ul_async_count_drop (&ul_async.stats.dropped_priority);
+          return 1;
+        }
+      break;
+
+    default:
+      return -1;
+    }
+
+  if (*dst == NULL)
+    {
+      /* Does not fit even in an empty ring. */
+      pthread_mutex_unlock (&queue->lock);
+      return -1;
+    }
+  return 0;
+}
+
+/* Queue the message for the background thread. Returns -1 if that
+   was not possible, and the message needs to be sent right away
+   instead, and one if the queue policy dropped it. */
+static int
+_ul_async_record (int format_version, int priority,
+                  const char *msg_format, const ul_template_t *template,
+                  va_list ap, unsigned int sample_rate)
+{
+  size_t size = ul_process_data.async_size;
+  ul_buffer_t *scratch = &ul_async_scratch;
+  ul_async_queue_t *queue;
+  ul_ring_t *ring;
+  size_t len;
+  void *dst;
+  int lane, ret;
+
+  if (!__atomic_load_n (&ul_async.running, __ATOMIC_ACQUIRE) &&
+      _ul_async_start () != 0)
+    return -1;
+
+  queue = _ul_async_get_queue ();
+  if (queue == NULL)
+    return -1;
+
+  if (_ul_async_capture (scratch, format_version, priority, msg_format,
+                         template, ap, sample_rate) != 0)
+    return -1;
+  len = scratch->ptr - scratch->msg;
+
+  lane = _ul_async_lane (priority);
+  ring = &queue->lanes[lane];
+
+  pthread_mutex_lock (&queue->lock);
+  /* Resizing has to wait until the ring is drained. Without a ring,
+     the message is sent right away. */
+  if (ring->size != size && ring->count == 0)
+    {
+      ul_ring_free (ring);
+      if (ul_ring_init (ring, size) != 0)
+        {
+          pthread_mutex_unlock (&queue->lock);
+          return -1;
+        }
+    }
+  dst = ul_ring_push (ring, len, priority);
+  if (dst == NULL)
+    {
+      pthread_mutex_unlock (&queue->lock);
+      ret = _ul_async_make_room (queue, len, priority, &dst);
+      if (ret != 0)
+        return ret;
+    }
+  memcpy (dst, scratch->msg, len);
+  /* Counted while still locked, so that the count of a lane is never
+     less than the records in it. */
+  __atomic_fetch_add (&ul_async.lane_pending[lane], 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add (&ul_async.pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&queue->lock);
+
+  if (__atomic_load_n (&ul_async.sleeping, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock (&ul_async.lock);
+      pthread_cond_signal (&ul_async.cond);
+      pthread_mutex_unlock (&ul_async.lock);
+    }
+
+  return 0;
+}
+
+/* Applies what the control file sets, the mask last, so that the
+   messages it lets through already get the rest of the settings. */
+static void
+_ul_control_apply (const ul_control_t *control)
+{
+  size_t i;
+  int pri;
+
+  for (i = 0; i < control->nsites; i++)
+    ul_callsite_set (control->sites[i].file, control->sites[i].line,
+                     control->sites[i].enable);
+  for (pri = 0; pri <= LOG_DEBUG; pri++)
+    if (control->sample_set & (1 << pri))
+      ul_set_sample_rate (pri, control->sample[pri]);
+  if (control->has_rate_limit)
+    ul_set_rate_limit (control->rate, control->burst);
+  if (control->has_fields)
+    ul_set_implicit_fields (control->fields);
+  if (control->has_flags)
+    ul_set_log_flags (control->flags);
+  if (control->has_mask)
+    setlogmask (control->mask);
+}
+
+static int
+_ul_control_load (const char *path)
+{
+  ul_control_t control;
+
+  if (ul_control_read (path, &control) != 0)
+    return -1;
+  _ul_control_apply (&control);
+  ul_control_free (&control);
+  return 0;
+}
+
+/* Whether the file changed since we last looked: with inotify, whether
+   any of the events on its directory is about it being rewritten or
+   replaced by a rename; without, whether it looks different. */
+static int
+_ul_control_changed (void)
+{
+  struct stat st;
+
+  if (ul_control.watch_fd == -1)
+    {
+      if (stat (ul_control.path, &st) != 0 ||
+          (st.st_ino == ul_control.st.st_ino &&
+           st.st_size == ul_control.st.st_size &&
+           st.st_mtim.tv_sec == ul_control.st.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == ul_control.st.st_mtim.tv_nsec))
+        return 0;
+      ul_control.st = st;
+      return 1;
+    }
+
+#ifdef HAVE_SYS_INOTIFY_H
+  {
+    char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    int changed = 0;
+    char *p;
+
+    len = read (ul_control.watch_fd, buffer, sizeof (buffer));
+    for (p = buffer; len > 0 && p < buffer + len;
+         p += sizeof (*event) + event->len)
+      {
+        event = (const struct inotify_event *)p;
+        if (event->len > 0 && strcmp (event->name, ul_control.name) == 0)
+          changed = 1;
+      }
+    return changed;
+  }
+#else
+  return 0;
+#endif
+}
+
+static void *
+_ul_control_thread (void *data)
+{
+  struct pollfd fds[2];
+  int ret;
+
+  (void)data;
+
+  fds[0].fd = ul_control.wake[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = ul_control.watch_fd;
+  fds[1].events = POLLIN;
+
+  for (;;)
+    {
+      ret = poll (fds, ul_control.watch_fd != -1 ? 2 : 1,
+                  ul_control.watch_fd != -1 ? -1 : 1000);
+      if (ret < 0 && errno != EINTR)
+        break;
+      if (ret > 0 && fds[0].revents != 0)
+        break;
+      if (_ul_control_changed ())
+        /* A file that does not parse leaves the settings alone. */
+        _ul_control_load (ul_control.path);
+    }
+
+  return NULL;
+}
+
+/* Called with the lock held. */
+static void
+_ul_control_stop_locked (void)
+{
+  if (!ul_control.running)
+    return;
+
+  while (write (ul_control.wake[1], "", 1) < 0 && errno == EINTR)
+    ;
+  pthread_join (ul_control.thread, NULL);
+  close (ul_control.wake[0]);
+  close (ul_control.wake[1]);
+  if (ul_control.watch_fd != -1)
+    close (ul_control.watch_fd);
+  free (ul_control.path);
+  ul_control.path = NULL;
+  ul_control.running = 0;
+}
+
+static void
+_ul_control_stop (void)
+{
+  pthread_mutex_lock (&ul_control.lock);
+  _ul_control_stop_locked ();
+  pthread_mutex_unlock (&ul_control.lock);
+}
+
+/* Starts watching PATH, which has just been applied. Called with the
+   lock held. */
+static int
+_ul_control_start_locked (const char *path)
+{
+  char *slash;
+  sigset_t all, old;
+  int ret;
+
+  ul_control.path = strdup (path);
+  if (ul_control.path == NULL)
+    return -1;
+  slash = strrchr (ul_control.path, '/');
+  ul_control.name = (slash != NULL) ? slash + 1 : ul_control.path;
+  stat (path, &ul_control.st);
+
+  if (pipe2 (ul_control.wake, O_CLOEXEC) != 0)
+    {
+      free (ul_control.path);
+      ul_control.path = NULL;
+      return -1;
+    }
+
+  /* The directory is watched rather than the file, so that we notice
+     it being replaced, as most editors do. */
+  ul_control.watch_fd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+  ul_control.watch_fd = inotify_init1 (IN_CLOEXEC);
+  if (ul_control.watch_fd != -1)
+    {
+      if (slash != NULL)
+        *slash = '\0';
+      ret = inotify_add_watch (ul_control.watch_fd,
+                               slash == NULL ? "." :
+                               slash == ul_control.path ? "/" :
+                               ul_control.path,
+                               IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (slash != NULL)
+        *slash = '/';
+      if (ret == -1)
+        {
+          close (ul_control.watch_fd);
+          ul_control.watch_fd = -1;
+        }
+    }
+#endif
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  ret = pthread_create (&ul_control.thread, NULL, _ul_control_thread, NULL);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (ret != 0)
+    {
+      close (ul_control.wake[0]);
+      close (ul_control.wake[1]);
+      if (ul_control.watch_fd != -1)
+        close (ul_control.watch_fd);
+      free (ul_control.path);
+      ul_control.path = NULL;
+      errno = ret;
+      return -1;
+    }
+  ul_control.running = 1;
+
+  return 0;
+}
+
+/* Copy the counters, and those kept elsewhere, to the segment. */
+static void
+_ul_stats_publish (void)
+{
+  ul_stats_counters_t counters;
+  uint64_t *src = (uint64_t *)&ul_stats.counters, *dst = (uint64_t *)&counters;
+  size_t i;
+
+  for (i = 0; i < sizeof (counters) / sizeof (uint64_t); i++)
+    dst[i] = __atomic_load_n (&src[i], __ATOMIC_RELAXED);
+
+  counters.dropped =
+    __atomic_load_n (&ul_async.stats.dropped_newest, __ATOMIC_RELAXED) +
+    __atomic_load_n (&ul_async.stats.dropped_oldest, __ATOMIC_RELAXED) +
+    __atomic_load_n (&ul_async.stats.dropped_priority, __ATOMIC_RELAXED) +
+    __atomic_load_n (&ul_async.stats.dropped_timeout, __ATOMIC_RELAXED);
+  counters.blocked = __atomic_load_n (&ul_async.stats.blocked,
+                                      __ATOMIC_RELAXED);
+  counters.send_failed = __atomic_load_n (&ul_send.stats.failed,
+                                          __ATOMIC_RELAXED);
+  counters.remote_dropped = __atomic_load_n (&ul_remote.remote.dropped,
+                                             __ATOMIC_RELAXED);
+  counters.ring_memory = ul_ring_memory ();
+
+  ul_stats_publish (ul_stats.shm, &counters);
+}
+
+static void *
+_ul_stats_thread (void *data)
+{
+  struct timespec deadline;
+
+  (void)data;
+
+  pthread_mutex_lock (&ul_stats.lock);
+  while (!ul_stats.stop)
+    {
+      _ul_stats_publish ();
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += ul_stats.interval_ms / 1000;
+      deadline.tv_nsec += (ul_stats.interval_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+      while (!ul_stats.stop &&
+             pthread_cond_timedwait (&ul_stats.cond, &ul_stats.lock,
+                                     &deadline) != ETIMEDOUT)
+        ;
+    }
+  pthread_mutex_unlock (&ul_stats.lock);
+
+  return NULL;
+}
+
+/* Stop updating the segment, and remove it. Called with the lock
+   held. */
+static void
+_ul_stats_stop_locked (void)
+{
+  if (ul_stats.shm == NULL)
+    return;
+
+  __atomic_store_n (&ul_stats.enabled, 0, __ATOMIC_RELAXED);
+  ul_stats.stop = 1;
+  pthread_cond_signal (&ul_stats.cond);
+  pthread_mutex_unlock (&ul_stats.lock);
+  pthread_join (ul_stats.thread, NULL);
+  pthread_mutex_lock (&ul_stats.lock);
+  ul_stats.stop = 0;
+
+  ul_stats_detach (ul_stats.shm);
+  ul_stats_remove (ul_stats.pid);
+  ul_stats.shm = NULL;
+}
+
+static void
+_ul_stats_stop (void)
+{
+  pthread_mutex_lock (&ul_stats.lock);
+  _ul_stats_stop_locked ();
+  pthread_mutex_unlock (&ul_stats.lock);
+}
+
+static inline void
+_ul_stats_latency (const struct timespec *start)
+{
+  struct timespec now;
+  uint64_t ns;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  ns = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+    now.tv_nsec - start->tv_nsec;
+  __atomic_fetch_add (&ul_stats.counters.latency[ul_stats_latency_bucket (ns)],
+                      1, __ATOMIC_RELAXED);
+}
+
+/* Everything _ul_vsyslog() does, once the message passed the mask. */
+static inline int
+_ul_vsyslog_unmasked (int format_version, int priority,
+                      const char *msg_format, va_list ap)
+{
+  unsigned int sample_rate;
+
+  if (ul_process_data.flight_size != 0)
+    {
+      if (LOG_PRI (priority) > ul_process_data.flight_threshold)
+        return _ul_flight_record (format_version, priority, msg_format, ap);
+      if (LOG_PRI (priority) <= LOG_ERR)
+        _ul_flight_flush ();
+    }
+
+  sample_rate = _ul_sample (priority, msg_format);
+  if (sample_rate == 0)
+    return 0;
+
+  if (!_ul_ratelimit (priority, msg_format))
+    return 0;
+
+  if (ul_binlog.log != NULL &&
+      _ul_binlog_record (format_version, priority, msg_format, ap,
+                         sample_rate) == 0)
+    {
+      if (__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+        _ul_stats_count (priority, UL_STATS_SINK_BINLOG, 0);
+      return 0;
+    }
+
+  if (ul_process_data.async_size != 0 &&
+      _ul_async_record (format_version, priority, msg_format, NULL, ap,
+                        sample_rate) != -1)
+    return 0;
+
+  return _ul_vsyslog_output (format_version, priority, msg_format, ap,
+                             sample_rate);
+}
+
+/* When statistics are exported, the time spent in the call is
+   counted too. */
+static inline int
+_ul_vsyslog (int format_version, int priority,
+             const char *msg_format, va_list ap)
+{
+  struct timespec start;
+  int status;
+
+  _ul_env_check ();
+  if (!(setlogmask (0) & LOG_MASK (LOG_PRI (priority))))
+    return 0;
+
+  if (!__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+    return _ul_vsyslog_unmasked (format_version, priority, msg_format, ap);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  status = _ul_vsyslog_unmasked (format_version, priority, msg_format, ap);
+  _ul_stats_latency (&start);
+
+  return status;
+}
+
+/* Like _ul_vsyslog_unmasked(), for a message compiled in advance.
+   The template formats are used for deferred formatting too, and
+   binary logs get the message as JSON. */
+static int
+_ul_vsyslog_template_unmasked (const ul_template_t *template, va_list ap)
+{
+  ul_buffer_t *buffer = &ul_buffer;
+  int priority = template->priority;
+  unsigned int sample_rate;
+  const char *msg;
+
+  if (ul_process_data.flight_size != 0)
+    {
+      if (LOG_PRI (priority) > ul_process_data.flight_threshold)
+        {
+          buffer = _ul_template_vformat (buffer, template, ap);
+          if (buffer == NULL || (msg = ul_buffer_finalize (buffer)) == NULL)
+            return -1;
+          return _ul_flight_push (priority, msg, buffer->ptr - buffer->msg);
+        }
+      if (LOG_PRI (priority) <= LOG_ERR)
+        _ul_flight_flush ();
+    }
+
+  sample_rate = _ul_sample (priority, template->msg_format);
+  if (sample_rate == 0)
+    return 0;
+
+  if (!_ul_ratelimit (priority, template->msg_format))
+    return 0;
+
+  if (ul_process_data.async_size != 0 &&
+      _ul_async_record (0, priority, NULL, template, ap,
+                        sample_rate) != -1)
+    return 0;
+
+  buffer = _ul_template_vformat (buffer, template, ap);
+  if (buffer == NULL)
+    return -1;
+
+  return _ul_buffer_output (buffer, priority, sample_rate);
+}
+
+static inline int
+_ul_vsyslog_template (const ul_template_t *template, va_list ap)
+{
+  struct timespec start;
+  int status;
+
+  _ul_env_check ();
+  if (!(setlogmask (0) & LOG_MASK (LOG_PRI (template->priority))))
+    return 0;
+
+  if (!__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+    return _ul_vsyslog_template_unmasked (template, ap);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  status = _ul_vsyslog_template_unmasked (template, ap);
+  _ul_stats_latency (&start);
+
+  return status;
+}
+
+/* Messages logged from signal handlers are formatted into one of these
+   buffers, claimed without locking, and sent on a socket of their own,
+   unless the syslog socket is a datagram one, which can be shared.
+   Nothing on this path allocates, locks, or calls anything that is
+   not async-signal-safe. */
+#define UL_EMERGENCY_BUFFERS 8
+#define UL_EMERGENCY_SIZE 2048
+
+static struct
+{
+  int fd;
+  struct
+  {
+    int busy;
+    char data[UL_EMERGENCY_SIZE];
+  } buffers[UL_EMERGENCY_BUFFERS];
+} ul_emergency = { .fd = -1 };
+
+/* Connect a new socket to the syslog daemon: the one set with
+   ul_set_syslog_socket(), if any, or the default one. TYPE is the
+   socket type to use, or zero to try both. */
+static int
+_ul_emergency_connect (int type)
+{
+  struct sockaddr_un local;
+  const struct sockaddr *addr;
+  socklen_t addrlen;
+  int fd, i;
+  static const int types[] = { SOCK_DGRAM, SOCK_STREAM };
+
+  if (ul_send.enabled && ul_send.sink.addr.ss_family == AF_UNIX)
+    {
+      addr = (const struct sockaddr *)&ul_send.sink.addr;
+      addrlen = ul_send.sink.addrlen;
+    }
+  else
+    {
+      memset (&local, 0, sizeof (local));
+      local.sun_family = AF_UNIX;
+      memcpy (local.sun_path, _PATH_LOG, sizeof (_PATH_LOG));
+      addr = (const struct sockaddr *)&local;
+      addrlen = sizeof (local);
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      if (type != 0 && type != types[i])
+        continue;
+      fd = socket (AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+      if (fd == -1)
+        return -1;
+      if (connect (fd, addr, addrlen) == 0)
+        return fd;
+      close (fd);
+      if (errno != EPROTOTYPE)
+        return -1;
+    }
+  return -1;
+}
+
+/* Return the socket to send emergency messages on, and its type in
+   *TYPE. */
+static int
+_ul_emergency_socket (int *type)
+{
+  socklen_t len = sizeof (*type);
+  int fd, old = -1;
+
+  if (ul_send.enabled && ul_send.sink.type == SOCK_DGRAM &&
+      (fd = ul_send.sink.fd) != -1)
+    {
+      *type = SOCK_DGRAM;
+      return fd;
+    }
+
+  fd = __atomic_load_n (&ul_emergency.fd, __ATOMIC_ACQUIRE);
+  if (fd == -1)
+    {
+      fd = _ul_emergency_connect (0);
+      if (fd == -1)
+        return -1;
+      /* Another handler may have been faster. */
+      if (!__atomic_compare_exchange_n (&ul_emergency.fd, &old, fd, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+          close (fd);
+          fd = old;
+        }
+    }
+
+  if (getsockopt (fd, SOL_SOCKET, SO_TYPE, type, &len) != 0)
+    return -1;
+  return fd;
+}
+
+static int
+_ul_emergency_send (int fd, int type, const char *msg, size_t len)
+{
+  int new_fd;
+
+  if (send (fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)len)
+    return 0;
+  if (fd != ul_emergency.fd ||
+      (errno != ECONNREFUSED && errno != ENOTCONN && errno != EPIPE &&
+       errno != ECONNRESET))
+    return -1;
+
+  /* The daemon was restarted: reconnect in place, so that the
+     descriptor stays valid for anyone else using it, and retry once. */
+  new_fd = _ul_emergency_connect (type);
+  if (new_fd == -1)
+    return -1;
+  if (dup2 (new_fd, fd) == -1)
+    {
+      close (new_fd);
+      return -1;
+    }
+  close (new_fd);
+
+  if (send (fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)len)
+    return 0;
+  return -1;
+}
+
+static inline void
+_ul_emergency_append_field (ul_safe_buffer_t *b, const char *key,
+                            const char *value)
+{
+  ul_safe_append (b, ",\"", 2);
+  ul_safe_append_escaped (b, key, strlen (key));
+  ul_safe_append (b, "\":\"", 3);
+  ul_safe_append_escaped (b, value, strlen (value));
+  ul_safe_append (b, "\"", 1);
+}
+
+static inline void
+_ul_emergency_append_uint (ul_safe_buffer_t *b, const char *key,
+                           uintmax_t value)
+{
+  ul_safe_append (b, ",\"", 2);
+  ul_safe_append_str (b, key);
+  ul_safe_append (b, "\":\"", 3);
+  ul_safe_append_uint (b, value);
+  ul_safe_append (b, "\"", 1);
+}
+
+/* The implicit fields, like _ul_discover() adds them. TS and
+   THREAD_INFO are the same too, but the time is always taken as is:
+   local time cannot be computed safely, so the timestamp is in UTC
+   unless it is a number. */
+static void
+_ul_emergency_discover (ul_safe_buffer_t *b, int priority,
+                        const struct timespec *ts,
+                        const char *thread_info, size_t thread_info_len)
+{
+  int fields = ul_process_data.fields;
+  const char *ident;
+  struct utsname uts;
+  struct timespec now;
+
+  if (ul_process_data.flags & LOG_UL_NOIMPLICIT)
+    return;
+
+  if (fields & LOG_UL_FIELD_PID)
+    _ul_emergency_append_uint (b, "pid", _find_pid ());
+  if (fields & LOG_UL_FIELD_FACILITY)
+    _ul_emergency_append_field (b, "facility", _find_facility (priority));
+  if (fields & LOG_UL_FIELD_PRIORITY)
+    _ul_emergency_append_field (b, "priority", _find_prio (priority));
+  if (fields & LOG_UL_FIELD_UID)
+    _ul_emergency_append_uint (b, "uid", _get_uid ());
+  if (fields & LOG_UL_FIELD_GID)
+    _ul_emergency_append_uint (b, "gid", _get_gid ());
+  if (fields & LOG_UL_FIELD_HOST)
+    {
+      if (ul_process_data.hostname[0] != '\0')
+        _ul_emergency_append_field (b, "host", ul_process_data.hostname);
+      else if (uname (&uts) == 0)
+        _ul_emergency_append_field (b, "host", uts.nodename);
+    }
+
+  /* The rendered fields end with a comma, instead of starting with
+     one. */
+  if (thread_info_len > 0)
+    {
+      ul_safe_append (b, ",", 1);
+      ul_safe_append (b, thread_info, thread_info_len - 1);
+    }
+
+  ident = (fields & LOG_UL_FIELD_PROGRAM) ? _get_ident () : NULL;
+  if (ident != NULL)
+    _ul_emergency_append_field (b, "program", ident);
+
+  if (ul_process_data.flags & LOG_UL_NOTIME ||
+      !(fields & LOG_UL_FIELD_TIMESTAMP))
+    return;
+
+  if (ts == NULL)
+    {
+      clock_gettime (ul_process_data.timestamp_clock, &now);
+      ts = &now;
+    }
+  ul_safe_append_str (b, ",\"timestamp\":");
+  switch (_ul_timestamp_mode ())
+    {
+    case LOG_UL_TIME_EPOCH_S:
+      ul_safe_append_uint (b, ts->tv_sec);
+      break;
+    case LOG_UL_TIME_EPOCH_MS:
+      ul_safe_append_uint (b, (uintmax_t)ts->tv_sec * 1000 +
+                           ts->tv_nsec / 1000000);
+      break;
+    case LOG_UL_TIME_EPOCH_NS:
+      ul_safe_append_uint (b, (uintmax_t)ts->tv_sec * 1000000000 +
+                           ts->tv_nsec);
+      break;
+    default:
+      ul_safe_append (b, "\"", 1);
+      ul_safe_append_utc (b, ts, 9);
+      ul_safe_append (b, "\"", 1);
+      break;
+    }
+}
+
+/* Claim one of the buffers. Returns its index, or -1. */
+static int
+_ul_emergency_claim (ul_safe_buffer_t *b)
+{
+  int i;
+
+  for (i = 0; i < UL_EMERGENCY_BUFFERS; i++)
+    if (!__atomic_exchange_n (&ul_emergency.buffers[i].busy, 1,
+                              __ATOMIC_ACQUIRE))
+      break;
+  if (i == UL_EMERGENCY_BUFFERS)
+    {
+      errno = EBUSY;
+      return -1;
+    }
+
+  b->ptr = ul_emergency.buffers[i].data;
+  b->end = b->ptr + UL_EMERGENCY_SIZE;
+  b->truncated = 0;
+  return i;
+}
+
+/* Claim one of the buffers, and start a message in it, with the
+   header _ul_send() would use, but no timestamp: that would have to be
+   in local time. Returns the index of the buffer, or -1. */
+static int
+_ul_emergency_begin (ul_safe_buffer_t *b, int priority)
+{
+  const char *ident;
+  int i;
+
+  i = _ul_emergency_claim (b);
+  if (i == -1)
+    return -1;
+
+  if ((priority & LOG_FACMASK) == 0)
+    priority |= ul_process_data.facility;
+  ident = _get_ident ();
+
+  ul_safe_append (b, "<", 1);
+  ul_safe_append_uint (b, priority);
+  ul_safe_append (b, ">", 1);
+  ul_safe_append_str (b, ident ? ident : "");
+  if (ul_process_data.option & LOG_PID)
+    {
+      ul_safe_append (b, "[", 1);
+      ul_safe_append_uint (b, _find_pid ());
+      ul_safe_append (b, "]", 1);
+    }
+  ul_safe_append_str (b, ": @cee:");
+
+  return i;
+}
+
+/* Send the message started in buffer I, and release the buffer. A
+   message that did not fit is dropped. */
+static int
+_ul_emergency_end (ul_safe_buffer_t *b, int i)
+{
+  char *data = ul_emergency.buffers[i].data;
+  int fd, type, ret = -1;
+
+  fd = _ul_emergency_socket (&type);
+  if (fd == -1)
+    goto out;
+
+  if (type == SOCK_STREAM)
+    ul_safe_append (b, "", 1);
+  if (b->truncated)
+    {
+      errno = EMSGSIZE;
+      goto out;
+    }
+
+  ret = _ul_emergency_send (fd, type, data, b->ptr - data);
+
+ out:
+  __atomic_store_n (&ul_emergency.buffers[i].busy, 0, __ATOMIC_RELEASE);
+  return ret;
+}
+
+static int
+_ul_vsyslog_signal_safe (int priority, const char *msg_format,
+                         va_list ap_orig)
+{
+  int saved_errno = errno;
+  ul_safe_buffer_t b;
+  const char *key, *fmt;
+  va_list ap;
+  int i;
+
+  i = _ul_emergency_begin (&b, priority);
+  if (i == -1)
+    return -1;
+
+  ul_safe_append_str (&b, "{\"msg\":\"");
+  va_copy (ap, ap_orig);
+  if (ul_safe_vformat (&b, msg_format, &ap) != 0)
+    goto err;
+  ul_safe_append (&b, "\"", 1);
+
+  while ((key = va_arg (ap, const char *)) != NULL)
+    {
+      fmt = va_arg (ap, const char *);
+      ul_safe_append (&b, ",\"", 2);
+      ul_safe_append_escaped (&b, key, strlen (key));
+      ul_safe_append (&b, "\":\"", 3);
+      if (ul_safe_vformat (&b, fmt, &ap) != 0)
+        goto err;
+      ul_safe_append (&b, "\"", 1);
+    }
+  va_end (ap);
+
+  _ul_emergency_discover (&b, priority, NULL, NULL, 0);
+  ul_safe_append (&b, "}", 1);
+
+  if (_ul_emergency_end (&b, i) != 0)
+    return -1;
+  errno = saved_errno;
+  return 0;
+
+ err:
+  va_end (ap);
+  __atomic_store_n (&ul_emergency.buffers[i].busy, 0, __ATOMIC_RELEASE);
+  errno = EINVAL;
+  return -1;
+}
+
+/* Crash handling: when the program crashes, whatever is still queued,
+   or held by the flight recorder of the crashing thread, is rendered
+   the way ul_syslog_signal_safe() renders messages, and sent where
+   _ul_output() would send it, before the handler that was installed
+   before ours is called. */
+#define UL_CRASH_SIGNALS 4
+/* How long to try writing to the remote collector. */
+#define UL_CRASH_REMOTE_TIMEOUT 100
+
+/* Where the crash handler sends messages. An output handler cannot be
+   called safely, so its messages go to the syslog socket, like those
+   for the remote collector when it is not connected. */
+#define UL_CRASH_SINK_SYSLOG 0
+#define UL_CRASH_SINK_BINLOG 1
+#define UL_CRASH_SINK_REMOTE 2
+
+static const int ul_crash_signals[UL_CRASH_SIGNALS] =
+  { SIGSEGV, SIGBUS, SIGABRT, SIGFPE };
+
+static struct
+{
+  int enabled;
+  int flushing;
+  int sink;
+  struct sigaction old[UL_CRASH_SIGNALS];
+} ul_crash;
+
+/* Claim one of the buffers, and start a message in it, with the header
+   the sink takes: the one _ul_remote_output() would use for the remote
+   collector, none for the binary log. Returns the index of the buffer,
+   or -1. */
+static int
+_ul_crash_begin (ul_safe_buffer_t *b, int priority)
+{
+  const char *host = ul_process_data.hostname, *ident;
+  struct utsname uts;
+  struct timespec now;
+  int i;
+
+  if (ul_crash.sink == UL_CRASH_SINK_SYSLOG)
+    return _ul_emergency_begin (b, priority);
+
+  i = _ul_emergency_claim (b);
+  if (i == -1 || ul_crash.sink == UL_CRASH_SINK_BINLOG)
+    return i;
+
+  if ((priority & LOG_FACMASK) == 0)
+    priority |= ul_process_data.facility;
+  if (host[0] == '\0' && uname (&uts) == 0)
+    host = uts.nodename;
+  ident = _get_ident ();
+  clock_gettime (CLOCK_REALTIME, &now);
+
+  ul_safe_append (b, "<", 1);
+  ul_safe_append_uint (b, priority);
+  ul_safe_append (b, ">1 ", 3);
+  ul_safe_append_utc (b, &now, 6);
+  ul_safe_append (b, " ", 1);
+  ul_safe_append_str (b, host[0] ? host : "-");
+  ul_safe_append (b, " ", 1);
+  ul_safe_append_str (b, (ident && ident[0]) ? ident : "-");
+  ul_safe_append (b, " ", 1);
+  ul_safe_append_uint (b, _find_pid ());
+  ul_safe_append_str (b, " - - @cee:");
+
+  return i;
+}
+
+/* Send the message started in buffer I, and release the buffer. A
+   message that did not fit is dropped. */
+static void
+_ul_crash_end (ul_safe_buffer_t *b, int i, int priority)
+{
+  char *data = ul_emergency.buffers[i].data;
+
+  if (ul_crash.sink == UL_CRASH_SINK_SYSLOG)
+    {
+      _ul_emergency_end (b, i);
+      return;
+    }
+
+  if (!b->truncated)
+    {
+      if (ul_crash.sink == UL_CRASH_SINK_BINLOG)
+        ul_binlog_crash_json (ul_binlog.log, priority, data, b->ptr - data);
+      else
+        ul_remote_crash_send (&ul_remote.remote, data, b->ptr - data,
+                              UL_CRASH_REMOTE_TIMEOUT);
+    }
+  __atomic_store_n (&ul_emergency.buffers[i].busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Send a record captured by _ul_async_capture(), rendered like
+   _ul_async_render() does. */
+static void
+_ul_crash_send_record (const char *record)
+{
+  ul_async_header_t header;
+  ul_safe_buffer_t b;
+  const ul_fmt_t *fmt;
+  const char *p, *key;
+  unsigned int n;
+  int i;
+
+  memcpy (&header, record, sizeof (header));
+  p = record + sizeof (header);
+
+  i = _ul_crash_begin (&b, header.priority);
+  if (i == -1)
+    return;
+
+  ul_safe_append (&b, "{", 1);
+  for (n = 0; n < header.nfields; n++)
+    {
+      key = "msg";
+      if (n > 0)
+        {
+          key = ul_fmt_captured_string (&p);
+          ul_safe_append (&b, ",", 1);
+        }
+      memcpy (&fmt, p, sizeof (fmt));
+      p += sizeof (fmt);
+
+      ul_safe_append (&b, "\"", 1);
+      ul_safe_append_escaped (&b, key, strlen (key));
+      ul_safe_append (&b, "\":\"", 3);
+      ul_fmt_render_safe (fmt, &p, header.saved_errno, &b);
+      ul_safe_append (&b, "\"", 1);
+    }
+
+  _ul_emergency_discover (&b, header.priority, &header.ts,
+                          p, header.thread_info_len);
+  if (header.sample_rate > 1)
+    _ul_emergency_append_uint (&b, "sample_rate", header.sample_rate);
+  ul_safe_append (&b, "}", 1);
+
+  _ul_crash_end (&b, i, header.priority);
+}
+
+/* Send everything still queued, oldest first. Nothing is locked: the
+   queues may be inconsistent if the crash happened while one was being
+   modified, but the program is going down anyway. */
+static void
+_ul_crash_flush_async (void)
+{
+  ul_async_queue_t *queue, *oldest_queue;
+  ul_async_header_t header;
+  struct timespec oldest_ts;
+  const char *record, *oldest;
+  int lane, oldest_lane = 0;
+
+  for (;;)
+    {
+      oldest = NULL;
+      oldest_queue = NULL;
+      for (queue = __atomic_load_n (&ul_async.queues, __ATOMIC_ACQUIRE);
+           queue != NULL; queue = queue->next)
+        for (lane = 0; lane < UL_ASYNC_LANES; lane++)
+          {
+            record = ul_ring_front (&queue->lanes[lane], NULL, NULL);
+            if (record == NULL)
+              continue;
+            memcpy (&header, record, sizeof (header));
+            if (oldest != NULL &&
+                (header.ts.tv_sec > oldest_ts.tv_sec ||
+                 (header.ts.tv_sec == oldest_ts.tv_sec &&
+                  header.ts.tv_nsec >= oldest_ts.tv_nsec)))
+              continue;
+            oldest = record;
+            oldest_ts = header.ts;
+            oldest_queue = queue;
+            oldest_lane = lane;
+          }
+      if (oldest == NULL)
+        break;
+
+      _ul_crash_send_record (oldest);
+      ul_ring_pop (&oldest_queue->lanes[oldest_lane]);
+      __atomic_fetch_sub (&ul_async.lane_pending[oldest_lane], 1,
+                          __ATOMIC_SEQ_CST);
+    }
+}
+
+static void
+_ul_crash_flush_flight (void)
+{
+  ul_ring_t *ring = &ul_flight_ring;
+  ul_safe_buffer_t b;
+  const char *msg;
+  uint32_t priority;
+  size_t len;
+  int i;
+
+  while ((msg = ul_ring_front (ring, &len, &priority)) != NULL)
+    {
+      i = _ul_crash_begin (&b, priority);
+      if (i == -1)
+        return;
+      /* Without the terminating NUL. */
+      ul_safe_append (&b, msg, len - 1);
+      _ul_crash_end (&b, i, priority);
+      ul_ring_pop (ring);
+    }
+}
+
+/* What was buffered for the binary log, or the remote collector, goes
+   out first, being older. */
+static void
+_ul_crash_flush (void)
+{
+  int remote = -1;
+
+  if (__atomic_load_n (&ul_remote.enabled, __ATOMIC_RELAXED))
+    remote = ul_remote_crash_flush (&ul_remote.remote,
+                                    UL_CRASH_REMOTE_TIMEOUT);
+
+  if (ul_binlog.log != NULL)
+    ul_crash.sink = UL_CRASH_SINK_BINLOG;
+  else if (ul_process_data.output_handler == NULL && remote == 0)
+    ul_crash.sink = UL_CRASH_SINK_REMOTE;
+  else
+    ul_crash.sink = UL_CRASH_SINK_SYSLOG;
+
+  _ul_crash_flush_async ();
+  _ul_crash_flush_flight ();
+  if (ul_binlog.log != NULL)
+    ul_binlog_crash_flush (ul_binlog.log);
+}
+
+static void
+_ul_crash_handler (int signo, siginfo_t *info, void *context)
+{
+  const struct sigaction *old = NULL;
+  int saved_errno = errno;
+  int i;
+
+  for (i = 0; i < UL_CRASH_SIGNALS; i++)
+    if (ul_crash_signals[i] == signo)
+      old = &ul_crash.old[i];
+  if (old == NULL)
+    return;
+
+  /* Only the first crash is flushed, should there be more at once, or
+     one while flushing. */
+  if (!__atomic_exchange_n (&ul_crash.flushing, 1, __ATOMIC_ACQ_REL))
+    _ul_crash_flush ();
+
+  if (old->sa_flags & SA_SIGINFO)
+    old->sa_sigaction (signo, info, context);
+  else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+    old->sa_handler (signo);
+  else
+    {
+      /* Put the old disposition back, and raise the signal again:
+         it is blocked until we return, and kills the program then.
+         If it was ignored, a fault happens again instead, which
+         cannot be ignored. */
+      sigaction (signo, old, NULL);
+      if (old->sa_handler == SIG_DFL)
+        raise (signo);
+    }
+
+  errno = saved_errno;
+}
+
+int
+ul_syslog (int priority, const char *msg_format, ...)
+{
+  va_list ap;
+  int status;
+
+  va_start (ap, msg_format);
+  status = ul_vsyslog (priority, msg_format, ap);
+  va_end (ap);
+
+  return status;
+}
+
+int
+ul_vsyslog (int priority, const char *msg_format, va_list ap)
+{
+  return _ul_vsyslog (1, priority, msg_format, ap);
+}
+
+ul_template_t *
+ul_compile (int priority, const char *msg_format, ...)
+{
+  ul_template_t *template;
+  va_list ap;
+
+  va_start (ap, msg_format);
+  template = ul_template_compile (priority, msg_format, ap);
+  va_end (ap);
+
+  return template;
+}
+
+void
+ul_template_free (ul_template_t *template)
+{
+  ul_template_destroy (template);
+}
+
+int
+ul_syslog_t (const ul_template_t *template, ...)
+{
+  va_list ap;
+  int status;
+
+  va_start (ap, template);
+  status = ul_vsyslog_t (template, ap);
+  va_end (ap);
+
+  return status;
+}
+
+int
+ul_vsyslog_t (const ul_template_t *template, va_list ap)
+{
+  if (template == NULL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return _ul_vsyslog_template (template, ap);
+}
+
+int
+ul_syslog_signal_safe (int priority, const char *msg_format, ...)
+{
+  va_list ap;
+  int status;
+
+  va_start (ap, msg_format);
+  status = _ul_vsyslog_signal_safe (priority, msg_format, ap);
+  va_end (ap);
+
+  return status;
+}
+
+int
+ul_syslog_callsite (ul_callsite_t *site, int priority,
+                    const char *msg_format, ...)
+{
+  ul_callsite_t *outer = ul_callsite_current;
+  va_list ap;
+  int status;
+
+  __atomic_fetch_add (&site->hits, 1, __ATOMIC_RELAXED);
+
+  ul_callsite_current = site;
+  va_start (ap, msg_format);
+  status = _ul_vsyslog (1, priority, msg_format, ap);
+  va_end (ap);
+  ul_callsite_current = outer;
+
+  return status;
+}
+
+void
+ul_register_callsites (ul_callsite_t *start, ul_callsite_t *stop)
+{
+  ul_callsite_register (start, stop);
+}
+
+void
+ul_unregister_callsites (ul_callsite_t *start, ul_callsite_t *stop)
+{
+  ul_callsite_unregister (start, stop);
+}
+
+int
+ul_foreach_callsite (ul_callsite_func_t func, void *user_data)
+{
+  return ul_callsite_foreach (func, user_data);
+}
+
+int
+ul_set_callsite (const char *file, unsigned int line, int enable)
+{
+  return ul_callsite_set (file, line, enable);
+}
+
+void
+ul_legacy_vsyslog (int priority, const char *msg_format, va_list ap)
+{
+  if (ul_recurse)
+    {
+      old_vsyslog (priority, msg_format, ap);
+    }
+  else
+    {
+      ul_recurse = 1;
+      _ul_vsyslog (0, priority, msg_format, ap);
+      ul_recurse = 0;
+    }
+}
+
+void
+ul_legacy_syslog (int priority, const char *msg_format, ...)
+{
+  va_list ap;
+
+  va_start (ap, msg_format);
+  ul_legacy_vsyslog (priority, msg_format, ap);
+  va_end (ap);
+}
+
+/* Batches: all records are formatted back to back into one buffer,
+   with a single timestamp, and the implicit fields that do not depend
+   on the priority rendered once. Every record is the syslog header, if
+   the batch goes to the syslog socket, followed by the payload and its
+   terminating NUL; offsets are kept, as the buffer may move. */
+typedef struct
+{
+  int priority;     /* As given, the facility is only added for sending */
+  size_t start;     /* Of the header, or the payload */
+  size_t payload;
+  size_t end;       /* After the NUL */
+} ul_batch_entry_t;
+
+/* Whether messages go to the syslog socket, see _ul_output(). */
+static inline int
+_ul_batch_direct (void)
+{
+  return ul_binlog.log == NULL && ul_process_data.output_handler == NULL &&
+    !__atomic_load_n (&ul_remote.enabled, __ATOMIC_RELAXED) &&
+    ul_send.enabled;
+}
+
+static int
+_ul_batch_format (ul_buffer_t *out, const ul_record_t *record,
+                  const struct timespec *ts, const ul_buffer_t *tail,
+                  int direct, unsigned int sample_rate,
+                  ul_batch_entry_t *entry)
+{
+  ul_buffer_t *buffer = out;
+  size_t i;
+
+  entry->priority = record->priority;
+  entry->start = out->ptr - out->msg;
+
+  if (direct)
+    {
+      int priority = record->priority;
+
+      if ((priority & LOG_FACMASK) == 0)
+        priority |= ul_process_data.facility;
+      if (ul_buffer_reserve (out, UL_SEND_HEADER_SIZE + 5) != 0)
+        return -1;
+      out->ptr += _ul_send_header (out->ptr, priority, ts->tv_sec);
+      memcpy (out->ptr, "@cee:", 5);
+      out->ptr += 5;
+    }
+  entry->payload = out->ptr - out->msg;
+
+  if (ul_buffer_begin (buffer) != 0 ||
+      (buffer = ul_buffer_append (buffer, "msg",
+                                  record->msg ? record->msg :
+                                  "(null)")) == NULL)
+    return -1;
+  for (i = 0; i < record->nfields; i++)
+    if ((buffer = ul_buffer_append (buffer, record->keys[i],
+                                    record->values[i] ? record->values[i] :
+                                    "(null)")) == NULL)
+      return -1;
+
+  if (tail != NULL)
+    {
+      /* Skip the opening brace of the rendered fields. */
+      if ((buffer = _ul_discover_head (buffer, record->priority)) == NULL ||
+          (buffer = ul_buffer_append_raw (buffer, tail->msg + 1,
+                                          tail->ptr - tail->msg - 1)) == NULL)
+        return -1;
+    }
+  else if ((buffer = _ul_discover (buffer, record->priority, ts,
+                                   NULL, 0)) == NULL)
+    return -1;
+
+  if (sample_rate > 1 &&
+      (buffer = ul_buffer_append_uint (buffer, "sample_rate",
+                                       sample_rate)) == NULL)
+    return -1;
+
+  if (ul_buffer_finalize (buffer) == NULL)
+    return -1;
+  entry->end = out->ptr - out->msg;
+  return 0;
+}
+
+/* Like _ul_send() does, give the fallback handler the priority with
+   the facility. */
+static void
+_ul_batch_send_failed (ul_buffer_t *out, const ul_batch_entry_t *entry)
+{
+  int priority = entry->priority;
+
+  if ((priority & LOG_FACMASK) == 0)
+    priority |= ul_process_data.facility;
+  _ul_send_failed (priority, out->msg + entry->payload);
+}
+
+/* Send the COUNT formatted records in ENTRIES. */
+static void
+_ul_batch_emit (ul_buffer_t *out, const ul_batch_entry_t *entries,
+                size_t count, int direct)
+{
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+  size_t i, sent = 0;
+
+  if (count == 0)
+    return;
+
+  if (!direct)
+    {
+      for (i = 0; i < count; i++)
+        _ul_output (entries[i].priority, out->msg + entries[i].payload);
+      return;
+    }
+
+  if (__atomic_load_n (&ul_stats.enabled, __ATOMIC_RELAXED))
+    for (i = 0; i < count; i++)
+      _ul_stats_count (entries[i].priority, UL_STATS_SINK_SOCKET,
+                       entries[i].end - 1 - entries[i].payload);
+
+  /* Records on a stream socket are separated by their NUL already. */
+  if (ul_send.sink.type == SOCK_STREAM)
+    {
+      struct iovec all;
+
+      all.iov_base = out->msg + entries[0].start;
+      all.iov_len = entries[count - 1].end - entries[0].start;
+      if (ul_sink_send (&ul_send.sink, &all, 1, ul_send.timeout) != 0)
+        for (i = 0; i < count; i++)
+          _ul_batch_send_failed (out, &entries[i]);
+      return;
+    }
+
+  msgs = calloc (count, sizeof (struct mmsghdr) + sizeof (struct iovec));
+  if (msgs != NULL)
+    {
+      iov = (struct iovec *)(msgs + count);
+      for (i = 0; i < count; i++)
+        {
+          iov[i].iov_base = out->msg + entries[i].start;
+          iov[i].iov_len = entries[i].end - 1 - entries[i].start;
+          msgs[i].msg_hdr.msg_iov = &iov[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+      sent = ul_sink_send_many (&ul_send.sink, msgs, count);
+      free (msgs);
+    }
+
+  /* The rest is retried one by one, until the deadline. */
+  for (i = sent; i < count; i++)
+    {
+      struct iovec one;
+
+      one.iov_base = out->msg + entries[i].start;
+      one.iov_len = entries[i].end - 1 - entries[i].start;
+      if (ul_sink_send (&ul_send.sink, &one, 1, ul_send.timeout) != 0)
+        _ul_batch_send_failed (out, &entries[i]);
+    }
+}
+
+int
+ul_syslog_batch (const ul_record_t *records, size_t count)
+{
+  ul_buffer_t out = { NULL, NULL, NULL }, tail = { NULL, NULL, NULL };
+  ul_buffer_t *tailp = NULL;
+  ul_batch_entry_t *entries;
+  struct timespec ts;
+  size_t i, n = 0, emitted = 0;
+  unsigned int sample_rate;
+  int mask, direct, held, pri, ret = -1;
+
+  if (count == 0)
+    return 0;
+  entries = malloc (count * sizeof (ul_batch_entry_t));
+  if (entries == NULL)
+    return -1;
+
+  _ul_env_check ();
+  mask = setlogmask (0);
+  direct = _ul_batch_direct ();
+  clock_gettime (ul_process_data.timestamp_clock, &ts);
+
+  /* The thread sequence number differs for every record. */
+  if ((ul_process_data.flags & (LOG_UL_NOIMPLICIT | LOG_UL_THREADINFO)) == 0)
+    {
+      if (ul_buffer_reset (&tail) != 0 ||
+          _ul_discover_tail (&tail, &ts, NULL, 0) == NULL)
+        goto out;
+      tailp = &tail;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      pri = LOG_PRI (records[i].priority);
+      if (!(mask & LOG_MASK (pri)))
+        continue;
+
+      held = 0;
+      if (ul_process_data.flight_size != 0)
+        {
+          held = (pri > ul_process_data.flight_threshold);
+          /* Like for single messages, what the flight recorder held
+             back goes before the error, but after what came before
+             it. */
+          if (!held && pri <= LOG_ERR)
+            {
+              _ul_batch_emit (&out, entries + emitted, n - emitted, direct);
+              emitted = n;
+              _ul_flight_flush ();
+            }
+        }
+
+      /* The message of a record stands for its call site. */
+      sample_rate = 1;
+      if (!held)
+        {
+          sample_rate = _ul_sample (records[i].priority, records[i].msg);
+          if (sample_rate == 0 ||
+              !_ul_ratelimit (records[i].priority, records[i].msg))
+            continue;
+        }
+
+      if (_ul_batch_format (&out, &records[i], &ts, tailp, held ? 0 : direct,
+                            sample_rate, &entries[n]) != 0)
+        goto out;
+
+      if (held)
+        {
+          _ul_flight_push (records[i].priority,
+                           out.msg + entries[n].payload,
+                           entries[n].end - entries[n].payload);
+          out.ptr = out.msg + entries[n].start;
+          continue;
+        }
+      n++;
+    }
+
+  _ul_batch_emit (&out, entries + emitted, n - emitted, direct);
+  emitted = n;
+  ret = 0;
+
+ out:
+  if (ret != 0)
+    {
+      /* Send what was formatted before running out of memory. */
+      _ul_batch_emit (&out, entries + emitted, n - emitted, direct);
+      errno = ENOMEM;
+    }
+  free (entries);
+  free (out.msg);
+  free (tail.msg);
+  return ret;
+}
+
+int
+ul_setlogmask (int mask)
+{
+  return setlogmask (mask);
+}
+
+int
+ul_set_timestamp_mode (int mode)
+{
+  ul_timestamp_func_t func;
+  clockid_t clock = CLOCK_REALTIME;
+
+  switch (mode & ~LOG_UL_TIME_COARSE)
+    {
+    case LOG_UL_TIME_LOCAL:
+      func = _ul_timestamp_local;
+      break;
+    case LOG_UL_TIME_UTC:
+      func = _ul_timestamp_utc;
+      break;
+    case LOG_UL_TIME_EPOCH_S:
+      func = _ul_timestamp_epoch_s;
+      break;
+    case LOG_UL_TIME_EPOCH_MS:
+      func = _ul_timestamp_epoch_ms;
+      break;
+    case LOG_UL_TIME_EPOCH_NS:
+      func = _ul_timestamp_epoch_ns;
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+    }
+
+#ifdef CLOCK_REALTIME_COARSE
+  if (mode & LOG_UL_TIME_COARSE)
+    clock = CLOCK_REALTIME_COARSE;
+#endif
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.timestamp_clock = clock;
+  ul_process_data.timestamp_func = func;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  return 0;
+}
+
+void
+ul_set_rate_limit (unsigned int rate, unsigned int burst)
+{
+  if (burst == 0)
+    burst = rate > 0 ? rate : 1;
+  if (burst > UL_SITE_MAX_BURST)
+    burst = UL_SITE_MAX_BURST;
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.ratelimit_burst = burst;
+  ul_process_data.ratelimit_rate = rate;
+  pthread_mutex_unlock (&ul_process_data.lock);
+}
+
+int
+ul_set_sample_rate (int priority, unsigned int rate)
+{
+  if (priority < 0 || priority > LOG_DEBUG)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.sample_rate[priority] = rate;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  return 0;
+}
+
+int
+ul_set_site_sample_rate (const char *msg_format, unsigned int rate)
+{
+  ul_site_t *site;
+
+  if (msg_format == NULL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  site = ul_site_lookup (msg_format);
+  if (site == NULL)
+    {
+      errno = ENOSPC;
+      return -1;
+    }
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  site->sample_rate = rate;
+  if (rate != 0)
+    ul_process_data.site_sampling = 1;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  return 0;
+}
+
+int
+ul_set_flight_recorder (int threshold, size_t size)
+{
+  if (threshold < LOG_EMERG || threshold > LOG_DEBUG)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.flight_threshold = threshold;
+  ul_process_data.flight_size = size;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  return 0;
+}
+
+void
+ul_flight_recorder_flush (void)
+{
+  _ul_flight_flush ();
+}
+
+int
+ul_set_binary_log (const char *path)
+{
+  ul_binlog_t *log = NULL, *old;
+
+  if (path != NULL && (log = ul_binlog_open (path)) == NULL)
+    return -1;
+
+  pthread_mutex_lock (&ul_binlog.lock);
+  old = ul_binlog.log;
+  ul_binlog.log = log;
+  pthread_mutex_unlock (&ul_binlog.lock);
+
+  return ul_binlog_close (old);
+}
+
+int
+ul_set_queue_policy (int policy, unsigned int timeout_ms)
+{
+  if (policy < LOG_UL_QUEUE_SYNC || policy > LOG_UL_QUEUE_DROP_PRIORITY)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.queue_policy = policy;
+  ul_process_data.queue_timeout = timeout_ms;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  return 0;
+}
+
+void
+ul_get_queue_stats (ul_queue_stats_t *stats)
+{
+  stats->dropped_newest =
+    __atomic_load_n (&ul_async.stats.dropped_newest, __ATOMIC_RELAXED);
+  stats->dropped_oldest =
+    __atomic_load_n (&ul_async.stats.dropped_oldest, __ATOMIC_RELAXED);
+  stats->dropped_priority =
+    __atomic_load_n (&ul_async.stats.dropped_priority, __ATOMIC_RELAXED);
+  stats->dropped_timeout =
+    __atomic_load_n (&ul_async.stats.dropped_timeout, __ATOMIC_RELAXED);
+  stats->blocked =
+    __atomic_load_n (&ul_async.stats.blocked, __ATOMIC_RELAXED);
+}
+
+int
+ul_set_async (size_t size)
+{
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.async_size = size;
+  pthread_mutex_unlock (&ul_process_data.lock);
+
+  if (size != 0)
+    return _ul_async_start ();
+  return _ul_async_stop ();
+}
+
+int
+ul_set_syslog_socket (const char *path, int timeout_ms)
+{
+  int ret = 0, fd, new_fd;
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  if (timeout_ms < 0)
+    {
+      /* The socket is kept: other threads may be sending on it. */
+      ul_send.enabled = 0;
+      goto out;
+    }
+
+  ul_send.timeout = timeout_ms;
+  if (ul_sink_set_unix (&ul_send.sink, path ? path : _PATH_LOG) != 0)
+    {
+      ret = -1;
+      goto out;
+    }
+  /* The daemon may not be running yet: that is only an error once a
+     message is sent. */
+  ul_sink_connect (&ul_send.sink);
+  ul_send.enabled = 1;
+
+  /* Reconnect the socket for signal handlers too, if it was opened;
+     one might be using it right now, so it cannot be closed. */
+  fd = __atomic_load_n (&ul_emergency.fd, __ATOMIC_ACQUIRE);
+  if (fd != -1 && (new_fd = _ul_emergency_connect (0)) != -1)
+    {
+      dup2 (new_fd, fd);
+      close (new_fd);
+    }
+
+ out:
+  pthread_mutex_unlock (&ul_process_data.lock);
+  return ret;
+}
+
+void
+ul_set_fallback_handler (ul_output_handler_t handler, void *user_data)
+{
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_send.fallback = handler;
+  ul_send.fallback_data = user_data;
+  pthread_mutex_unlock (&ul_process_data.lock);
+}
+
+void
+ul_get_send_stats (ul_send_stats_t *stats)
+{
+  stats->failed = __atomic_load_n (&ul_send.stats.failed, __ATOMIC_RELAXED);
+  stats->diverted = __atomic_load_n (&ul_send.stats.diverted,
+                                     __ATOMIC_RELAXED);
+  stats->remote_dropped = __atomic_load_n (&ul_remote.remote.dropped,
+                                           __ATOMIC_RELAXED);
+  stats->remote_connects = __atomic_load_n (&ul_remote.remote.connects,
+                                            __ATOMIC_RELAXED);
+}
+
+int
+ul_set_stats_export (unsigned int interval_ms)
+{
+  ul_stats_shm_t *shm;
+  sigset_t all, old;
+  int ret;
+
+  pthread_mutex_lock (&ul_stats.lock);
+  _ul_stats_stop_locked ();
+
+  if (interval_ms == 0)
+    {
+      pthread_mutex_unlock (&ul_stats.lock);
+      return 0;
+    }
+
+  ul_stats.pid = getpid ();
+  shm = ul_stats_create (ul_stats.pid, interval_ms);
+  if (shm == NULL)
+    {
+      pthread_mutex_unlock (&ul_stats.lock);
+      return -1;
+    }
+  ul_stats.shm = shm;
+  ul_stats.interval_ms = interval_ms;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  ret = pthread_create (&ul_stats.thread, NULL, _ul_stats_thread, NULL);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (ret != 0)
+    {
+      ul_stats_detach (shm);
+      ul_stats_remove (ul_stats.pid);
+      ul_stats.shm = NULL;
+      pthread_mutex_unlock (&ul_stats.lock);
+      errno = ret;
+      return -1;
+    }
+  __atomic_store_n (&ul_stats.enabled, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&ul_stats.lock);
+
+  return 0;
+}
+
+int
+ul_set_control_file (const char *path)
+{
+  int ret = 0;
+
+  pthread_mutex_lock (&ul_control.lock);
+  _ul_control_stop_locked ();
+  if (path != NULL)
+    {
+      ret = _ul_control_load (path);
+      if (ret == 0)
+        ret = _ul_control_start_locked (path);
+    }
+  pthread_mutex_unlock (&ul_control.lock);
+
+  return ret;
+}
+
+int
+ul_set_remote (const char *host, const char *port, int type, size_t size)
+{
+  int ret = 0;
+
+  /* Closing may take a while: it is not done with the process
+     locked. Messages that were on their way to the remote when it was
+     disabled are dropped, see ul_remote_send(). */
+  pthread_mutex_lock (&ul_remote.lock);
+  __atomic_store_n (&ul_remote.enabled, 0, __ATOMIC_RELAXED);
+  ul_remote_close (&ul_remote.remote, UL_REMOTE_CLOSE_TIMEOUT);
+  if (host != NULL)
+    {
+      ret = ul_remote_open (&ul_remote.remote, host, port, type, size);
+      __atomic_store_n (&ul_remote.enabled, ret == 0, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&ul_remote.lock);
+
+  return ret;
+}
+
+int
+ul_set_crash_handler (int enable)
+{
+  struct sigaction sa;
+  int i, type, ret = 0;
+
+  pthread_mutex_lock (&ul_process_data.lock);
+  if (!enable == !ul_crash.enabled)
+    goto out;
+
+  if (!enable)
+    {
+      for (i = 0; i < UL_CRASH_SIGNALS; i++)
+        sigaction (ul_crash_signals[i], &ul_crash.old[i], NULL);
+      ul_crash.enabled = 0;
+      goto out;
+    }
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_sigaction = _ul_crash_handler;
+  sigemptyset (&sa.sa_mask);
+  /* Use the alternate stack, if the program set one up, so that stack
+     overflows can be handled too. */
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  for (i = 0; i < UL_CRASH_SIGNALS; i++)
+    if (sigaction (ul_crash_signals[i], &sa, &ul_crash.old[i]) != 0)
+      {
+        while (--i >= 0)
+          sigaction (ul_crash_signals[i], &ul_crash.old[i], NULL);
+        ret = -1;
+        goto out;
+      }
+  ul_crash.enabled = 1;
+
+  /* Connect now, if a socket of our own is needed, rather than while
+     crashing. */
+  _ul_emergency_socket (&type);
+
+ out:
+  pthread_mutex_unlock (&ul_process_data.lock);
+  return ret;
+}
+
+void
+ul_set_output_handler (ul_output_handler_t handler, void *user_data)
+{
+  pthread_mutex_lock (&ul_process_data.lock);
+  ul_process_data.output_handler = handler;
+  ul_process_data.output_data = user_data;
+  pthread_mutex_unlock (&ul_process_data.lock);
+}
+
+int
+ul_set_thread_name (const char *name)
+{
+  int ret = ENOSYS;
+
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  ret = pthread_setname_np (pthread_self (), name);
+#endif
+  ul_thread_data.valid = 0;
+
+  return ret;
 }
@@ -30,12 +30,89 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #define LOG_UL_ALL             0x0000
 #define LOG_UL_NOIMPLICIT      0x0040
 #define LOG_UL_NOCACHE         0x0080
 #define LOG_UL_NOCACHE_UID     0x0100
 #define LOG_UL_NOTIME          0x0200
+#define LOG_UL_THREADINFO      0x0400
+
+#define LOG_UL_FIELD_PID       0x0001
+#define LOG_UL_FIELD_FACILITY  0x0002
+#define LOG_UL_FIELD_PRIORITY  0x0004
+#define LOG_UL_FIELD_UID       0x0008
+#define LOG_UL_FIELD_GID       0x0010
+#define LOG_UL_FIELD_HOST      0x0020
+#define LOG_UL_FIELD_PROGRAM   0x0040
+#define LOG_UL_FIELD_TIMESTAMP 0x0080
+#define LOG_UL_FIELD_ALL       0x00ff
+
+#define LOG_UL_TIME_LOCAL      0x0000
+#define LOG_UL_TIME_UTC        0x0001
+#define LOG_UL_TIME_EPOCH_S    0x0002
+#define LOG_UL_TIME_EPOCH_MS   0x0003
+#define LOG_UL_TIME_EPOCH_NS   0x0004
+#define LOG_UL_TIME_COARSE     0x0100
+
+#define LOG_UL_QUEUE_SYNC          0
+#define LOG_UL_QUEUE_BLOCK         1
+#define LOG_UL_QUEUE_DROP_NEWEST   2
+#define LOG_UL_QUEUE_DROP_OLDEST   3
+#define LOG_UL_QUEUE_DROP_PRIORITY 4
+
+typedef struct
+{
+  unsigned long dropped_newest;    /* LOG_UL_QUEUE_DROP_NEWEST */
+  unsigned long dropped_oldest;    /* LOG_UL_QUEUE_DROP_OLDEST */
+  unsigned long dropped_priority;  /* LOG_UL_QUEUE_DROP_PRIORITY */
+  unsigned long dropped_timeout;   /* LOG_UL_QUEUE_BLOCK */
+  unsigned long blocked;           /* LOG_UL_QUEUE_BLOCK, waits */
+} ul_queue_stats_t;
+
+typedef struct
+{
+  unsigned long failed;    /* Not sent to the syslog socket in time */
+  unsigned long diverted;  /* Of those, passed to the fallback handler */
+  unsigned long remote_dropped;   /* Not sent to the remote collector */
+  unsigned long remote_connects;  /* Attempts to connect to it */
+} ul_send_stats_t;
+
+/* A record for ul_syslog_batch(): a message, and NFIELDS additional
+   fields, as arrays of keys and values. */
+typedef struct
+{
+  int priority;
+  const char *msg;
+  const char *const *keys;
+  const char *const *values;
+  size_t nfields;
+} ul_record_t;
+
+/* A message compiled in advance by ul_compile(), for ul_syslog_t(). */
+typedef struct ul_template ul_template_t;
+
+/* A call site of UL_SYSLOG(). Sites are placed in the ul_callsites
+   section of the object they are in, so that all of them are known
+   at startup, before they log anything. ENABLED and HITS are accessed
+   atomically. */
+typedef struct
+{
+  const char *file;
+  const char *function;
+  const char *format;
+  unsigned int line;
+  int enabled;
+  unsigned long hits;      /* Messages logged from the site */
+  const char *fragment;    /* The file and line fields, once rendered */
+  size_t fragment_len;
+} ul_callsite_t;
+
+typedef int (*ul_callsite_func_t) (ul_callsite_t *site, void *user_data);
+
+typedef void (*ul_output_handler_t) (int priority, const char *message,
+                                     void *user_data);
 
 char *ul_format (int priority, const char *msg_format, ...)
   __attribute__((warn_unused_result, sentinel));
@@ -44,12 +121,99 @@ char *ul_vformat (int priority, const char *msg_format, va_list ap)
 
 void ul_openlog (const char *ident, int option, int facility);
 void ul_set_log_flags (int flags);
+int ul_set_implicit_fields (int fields);
 void ul_closelog (void);
 int ul_setlogmask (int mask);
+int ul_set_timestamp_mode (int mode);
+void ul_set_rate_limit (unsigned int rate, unsigned int burst);
+int ul_set_sample_rate (int priority, unsigned int rate);
+int ul_set_site_sample_rate (const char *msg_format, unsigned int rate);
+int ul_set_flight_recorder (int threshold, size_t size);
+void ul_flight_recorder_flush (void);
+int ul_set_async (size_t size);
+int ul_set_queue_policy (int policy, unsigned int timeout_ms);
+void ul_get_queue_stats (ul_queue_stats_t *stats);
+int ul_set_binary_log (const char *path);
+void ul_set_output_handler (ul_output_handler_t handler, void *user_data);
+int ul_set_syslog_socket (const char *path, int timeout_ms);
+void ul_set_fallback_handler (ul_output_handler_t handler, void *user_data);
+void ul_get_send_stats (ul_send_stats_t *stats);
+int ul_set_stats_export (unsigned int interval_ms);
+int ul_set_control_file (const char *path);
+int ul_set_remote (const char *host, const char *port, int type,
+                   size_t size);
+int ul_set_crash_handler (int enable);
+int ul_set_thread_name (const char *name);
 
 int ul_syslog (int priority, const char *msg_format, ...)
   __attribute__((sentinel));
 int ul_vsyslog (int priority, const char *msg_format, va_list ap);
+int ul_syslog_batch (const ul_record_t *records, size_t count);
+ul_template_t *ul_compile (int priority, const char *msg_format, ...)
+  __attribute__((warn_unused_result, sentinel));
+void ul_template_free (ul_template_t *template);
+int ul_syslog_t (const ul_template_t *template, ...);
+int ul_vsyslog_t (const ul_template_t *template, va_list ap);
+int ul_syslog_signal_safe (int priority, const char *msg_format, ...)
+  __attribute__((sentinel));
+
+int ul_syslog_callsite (ul_callsite_t *site, int priority,
+                        const char *msg_format, ...)
+  __attribute__((sentinel));
+void ul_register_callsites (ul_callsite_t *start, ul_callsite_t *stop)
+  __attribute__((weak));
+void ul_unregister_callsites (ul_callsite_t *start, ul_callsite_t *stop)
+  __attribute__((weak));
+int ul_foreach_callsite (ul_callsite_func_t func, void *user_data);
+int ul_set_callsite (const char *file, unsigned int line, int enable);
+
+/* Like ul_syslog(), but with a descriptor for the call site, which
+   adds the file and line to the message, and lets the site be turned
+   off at runtime, in which case not even the arguments are evaluated.
+   MSG_FORMAT must be a string literal. */
+#define UL_SYSLOG(priority, msg_format, ...)                            \
+  do                                                                    \
+    {                                                                   \
+      static ul_callsite_t _ul_callsite                                 \
+        __attribute__((section ("ul_callsites"), used,                  \
+                       aligned (__alignof__ (ul_callsite_t)))) =        \
+        { __FILE__, __func__, msg_format, __LINE__, 1, 0, NULL, 0 };    \
+                                                                        \
+      if (__builtin_expect (__atomic_load_n (&_ul_callsite.enabled,     \
+                                             __ATOMIC_RELAXED), 1))     \
+        ul_syslog_callsite (&_ul_callsite, (priority), msg_format,      \
+                            __VA_ARGS__);                               \
+    }                                                                   \
+  while (0)
+
+/* The linker defines these for the object the header is included in,
+   if it has any call sites; every object registers its own, and
+   unregisters them when it is unloaded. Objects that include the
+   header without linking to the library are left alone. */
+extern ul_callsite_t __start_ul_callsites[]
+  __attribute__((weak, visibility ("hidden")));
+extern ul_callsite_t __stop_ul_callsites[]
+  __attribute__((weak, visibility ("hidden")));
+
+static void _ul_register_callsites (void) __attribute__((constructor));
+static void
+_ul_register_callsites (void)
+{
+  ul_callsite_t *start = __start_ul_callsites, *stop = __stop_ul_callsites;
+
+  if (ul_register_callsites != NULL && start != stop)
+    ul_register_callsites (start, stop);
+}
+
+static void _ul_unregister_callsites (void) __attribute__((destructor));
+static void
+_ul_unregister_callsites (void)
+{
+  ul_callsite_t *start = __start_ul_callsites, *stop = __stop_ul_callsites;
+
+  if (ul_unregister_callsites != NULL && start != stop)
+    ul_unregister_callsites (start, stop);
+}
 
 void ul_legacy_syslog (int priority, const char *msg_format, ...);
 void ul_legacy_vsyslog (int priority, const char *msg_format, va_list ap);
@@ -3,7 +3,14 @@
 #include "umberlog.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <pthread.h>
 
 static inline struct timespec
 ts_diff (struct timespec start, struct timespec end)
@@ -57,6 +64,592 @@ test_perf_simple (int flags, unsigned long cnt)
           dt.tv_sec, dt.tv_nsec);
 }
 
+static inline void
+test_perf_timestamp (int mode, const char *name, unsigned long cnt)
+{
+  char *msg;
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  ul_openlog ("umberlog/test_perf_timestamp", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_timestamp_mode (mode);
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    {
+      msg = ul_format (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__, NULL);
+      free (msg);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  ul_set_timestamp_mode (LOG_UL_TIME_LOCAL);
+  ul_closelog ();
+
+  dt = ts_diff (st, et);
+
+  printf ("# test_perf_timestamp(%s, %lu): %lu.%09lus\n",
+          name, cnt, dt.tv_sec, dt.tv_nsec);
+}
+
+/* Keys for test_perf_fields(): every record takes its keys from a
+   different slice of the pool, so none of them are ever found in the
+   key cache. */
+#define KEY_POOL_SIZE 8192
+
+static const char *key_pool[KEY_POOL_SIZE];
+
+static void
+key_pool_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < KEY_POOL_SIZE; i++)
+    {
+      char key[16];
+
+      snprintf (key, sizeof (key), "field%d", (int)(i % 20));
+      key_pool[i] = strdup (key);
+    }
+}
+
+#define K(n) (literal ? "field" #n : key_pool[(base + n) % KEY_POOL_SIZE])
+
+#define FIELDS10(a, b, c, d, e, f, g, h, i, j) \
+  K (a), "%s", "value", K (b), "%s", "value", K (c), "%s", "value", \
+  K (d), "%s", "value", K (e), "%s", "value", K (f), "%s", "value", \
+  K (g), "%s", "value", K (h), "%s", "value", K (i), "%s", "value", \
+  K (j), "%s", "value"
+
+static inline double
+test_perf_fields_run (int nfields, int literal, unsigned long cnt)
+{
+  char *msg;
+  unsigned long i, base = 0;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    {
+      if (nfields == 10)
+        msg = ul_format (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+                         FIELDS10 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9),
+                         NULL);
+      else
+        msg = ul_format (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+                         FIELDS10 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9),
+                         FIELDS10 (10, 11, 12, 13, 14, 15, 16, 17, 18, 19),
+                         NULL);
+      free (msg);
+      base += nfields;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+static inline void
+test_perf_fields (int nfields, unsigned long cnt)
+{
+  double cached, uncached;
+
+  ul_openlog ("umberlog/test_perf_fields", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_NOIMPLICIT);
+
+  uncached = test_perf_fields_run (nfields, 0, cnt);
+  cached = test_perf_fields_run (nfields, 1, cnt);
+
+  ul_closelog ();
+
+  printf ("# test_perf_fields(%d, %lu): %.1fns/record cached, "
+          "%.1fns/record uncached, %.2fns/field gain\n",
+          nfields, cnt, cached / cnt, uncached / cnt,
+          (uncached - cached) / cnt / nfields);
+}
+
+static void
+discard_output (int priority, const char *msg, void *user_data)
+{
+  (void)priority;
+  (void)msg;
+  (void)user_data;
+}
+
+static inline double
+test_perf_async_run (unsigned long cnt)
+{
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &st);
+  for (i = 0; i < cnt; i++)
+    ul_syslog (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+               "count", "%lu", i,
+               NULL);
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* CPU time spent in the calling thread, with formatting done in the
+   calling thread, and deferred to the background thread. CPU time,
+   because the background thread may well share the CPU with us. */
+static inline void
+test_perf_async (unsigned long cnt)
+{
+  double sync, async;
+
+  ul_openlog ("umberlog/test_perf_async", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_output_handler (discard_output, NULL);
+
+  sync = test_perf_async_run (cnt);
+  ul_set_async (64 * 1024 * 1024);
+  async = test_perf_async_run (cnt);
+  ul_set_async (0);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  printf ("# test_perf_async(%lu): %.1fns/record sync, "
+          "%.1fns/record async\n", cnt, sync / cnt, async / cnt);
+}
+
+static struct timespec lanes_err_sent, lanes_last_sent;
+
+static void
+lanes_output (int priority, const char *msg, void *user_data)
+{
+  (void)msg;
+  (void)user_data;
+
+  clock_gettime (CLOCK_MONOTONIC, &lanes_last_sent);
+  if (LOG_PRI (priority) == LOG_ERR)
+    lanes_err_sent = lanes_last_sent;
+}
+
+/* Time it takes for an error to be sent, when it is logged after a
+   flood of debug messages that are still queued, compared to the time
+   it takes to send the flood itself. */
+static inline void
+test_perf_lanes (unsigned long cnt, int rounds)
+{
+  struct timespec st, dt;
+  double err = 0, err_max = 0, flood = 0, t;
+  unsigned long i;
+  int r;
+
+  ul_openlog ("umberlog/test_perf_lanes", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_output_handler (lanes_output, NULL);
+
+  for (r = 0; r < rounds; r++)
+    {
+      ul_set_async (64 * 1024 * 1024);
+      for (i = 0; i < cnt; i++)
+        ul_syslog (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+                   "count", "%lu", i,
+                   NULL);
+      clock_gettime (CLOCK_MONOTONIC, &st);
+      ul_syslog (LOG_ERR, "urgent", NULL);
+      ul_set_async (0);
+
+      dt = ts_diff (st, lanes_err_sent);
+      t = dt.tv_sec * 1e9 + dt.tv_nsec;
+      err += t;
+      if (t > err_max)
+        err_max = t;
+      dt = ts_diff (st, lanes_last_sent);
+      flood += dt.tv_sec * 1e9 + dt.tv_nsec;
+    }
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  printf ("# test_perf_lanes(%lu, %d): %.1fus/error average, "
+          "%.1fus/error max, %.1fus to drain the backlog\n", cnt, rounds,
+          err / rounds / 1000, err_max / 1000, flood / rounds / 1000);
+}
+
+static size_t json_bytes;
+
+static void
+count_output (int priority, const char *msg, void *user_data)
+{
+  (void)priority;
+  (void)user_data;
+
+  json_bytes += strlen ("@cee:") + strlen (msg);
+}
+
+static inline double
+test_perf_binary_log_run (unsigned long cnt)
+{
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    ul_syslog (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+               "count", "%lu", i,
+               "status", "%s", "ok",
+               NULL);
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* Time and bytes per record, formatted to JSON, and written to a
+   binary log instead. */
+static inline void
+test_perf_binary_log (unsigned long cnt)
+{
+  char path[] = "/tmp/umberlog-perf-XXXXXX";
+  double json, binary;
+  struct stat st;
+  int fd;
+
+  fd = mkstemp (path);
+  if (fd == -1)
+    return;
+  close (fd);
+
+  ul_openlog ("umberlog/test_perf_binary_log", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_output_handler (count_output, NULL);
+
+  json_bytes = 0;
+  json = test_perf_binary_log_run (cnt);
+  ul_set_binary_log (path);
+  binary = test_perf_binary_log_run (cnt);
+  ul_set_binary_log (NULL);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  if (stat (path, &st) == 0)
+    printf ("# test_perf_binary_log(%lu): %.1fns/record json, "
+            "%.1fns/record binary, %.1f bytes/record json, "
+            "%.1f bytes/record binary\n", cnt, json / cnt, binary / cnt,
+            (double)json_bytes / cnt, (double)st.st_size / cnt);
+  unlink (path);
+}
+
+static void *
+batch_reader (void *data)
+{
+  char buf[4096];
+
+  while (recv (*(int *)data, buf, sizeof (buf), 0) > 0)
+    ;
+  return NULL;
+}
+
+static inline double
+test_perf_batch_run (unsigned long cnt, size_t batch)
+{
+  static const char *const keys[] = { "count" };
+  ul_record_t records[100];
+  char values[100][24];
+  const char *value_ptrs[100];
+  struct timespec st, et, dt;
+  unsigned long i;
+  size_t j;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i += batch)
+    {
+      if (batch == 1)
+        {
+          ul_syslog (LOG_INFO, "hello, I'm test_perf_batch!",
+                     "count", "%lu", i,
+                     NULL);
+          continue;
+        }
+      for (j = 0; j < batch; j++)
+        {
+          snprintf (values[j], sizeof (values[j]), "%lu", i + j);
+          value_ptrs[j] = values[j];
+          records[j].priority = LOG_INFO;
+          records[j].msg = "hello, I'm test_perf_batch!";
+          records[j].keys = keys;
+          records[j].values = &value_ptrs[j];
+          records[j].nfields = 1;
+        }
+      ul_syslog_batch (records, batch);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* Time per record sent to the syslog socket, one at a time, and in
+   batches of a hundred. */
+static inline void
+test_perf_batch (unsigned long cnt)
+{
+  char dir[] = "/tmp/umberlog-perf-XXXXXX";
+  char path[PATH_MAX];
+  struct sockaddr_un sun;
+  double single, batched;
+  pthread_t reader;
+  int fd;
+
+  if (mkdtemp (dir) == NULL)
+    return;
+  snprintf (path, sizeof (path), "%s/log", dir);
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  if (fd == -1 || bind (fd, (struct sockaddr *)&sun, sizeof (sun)) != 0 ||
+      pthread_create (&reader, NULL, batch_reader, &fd) != 0)
+    goto out;
+
+  ul_openlog ("umberlog/test_perf_batch", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_syslog_socket (path, 1000);
+
+  single = test_perf_batch_run (cnt, 1);
+  batched = test_perf_batch_run (cnt, 100);
+
+  ul_set_syslog_socket (NULL, -1);
+  ul_closelog ();
+  shutdown (fd, SHUT_RDWR);
+  pthread_join (reader, NULL);
+
+  printf ("# test_perf_batch(%lu): %.1fns/record single, "
+          "%.1fns/record in batches of 100\n", cnt, single / cnt,
+          batched / cnt);
+
+ out:
+  if (fd != -1)
+    close (fd);
+  unlink (path);
+  rmdir (dir);
+}
+
+static inline double
+test_perf_template_run (ul_template_t *template, unsigned long cnt)
+{
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    {
+      if (template)
+        ul_syslog_t (template, "10.0.0.1:4242", 17, "10.0.0.1", i,
+                     "closed");
+      else
+        ul_syslog (LOG_DEBUG, "conn %s closed after %d ms",
+                   "10.0.0.1:4242", 17,
+                   "peer", "%s", "10.0.0.1",
+                   "bytes", "%lu", i,
+                   "state", "%s", "closed",
+                   NULL);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* The same message, with the format parsed on every call, and compiled
+   in advance. */
+static inline void
+test_perf_template (unsigned long cnt)
+{
+  ul_template_t *template;
+  double parsed, compiled;
+
+  ul_openlog ("umberlog/test_perf_template", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_output_handler (discard_output, NULL);
+
+  template = ul_compile (LOG_DEBUG, "conn %s closed after %d ms",
+                         "peer", "%s",
+                         "bytes", "%lu",
+                         "state", "%s",
+                         NULL);
+  parsed = test_perf_template_run (NULL, cnt);
+  compiled = test_perf_template_run (template, cnt);
+  ul_template_free (template);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  printf ("# test_perf_template(%lu): %.1fns/record parsed, "
+          "%.1fns/record compiled\n", cnt, parsed / cnt, compiled / cnt);
+}
+
+static inline double
+test_perf_callsite_run (unsigned long cnt)
+{
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    UL_SYSLOG (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+               "count", "%lu", i,
+               NULL);
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* The cost of a call site turned off, against one logging. */
+static inline void
+test_perf_callsite (unsigned long cnt)
+{
+  double enabled, disabled;
+
+  ul_openlog ("umberlog/test_perf_callsite", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_output_handler (discard_output, NULL);
+
+  enabled = test_perf_callsite_run (cnt);
+  ul_set_callsite (__FILE__, 0, 0);
+  disabled = test_perf_callsite_run (cnt);
+  ul_set_callsite (__FILE__, 0, 1);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  printf ("# test_perf_callsite(%lu): %.1fns/record enabled, "
+          "%.2fns/record disabled\n", cnt, enabled / cnt, disabled / cnt);
+}
+
+static inline double
+test_perf_stats_run (unsigned long cnt)
+{
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    ul_syslog (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__,
+               "count", "%lu", i,
+               NULL);
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* The cost of counting for ulstat(1). */
+static inline void
+test_perf_stats (unsigned long cnt)
+{
+  double off, on;
+
+  ul_openlog ("umberlog/test_perf_stats", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_set_output_handler (discard_output, NULL);
+
+  off = test_perf_stats_run (cnt);
+  ul_set_stats_export (100);
+  on = test_perf_stats_run (cnt);
+  ul_set_stats_export (0);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  printf ("# test_perf_stats(%lu): %.1fns/record without export, "
+          "%.1fns/record with\n", cnt, off / cnt, on / cnt);
+}
+
+static inline double
+test_perf_implicit_run (int fields, unsigned long cnt)
+{
+  char *msg;
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  ul_set_implicit_fields (fields);
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  for (i = 0; i < cnt; i++)
+    {
+      msg = ul_format (LOG_DEBUG, "hello, I'm %s!", __FUNCTION__, NULL);
+      free (msg);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* Every implicit field, against only the priority and timestamp. */
+static inline void
+test_perf_implicit (unsigned long cnt)
+{
+  double all, some;
+
+  ul_openlog ("umberlog/test_perf_implicit", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_NOCACHE);
+
+  all = test_perf_implicit_run (LOG_UL_FIELD_ALL, cnt);
+  some = test_perf_implicit_run (LOG_UL_FIELD_PRIORITY |
+                               LOG_UL_FIELD_TIMESTAMP, cnt);
+  ul_set_implicit_fields (LOG_UL_FIELD_ALL);
+
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_closelog ();
+
+  printf ("# test_perf_implicit(%lu, nocache): %.1fns/record all fields, "
+          "%.1fns/record priority and timestamp\n", cnt, all / cnt,
+          some / cnt);
+}
+
+#define LEGACY_FORMAT "%s: request %lu took %.3fms, status %03d, path %-12s"
+#define LEGACY_ARGS __FUNCTION__, i, 1.25 * (i % 100), 200, "/index.html"
+
+static inline double
+test_perf_legacy_run (int legacy, unsigned long cnt)
+{
+  unsigned long i;
+  struct timespec st, et, dt;
+
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  if (legacy)
+    for (i = 0; i < cnt; i++)
+      ul_legacy_syslog (LOG_DEBUG, LEGACY_FORMAT, LEGACY_ARGS);
+  else
+    for (i = 0; i < cnt; i++)
+      ul_syslog (LOG_DEBUG, LEGACY_FORMAT, LEGACY_ARGS, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &et);
+
+  dt = ts_diff (st, et);
+  return dt.tv_sec * 1e9 + dt.tv_nsec;
+}
+
+/* A legacy syslog() call, which has its message printed straight into
+   the buffer, against the same message with key-value pairs possibly
+   following it, which needs the arguments stepped over. */
+static inline void
+test_perf_legacy (unsigned long cnt)
+{
+  double legacy, pairs;
+
+  ul_openlog ("umberlog/test_perf_legacy", 0, LOG_LOCAL0);
+  ul_set_output_handler (discard_output, NULL);
+
+  legacy = test_perf_legacy_run (1, cnt);
+  pairs = test_perf_legacy_run (0, cnt);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+
+  printf ("# test_perf_legacy(%lu): %.1fns/record legacy, "
+          "%.1fns/record with pairs\n", cnt, legacy / cnt, pairs / cnt);
+}
+
 int
 main (void)
 {
@@ -69,5 +662,31 @@ main (void)
   test_perf_simple (LOG_UL_NOTIME, 100000);
   test_perf_simple (LOG_UL_NOTIME, 1000000);
 
+  test_perf_timestamp (LOG_UL_TIME_LOCAL, "local", 1000000);
+  test_perf_timestamp (LOG_UL_TIME_UTC, "utc", 1000000);
+  test_perf_timestamp (LOG_UL_TIME_EPOCH_NS, "epoch-ns", 1000000);
+  test_perf_timestamp (LOG_UL_TIME_EPOCH_NS | LOG_UL_TIME_COARSE,
+                       "epoch-ns-coarse", 1000000);
+
+  key_pool_init ();
+  test_perf_fields (10, 100000);
+  test_perf_fields (20, 100000);
+
+  test_perf_async (100000);
+  test_perf_lanes (10000, 20);
+
+  test_perf_binary_log (100000);
+
+  test_perf_batch (100000);
+
+  test_perf_template (100000);
+
+  test_perf_callsite (1000000);
+
+  test_perf_stats (100000);
+
+  test_perf_implicit (100000);
+  test_perf_legacy (100000);
+
   return 0;
 }
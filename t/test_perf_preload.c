@@ -0,0 +1,339 @@
+#define _GNU_SOURCE 1
+
+/* The same syslog()-heavy workload, run with the stock syslog() of the
+   C library, and with libumberlog_preload preloaded, against a /dev/log
+   of our own: a datagram socket in a private mount namespace, read by
+   a thread that counts what arrives. This program is not linked with
+   libumberlog; it runs itself again to do the logging. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SKIP 77
+
+#define FORMAT_SIMPLE   0
+#define FORMAT_ARGS     1
+#define FORMAT_COMPLEX  2
+
+static const char *format_names[] = { "simple", "args", "complex" };
+
+/* The stand-in syslog daemon. */
+static struct
+{
+  int fd;
+  int stop;
+  unsigned long records;
+  unsigned long long bytes;
+} daemon_state;
+
+typedef struct
+{
+  pthread_t thread;
+  int format;
+  unsigned long count;
+  uint64_t *latency;
+} worker_t;
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+worker_run (void *data)
+{
+  worker_t *w = data;
+  unsigned long i;
+  uint64_t start;
+
+  for (i = 0; i < w->count; i++)
+    {
+      start = now_ns ();
+      switch (w->format)
+        {
+        case FORMAT_SIMPLE:
+          syslog (LOG_INFO, "connection accepted");
+          break;
+        case FORMAT_ARGS:
+          syslog (LOG_INFO, "user %s logged in from %s port %d",
+                  "alice", "192.0.2.1", 22);
+          break;
+        default:
+          syslog (LOG_NOTICE, "%s: request %lu/%u took %.3fms, "
+                  "status %03d, flags %#08x, path %-12s (%zu bytes)",
+                  "worker", i, 7U, 1.25 * (i % 100), 200, 0x1f,
+                  "/index.html", (size_t)4096);
+          break;
+        }
+      w->latency[i] = now_ns () - start;
+    }
+
+  return NULL;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* The child: log COUNT messages from each of THREADS threads, and
+   print the wall time and the latency percentiles. */
+static int
+run_workload (int format, int threads, unsigned long count)
+{
+  worker_t *workers;
+  uint64_t *all, start, elapsed;
+  unsigned long total = count * threads;
+  int t;
+
+  openlog ("test_perf_preload", 0, LOG_LOCAL0);
+
+  workers = calloc (threads, sizeof (worker_t));
+  all = malloc (total * sizeof (uint64_t));
+  if (workers == NULL || all == NULL)
+    return 1;
+
+  start = now_ns ();
+  for (t = 0; t < threads; t++)
+    {
+      workers[t].format = format;
+      workers[t].count = count;
+      workers[t].latency = all + t * count;
+      if (pthread_create (&workers[t].thread, NULL, worker_run,
+                          &workers[t]) != 0)
+        return 1;
+    }
+  for (t = 0; t < threads; t++)
+    pthread_join (workers[t].thread, NULL);
+  elapsed = now_ns () - start;
+
+  closelog ();
+
+  qsort (all, total, sizeof (uint64_t), compare_u64);
+  printf ("%llu %llu %llu %llu\n", (unsigned long long)elapsed,
+          (unsigned long long)all[total / 2],
+          (unsigned long long)all[total * 99 / 100],
+          (unsigned long long)all[total * 999 / 1000]);
+
+  free (all);
+  free (workers);
+  return 0;
+}
+
+static int
+write_file (const char *path, const char *contents)
+{
+  int fd = open (path, O_WRONLY);
+  ssize_t len;
+
+  if (fd < 0)
+    return -1;
+  len = write (fd, contents, strlen (contents));
+  close (fd);
+  return (len == (ssize_t)strlen (contents)) ? 0 : -1;
+}
+
+/* Put a tmpfs over /dev in a mount namespace of our own, so that we
+   can have a /dev/log of our own without touching the real one. */
+static int
+private_dev (void)
+{
+  char map[64];
+  uid_t uid = getuid ();
+  gid_t gid = getgid ();
+
+  if (unshare (CLONE_NEWNS) != 0)
+    {
+      if (unshare (CLONE_NEWUSER | CLONE_NEWNS) != 0)
+        return -1;
+      write_file ("/proc/self/setgroups", "deny");
+      snprintf (map, sizeof (map), "0 %d 1", (int)uid);
+      if (write_file ("/proc/self/uid_map", map) != 0)
+        return -1;
+      snprintf (map, sizeof (map), "0 %d 1", (int)gid);
+      if (write_file ("/proc/self/gid_map", map) != 0)
+        return -1;
+    }
+
+  if (mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+      mount ("none", "/dev", "tmpfs", 0, NULL) != 0)
+    return -1;
+  return 0;
+}
+
+static void *
+daemon_run (void *data)
+{
+  char buffer[65536];
+  ssize_t len;
+
+  (void)data;
+
+  while (!__atomic_load_n (&daemon_state.stop, __ATOMIC_RELAXED))
+    {
+      len = recv (daemon_state.fd, buffer, sizeof (buffer), 0);
+      if (len <= 0)
+        continue;
+      __atomic_fetch_add (&daemon_state.records, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add (&daemon_state.bytes, len, __ATOMIC_RELAXED);
+    }
+
+  return NULL;
+}
+
+static int
+daemon_start (pthread_t *thread)
+{
+  struct sockaddr_un sun;
+  struct timeval tv = { 0, 100000 };
+  int size = 4 * 1024 * 1024;
+
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, "/dev/log");
+
+  daemon_state.fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  if (daemon_state.fd < 0 ||
+      bind (daemon_state.fd, (struct sockaddr *)&sun, sizeof (sun)) != 0)
+    return -1;
+  setsockopt (daemon_state.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+  setsockopt (daemon_state.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+  return pthread_create (thread, NULL, daemon_run, NULL);
+}
+
+/* Run the workload in a child, with the library preloaded if PRELOAD
+   is set, and report on it. */
+static int
+test_perf_preload (const char *preload, int format, int threads,
+                   unsigned long count)
+{
+  char format_arg[16], threads_arg[16], count_arg[32], line[256];
+  unsigned long long elapsed, p50, p99, p999;
+  unsigned long records, expected = count * threads, waited;
+  unsigned long long bytes;
+  int fds[2], status;
+  FILE *in;
+  pid_t pid;
+
+  snprintf (format_arg, sizeof (format_arg), "%d", format);
+  snprintf (threads_arg, sizeof (threads_arg), "%d", threads);
+  snprintf (count_arg, sizeof (count_arg), "%lu", count);
+
+  records = __atomic_load_n (&daemon_state.records, __ATOMIC_RELAXED);
+  bytes = __atomic_load_n (&daemon_state.bytes, __ATOMIC_RELAXED);
+
+  if (pipe (fds) != 0)
+    return -1;
+  pid = fork ();
+  if (pid < 0)
+    return -1;
+  if (pid == 0)
+    {
+      dup2 (fds[1], STDOUT_FILENO);
+      close (fds[0]);
+      close (fds[1]);
+      if (preload != NULL)
+        setenv ("LD_PRELOAD", preload, 1);
+      else
+        unsetenv ("LD_PRELOAD");
+      execl ("/proc/self/exe", "test_perf_preload", "--run", format_arg,
+             threads_arg, count_arg, (char *)NULL);
+      _exit (127);
+    }
+
+  close (fds[1]);
+  in = fdopen (fds[0], "r");
+  if (in == NULL || fgets (line, sizeof (line), in) == NULL ||
+      sscanf (line, "%llu %llu %llu %llu", &elapsed, &p50, &p99,
+              &p999) != 4)
+    elapsed = 0;
+  if (in != NULL)
+    fclose (in);
+  if (waitpid (pid, &status, 0) != pid || !WIFEXITED (status) ||
+      WEXITSTATUS (status) != 0 || elapsed == 0)
+    return -1;
+
+  /* Let the daemon catch up. */
+  for (waited = 0; waited < 2000 &&
+         __atomic_load_n (&daemon_state.records, __ATOMIC_RELAXED) -
+         records < expected; waited++)
+    usleep (1000);
+  records = __atomic_load_n (&daemon_state.records, __ATOMIC_RELAXED) -
+    records;
+  bytes = __atomic_load_n (&daemon_state.bytes, __ATOMIC_RELAXED) - bytes;
+
+  printf ("# test_perf_preload(%s, %s, %d thread%s): %.0f calls/s, "
+          "p50 %lluns, p99 %lluns, p99.9 %lluns, %.0f bytes/record, "
+          "%lu/%lu received\n",
+          preload ? "preload" : "glibc", format_names[format], threads,
+          threads > 1 ? "s" : "", expected * 1e9 / elapsed, p50, p99, p999,
+          records ? (double)bytes / records : 0.0, records, expected);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const int thread_counts[] = { 1, 4 };
+  const char *preload = UMBERLOG_PRELOAD;
+  pthread_t daemon_thread;
+  unsigned long count = 10000;
+  int format, t, status = 0;
+
+  if (argc == 5 && strcmp (argv[1], "--run") == 0)
+    return run_workload (atoi (argv[2]), atoi (argv[3]),
+                         strtoul (argv[4], NULL, 10));
+
+  if (private_dev () != 0 || daemon_start (&daemon_thread) != 0)
+    {
+      printf ("# test_perf_preload: cannot set up a private /dev/log "
+              "(%s), skipping\n", strerror (errno));
+      return SKIP;
+    }
+  if (access (preload, R_OK) != 0)
+    {
+      printf ("# test_perf_preload: %s not found, skipping\n", preload);
+      preload = NULL;
+      status = SKIP;
+    }
+
+  for (format = FORMAT_SIMPLE; format <= FORMAT_COMPLEX; format++)
+    for (t = 0; t < (int)(sizeof (thread_counts) / sizeof (int)); t++)
+      {
+        if (test_perf_preload (NULL, format, thread_counts[t], count) != 0)
+          status = 1;
+        if (preload != NULL &&
+            test_perf_preload (preload, format, thread_counts[t],
+                               count) != 0)
+          status = 1;
+      }
+
+  __atomic_store_n (&daemon_state.stop, 1, __ATOMIC_RELAXED);
+  pthread_join (daemon_thread, NULL);
+  close (daemon_state.fd);
+
+  return status;
+}
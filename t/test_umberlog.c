@@ -7,11 +7,27 @@
 #include <json.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
 
 #include <check.h>
 
@@ -308,62 +324,2465 @@ START_TEST (test_discover_priority)
 END_TEST
 
 /**
- * Test for correct JSON escaping.
+ * Test that the cached pid is refreshed in a forked child.
  */
-START_TEST (test_json_escape)
+START_TEST (test_fork_pid)
 {
-  static const char control_chars[] =
-    "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
-    "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f"
-    "\x20";
+  char *msg, *pid;
+  char buf[4096];
+  struct json_object *jo;
+  int fds[2], status;
+  pid_t child;
+  ssize_t len;
+
+  ul_openlog ("umberlog/test_fork_pid", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+
+  ck_assert (pipe (fds) == 0);
+
+  child = fork ();
+  ck_assert (child != -1);
+  if (child == 0)
+    {
+      close (fds[0]);
+      msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
+      if (write (fds[1], msg, strlen (msg)) != (ssize_t)strlen (msg))
+        _exit (1);
+      _exit (0);
+    }
+
+  close (fds[1]);
+  len = read (fds[0], buf, sizeof (buf) - 1);
+  close (fds[0]);
+  ck_assert (waitpid (child, &status, 0) == child);
+  ck_assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  ck_assert (len > 0);
+  buf[len] = '\0';
+
+  jo = parse_msg (buf);
+
+  if (asprintf (&pid, "%d", child) == -1)
+    abort ();
+  verify_value (jo, "pid", pid);
+  free (pid);
+
+  json_object_put (jo);
+
+  ul_closelog ();
+}
+END_TEST
 
+/**
+ * Test the opt-in per-thread fields.
+ */
+START_TEST (test_thread_info)
+{
   char *msg;
   struct json_object *jo;
+  unsigned long seq;
 
-  ul_openlog ("umberlog/test_json_escape", 0, LOG_LOCAL0);
+  ul_openlog ("umberlog/test_thread_info", 0, LOG_LOCAL0);
 
-  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__,
-                   "quotes", "Hi, \"quoted value\" speaking!",
-                   "\"really\"", "yeah",
-                   "control", "foo\nbar",
-                   "utf8", "Árvíztűrő tükörfúrógép",
-                   "junk", "\013foo",
-                   "all_control", control_chars,
-                   NULL);
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
   jo = parse_msg (msg);
   free (msg);
 
-  verify_value (jo, "quotes", "Hi, \"quoted value\" speaking!");
-  verify_value (jo, "\"really\"", "yeah");
-  verify_value (jo, "control", "foo\nbar");
-  verify_value (jo, "utf8", "Árvíztűrő tükörfúrógép");
-  verify_value (jo, "junk", "\013foo");
-  verify_value (jo, "all_control", control_chars);
+  verify_value_missing (jo, "tid");
+  verify_value_missing (jo, "seq");
+
+  json_object_put (jo);
+
+  ul_set_log_flags (LOG_UL_THREADINFO);
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  ck_assert (ul_set_thread_name ("ul-test") == 0);
+#endif
+
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+#ifdef SYS_gettid
+  {
+    char *tid;
+
+    if (asprintf (&tid, "%ld", (long)syscall (SYS_gettid)) == -1)
+      abort ();
+    verify_value (jo, "tid", tid);
+    free (tid);
+  }
+#endif
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  verify_value (jo, "thread", "ul-test");
+#endif
+  verify_value_exists (jo, "pid");
+  verify_value_exists (jo, "seq");
+  seq = strtoul (json_object_get_string (json_object_object_get (jo, "seq")),
+                 NULL, 10);
+
+  json_object_put (jo);
+
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+  ck_assert (strtoul (json_object_get_string (json_object_object_get (jo, "seq")),
+                      NULL, 10) == seq + 1);
 
   json_object_put (jo);
 
+  ul_set_log_flags (LOG_UL_ALL);
   ul_closelog ();
 }
 END_TEST
 
 /**
- * Test that using a FACILITY | PRIORITY combo with ul_format has the
- * desired result.
+ * Test the various timestamp modes.
  */
-START_TEST (test_facprio)
+START_TEST (test_timestamp_modes)
 {
   char *msg;
+  const char *stamp;
   struct json_object *jo;
+  unsigned long long value, now;
 
-  msg = ul_format (LOG_LOCAL1 | LOG_DEBUG, "%s", __FUNCTION__,
-                   NULL);
+  ul_openlog ("umberlog/test_timestamp_modes", 0, LOG_LOCAL0);
+
+  ck_assert (ul_set_timestamp_mode (LOG_UL_TIME_UTC) == 0);
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
   jo = parse_msg (msg);
   free (msg);
 
-  verify_value (jo, "facility", "local1");
+  stamp = json_object_get_string (json_object_object_get (jo, "timestamp"));
+  ck_assert (stamp != NULL);
+  /* YYYY-MM-DDTHH:MM:SS.nnnnnnnnnZ */
+  ck_assert_int_eq (strlen (stamp), 30);
+  ck_assert (stamp[10] == 'T' && stamp[19] == '.' && stamp[29] == 'Z');
+
+  json_object_put (jo);
+
+  ck_assert (ul_set_timestamp_mode (LOG_UL_TIME_EPOCH_S |
+                                    LOG_UL_TIME_COARSE) == 0);
+  now = time (NULL);
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+  ck_assert (json_object_get_type (json_object_object_get (jo, "timestamp"))
+             == json_type_int);
+  value = strtoull (json_object_get_string (json_object_object_get (jo, "timestamp")),
+                    NULL, 10);
+  ck_assert (value >= now - 1 && value <= now + 1);
+
+  json_object_put (jo);
+
+  ck_assert (ul_set_timestamp_mode (LOG_UL_TIME_EPOCH_NS) == 0);
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__, NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+  value = strtoull (json_object_get_string (json_object_object_get (jo, "timestamp")),
+                    NULL, 10);
+  ck_assert (value / 1000000000ULL >= now - 1 &&
+             value / 1000000000ULL <= now + 1);
+
+  json_object_put (jo);
+
+  ck_assert (ul_set_timestamp_mode (42) == -1);
+
+  ck_assert (ul_set_timestamp_mode (LOG_UL_TIME_LOCAL) == 0);
+  ul_closelog ();
+}
+END_TEST
+
+/* Messages captured by capture_output(). */
+#define MAX_CAPTURED 64
+
+static char *captured[MAX_CAPTURED];
+static int captured_prio[MAX_CAPTURED];
+static int ncaptured;
+
+static void
+capture_output (int priority, const char *message, void *user_data)
+{
+  (void)user_data;
+
+  if (ncaptured < MAX_CAPTURED)
+    {
+      captured_prio[ncaptured] = priority;
+      captured[ncaptured++] = strdup (message);
+    }
+}
+
+static void
+capture_reset (void)
+{
+  while (ncaptured > 0)
+    free (captured[--ncaptured]);
+}
+
+/**
+ * Test per-call-site rate limiting, and the summary of suppressed
+ * messages.
+ */
+START_TEST (test_rate_limit)
+{
+  struct json_object *jo;
+  int i;
+
+  ul_openlog ("umberlog/test_rate_limit", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ul_set_rate_limit (20, 3);
+
+  for (i = 0; i < 10; i++)
+    {
+      ul_syslog (LOG_INFO, "flood %d", i, NULL);
+      if (i == 0)
+        ul_syslog (LOG_INFO, "another site", NULL);
+    }
+
+  ck_assert_int_eq (ncaptured, 4);
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "flood 0");
+  json_object_put (jo);
+  jo = parse_msg (captured[1]);
+  verify_value (jo, "msg", "another site");
+  json_object_put (jo);
+  jo = parse_msg (captured[3]);
+  verify_value (jo, "msg", "flood 2");
+  json_object_put (jo);
+  capture_reset ();
+
+  /* Wait for the bucket to get a token back. */
+  usleep (100000);
+  ul_syslog (LOG_INFO, "flood %d", 10, NULL);
+
+  ck_assert_int_eq (ncaptured, 2);
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "suppressed", "7");
+  verify_value (jo, "suppressed_format", "flood %d");
+  json_object_put (jo);
+  jo = parse_msg (captured[1]);
+  verify_value (jo, "msg", "flood 10");
+  json_object_put (jo);
+  capture_reset ();
+
+  ul_set_rate_limit (0, 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that a site that stops logging still gets its suppressed
+ * messages summarized.
+ */
+START_TEST (test_rate_limit_quiet)
+{
+  static const char quiet_format[] = "goes quiet %d";
+  struct json_object *jo;
+  int i;
+
+  ul_openlog ("umberlog/test_rate_limit_quiet", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ul_set_rate_limit (1, 2);
+
+  for (i = 0; i < 5; i++)
+    ul_syslog (LOG_WARNING, quiet_format, i, NULL);
+  ck_assert_int_eq (ncaptured, 2);
+
+  /* Swept once with the count seen, summarized on the next sweep. */
+  for (i = 0; i < 40 && __atomic_load_n (&ncaptured, __ATOMIC_ACQUIRE) < 3;
+       i++)
+    usleep (100000);
+
+  ck_assert_int_eq (ncaptured, 3);
+  ck_assert_int_eq (captured_prio[2], LOG_WARNING);
+  jo = parse_msg (captured[2]);
+  verify_value (jo, "suppressed", "3");
+  verify_value (jo, "suppressed_format", quiet_format);
+  json_object_put (jo);
+  capture_reset ();
+
+  ul_set_rate_limit (0, 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that the summary of a site that went quiet does not need its
+ * format any more, as a dynamic one may have been freed by then.
+ */
+START_TEST (test_rate_limit_quiet_freed)
+{
+  static const char text[] = "freed format %d";
+  struct json_object *jo;
+  char *format;
+  int i;
+
+  ul_openlog ("umberlog/test_rate_limit_quiet_freed", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ul_set_rate_limit (1, 2);
+
+  format = strdup (text);
+  ck_assert (format != NULL);
+  for (i = 0; i < 5; i++)
+    ul_syslog (LOG_WARNING, format, i, NULL);
+  ck_assert_int_eq (ncaptured, 2);
+  memset (format, 'x', strlen (format));
+  free (format);
+
+  for (i = 0; i < 40 && __atomic_load_n (&ncaptured, __ATOMIC_ACQUIRE) < 3;
+       i++)
+    usleep (100000);
+
+  ck_assert_int_eq (ncaptured, 3);
+  jo = parse_msg (captured[2]);
+  verify_value (jo, "suppressed", "3");
+  verify_value (jo, "suppressed_format", text);
+  json_object_put (jo);
+  capture_reset ();
+
+  ul_set_rate_limit (0, 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test per-priority and per-call-site sampling.
+ */
+START_TEST (test_sampling)
+{
+  static const char site_format[] = "site override";
+  struct json_object *jo;
+  int i, kept = 0;
+
+  ul_openlog ("umberlog/test_sampling", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ck_assert (ul_set_sample_rate (LOG_DEBUG, 4) == 0);
+  ck_assert (ul_set_sample_rate (LOG_DEBUG + 1, 4) == -1);
+
+  for (i = 0; i < 4000; i++)
+    {
+      ul_syslog (LOG_DEBUG, "sampled", NULL);
+      if (ncaptured > 0)
+        {
+          jo = parse_msg (captured[0]);
+          verify_value (jo, "sample_rate", "4");
+          json_object_put (jo);
+          kept++;
+          capture_reset ();
+        }
+    }
+  ck_assert_msg (kept > 800 && kept < 1200, "kept %d of 4000", kept);
+
+  /* Other priorities are not affected. */
+  ul_syslog (LOG_INFO, "not sampled", NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  jo = parse_msg (captured[0]);
+  verify_value_missing (jo, "sample_rate");
+  json_object_put (jo);
+  capture_reset ();
+
+  /* Call sites may override the rate of their priority. */
+  ck_assert (ul_set_site_sample_rate (site_format, 1) == 0);
+  for (i = 0; i < 10; i++)
+    ul_syslog (LOG_DEBUG, site_format, NULL);
+  ck_assert_int_eq (ncaptured, 10);
+  capture_reset ();
+
+  ul_set_sample_rate (LOG_DEBUG, 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test the flight recorder: low priority messages are only sent when
+ * an error is logged, or when flushed explicitly.
+ */
+START_TEST (test_flight_recorder)
+{
+  struct json_object *jo;
+  char expected[32];
+  int i;
+
+  ul_openlog ("umberlog/test_flight_recorder", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ck_assert (ul_set_flight_recorder (LOG_NOTICE, 16384) == 0);
+
+  ul_syslog (LOG_DEBUG, "debug %d", 1, NULL);
+  ul_syslog (LOG_INFO, "info %d", 2, NULL);
+  ul_syslog (LOG_NOTICE, "notice %d", 3, NULL);
+  ck_assert_int_eq (ncaptured, 1);
+
+  ul_syslog (LOG_ERR, "error %d", 4, NULL);
+  ck_assert_int_eq (ncaptured, 4);
+
+  jo = parse_msg (captured[1]);
+  verify_value (jo, "msg", "debug 1");
   verify_value (jo, "priority", "debug");
+  json_object_put (jo);
+  ck_assert_int_eq (LOG_PRI (captured_prio[1]), LOG_DEBUG);
+  jo = parse_msg (captured[2]);
+  verify_value (jo, "msg", "info 2");
+  json_object_put (jo);
+  jo = parse_msg (captured[3]);
+  verify_value (jo, "msg", "error 4");
+  json_object_put (jo);
+  capture_reset ();
+
+  /* The ring is bounded: the oldest messages are dropped, the newest
+     are kept, in order. */
+  ck_assert (ul_set_flight_recorder (LOG_NOTICE, 2048) == 0);
+  for (i = 0; i < 100; i++)
+    ul_syslog (LOG_DEBUG, "debug %d", i, NULL);
+  ck_assert_int_eq (ncaptured, 0);
+
+  ul_flight_recorder_flush ();
+  ck_assert (ncaptured > 0 && ncaptured < 100);
+  for (i = 0; i < ncaptured; i++)
+    {
+      snprintf (expected, sizeof (expected), "debug %d",
+                100 - ncaptured + i);
+      jo = parse_msg (captured[i]);
+      verify_value (jo, "msg", expected);
+      json_object_put (jo);
+    }
+  capture_reset ();
+
+  ul_flight_recorder_flush ();
+  ck_assert_int_eq (ncaptured, 0);
+
+  ul_set_flight_recorder (LOG_DEBUG, 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+START_TEST (test_templates)
+{
+  ul_template_t *template;
+  struct json_object *jo;
+  char expected[128];
+  int i;
+
+  ul_openlog ("umberlog/test_templates", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  template = ul_compile (LOG_NOTICE, "conn %s closed after %d ms (%5.1f%%)",
+                         "peer", "%s",
+                         "bytes", "%zu",
+                         "delta", "%ld",
+                         "unsigned", "%u",
+                         "flags", "%#x",
+                         "error", "%m",
+                         "plain", "\"no\" conversions\n",
+                         NULL);
+  ck_assert (template != NULL);
+
+  errno = ENOENT;
+  ck_assert (ul_syslog_t (template, "a\"b", -12, 99.5, "host\t1",
+                          (size_t)1234, LONG_MIN, -1, 255u) == 0);
+  ck_assert (ul_syslog_t (template, NULL, INT_MIN, 0.0, "x",
+                          (size_t)0, 0L, 0, 0u) == 0);
+  ck_assert_int_eq (ncaptured, 2);
+
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "conn a\"b closed after -12 ms ( 99.5%)");
+  verify_value (jo, "peer", "host\t1");
+  verify_value (jo, "bytes", "1234");
+  snprintf (expected, sizeof (expected), "%ld", LONG_MIN);
+  verify_value (jo, "delta", expected);
+  snprintf (expected, sizeof (expected), "%u", UINT_MAX);
+  verify_value (jo, "unsigned", expected);
+  verify_value (jo, "flags", "0xff");
+  verify_value (jo, "error", strerror (ENOENT));
+  verify_value (jo, "plain", "\"no\" conversions\n");
+  verify_value (jo, "facility", "local0");
+  verify_value (jo, "priority", "notice");
+  verify_value (jo, "program", "umberlog/test_templates");
+  verify_value_exists (jo, "timestamp");
+  json_object_put (jo);
+
+  jo = parse_msg (captured[1]);
+  snprintf (expected, sizeof (expected),
+            "conn (null) closed after %d ms (  0.0%%)", INT_MIN);
+  verify_value (jo, "msg", expected);
+  verify_value (jo, "flags", "0");
+  json_object_put (jo);
+  capture_reset ();
+
+  /* The mask applies as usual. */
+  ul_setlogmask (LOG_UPTO (LOG_WARNING));
+  ck_assert (ul_syslog_t (template, "a", 1, 1.0, "b", (size_t)1, 1L, 1,
+                          1u) == 0);
+  ck_assert_int_eq (ncaptured, 0);
+  ul_setlogmask (LOG_UPTO (LOG_DEBUG));
+  ul_template_free (template);
+
+  /* Deferred formatting may outlive the template. */
+  template = ul_compile (LOG_INFO, "message %d", "name", "%.3s", NULL);
+  ck_assert (template != NULL);
+  ck_assert (ul_set_async (65536) == 0);
+  for (i = 0; i < 10; i++)
+    ck_assert (ul_syslog_t (template, i, "abcdef") == 0);
+  ul_template_free (template);
+  ck_assert (ul_set_async (0) == 0);
+  ck_assert_int_eq (ncaptured, 10);
+  for (i = 0; i < 10; i++)
+    {
+      snprintf (expected, sizeof (expected), "message %d", i);
+      jo = parse_msg (captured[i]);
+      verify_value (jo, "msg", expected);
+      verify_value (jo, "name", "abc");
+      json_object_put (jo);
+    }
+  capture_reset ();
+
+  /* Formats that cannot be compiled. */
+  errno = 0;
+  ck_assert (ul_compile (LOG_INFO, "%n", NULL) == NULL);
+  ck_assert_int_eq (errno, EINVAL);
+  errno = 0;
+  ck_assert (ul_compile (LOG_INFO, "msg", "key", NULL, NULL) == NULL);
+  ck_assert_int_eq (errno, EINVAL);
+  errno = 0;
+  ck_assert (ul_syslog_t (NULL) == -1);
+  ck_assert_int_eq (errno, EINVAL);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+static int callsite_evaluated;
+
+static int
+callsite_arg (void)
+{
+  callsite_evaluated++;
+  return 42;
+}
+
+static void
+callsite_log (void)
+{
+  UL_SYSLOG (LOG_INFO, "callsite %d", callsite_arg (),
+             "extra", "%s", "value",
+             NULL);
+}
+
+static int
+callsite_find (ul_callsite_t *site, void *user_data)
+{
+  ul_callsite_t **found = (ul_callsite_t **)user_data;
+
+  if (strcmp (site->function, "callsite_log") != 0)
+    return 0;
+  *found = site;
+  return 1;
+}
+
+START_TEST (test_callsites)
+{
+  ul_callsite_t *site = NULL;
+  struct json_object *jo;
+  unsigned long hits;
+  int evaluated;
+  char line[16];
+
+  ul_openlog ("umberlog/test_callsites", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  /* Sites are known before they log anything. */
+  ck_assert_int_eq (ul_foreach_callsite (callsite_find, &site), 1);
+  ck_assert (site != NULL);
+  ck_assert (strstr (site->file, "test_umberlog.c") != NULL);
+  ck_assert_str_eq (site->format, "callsite %d");
+  snprintf (line, sizeof (line), "%u", site->line);
+  hits = site->hits;
+  evaluated = callsite_evaluated;
+
+  callsite_log ();
+  ck_assert_int_eq (ncaptured, 1);
+  ck_assert_int_eq (callsite_evaluated, evaluated + 1);
+  ck_assert_int_eq (site->hits, hits + 1);
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "callsite 42");
+  verify_value (jo, "extra", "value");
+  verify_value (jo, "file", site->file);
+  verify_value (jo, "line", line);
+  json_object_put (jo);
+  capture_reset ();
+
+  /* Disabled sites do not even evaluate their arguments. */
+  ck_assert_int_eq (ul_set_callsite ("test_umberlog.c", site->line, 0), 1);
+  callsite_log ();
+  ck_assert_int_eq (ncaptured, 0);
+  ck_assert_int_eq (callsite_evaluated, evaluated + 1);
+  ck_assert_int_eq (site->hits, hits + 1);
+  ck_assert_int_eq (ul_set_callsite ("no-such-file.c", 0, 1), 0);
+  ck_assert (ul_set_callsite (site->file, 0, 1) >= 1);
+
+  /* The fields are added to deferred messages too. */
+  ck_assert (ul_set_async (65536) == 0);
+  callsite_log ();
+  ck_assert (ul_set_async (0) == 0);
+  ck_assert_int_eq (ncaptured, 1);
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "callsite 42");
+  verify_value (jo, "line", line);
+  json_object_put (jo);
+  capture_reset ();
+
+  /* Only messages from the site get them. */
+  ul_syslog (LOG_INFO, "plain", NULL);
+  jo = parse_msg (captured[0]);
+  verify_value_missing (jo, "file");
+  verify_value_missing (jo, "line");
+  json_object_put (jo);
+  capture_reset ();
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that the call sites of an unloaded object are forgotten, once
+ * every translation unit of it unregistered them.
+ */
+START_TEST (test_callsites_unregister)
+{
+  static ul_callsite_t sites[2] =
+    {
+      { "plugin.c", "plugin_init", "plugin %d", 10, 1, 0, NULL, 0 },
+      { "plugin.c", "plugin_run", "running", 20, 1, 0, NULL, 0 },
+    };
+
+  ul_openlog ("umberlog/test_callsites_unregister", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  ul_register_callsites (sites, sites + 2);
+  ul_register_callsites (sites, sites + 2);
+  ck_assert_int_eq (ul_set_callsite ("plugin.c", 0, 1), 2);
+  ul_syslog_callsite (&sites[0], LOG_INFO, "plugin %d", 1, NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  ck_assert (sites[0].fragment != NULL);
+  capture_reset ();
+
+  ul_unregister_callsites (sites, sites + 2);
+  ck_assert_int_eq (ul_set_callsite ("plugin.c", 0, 1), 2);
+  ul_unregister_callsites (sites, sites + 2);
+  ck_assert_int_eq (ul_set_callsite ("plugin.c", 0, 1), 0);
+  ck_assert (sites[0].fragment == NULL);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/* Reads the totals of the running process with ulstat(1). */
+static void
+ulstat_read (double *msgs, double *warn, double *info, double *drops)
+{
+  char command[PATH_MAX + 64], line[256];
+  double err, notice, debug, kb;
+  FILE *out;
+
+  snprintf (command, sizeof (command), "%s -a -c 1 %d", UMBERLOG_ULSTAT,
+            (int)getpid ());
+  out = popen (command, "r");
+  ck_assert (out != NULL);
+  ck_assert (fgets (line, sizeof (line), out) != NULL);
+  ck_assert (strstr (line, "msgs") != NULL);
+  ck_assert (fgets (line, sizeof (line), out) != NULL);
+  ck_assert_int_eq (sscanf (line, "%lf %lf %lf %lf %lf %lf %lf %lf",
+                            msgs, &err, warn, &notice, info, &debug, &kb,
+                            drops), 8);
+  ck_assert_int_eq (pclose (out), 0);
+}
+
+START_TEST (test_stats_export)
+{
+  double msgs, warn, info, drops, msgs2, warn2, info2, drops2;
+  char name[64];
+  int fd;
+
+  ul_openlog ("umberlog/test_stats_export", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  ck_assert (ul_set_stats_export (10) == 0);
+  usleep (50000);
+  ulstat_read (&msgs, &warn, &info, &drops);
+
+  ul_syslog (LOG_WARNING, "warning", NULL);
+  ul_syslog (LOG_INFO, "info %d", 1, NULL);
+  ul_syslog (LOG_INFO, "info %d", 2, NULL);
+  ck_assert_int_eq (ncaptured, 3);
+  capture_reset ();
+
+  usleep (50000);
+  ulstat_read (&msgs2, &warn2, &info2, &drops2);
+  ck_assert (msgs2 == msgs + 3);
+  ck_assert (warn2 == warn + 1);
+  ck_assert (info2 == info + 2);
+  ck_assert (drops2 == drops);
+
+  /* Turning it off removes the segment. */
+  snprintf (name, sizeof (name), "/umberlog.%d", (int)getpid ());
+  fd = shm_open (name, O_RDONLY, 0);
+  ck_assert (fd >= 0);
+  close (fd);
+  ck_assert (ul_set_stats_export (0) == 0);
+  ck_assert (shm_open (name, O_RDONLY, 0) == -1);
+  ck_assert_int_eq (errno, ENOENT);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+START_TEST (test_stats_export_stuck)
+{
+  char command[PATH_MAX + 64], line[256], name[64];
+  volatile uint32_t *seq;
+  void *shm;
+  FILE *out;
+  int fd;
+
+  ul_openlog ("umberlog/test_stats_export_stuck", 0, LOG_LOCAL0);
+  ck_assert (ul_set_stats_export (60000) == 0);
+  usleep (50000);
+
+  /* As if the process stopped in the middle of an update: the
+     sequence number, after the magic and the version, stays odd. */
+  snprintf (name, sizeof (name), "/umberlog.%d", (int)getpid ());
+  fd = shm_open (name, O_RDWR, 0);
+  ck_assert (fd >= 0);
+  shm = mmap (NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ck_assert (shm != MAP_FAILED);
+  close (fd);
+  seq = (volatile uint32_t *)shm + 2;
+  (*seq)++;
+
+  snprintf (command, sizeof (command), "%s -a -c 1 %d 2>&1",
+            UMBERLOG_ULSTAT, (int)getpid ());
+  out = popen (command, "r");
+  ck_assert (out != NULL);
+  ck_assert (fgets (line, sizeof (line), out) != NULL);
+  ck_assert (strstr (line, "msgs") != NULL);
+  ck_assert (fgets (line, sizeof (line), out) != NULL);
+  ck_assert (strstr (line, "skipping") != NULL);
+  ck_assert (fgets (line, sizeof (line), out) == NULL);
+  ck_assert_int_eq (pclose (out), 0);
+
+  (*seq)++;
+  munmap (shm, 4096);
+  ck_assert (ul_set_stats_export (0) == 0);
+  ul_closelog ();
+}
+END_TEST
+
+START_TEST (test_stats_export_planted)
+{
+  struct stat st;
+  char name[64];
+  int fd;
+
+  /* A segment that is already there is not the one used. */
+  snprintf (name, sizeof (name), "/umberlog.%d", (int)getpid ());
+  fd = shm_open (name, O_RDWR | O_CREAT, 0666);
+  ck_assert (fd >= 0);
+  fchmod (fd, 0666);
+  close (fd);
+
+  ul_openlog ("umberlog/test_stats_export_planted", 0, LOG_LOCAL0);
+  ck_assert (ul_set_stats_export (10) == 0);
+
+  fd = shm_open (name, O_RDONLY, 0);
+  ck_assert (fd >= 0);
+  ck_assert (fstat (fd, &st) == 0);
+  ck_assert_int_eq (st.st_mode & 0777, 0600);
+  ck_assert (st.st_size > 0);
+  close (fd);
+
+  ck_assert (ul_set_stats_export (0) == 0);
+  ul_closelog ();
+}
+END_TEST
+
+/* Replaces the file at PATH, as an editor would. */
+static void
+control_write (const char *path, const char *contents)
+{
+  char tmp[PATH_MAX];
+  FILE *out;
+
+  snprintf (tmp, sizeof (tmp), "%s.new", path);
+  out = fopen (tmp, "w");
+  ck_assert (out != NULL);
+  fputs (contents, out);
+  ck_assert (fclose (out) == 0);
+  ck_assert (rename (tmp, path) == 0);
+}
+
+START_TEST (test_control_file)
+{
+  char dir[] = "/tmp/umberlog-control-XXXXXX", path[PATH_MAX];
+  struct json_object *jo;
+  int mask, i;
+
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/control", dir);
+
+  ul_openlog ("umberlog/test_control_file", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ul_set_log_flags (LOG_UL_ALL);
+  mask = ul_setlogmask (LOG_UPTO (LOG_WARNING));
+
+  /* The file is applied right away. */
+  control_write (path,
+                 "# Debugging a hot service\n"
+                 "mask = debug\n"
+                 "flags = notime, threadinfo\n"
+                 "sample = info 1\n");
+  ck_assert (ul_set_control_file (path) == 0);
+  ck_assert_int_eq (ul_setlogmask (0), LOG_UPTO (LOG_DEBUG));
+  ul_syslog (LOG_DEBUG, "debug", NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  jo = parse_msg (captured[0]);
+  verify_value_missing (jo, "timestamp");
+  verify_value_exists (jo, "seq");
+  json_object_put (jo);
+  capture_reset ();
+
+  /* And again whenever it changes. */
+  control_write (path, "mask = warning\nflags = all\n");
+  for (i = 0; i < 500 && ul_setlogmask (0) != LOG_UPTO (LOG_WARNING); i++)
+    usleep (10000);
+  ck_assert_int_eq (ul_setlogmask (0), LOG_UPTO (LOG_WARNING));
+  ul_syslog (LOG_DEBUG, "debug", NULL);
+  ck_assert_int_eq (ncaptured, 0);
+  ul_syslog (LOG_WARNING, "warning", NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  jo = parse_msg (captured[0]);
+  verify_value_exists (jo, "timestamp");
+  json_object_put (jo);
+  capture_reset ();
+
+  /* Files that do not parse are rejected as a whole. */
+  control_write (path, "mask = debug\nflags = loud\n");
+  ck_assert (ul_set_control_file (path) == -1);
+  ck_assert_int_eq (errno, EINVAL);
+  ck_assert_int_eq (ul_setlogmask (0), LOG_UPTO (LOG_WARNING));
+  control_write (path, "verbosity = 11\n");
+  ck_assert (ul_set_control_file (path) == -1);
+  ck_assert_int_eq (errno, EINVAL);
+  unlink (path);
+  ck_assert (ul_set_control_file (path) == -1);
+  ck_assert_int_eq (errno, ENOENT);
+  ck_assert (ul_set_control_file (NULL) == 0);
+
+  rmdir (dir);
+  ul_setlogmask (mask);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+START_TEST (test_async)
+{
+  struct json_object *jo;
+  char expected[64];
+  const char *str = NULL;
+  unsigned long seq;
+  int i;
+
+  ul_openlog ("umberlog/test_async", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL | LOG_UL_THREADINFO);
+  ul_set_output_handler (capture_output, NULL);
+  ck_assert (ul_set_async (65536) == 0);
+
+  /* Wide strings are not captured, those are sent right away. */
+  ul_syslog (LOG_INFO, "%ls", L"wide", NULL);
+
+  errno = ENOENT;
+  ul_syslog (LOG_INFO, "%s: %m", "file", NULL);
+  ul_syslog (LOG_INFO, "%5d|%-3u|%lx|%.*s|%%|%c", -42, 7u, 255ul, 3, "abcdef",
+             'z', NULL);
+  ul_syslog (LOG_INFO, "%s", str,
+             "float", "%.2f", 3.14159,
+             "long-double", "%.1Lf", 2.5L,
+             "size", "%zu", (size_t)12345,
+             "star", "%*d", 4, 9,
+             "plain", "no conversions",
+             NULL);
+  for (i = 0; i < 10; i++)
+    ul_syslog (LOG_DEBUG, "message %d", i, NULL);
+
+  ck_assert (ul_set_async (0) == 0);
+  ck_assert_int_eq (ncaptured, 14);
+
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "wide");
+  json_object_put (jo);
+
+  jo = parse_msg (captured[1]);
+  snprintf (expected, sizeof (expected), "file: %s", strerror (ENOENT));
+  verify_value (jo, "msg", expected);
+  verify_value (jo, "program", "umberlog/test_async");
+  verify_value (jo, "facility", "local0");
+  verify_value (jo, "priority", "info");
+  verify_value_exists (jo, "timestamp");
+  json_object_put (jo);
+
+  /* Thread information is that of the caller, not of the thread the
+     message was formatted in. */
+  jo = parse_msg (captured[0]);
+  seq = strtoul (json_object_get_string (json_object_object_get (jo, "seq")),
+                 NULL, 10);
+  snprintf (expected, sizeof (expected), "%lu", seq + 2);
+  json_object_put (jo);
+  jo = parse_msg (captured[2]);
+  verify_value (jo, "msg", "  -42|7  |ff|abc|%|z");
+  verify_value (jo, "seq", expected);
+#ifdef SYS_gettid
+  snprintf (expected, sizeof (expected), "%ld", (long)syscall (SYS_gettid));
+  verify_value (jo, "tid", expected);
+#endif
+  json_object_put (jo);
 
+  jo = parse_msg (captured[3]);
+  verify_value (jo, "msg", "(null)");
+  verify_value (jo, "float", "3.14");
+  verify_value (jo, "long-double", "2.5");
+  verify_value (jo, "size", "12345");
+  verify_value (jo, "star", "   9");
+  verify_value (jo, "plain", "no conversions");
   json_object_put (jo);
+
+  for (i = 0; i < 10; i++)
+    {
+      snprintf (expected, sizeof (expected), "message %d", i);
+      jo = parse_msg (captured[4 + i]);
+      verify_value (jo, "msg", expected);
+      verify_value (jo, "priority", "debug");
+      json_object_put (jo);
+    }
+  capture_reset ();
+
+  ul_set_output_handler (NULL, NULL);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_closelog ();
+}
+END_TEST
+
+START_TEST (test_async_no_memory)
+{
+  struct json_object *jo;
+
+  ul_openlog ("umberlog/test_async_no_memory", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  /* Without room for a queue, messages are sent right away, instead
+     of being dropped as if the queue was full. */
+  ck_assert (ul_set_queue_policy (LOG_UL_QUEUE_DROP_NEWEST, 0) == 0);
+  ck_assert (ul_set_async ((size_t)1 << 50) == 0);
+  ul_syslog (LOG_INFO, "no queue", NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "no queue");
+  json_object_put (jo);
+  capture_reset ();
+
+  ck_assert (ul_set_async (0) == 0);
+  ul_set_queue_policy (LOG_UL_QUEUE_SYNC, 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/* An output handler that holds up the background thread on "plug"
+   messages, until the gate is opened. */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_entered, gate_open;
+
+static void
+gated_output (int priority, const char *message, void *user_data)
+{
+  if (strstr (message, "\"plug\"") != NULL)
+    {
+      pthread_mutex_lock (&gate_lock);
+      gate_entered = 1;
+      pthread_cond_broadcast (&gate_cond);
+      while (!gate_open)
+        pthread_cond_wait (&gate_cond, &gate_lock);
+      pthread_mutex_unlock (&gate_lock);
+    }
+  capture_output (priority, message, user_data);
+}
+
+/* Start queueing, and plug the background thread. */
+static void
+gate_close (int policy, unsigned int timeout_ms)
+{
+  gate_entered = gate_open = 0;
+  ck_assert (ul_set_queue_policy (policy, timeout_ms) == 0);
+  ck_assert (ul_set_async (1024) == 0);
+  ul_syslog (LOG_INFO, "plug", NULL);
+
+  pthread_mutex_lock (&gate_lock);
+  while (!gate_entered)
+    pthread_cond_wait (&gate_cond, &gate_lock);
+  pthread_mutex_unlock (&gate_lock);
+}
+
+static void
+gate_release (void)
+{
+  pthread_mutex_lock (&gate_lock);
+  gate_open = 1;
+  pthread_cond_broadcast (&gate_cond);
+  pthread_mutex_unlock (&gate_lock);
+}
+
+static void *
+gate_release_later (void *data)
+{
+  (void)data;
+
+  usleep (50000);
+  gate_release ();
+  return NULL;
+}
+
+static void
+verify_captured (int i, const char *msg)
+{
+  struct json_object *jo;
+
+  ck_assert (i < ncaptured);
+  jo = parse_msg (captured[i]);
+  verify_value (jo, "msg", msg);
+  json_object_put (jo);
+}
+
+/**
+ * Test what happens with messages when the queue is full, under each
+ * of the queue policies.
+ */
+START_TEST (test_queue_policy)
+{
+  ul_queue_stats_t before, after;
+  pthread_t thread;
+  char expected[64];
+  int i, n, dropped;
+
+  ul_openlog ("umberlog/test_queue_policy", 0, LOG_LOCAL0);
+  ul_set_output_handler (gated_output, NULL);
+  ck_assert (ul_set_queue_policy (LOG_UL_QUEUE_DROP_PRIORITY + 1, 0) == -1);
+  ck_assert (errno == EINVAL);
+
+  /* Fill the queue, and see how much fits. */
+  ul_get_queue_stats (&before);
+  gate_close (LOG_UL_QUEUE_DROP_NEWEST, 0);
+  for (n = 0; ; n++)
+    {
+      ul_syslog (LOG_INFO, "newest %d", n, NULL);
+      ul_get_queue_stats (&after);
+      if (after.dropped_newest != before.dropped_newest)
+        break;
+    }
+  ck_assert (n > 2);
+  ul_syslog (LOG_INFO, "newest %d", n + 1, NULL);
+  gate_release ();
+  ck_assert (ul_set_async (0) == 0);
+
+  ul_get_queue_stats (&after);
+  ck_assert_int_eq (after.dropped_newest - before.dropped_newest, 2);
+  ck_assert_int_eq (ncaptured, n + 2);
+  verify_captured (0, "plug");
+  for (i = 0; i < n; i++)
+    {
+      snprintf (expected, sizeof (expected), "newest %d", i);
+      verify_captured (i + 1, expected);
+    }
+  verify_captured (n + 1, "2 queued messages dropped");
+  ck_assert_int_eq (captured_prio[n + 1] & LOG_PRIMASK, LOG_WARNING);
+  capture_reset ();
+
+  /* The oldest messages make room for the new ones. */
+  gate_close (LOG_UL_QUEUE_DROP_OLDEST, 0);
+  for (i = 0; i < 3 * n; i++)
+    ul_syslog (LOG_INFO, "oldest %d", i, NULL);
+  gate_release ();
+  ck_assert (ul_set_async (0) == 0);
+
+  before = after;
+  ul_get_queue_stats (&after);
+  dropped = after.dropped_oldest - before.dropped_oldest;
+  ck_assert (dropped > 0);
+  ck_assert_int_eq (ncaptured, 3 * n - dropped + 2);
+  for (i = 1; i < ncaptured - 1; i++)
+    {
+      snprintf (expected, sizeof (expected), "oldest %d", dropped + i - 1);
+      verify_captured (i, expected);
+    }
+  snprintf (expected, sizeof (expected), "%d queued messages dropped",
+            dropped);
+  verify_captured (ncaptured - 1, expected);
+  capture_reset ();
+
+  /* Less important messages make room for more important ones, but
+     not the other way around. */
+  gate_close (LOG_UL_QUEUE_DROP_PRIORITY, 0);
+  for (n = 0; ; n++)
+    {
+      ul_syslog (LOG_INFO, "priority %d", n, NULL);
+      ul_get_queue_stats (&after);
+      if (after.dropped_priority != before.dropped_priority)
+        break;
+    }
+  ul_syslog (LOG_NOTICE, "priority %d", n + 1, NULL);
+  gate_release ();
+  ck_assert (ul_set_async (0) == 0);
+
+  before = after;
+  ul_get_queue_stats (&after);
+  dropped = after.dropped_priority - before.dropped_priority;
+  ck_assert (dropped > 0);
+  ck_assert_int_eq (ncaptured, n - dropped + 3);
+  for (i = 1; i < ncaptured - 2; i++)
+    {
+      snprintf (expected, sizeof (expected), "priority %d", dropped + i - 1);
+      verify_captured (i, expected);
+    }
+  snprintf (expected, sizeof (expected), "priority %d", n + 1);
+  verify_captured (ncaptured - 2, expected);
+  snprintf (expected, sizeof (expected), "%d queued messages dropped",
+            dropped + 1);
+  verify_captured (ncaptured - 1, expected);
+  capture_reset ();
+
+  /* Waiting for room gives up after the timeout... */
+  before = after;
+  gate_close (LOG_UL_QUEUE_BLOCK, 20);
+  for (n = 0; ; n++)
+    {
+      ul_syslog (LOG_INFO, "block %d", n, NULL);
+      ul_get_queue_stats (&after);
+      if (after.blocked != before.blocked)
+        break;
+    }
+  ck_assert_int_eq (after.dropped_timeout - before.dropped_timeout, 1);
+
+  /* ...but succeeds once the background thread catches up. */
+  ck_assert (ul_set_queue_policy (LOG_UL_QUEUE_BLOCK, 0) == 0);
+  ck_assert (pthread_create (&thread, NULL, gate_release_later, NULL) == 0);
+  ul_syslog (LOG_INFO, "waited", NULL);
+  pthread_join (thread, NULL);
+  ck_assert (ul_set_async (0) == 0);
+
+  before = after;
+  ul_get_queue_stats (&after);
+  ck_assert_int_eq (after.dropped_timeout - before.dropped_timeout, 0);
+  ck_assert_int_eq (after.blocked - before.blocked, 1);
+  ck_assert_int_eq (ncaptured, n + 3);
+  verify_captured (1, "block 0");
+  /* The queue may well have been drained before the wait was over. */
+  i = strstr (captured[n + 1], "\"waited\"") != NULL ? n + 1 : n + 2;
+  verify_captured (i, "waited");
+  verify_captured (2 * n + 3 - i, "1 queued messages dropped");
+  capture_reset ();
+
+  ck_assert (ul_set_queue_policy (LOG_UL_QUEUE_SYNC, 0) == 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that errors are sent before queued messages of lower priority.
+ */
+START_TEST (test_priority_lanes)
+{
+  int i;
+
+  ul_openlog ("umberlog/test_priority_lanes", 0, LOG_LOCAL0);
+  ul_set_output_handler (gated_output, NULL);
+
+  gate_close (LOG_UL_QUEUE_SYNC, 0);
+  for (i = 0; i < 5; i++)
+    ul_syslog (LOG_DEBUG, "debug", NULL);
+  ul_syslog (LOG_WARNING, "warning", NULL);
+  ul_syslog (LOG_ERR, "error", NULL);
+  ul_syslog (LOG_CRIT, "critical", NULL);
+  gate_release ();
+  ck_assert (ul_set_async (0) == 0);
+
+  ck_assert_int_eq (ncaptured, 9);
+  verify_captured (0, "plug");
+  verify_captured (1, "error");
+  verify_captured (2, "critical");
+  verify_captured (3, "warning");
+  for (i = 4; i < 9; i++)
+    verify_captured (i, "debug");
+  capture_reset ();
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test sending to the syslog socket directly, with a deadline.
+ */
+START_TEST (test_syslog_socket)
+{
+  char dir[] = "/tmp/umberlog-socket-XXXXXX";
+  char path[PATH_MAX], buf[4096], expected[128];
+  struct sockaddr_un sun;
+  struct timespec st, et;
+  ul_send_stats_t before, after;
+  struct json_object *jo;
+  ssize_t len;
+  char *msg;
+  int fd, i;
+
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/log", dir);
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  ck_assert (fd != -1);
+  ck_assert (bind (fd, (struct sockaddr *)&sun, sizeof (sun)) == 0);
+
+  ul_openlog ("umberlog/test_syslog_socket", LOG_PID, LOG_LOCAL0);
+  ck_assert (ul_set_syslog_socket (path, 0) == 0);
+  ul_set_fallback_handler (capture_output, NULL);
+  ul_get_send_stats (&before);
+
+  /* Messages are formatted like syslog() does. */
+  ul_syslog (LOG_INFO, "hello", NULL);
+  len = recv (fd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+  ck_assert (len > 0);
+  buf[len] = '\0';
+  ck_assert (strncmp (buf, "<134>", 5) == 0);
+  snprintf (expected, sizeof (expected), " umberlog/test_syslog_socket[%d]: ",
+            (int)getpid ());
+  msg = strstr (buf, expected);
+  ck_assert (msg == buf + 5 + strlen ("Jan  1 00:00:00"));
+  msg += strlen (expected);
+  ck_assert (strncmp (msg, "@cee:", 5) == 0);
+  jo = parse_msg (msg + 5);
+  verify_value (jo, "msg", "hello");
+  json_object_put (jo);
+
+  /* When the daemon does not keep up, messages are diverted. */
+  for (i = 0; i < 100000 && ncaptured == 0; i++)
+    ul_syslog (LOG_INFO, "flood %d", i, NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  snprintf (expected, sizeof (expected), "flood %d", i - 1);
+  verify_captured (0, expected);
+  capture_reset ();
+  ul_get_send_stats (&after);
+  ck_assert_int_eq (after.failed - before.failed, 1);
+  ck_assert_int_eq (after.diverted - before.diverted, 1);
+
+  /* With a deadline, sending is retried until then. */
+  ck_assert (ul_set_syslog_socket (path, 100) == 0);
+  clock_gettime (CLOCK_MONOTONIC, &st);
+  ul_syslog (LOG_INFO, "late", NULL);
+  clock_gettime (CLOCK_MONOTONIC, &et);
+  ck_assert_int_eq (ncaptured, 1);
+  ck_assert ((et.tv_sec - st.tv_sec) * 1000 +
+             (et.tv_nsec - st.tv_nsec) / 1000000 >= 90);
+  capture_reset ();
+
+  while (recv (fd, buf, sizeof (buf), MSG_DONTWAIT) > 0)
+    ;
+  ul_syslog (LOG_INFO, "on time", NULL);
+  ck_assert_int_eq (ncaptured, 0);
+
+  /* Nor does it matter if the daemon is gone. */
+  close (fd);
+  unlink (path);
+  ul_syslog (LOG_INFO, "gone", NULL);
+  ck_assert_int_eq (ncaptured, 1);
+  capture_reset ();
+  ul_get_send_stats (&after);
+  ck_assert_int_eq (after.failed - before.failed, 3);
+
+  ck_assert (ul_set_syslog_socket (NULL, -1) == 0);
+  ul_set_fallback_handler (NULL, NULL);
+  ul_closelog ();
+  rmdir (dir);
+}
+END_TEST
+
+/**
+ * Test submitting several records at once.
+ */
+START_TEST (test_syslog_batch)
+{
+  static const char *const keys[] = { "user", "status" };
+  static const char *const values[] = { "alice \"a\"", "200" };
+  ul_record_t records[] =
+    {
+      { LOG_NOTICE, "first", keys, values, 2 },
+      { LOG_DEBUG, "masked", NULL, NULL, 0 },
+      { LOG_INFO, "second", keys, values, 1 },
+      { LOG_LOCAL1 | LOG_WARNING, "third", NULL, NULL, 0 },
+    };
+  char dir[] = "/tmp/umberlog-batch-XXXXXX";
+  char path[PATH_MAX], buf[4096], expected[128];
+  struct sockaddr_un sun;
+  struct json_object *jo;
+  const char *timestamp;
+  char *first_timestamp;
+  int fd, i;
+  ssize_t len;
+
+  ul_openlog ("umberlog/test_syslog_batch", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  ul_setlogmask (LOG_UPTO (LOG_INFO));
+
+  ck_assert (ul_syslog_batch (records, 4) == 0);
+  ck_assert_int_eq (ncaptured, 3);
+
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "first");
+  verify_value (jo, "user", "alice \"a\"");
+  verify_value (jo, "status", "200");
+  verify_value (jo, "priority", "notice");
+  verify_value (jo, "facility", "local0");
+  first_timestamp = strdup (json_object_get_string
+                            (json_object_object_get (jo, "timestamp")));
+  json_object_put (jo);
+
+  jo = parse_msg (captured[1]);
+  verify_value (jo, "msg", "second");
+  verify_value (jo, "user", "alice \"a\"");
+  verify_value_missing (jo, "status");
+  json_object_put (jo);
+
+  /* All records share the timestamp. */
+  jo = parse_msg (captured[2]);
+  verify_value (jo, "msg", "third");
+  verify_value (jo, "facility", "local1");
+  verify_value (jo, "priority", "warn");
+  timestamp = json_object_get_string (json_object_object_get (jo,
+                                                              "timestamp"));
+  ck_assert_str_eq (timestamp, first_timestamp);
+  json_object_put (jo);
+  free (first_timestamp);
+  /* Like for single messages, the handler gets the priority as it was
+     given. */
+  ck_assert_int_eq (captured_prio[0], LOG_NOTICE);
+  ck_assert_int_eq (captured_prio[1], LOG_INFO);
+  ck_assert_int_eq (captured_prio[2], LOG_LOCAL1 | LOG_WARNING);
+  capture_reset ();
+
+  /* Held back records are sent before the next error. */
+  ck_assert (ul_set_flight_recorder (LOG_NOTICE, 4096) == 0);
+  records[0].priority = LOG_INFO;
+  records[2].priority = LOG_ERR;
+  ck_assert (ul_syslog_batch (records, 3) == 0);
+  ck_assert_int_eq (ncaptured, 2);
+  verify_captured (0, "first");
+  verify_captured (1, "second");
+  capture_reset ();
+  ul_set_flight_recorder (LOG_DEBUG, 0);
+
+  /* Straight to the syslog socket. */
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/log", dir);
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  ck_assert (fd != -1);
+  ck_assert (bind (fd, (struct sockaddr *)&sun, sizeof (sun)) == 0);
+  ul_set_output_handler (NULL, NULL);
+  ck_assert (ul_set_syslog_socket (path, 0) == 0);
+  ul_set_fallback_handler (capture_output, NULL);
+
+  records[0].priority = LOG_NOTICE;
+  records[2].priority = LOG_INFO;
+  ck_assert (ul_syslog_batch (records, 4) == 0);
+  ck_assert_int_eq (ncaptured, 0);
+  for (i = 0; i < 3; i++)
+    {
+      static const char *const msgs[] = { "first", "second", "third" };
+      static const int prios[] = { LOG_LOCAL0 | LOG_NOTICE,
+                                   LOG_LOCAL0 | LOG_INFO,
+                                   LOG_LOCAL1 | LOG_WARNING };
+
+      len = recv (fd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+      ck_assert (len > 0);
+      buf[len] = '\0';
+      snprintf (expected, sizeof (expected), "<%d>", prios[i]);
+      ck_assert (strncmp (buf, expected, strlen (expected)) == 0);
+      ck_assert (strstr (buf, " umberlog/test_syslog_batch: @cee:") != NULL);
+      jo = parse_msg (strstr (buf, "@cee:") + 5);
+      verify_value (jo, "msg", msgs[i]);
+      json_object_put (jo);
+    }
+  ck_assert (recv (fd, buf, sizeof (buf), MSG_DONTWAIT) == -1);
+
+  close (fd);
+  unlink (path);
+  rmdir (dir);
+  ck_assert (ul_set_syslog_socket (NULL, -1) == 0);
+  ul_set_fallback_handler (NULL, NULL);
+  ul_setlogmask (LOG_UPTO (LOG_DEBUG));
+  ul_closelog ();
+}
+END_TEST
+
+START_TEST (test_syslog_batch_limits)
+{
+  static const char *const keys[] = { "n" };
+  static const char *const values[] = { "1" };
+  ul_record_t records[200];
+  struct json_object *jo;
+  int i;
+
+  ul_openlog ("umberlog/test_syslog_batch_limits", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  /* Every record with the same message counts against one bucket. */
+  for (i = 0; i < 5; i++)
+    {
+      records[i].priority = LOG_INFO;
+      records[i].msg = (i == 2) ? "another site" : "flood";
+      records[i].keys = keys;
+      records[i].values = values;
+      records[i].nfields = 1;
+    }
+  ul_set_rate_limit (1, 2);
+  ck_assert (ul_syslog_batch (records, 5) == 0);
+  ck_assert_int_eq (ncaptured, 3);
+  verify_captured (0, "flood");
+  verify_captured (1, "flood");
+  verify_captured (2, "another site");
+  capture_reset ();
+  ul_set_rate_limit (0, 0);
+
+  /* Sampled records say so. */
+  for (i = 0; i < 200; i++)
+    {
+      records[i].priority = LOG_DEBUG;
+      records[i].msg = "sampled";
+      records[i].keys = keys;
+      records[i].values = values;
+      records[i].nfields = 1;
+    }
+  ck_assert (ul_set_sample_rate (LOG_DEBUG, 2) == 0);
+  ck_assert (ul_syslog_batch (records, 200) == 0);
+  ck_assert (ncaptured > 0 && ncaptured < 200);
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "sampled");
+  verify_value (jo, "sample_rate", "2");
+  json_object_put (jo);
+  capture_reset ();
+  ul_set_sample_rate (LOG_DEBUG, 1);
+
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test logging from a signal handler, while the interrupted thread is
+ * busy logging itself.
+ */
+#define SIGNAL_SAFE_COUNT 50
+
+static int signal_safe_handled;
+static int signal_safe_done;
+
+static void
+signal_safe_count (int priority, const char *message, void *user_data)
+{
+  (void)priority;
+  (void)message;
+  (*(unsigned long *)user_data)++;
+}
+
+static void
+signal_safe_handler (int signo)
+{
+  int n = __atomic_load_n (&signal_safe_handled, __ATOMIC_RELAXED);
+
+  ul_syslog_signal_safe (LOG_WARNING, "signal %d", n,
+                         "name", "SIG%s\n\"%c\"", "USR1", 'x',
+                         "signo", "%d", signo,
+                         "count", "%lu", (unsigned long)n,
+                         NULL);
+  __atomic_store_n (&signal_safe_handled, n + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct
+{
+  pthread_t target;
+  int fd;
+  char *received[SIGNAL_SAFE_COUNT];
+} signal_safe_data_t;
+
+static void *
+signal_safe_sender (void *data)
+{
+  signal_safe_data_t *d = (signal_safe_data_t *)data;
+  struct timespec pause = { 0, 100000 };
+  char buf[4096];
+  ssize_t len;
+  int i;
+
+  for (i = 0; i < SIGNAL_SAFE_COUNT; i++)
+    {
+      pthread_kill (d->target, SIGUSR1);
+      while (__atomic_load_n (&signal_safe_handled, __ATOMIC_ACQUIRE) <= i)
+        nanosleep (&pause, NULL);
+      len = recv (d->fd, buf, sizeof (buf) - 1, 0);
+      if (len < 0)
+        len = 0;
+      buf[len] = '\0';
+      d->received[i] = strdup (buf);
+    }
+  __atomic_store_n (&signal_safe_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+START_TEST (test_syslog_signal_safe)
+{
+  char dir[] = "/tmp/umberlog-signal-XXXXXX";
+  char path[PATH_MAX], expected[128], long_value[4096];
+  struct sockaddr_un sun;
+  struct sigaction sa, old_sa;
+  signal_safe_data_t data;
+  struct json_object *jo;
+  unsigned long logged = 0;
+  pthread_t thread;
+  const char *msg;
+  int i;
+
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/log", dir);
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  data.fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  ck_assert (data.fd != -1);
+  ck_assert (bind (data.fd, (struct sockaddr *)&sun, sizeof (sun)) == 0);
+
+  ul_openlog ("umberlog/test_signal_safe", LOG_PID, LOG_LOCAL0);
+  ck_assert (ul_set_syslog_socket (path, 0) == 0);
+  /* Only messages logged from the handler reach the socket. */
+  ul_set_output_handler (signal_safe_count, &logged);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = signal_safe_handler;
+  sigemptyset (&sa.sa_mask);
+  ck_assert (sigaction (SIGUSR1, &sa, &old_sa) == 0);
+
+  data.target = pthread_self ();
+  signal_safe_handled = 0;
+  signal_safe_done = 0;
+  ck_assert (pthread_create (&thread, NULL, signal_safe_sender, &data) == 0);
+  while (!__atomic_load_n (&signal_safe_done, __ATOMIC_ACQUIRE))
+    ul_syslog (LOG_INFO, "busy %lu", logged, "key", "%s", "value", NULL);
+  pthread_join (thread, NULL);
+  ck_assert (sigaction (SIGUSR1, &old_sa, NULL) == 0);
+  ck_assert (logged > 0);
+
+  snprintf (expected, sizeof (expected),
+            "<132>umberlog/test_signal_safe[%d]: @cee:", (int)getpid ());
+  for (i = 0; i < SIGNAL_SAFE_COUNT; i++)
+    {
+      msg = data.received[i];
+      ck_assert (strncmp (msg, expected, strlen (expected)) == 0);
+
+      jo = parse_msg (msg + strlen (expected));
+      snprintf (long_value, sizeof (long_value), "signal %d", i);
+      verify_value (jo, "msg", long_value);
+      verify_value (jo, "name", "SIGUSR1\n\"x\"");
+      snprintf (long_value, sizeof (long_value), "%d", SIGUSR1);
+      verify_value (jo, "signo", long_value);
+      snprintf (long_value, sizeof (long_value), "%d", i);
+      verify_value (jo, "count", long_value);
+      snprintf (long_value, sizeof (long_value), "%d", (int)getpid ());
+      verify_value (jo, "pid", long_value);
+      verify_value (jo, "facility", "local0");
+      verify_value (jo, "priority", "warn");
+      verify_value (jo, "program", "umberlog/test_signal_safe");
+      verify_value_exists (jo, "host");
+      verify_value_exists (jo, "timestamp");
+      json_object_put (jo);
+      free (data.received[i]);
+    }
+
+  /* Unsupported formats, and messages that do not fit, are refused. */
+  ck_assert (ul_syslog_signal_safe (LOG_INFO, "%f", 1.0, NULL) == -1);
+  ck_assert_int_eq (errno, EINVAL);
+  memset (long_value, 'x', sizeof (long_value) - 1);
+  long_value[sizeof (long_value) - 1] = '\0';
+  ck_assert (ul_syslog_signal_safe (LOG_INFO, "%s", long_value, NULL) == -1);
+  ck_assert_int_eq (errno, EMSGSIZE);
+  ck_assert (recv (data.fd, long_value, sizeof (long_value),
+                   MSG_DONTWAIT) == -1);
+
+  close (data.fd);
+  unlink (path);
+  ck_assert (ul_set_syslog_socket (NULL, -1) == 0);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+  rmdir (dir);
+}
+END_TEST
+
+/**
+ * Test that a crash sends what is still queued, or held by the flight
+ * recorder, before the previous handler is called.
+ */
+static void
+crash_exit (int signo)
+{
+  (void)signo;
+  _exit (42);
+}
+
+START_TEST (test_crash_flush)
+{
+  char dir[] = "/tmp/umberlog-crash-XXXXXX";
+  char path[PATH_MAX], buf[4096], expected[128];
+  struct sockaddr_un sun;
+  struct json_object *jo;
+  int fd, i, status;
+  pid_t child;
+  ssize_t len;
+
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/log", dir);
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  ck_assert (fd != -1);
+  ck_assert (bind (fd, (struct sockaddr *)&sun, sizeof (sun)) == 0);
+
+  child = fork ();
+  ck_assert (child != -1);
+  if (child == 0)
+    {
+      ul_openlog ("umberlog/test_crash_flush", 0, LOG_LOCAL0);
+      ul_set_output_handler (gated_output, NULL);
+      if (ul_set_syslog_socket (path, 0) != 0)
+        _exit (1);
+      gate_close (LOG_UL_QUEUE_DROP_NEWEST, 0);
+      if (ul_set_flight_recorder (LOG_NOTICE, 4096) != 0)
+        _exit (1);
+
+      for (i = 0; i < 5; i++)
+        ul_syslog (LOG_NOTICE, "queued %d", i,
+                   "name", "%s", "crash\n",
+                   "hex", "%lx", 255ul,
+                   "width", "%5d", i,
+                   NULL);
+      for (i = 0; i < 3; i++)
+        ul_syslog (LOG_INFO, "context %d", i, NULL);
+
+      signal (SIGABRT, crash_exit);
+      if (ul_set_crash_handler (1) != 0)
+        _exit (1);
+      abort ();
+    }
+
+  ck_assert (waitpid (child, &status, 0) == child);
+  ck_assert (WIFEXITED (status));
+  ck_assert_int_eq (WEXITSTATUS (status), 42);
+
+  /* Queued messages, oldest first, then the ones held back. */
+  for (i = 0; i < 8; i++)
+    {
+      len = recv (fd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+      ck_assert (len > 0);
+      buf[len] = '\0';
+
+      snprintf (expected, sizeof (expected),
+                "<%d>umberlog/test_crash_flush: @cee:",
+                LOG_LOCAL0 | ((i < 5) ? LOG_NOTICE : LOG_INFO));
+      ck_assert (strncmp (buf, expected, strlen (expected)) == 0);
+      jo = parse_msg (buf + strlen (expected));
+      if (i < 5)
+        {
+          snprintf (expected, sizeof (expected), "queued %d", i);
+          verify_value (jo, "msg", expected);
+          verify_value (jo, "name", "crash\n");
+          verify_value (jo, "hex", "ff");
+          /* Which cannot be rendered safely. */
+          verify_value (jo, "width", "%5d");
+          verify_value (jo, "priority", "notice");
+        }
+      else
+        {
+          snprintf (expected, sizeof (expected), "context %d", i - 5);
+          verify_value (jo, "msg", expected);
+          verify_value (jo, "priority", "info");
+        }
+      verify_value (jo, "program", "umberlog/test_crash_flush");
+      verify_value_exists (jo, "timestamp");
+      json_object_put (jo);
+    }
+  ck_assert (recv (fd, buf, sizeof (buf), MSG_DONTWAIT) == -1);
+
+  close (fd);
+  unlink (path);
+  rmdir (dir);
+}
+END_TEST
+
+/* A loopback socket for test_remote(), on an ephemeral port. */
+static int
+remote_listen (int type, char *port, size_t size)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+  int fd;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (port[0] != '\0')
+    sin.sin_port = htons (atoi (port));
+  fd = socket (AF_INET, type, 0);
+  ck_assert (fd != -1);
+  ck_assert (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR,
+                         &(int){ 1 }, sizeof (int)) == 0);
+  ck_assert (bind (fd, (struct sockaddr *)&sin, sizeof (sin)) == 0);
+  if (type == SOCK_STREAM)
+    ck_assert (listen (fd, 1) == 0);
+  ck_assert (getsockname (fd, (struct sockaddr *)&sin, &len) == 0);
+  snprintf (port, size, "%d", ntohs (sin.sin_port));
+  return fd;
+}
+
+/* Read an RFC 6587 octet-counted frame. */
+static char *
+remote_read_frame (FILE *in)
+{
+  size_t len;
+  char *msg;
+
+  ck_assert (fscanf (in, "%zu ", &len) == 1);
+  msg = malloc (len + 1);
+  ck_assert (fread (msg, 1, len, in) == len);
+  msg[len] = '\0';
+  return msg;
+}
+
+/* Check the RFC 5424 header, and the message in the payload. */
+static void
+remote_verify (const char *frame, const char *expected)
+{
+  struct json_object *jo;
+  char prefix[64];
+  const char *p;
+
+  ck_assert (strncmp (frame, "<134>1 ", 7) == 0);
+  snprintf (prefix, sizeof (prefix), " umberlog/test_remote %d - - @cee:",
+            (int)getpid ());
+  p = strstr (frame, prefix);
+  ck_assert (p != NULL);
+  jo = parse_msg (p + strlen (prefix));
+  verify_value (jo, "msg", expected);
+  json_object_put (jo);
+}
+
+/**
+ * Test sending to a remote collector, over TCP and UDP.
+ */
+START_TEST (test_remote)
+{
+  char port[16] = "", expected[32], buf[4096];
+  ul_send_stats_t before, after;
+  FILE *in;
+  char *frame;
+  ssize_t len;
+  int fd, conn, i;
+
+  ul_openlog ("umberlog/test_remote", 0, LOG_LOCAL0);
+  ul_get_send_stats (&before);
+  ck_assert (ul_set_remote ("127.0.0.1", "514", SOCK_RAW, 4096) == -1);
+  ck_assert (errno == EINVAL);
+
+  /* Over TCP, messages are framed with their length. */
+  fd = remote_listen (SOCK_STREAM, port, sizeof (port));
+  ck_assert (ul_set_remote ("127.0.0.1", port, SOCK_STREAM, 65536) == 0);
+  for (i = 0; i < 100; i++)
+    ul_syslog (LOG_INFO, "tcp %d", i, NULL);
+  conn = accept (fd, NULL, NULL);
+  ck_assert (conn != -1);
+  in = fdopen (conn, "r");
+  for (i = 0; i < 100; i++)
+    {
+      frame = remote_read_frame (in);
+      snprintf (expected, sizeof (expected), "tcp %d", i);
+      remote_verify (frame, expected);
+      free (frame);
+    }
+  ck_assert (ul_set_remote (NULL, NULL, 0, 0) == 0);
+  fclose (in);
+  close (fd);
+
+  /* While the collector is away, messages are kept, up to a limit... */
+  ck_assert (ul_set_remote ("127.0.0.1", port, SOCK_STREAM, 1024) == 0);
+  for (i = 0; i < 10; i++)
+    ul_syslog (LOG_INFO, "kept %d", i, NULL);
+  usleep (50000);
+  ul_get_send_stats (&after);
+  ck_assert (after.remote_dropped - before.remote_dropped > 0);
+  ck_assert (after.remote_connects - before.remote_connects > 0);
+
+  /* ...and sent once it is back. */
+  fd = remote_listen (SOCK_STREAM, port, sizeof (port));
+  conn = accept (fd, NULL, NULL);
+  ck_assert (conn != -1);
+  in = fdopen (conn, "r");
+  for (i = 0; i < 10 - (int)(after.remote_dropped - before.remote_dropped);
+       i++)
+    {
+      frame = remote_read_frame (in);
+      snprintf (expected, sizeof (expected), "kept %d", i);
+      remote_verify (frame, expected);
+      free (frame);
+    }
+  ck_assert (ul_set_remote (NULL, NULL, 0, 0) == 0);
+  fclose (in);
+  close (fd);
+
+  /* Over UDP, every message is a datagram. */
+  port[0] = '\0';
+  fd = remote_listen (SOCK_DGRAM, port, sizeof (port));
+  ck_assert (ul_set_remote ("127.0.0.1", port, SOCK_DGRAM, 65536) == 0);
+  for (i = 0; i < 3; i++)
+    ul_syslog (LOG_INFO, "udp %d", i, NULL);
+  for (i = 0; i < 3; i++)
+    {
+      len = recv (fd, buf, sizeof (buf) - 1, 0);
+      ck_assert (len > 0);
+      buf[len] = '\0';
+      snprintf (expected, sizeof (expected), "udp %d", i);
+      remote_verify (buf, expected);
+    }
+  ck_assert (ul_set_remote (NULL, NULL, 0, 0) == 0);
+  close (fd);
+
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that a crash sends what is still queued to the remote
+ * collector, after what the collector was sent already.
+ */
+START_TEST (test_crash_flush_remote)
+{
+  char port[16] = "", expected[128], byte;
+  struct json_object *jo;
+  int fd, conn, sync[2], i, status;
+  const char *p;
+  char *frame;
+  pid_t child;
+  FILE *in;
+
+  fd = remote_listen (SOCK_STREAM, port, sizeof (port));
+  ck_assert (pipe (sync) == 0);
+
+  child = fork ();
+  ck_assert (child != -1);
+  if (child == 0)
+    {
+      close (sync[1]);
+      ul_openlog ("umberlog/test_crash_flush", 0, LOG_LOCAL0);
+      ul_set_output_handler (NULL, NULL);
+      if (ul_set_remote ("127.0.0.1", port, SOCK_STREAM, 65536) != 0)
+        _exit (1);
+      ul_syslog (LOG_NOTICE, "connected", NULL);
+      if (read (sync[0], &byte, 1) != 1)
+        _exit (1);
+
+      ul_set_output_handler (gated_output, NULL);
+      gate_close (LOG_UL_QUEUE_DROP_NEWEST, 0);
+      if (ul_set_flight_recorder (LOG_NOTICE, 4096) != 0)
+        _exit (1);
+      for (i = 0; i < 3; i++)
+        ul_syslog (LOG_NOTICE, "queued %d", i, NULL);
+      for (i = 0; i < 2; i++)
+        ul_syslog (LOG_INFO, "context %d", i, NULL);
+      /* What is queued is for the collector again. */
+      ul_set_output_handler (NULL, NULL);
+
+      signal (SIGABRT, crash_exit);
+      if (ul_set_crash_handler (1) != 0)
+        _exit (1);
+      abort ();
+    }
+  close (sync[0]);
+
+  conn = accept (fd, NULL, NULL);
+  ck_assert (conn != -1);
+  in = fdopen (conn, "r");
+  frame = remote_read_frame (in);
+  ck_assert (strstr (frame, "\"msg\":\"connected\"") != NULL);
+  free (frame);
+  ck_assert (write (sync[1], "", 1) == 1);
+
+  /* Queued messages, oldest first, then the ones held back, framed
+     like the others. */
+  for (i = 0; i < 5; i++)
+    {
+      frame = remote_read_frame (in);
+      snprintf (expected, sizeof (expected), "<%d>1 ",
+                LOG_LOCAL0 | ((i < 3) ? LOG_NOTICE : LOG_INFO));
+      ck_assert (strncmp (frame, expected, strlen (expected)) == 0);
+      snprintf (expected, sizeof (expected),
+                " umberlog/test_crash_flush %d - - @cee:", (int)child);
+      p = strstr (frame, expected);
+      ck_assert (p != NULL);
+      jo = parse_msg (p + strlen (expected));
+      if (i < 3)
+        snprintf (expected, sizeof (expected), "queued %d", i);
+      else
+        snprintf (expected, sizeof (expected), "context %d", i - 3);
+      verify_value (jo, "msg", expected);
+      verify_value (jo, "program", "umberlog/test_crash_flush");
+      json_object_put (jo);
+      free (frame);
+    }
+
+  ck_assert (waitpid (child, &status, 0) == child);
+  ck_assert (WIFEXITED (status));
+  ck_assert_int_eq (WEXITSTATUS (status), 42);
+  ck_assert (fgetc (in) == EOF);
+
+  fclose (in);
+  close (fd);
+  close (sync[1]);
+}
+END_TEST
+
+/* Log the same messages, formatted right away, and to a binary log. */
+static void
+binary_log_messages (void)
+{
+  errno = EACCES;
+  ul_syslog (LOG_INFO, "%s: %m", "file", NULL);
+  ul_syslog (LOG_WARNING | LOG_DAEMON, "%5d|%-3u|%lx|%.*s|%%|%c|%.2f",
+             -42, 7u, 255ul, 3, "abcdef", 'z', 2.5,
+             "key", "%s", "value",
+             "null", "%s", NULL,
+             "escaped", "\"%s\"", "tab\there",
+             NULL);
+  /* Not captured, written to the log formatted. */
+  ul_syslog (LOG_DEBUG, "%ls", L"wide", NULL);
+  ul_syslog (LOG_ERR, "no conversions", NULL);
+  callsite_log ();
+}
+
+static FILE *
+binary_log_decode (const char *path)
+{
+  char command[PATH_MAX + 64];
+  FILE *out;
+
+  snprintf (command, sizeof (command), "%s %s", UMBERLOG_DECODE, path);
+  out = popen (command, "r");
+  ck_assert (out != NULL);
+  return out;
+}
+
+static void
+binary_log_next (FILE *out, char *line, size_t size)
+{
+  ck_assert (fgets (line, size, out) != NULL);
+  line[strcspn (line, "\n")] = '\0';
+  ck_assert (strncmp (line, "@cee:", 5) == 0);
+}
+
+START_TEST (test_binary_log)
+{
+  char path[] = "/tmp/umberlog-binlog-XXXXXX";
+  char line[4096], expected[64];
+  struct timespec before, after;
+  struct json_object *jo;
+  unsigned long long ts;
+  FILE *out;
+  int fd, i;
+
+  fd = mkstemp (path);
+  ck_assert (fd != -1);
+  close (fd);
+
+  ul_openlog ("umberlog/test_binary_log", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_NOTIME);
+  ul_set_output_handler (capture_output, NULL);
+
+  binary_log_messages ();
+  ck_assert_int_eq (ncaptured, 5);
+  ck_assert (ul_set_binary_log (path) == 0);
+  binary_log_messages ();
+  ck_assert (ul_set_binary_log (NULL) == 0);
+  ck_assert_int_eq (ncaptured, 5);
+
+  /* The decoded messages are exactly what would have been sent. */
+  out = binary_log_decode (path);
+  for (i = 0; i < 5; i++)
+    {
+      binary_log_next (out, line, sizeof (line));
+      ck_assert_str_eq (line + 5, captured[i]);
+    }
+  ck_assert (fgets (line, sizeof (line), out) == NULL);
+  ck_assert_int_eq (pclose (out), 0);
+  capture_reset ();
+
+  /* Sessions can be appended, with different settings. */
+  ul_set_log_flags (LOG_UL_ALL | LOG_UL_THREADINFO);
+  ul_set_timestamp_mode (LOG_UL_TIME_EPOCH_NS);
+  ck_assert (ul_set_binary_log (path) == 0);
+  clock_gettime (CLOCK_REALTIME, &before);
+  ul_syslog (LOG_NOTICE, "second session %d", 2, NULL);
+  clock_gettime (CLOCK_REALTIME, &after);
+  ck_assert (ul_set_binary_log (NULL) == 0);
+  ck_assert_int_eq (ncaptured, 0);
+
+  out = binary_log_decode (path);
+  for (i = 0; i < 6; i++)
+    binary_log_next (out, line, sizeof (line));
+  ck_assert_int_eq (pclose (out), 0);
+
+  jo = parse_msg (line + 5);
+  verify_value (jo, "msg", "second session 2");
+  verify_value (jo, "priority", "notice");
+  verify_value (jo, "program", "umberlog/test_binary_log");
+  snprintf (expected, sizeof (expected), "%d", (int)getpid ());
+  verify_value (jo, "pid", expected);
+  verify_value_exists (jo, "seq");
+#ifdef SYS_gettid
+  snprintf (expected, sizeof (expected), "%ld", (long)syscall (SYS_gettid));
+  verify_value (jo, "tid", expected);
+#endif
+  ts = strtoull (json_object_get_string (json_object_object_get (jo,
+                                                                 "timestamp")),
+                 NULL, 10);
+  ck_assert (ts >= (unsigned long long)before.tv_sec * 1000000000 +
+             before.tv_nsec);
+  ck_assert (ts <= (unsigned long long)after.tv_sec * 1000000000 +
+             after.tv_nsec);
+  json_object_put (jo);
+
+  unlink (path);
+  ul_set_timestamp_mode (LOG_UL_TIME_LOCAL);
+  ul_set_output_handler (NULL, NULL);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_closelog ();
+}
+END_TEST
+
+static void *
+binary_log_zoned_thread (void *data)
+{
+  (void)data;
+
+  /* A new thread, so that nothing was rendered in another zone. */
+  ul_syslog (LOG_NOTICE, "zoned", NULL);
+  return NULL;
+}
+
+/**
+ * Test that local timestamps decode in the time zone of the writer,
+ * not in that of the reader.
+ */
+START_TEST (test_binary_log_zone)
+{
+  char path[] = "/tmp/umberlog-binlog-XXXXXX";
+  char line[4096], command[PATH_MAX + 64];
+  const char *ts;
+  struct json_object *jo;
+  pthread_t thread;
+  FILE *out;
+  int fd;
+
+  fd = mkstemp (path);
+  ck_assert (fd != -1);
+  close (fd);
+
+  setenv ("TZ", "IST-5:30", 1);
+  tzset ();
+  ul_openlog ("umberlog/test_binary_log_zone", 0, LOG_LOCAL0);
+  ck_assert (ul_set_binary_log (path) == 0);
+  ck_assert (pthread_create (&thread, NULL, binary_log_zoned_thread,
+                             NULL) == 0);
+  pthread_join (thread, NULL);
+  ck_assert (ul_set_binary_log (NULL) == 0);
+  unsetenv ("TZ");
+  tzset ();
+
+  snprintf (command, sizeof (command), "TZ=EST5 %s %s", UMBERLOG_DECODE,
+            path);
+  out = popen (command, "r");
+  ck_assert (out != NULL);
+  binary_log_next (out, line, sizeof (line));
+  ck_assert_int_eq (pclose (out), 0);
+
+  jo = parse_msg (line + 5);
+  verify_value (jo, "msg", "zoned");
+  ts = json_object_get_string (json_object_object_get (jo, "timestamp"));
+  ck_assert (strlen (ts) > 5);
+  ck_assert_str_eq (ts + strlen (ts) - 5, "+0530");
+  json_object_put (jo);
+
+  unlink (path);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that records written after a failed write to a binary log
+ * still decode: the strings defined in what could not be written are
+ * defined again.
+ */
+START_TEST (test_binary_log_write_error)
+{
+  char path[] = "/tmp/umberlog-binlog-XXXXXX";
+  char line[4096];
+  struct rlimit limit, saved;
+  struct json_object *jo;
+  struct stat st;
+  FILE *out;
+  int fd;
+
+  fd = mkstemp (path);
+  ck_assert (fd != -1);
+  close (fd);
+
+  ul_openlog ("umberlog/test_binary_log_write_error", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+  signal (SIGXFSZ, SIG_IGN);
+
+  /* Errors are flushed right away. */
+  ck_assert (ul_set_binary_log (path) == 0);
+  ul_syslog (LOG_ERR, "first site %d", 1, NULL);
+
+  /* Only part of the next flush fits. */
+  ck_assert (stat (path, &st) == 0);
+  ck_assert (getrlimit (RLIMIT_FSIZE, &saved) == 0);
+  limit = saved;
+  limit.rlim_cur = st.st_size + 10;
+  ck_assert (setrlimit (RLIMIT_FSIZE, &limit) == 0);
+  ul_syslog (LOG_ERR, "second site %d", 2, NULL);
+  ck_assert (setrlimit (RLIMIT_FSIZE, &saved) == 0);
+
+  ul_syslog (LOG_ERR, "second site %d", 3, NULL);
+  ul_syslog (LOG_ERR, "first site %d", 4, NULL);
+  ck_assert (ul_set_binary_log (NULL) == 0);
+  ck_assert_int_eq (ncaptured, 0);
+  signal (SIGXFSZ, SIG_DFL);
+
+  out = binary_log_decode (path);
+  binary_log_next (out, line, sizeof (line));
+  jo = parse_msg (line + 5);
+  verify_value (jo, "msg", "first site 1");
+  json_object_put (jo);
+  binary_log_next (out, line, sizeof (line));
+  jo = parse_msg (line + 5);
+  verify_value (jo, "msg", "second site 3");
+  json_object_put (jo);
+  binary_log_next (out, line, sizeof (line));
+  jo = parse_msg (line + 5);
+  verify_value (jo, "msg", "first site 4");
+  json_object_put (jo);
+  ck_assert (fgets (line, sizeof (line), out) == NULL);
+  ck_assert_int_eq (pclose (out), 0);
+
+  unlink (path);
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test choosing the implicit fields one by one.
+ */
+START_TEST (test_implicit_fields)
+{
+  char path[] = "/tmp/umberlog-fields-XXXXXX";
+  char line[4096];
+  struct json_object *jo;
+  FILE *out;
+  char *msg;
+  int fd;
+
+  ul_openlog ("umberlog/test_implicit_fields", 0, LOG_LOCAL0);
+  ul_set_log_flags (LOG_UL_ALL);
+
+  ck_assert (ul_set_implicit_fields (LOG_UL_FIELD_PRIORITY |
+                                     LOG_UL_FIELD_TIMESTAMP) == 0);
+  msg = ul_format (LOG_INFO, "fields", NULL);
+  jo = parse_msg (msg);
+  free (msg);
+  verify_value (jo, "priority", "info");
+  verify_value_exists (jo, "timestamp");
+  verify_value_missing (jo, "pid");
+  verify_value_missing (jo, "facility");
+  verify_value_missing (jo, "uid");
+  verify_value_missing (jo, "gid");
+  verify_value_missing (jo, "host");
+  verify_value_missing (jo, "program");
+  json_object_put (jo);
+
+  /* The flags still apply on top. */
+  ul_set_log_flags (LOG_UL_NOTIME);
+  msg = ul_format (LOG_INFO, "fields", NULL);
+  jo = parse_msg (msg);
+  free (msg);
+  verify_value (jo, "priority", "info");
+  verify_value_missing (jo, "timestamp");
+  json_object_put (jo);
+
+  /* Binary logs remember the choice. */
+  fd = mkstemp (path);
+  ck_assert (fd != -1);
+  close (fd);
+  ck_assert (ul_set_implicit_fields (LOG_UL_FIELD_HOST |
+                                     LOG_UL_FIELD_PROGRAM) == 0);
+  ck_assert (ul_set_binary_log (path) == 0);
+  ul_syslog (LOG_INFO, "fields", NULL);
+  ck_assert (ul_set_binary_log (NULL) == 0);
+  out = binary_log_decode (path);
+  binary_log_next (out, line, sizeof (line));
+  ck_assert_int_eq (pclose (out), 0);
+  jo = parse_msg (line + 5);
+  verify_value (jo, "program", "umberlog/test_implicit_fields");
+  verify_value_exists (jo, "host");
+  verify_value_missing (jo, "priority");
+  verify_value_missing (jo, "pid");
+  json_object_put (jo);
+  unlink (path);
+
+  ck_assert (ul_set_implicit_fields (0x100) == -1);
+  ck_assert_int_eq (errno, EINVAL);
+
+  ul_set_implicit_fields (LOG_UL_FIELD_ALL);
+  ul_set_log_flags (LOG_UL_ALL);
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test for correct JSON escaping.
+ */
+START_TEST (test_json_escape)
+{
+  static const char control_chars[] =
+    "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+    "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f"
+    "\x20";
+
+  char *msg;
+  struct json_object *jo;
+
+  ul_openlog ("umberlog/test_json_escape", 0, LOG_LOCAL0);
+
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__,
+                   "quotes", "Hi, \"quoted value\" speaking!",
+                   "\"really\"", "yeah",
+                   "control", "foo\nbar",
+                   "utf8", "Árvíztűrő tükörfúrógép",
+                   "junk", "\013foo",
+                   "all_control", control_chars,
+                   NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+  verify_value (jo, "quotes", "Hi, \"quoted value\" speaking!");
+  verify_value (jo, "\"really\"", "yeah");
+  verify_value (jo, "control", "foo\nbar");
+  verify_value (jo, "utf8", "Árvíztűrő tükörfúrógép");
+  verify_value (jo, "junk", "\013foo");
+  verify_value (jo, "all_control", control_chars);
+
+  json_object_put (jo);
+
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that using a FACILITY | PRIORITY combo with ul_format has the
+ * desired result.
+ */
+START_TEST (test_facprio)
+{
+  char *msg;
+  struct json_object *jo;
+
+  msg = ul_format (LOG_LOCAL1 | LOG_DEBUG, "%s", __FUNCTION__,
+                   NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+  verify_value (jo, "facility", "local1");
+  verify_value (jo, "priority", "debug");
+
+  json_object_put (jo);
+}
+END_TEST
+
+/**
+ * Test that keys are not cached by their address alone: reusing the
+ * same buffer for different keys must still produce the right keys.
+ */
+START_TEST (test_key_reuse)
+{
+  char *msg;
+  struct json_object *jo;
+  char key[32];
+  int i;
+
+  ul_openlog ("umberlog/test_key_reuse", 0, LOG_LOCAL0);
+
+  for (i = 0; i < 3; i++)
+    {
+      char value[16];
+
+      snprintf (key, sizeof (key), i == 2 ? "key\"%d" : "key%d", i);
+      snprintf (value, sizeof (value), "%d", i);
+
+      msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__,
+                       key, "%d", i,
+                       NULL);
+      jo = parse_msg (msg);
+      free (msg);
+
+      verify_value (jo, key, value);
+
+      json_object_put (jo);
+    }
+
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test that the trivial formats handled without printf() produce the
+ * same output printf() would.
+ */
+START_TEST (test_trivial_formats)
+{
+  char *msg, *expected;
+  struct json_object *jo;
+
+  ul_openlog ("umberlog/test_trivial_formats", 0, LOG_LOCAL0);
+
+  msg = ul_format (LOG_DEBUG, "%s", __FUNCTION__,
+                   "int_min", "%d", INT_MIN,
+                   "int_zero", "%d", 0,
+                   "uint_max", "%u", UINT_MAX,
+                   "long_min", "%ld", LONG_MIN,
+                   "ulong_max", "%lu", ULONG_MAX,
+                   "size", "%zu", (size_t)1234567890,
+                   "null", "%s", NULL,
+                   "literal", "100%% literal",
+                   "plain", "no conversions",
+                   NULL);
+  jo = parse_msg (msg);
+  free (msg);
+
+  verify_value (jo, "msg", "test_trivial_formats");
+
+#define VERIFY_PRINTF(key, fmt, value)                   \
+  if (asprintf (&expected, fmt, value) == -1)            \
+    abort ();                                            \
+  verify_value (jo, key, expected);                      \
+  free (expected)
+
+  VERIFY_PRINTF ("int_min", "%d", INT_MIN);
+  VERIFY_PRINTF ("uint_max", "%u", UINT_MAX);
+  VERIFY_PRINTF ("long_min", "%ld", LONG_MIN);
+  VERIFY_PRINTF ("ulong_max", "%lu", ULONG_MAX);
+#undef VERIFY_PRINTF
+
+  verify_value (jo, "int_zero", "0");
+  verify_value (jo, "size", "1234567890");
+  verify_value (jo, "null", "(null)");
+  verify_value (jo, "literal", "100% literal");
+  verify_value (jo, "plain", "no conversions");
+
+  json_object_put (jo);
+
+  ul_closelog ();
+}
+END_TEST
+
+/**
+ * Test the messages of legacy syslog() calls, which are printed
+ * straight into the buffer, and escaped there.
+ */
+START_TEST (test_legacy_format)
+{
+  char long_value[2048], *expected;
+  struct json_object *jo;
+
+  ul_openlog ("umberlog/test_legacy_format", 0, LOG_LOCAL0);
+  ul_set_output_handler (capture_output, NULL);
+
+  memset (long_value, 'x', sizeof (long_value) - 1);
+  long_value[sizeof (long_value) - 1] = '\0';
+  long_value[1000] = '"';
+  long_value[2000] = '\n';
+
+  ul_legacy_syslog (LOG_INFO, "plain %% message");
+  ul_legacy_syslog (LOG_INFO, "%s", NULL);
+  ul_legacy_syslog (LOG_INFO, "user %s from %s port %d", "a\"b\\c",
+                    "line\nbreak\x01", 22);
+  ul_legacy_syslog (LOG_INFO, "<%s>", long_value);
+  ul_legacy_syslog (LOG_INFO, "cut%cshort", '\0');
+
+  ck_assert_int_eq (ncaptured, 5);
+
+  jo = parse_msg (captured[0]);
+  verify_value (jo, "msg", "plain % message");
+  verify_value_exists (jo, "pid");
+  json_object_put (jo);
+
+  jo = parse_msg (captured[1]);
+  verify_value (jo, "msg", "(null)");
+  json_object_put (jo);
+
+  jo = parse_msg (captured[2]);
+  verify_value (jo, "msg", "user a\"b\\c from line\nbreak\x01 port 22");
+  json_object_put (jo);
+
+  jo = parse_msg (captured[3]);
+  if (asprintf (&expected, "<%s>", long_value) == -1)
+    abort ();
+  verify_value (jo, "msg", expected);
+  free (expected);
+  json_object_put (jo);
+
+  jo = parse_msg (captured[4]);
+  verify_value (jo, "msg", "cut");
+  json_object_put (jo);
+
+  capture_reset ();
+  ul_set_output_handler (NULL, NULL);
+  ul_closelog ();
 }
 END_TEST
 
@@ -421,6 +2840,38 @@ main (void)
   tcase_add_test (ft, test_no_implicit);
   tcase_add_test (ft, test_additional_fields);
   tcase_add_test (ft, test_discover_priority);
+  tcase_add_test (ft, test_trivial_formats);
+  tcase_add_test (ft, test_legacy_format);
+  tcase_add_test (ft, test_fork_pid);
+  tcase_add_test (ft, test_thread_info);
+  tcase_add_test (ft, test_timestamp_modes);
+  tcase_add_test (ft, test_rate_limit);
+  tcase_add_test (ft, test_rate_limit_quiet);
+  tcase_add_test (ft, test_rate_limit_quiet_freed);
+  tcase_add_test (ft, test_sampling);
+  tcase_add_test (ft, test_flight_recorder);
+  tcase_add_test (ft, test_async);
+  tcase_add_test (ft, test_async_no_memory);
+  tcase_add_test (ft, test_queue_policy);
+  tcase_add_test (ft, test_priority_lanes);
+  tcase_add_test (ft, test_binary_log);
+  tcase_add_test (ft, test_binary_log_write_error);
+  tcase_add_test (ft, test_binary_log_zone);
+  tcase_add_test (ft, test_implicit_fields);
+  tcase_add_test (ft, test_syslog_socket);
+  tcase_add_test (ft, test_syslog_batch);
+  tcase_add_test (ft, test_syslog_batch_limits);
+  tcase_add_test (ft, test_templates);
+  tcase_add_test (ft, test_callsites);
+  tcase_add_test (ft, test_callsites_unregister);
+  tcase_add_test (ft, test_stats_export);
+  tcase_add_test (ft, test_stats_export_planted);
+  tcase_add_test (ft, test_stats_export_stuck);
+  tcase_add_test (ft, test_control_file);
+  tcase_add_test (ft, test_syslog_signal_safe);
+  tcase_add_test (ft, test_crash_flush);
+  tcase_add_test (ft, test_remote);
+  tcase_add_test (ft, test_crash_flush_remote);
 #ifdef HAVE_PARSE_PRINTF_FORMAT
   tcase_add_test (ft, test_positional_params);
 #endif
@@ -429,6 +2880,7 @@ main (void)
   bt = tcase_create ("Bug tests");
   tcase_add_test (bt, test_json_escape);
   tcase_add_test (bt, test_facprio);
+  tcase_add_test (bt, test_key_reuse);
   suite_add_tcase (s, bt);
 
   sr = srunner_create (s);
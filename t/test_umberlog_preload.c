@@ -11,6 +11,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include <check.h>
 
@@ -117,14 +122,227 @@ START_TEST (test_simple)
 }
 END_TEST
 
+/* The environment is only read at startup: run ourselves again, with
+   ENV added to it, to format a message there, and log it too. */
+static struct json_object *
+env_format (const char *env)
+{
+  char self[PATH_MAX], command[PATH_MAX * 2], line[4096];
+  ssize_t len;
+  FILE *out;
+
+  len = readlink ("/proc/self/exe", self, sizeof (self) - 1);
+  ck_assert (len > 0);
+  self[len] = '\0';
+
+  snprintf (command, sizeof (command), "env %s %s --format", env, self);
+  out = popen (command, "r");
+  ck_assert (out != NULL);
+  ck_assert (fgets (line, sizeof (line), out) != NULL);
+  ck_assert_int_eq (pclose (out), 0);
+  line[strcspn (line, "\n")] = '\0';
+
+  return parse_msg (line);
+}
+
+/**
+ * Test the flags and timestamp mode set from the environment.
+ */
+START_TEST (test_env_flags)
+{
+  struct json_object *jo, *ts;
+
+  jo = env_format ("UL_FLAGS=notime");
+  verify_value_missing (jo, "timestamp");
+  verify_value_exists (jo, "pid");
+  json_object_put (jo);
+
+  jo = env_format ("UL_FLAGS=LOG_UL_THREADINFO UL_TIMESTAMP=epoch_ms,coarse");
+  verify_value_exists (jo, "seq");
+  ts = json_object_object_get (jo, "timestamp");
+  ck_assert (ts != NULL);
+  ck_assert (json_object_get_type (ts) == json_type_int);
+  json_object_put (jo);
+}
+END_TEST
+
+/**
+ * Test sending to a socket, from the background thread, as set from
+ * the environment.
+ */
+START_TEST (test_env_sinks)
+{
+  char dir[] = "/tmp/umberlog-env-XXXXXX";
+  char path[PATH_MAX], env[PATH_MAX + 128], buf[4096];
+  struct sockaddr_un sun;
+  struct timeval tv = { 5, 0 };
+  ssize_t len;
+  char *msg;
+  int fd;
+
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/log", dir);
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+  ck_assert (fd >= 0);
+  ck_assert (bind (fd, (struct sockaddr *)&sun, sizeof (sun)) == 0);
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+  snprintf (env, sizeof (env), "UL_SOCKET=%s,100 UL_ASYNC=64k "
+            "UL_QUEUE_POLICY=block,100", path);
+  json_object_put (env_format (env));
+
+  len = recv (fd, buf, sizeof (buf) - 1, 0);
+  ck_assert (len > 0);
+  buf[len] = '\0';
+  msg = strstr (buf, "@cee:");
+  ck_assert (msg != NULL);
+  ck_assert (strstr (msg, "\"msg\":\"environment\"") != NULL);
+
+  close (fd);
+  unlink (path);
+  rmdir (dir);
+}
+END_TEST
+
+/**
+ * Test choosing the implicit fields with UL_FIELDS.
+ */
+START_TEST (test_env_fields)
+{
+  struct json_object *jo;
+
+  jo = env_format ("UL_FIELDS=priority,timestamp");
+  verify_value (jo, "priority", "info");
+  verify_value_exists (jo, "timestamp");
+  verify_value_missing (jo, "pid");
+  verify_value_missing (jo, "host");
+  verify_value_missing (jo, "program");
+  json_object_put (jo);
+
+  /* Values that do not parse are ignored. */
+  jo = env_format ("UL_FIELDS=priority,colour");
+  verify_value_exists (jo, "pid");
+  verify_value_exists (jo, "host");
+  json_object_put (jo);
+}
+END_TEST
+
+/**
+ * Test that a daemon, which forks before logging anything, keeps the
+ * sinks set from the environment.
+ */
+START_TEST (test_env_fork)
+{
+  char dir[] = "/tmp/umberlog-env-XXXXXX";
+  char self[PATH_MAX], path[PATH_MAX], command[PATH_MAX * 4], line[4096];
+  struct json_object *jo;
+  int stats = 0;
+  ssize_t len;
+  FILE *f;
+
+  ck_assert (mkdtemp (dir) != NULL);
+  snprintf (path, sizeof (path), "%s/control", dir);
+  f = fopen (path, "w");
+  ck_assert (f != NULL);
+  fputs ("fields = priority\n", f);
+  ck_assert (fclose (f) == 0);
+
+  len = readlink ("/proc/self/exe", self, sizeof (self) - 1);
+  ck_assert (len > 0);
+  self[len] = '\0';
+
+  snprintf (command, sizeof (command),
+            "env UL_BINARY_LOG=%s/log UL_STATS=100 UL_CONTROL=%s %s --daemon",
+            dir, path, self);
+  f = popen (command, "r");
+  ck_assert (f != NULL);
+  ck_assert (fgets (line, sizeof (line), f) != NULL);
+  line[strcspn (line, "\n")] = '\0';
+  jo = parse_msg (line);
+  verify_value (jo, "priority", "info");
+  verify_value_missing (jo, "pid");
+  json_object_put (jo);
+  ck_assert (fscanf (f, "stats %d", &stats) == 1);
+  ck_assert_int_eq (stats, 1);
+  /* The child closes the pipe once it wrote out its log. */
+  while (fgets (line, sizeof (line), f) != NULL)
+    ;
+  ck_assert_int_eq (pclose (f), 0);
+
+  snprintf (command, sizeof (command), "%s %s/log", UMBERLOG_DECODE, dir);
+  f = popen (command, "r");
+  ck_assert (f != NULL);
+  ck_assert (fgets (line, sizeof (line), f) != NULL);
+  ck_assert (strstr (line, "\"msg\":\"daemon\"") != NULL);
+  ck_assert_int_eq (pclose (f), 0);
+
+  unlink (path);
+  snprintf (path, sizeof (path), "%s/log", dir);
+  unlink (path);
+  rmdir (dir);
+}
+END_TEST
+
+/* Like a daemon: fork before logging anything, and log from the child
+   once the parent exited. Prints the message formatted there, and
+   whether the statistics segment of the child exists. */
+static int
+daemon_format (void)
+{
+  char name[32], byte, *msg;
+  int sync[2], fd;
+  pid_t child;
+
+  if (pipe (sync) != 0 || (child = fork ()) == -1)
+    return EXIT_FAILURE;
+  if (child > 0)
+    return EXIT_SUCCESS;
+
+  /* The pipe is closed once the parent is gone. */
+  close (sync[1]);
+  if (read (sync[0], &byte, 1) != 0)
+    return EXIT_FAILURE;
+
+  syslog (LOG_INFO, "daemon");
+  msg = ul_format (LOG_INFO, "daemon", NULL);
+  if (msg == NULL)
+    return EXIT_FAILURE;
+  puts (msg);
+  free (msg);
+
+  snprintf (name, sizeof (name), "/umberlog.%d", (int)getpid ());
+  fd = shm_open (name, O_RDONLY, 0);
+  printf ("stats %d\n", fd != -1);
+  if (fd != -1)
+    close (fd);
+  return EXIT_SUCCESS;
+}
+
 int
-main (void)
+main (int argc, char *argv[])
 {
   Suite *s;
   SRunner *sr;
   TCase *ft, *bt;
   int nfailed;
 
+  if (argc > 1 && strcmp (argv[1], "--format") == 0)
+    {
+      char *msg = ul_format (LOG_INFO, "environment", NULL);
+
+      if (msg == NULL)
+        return EXIT_FAILURE;
+      puts (msg);
+      free (msg);
+      syslog (LOG_INFO, "environment");
+      return EXIT_SUCCESS;
+    }
+  if (argc > 1 && strcmp (argv[1], "--daemon") == 0)
+    return daemon_format ();
+
   s = suite_create ("Umberlog (LD_PRELOAD) functional testsuite");
 
 #if DEFAULT_LOG_FLAGS == LOG_UL_ALL
@@ -135,6 +353,13 @@ main (void)
   suite_add_tcase (s, ft);
 #endif
 
+  bt = tcase_create ("Environment");
+  tcase_add_test (bt, test_env_fields);
+  tcase_add_test (bt, test_env_flags);
+  tcase_add_test (bt, test_env_sinks);
+  tcase_add_test (bt, test_env_fork);
+  suite_add_tcase (s, bt);
+
   sr = srunner_create (s);
 
   srunner_run_all (sr, CK_ENV);
@@ -0,0 +1,232 @@
+/* ulstat.c -- Report the statistics a libumberlog process exports
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/* The upper bound of a latency bucket, in microseconds. */
+static double
+bucket_us (unsigned int bucket)
+{
+  return (double)(1ULL << (UL_STATS_LATENCY_SHIFT + bucket)) / 1000.0;
+}
+
+/* The bucket under which a fraction of the calls in LATENCY fall. */
+static double
+percentile (const uint64_t *latency, double fraction)
+{
+  uint64_t total = 0, seen = 0;
+  unsigned int i;
+
+  for (i = 0; i < UL_STATS_LATENCY_BUCKETS; i++)
+    total += latency[i];
+  if (total == 0)
+    return 0;
+
+  for (i = 0; i < UL_STATS_LATENCY_BUCKETS; i++)
+    {
+      seen += latency[i];
+      if (seen >= total * fraction)
+        break;
+    }
+  if (i == UL_STATS_LATENCY_BUCKETS)
+    i--;
+  return bucket_us (i);
+}
+
+static void
+print_header (void)
+{
+  printf ("%10s %8s %8s %8s %8s %8s %10s %8s %8s %8s %8s\n",
+          "msgs", "err", "warn", "notice", "info", "debug",
+          "kB", "drops", "p50us", "p99us", "ringkB");
+}
+
+/* Print the difference between two snapshots, scaled to a second
+   when SECONDS is not zero. */
+static void
+print_line (const ul_stats_counters_t *now, const ul_stats_counters_t *then,
+            double seconds)
+{
+  uint64_t messages[8], latency[UL_STATS_LATENCY_BUCKETS], total = 0;
+  double scale = (seconds > 0) ? 1.0 / seconds : 1.0;
+  uint64_t drops;
+  unsigned int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      messages[i] = now->messages[i] - then->messages[i];
+      total += messages[i];
+    }
+  for (i = 0; i < UL_STATS_LATENCY_BUCKETS; i++)
+    latency[i] = now->latency[i] - then->latency[i];
+  drops = (now->suppressed - then->suppressed) +
+    (now->dropped - then->dropped) +
+    (now->send_failed - then->send_failed) +
+    (now->remote_dropped - then->remote_dropped);
+
+  printf ("%10.0f %8.0f %8.0f %8.0f %8.0f %8.0f %10.1f %8.0f %8.1f %8.1f "
+          "%8.1f\n",
+          total * scale,
+          (messages[LOG_EMERG] + messages[LOG_ALERT] + messages[LOG_CRIT] +
+           messages[LOG_ERR]) * scale,
+          messages[LOG_WARNING] * scale, messages[LOG_NOTICE] * scale,
+          messages[LOG_INFO] * scale, messages[LOG_DEBUG] * scale,
+          (now->bytes - then->bytes) * scale / 1024.0,
+          drops * scale,
+          percentile (latency, 0.50), percentile (latency, 0.99),
+          now->ring_memory / 1024.0);
+}
+
+static void
+usage (FILE *out, const char *name)
+{
+  fprintf (out, "Usage: %s [-a] [-i INTERVAL] [-c COUNT] PID\n"
+           "Report the statistics a libumberlog process exports.\n"
+           "  -a           print totals instead of rates\n"
+           "  -i INTERVAL  seconds between reports (default 1)\n"
+           "  -c COUNT     stop after COUNT reports\n",
+           name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ul_stats_counters_t now, then;
+  ul_stats_shm_t *shm;
+  uint64_t now_ns, then_ns;
+  double interval = 1;
+  long count = -1, n;
+  int opt, totals = 0;
+  pid_t pid;
+  char *end;
+
+  while ((opt = getopt (argc, argv, "ai:c:h")) != -1)
+    switch (opt)
+      {
+      case 'a':
+        totals = 1;
+        break;
+      case 'i':
+        interval = strtod (optarg, &end);
+        if (*end != '\0' || interval <= 0)
+          {
+            fprintf (stderr, "%s: invalid interval: %s\n", argv[0], optarg);
+            return 2;
+          }
+        break;
+      case 'c':
+        count = strtol (optarg, &end, 10);
+        if (*end != '\0' || count <= 0)
+          {
+            fprintf (stderr, "%s: invalid count: %s\n", argv[0], optarg);
+            return 2;
+          }
+        break;
+      case 'h':
+        usage (stdout, argv[0]);
+        return 0;
+      default:
+        usage (stderr, argv[0]);
+        return 2;
+      }
+
+  if (optind != argc - 1)
+    {
+      usage (stderr, argv[0]);
+      return 2;
+    }
+  pid = strtol (argv[optind], &end, 10);
+  if (*end != '\0' || pid <= 0)
+    {
+      fprintf (stderr, "%s: invalid pid: %s\n", argv[0], argv[optind]);
+      return 2;
+    }
+
+  shm = ul_stats_attach (pid);
+  if (shm == NULL)
+    {
+      if (errno == ENOENT)
+        fprintf (stderr, "%s: process %d does not export statistics "
+                 "(see ul_set_stats_export())\n", argv[0], (int)pid);
+      else
+        fprintf (stderr, "%s: %d: %s\n", argv[0], (int)pid,
+                 strerror (errno));
+      return 1;
+    }
+
+  /* Like vmstat, the first report covers the whole life of the
+     process, and the ones after it only the interval before them. */
+  memset (&then, 0, sizeof (then));
+  then_ns = 0;
+  print_header ();
+  for (n = 0; count < 0 || n < count; n++)
+    {
+      if (n > 0)
+        {
+          usleep (interval * 1000000);
+          if (kill (pid, 0) != 0 && errno == ESRCH)
+            break;
+        }
+
+      if (ul_stats_read (shm, &now, &now_ns) != 0)
+        {
+          /* The process stopped in the middle of an update: what
+             could be read may not add up. */
+          fflush (stdout);
+          fprintf (stderr, "%s: %d: statistics are being updated, "
+                   "skipping\n", argv[0], (int)pid);
+          continue;
+        }
+      if (totals)
+        print_line (&now, &then, 0);
+      else
+        {
+          print_line (&now, &then,
+                      (n > 0 && now_ns > then_ns) ?
+                      (now_ns - then_ns) / 1e9 : 0);
+          then = now;
+          then_ns = now_ns;
+        }
+      fflush (stdout);
+    }
+
+  ul_stats_detach (shm);
+  return 0;
+}
@@ -0,0 +1,553 @@
+/* umberlog-decode.c -- Render binary logs as CEE-JSON
+ *
+ * Copyright (c) 2012 BalaBit IT Security Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BALABIT AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL BALABIT OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE 1
+#define SYSLOG_NAMES 1
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "umberlog.h"
+#include "buffer.h"
+#include "fmt.h"
+#include "binlog.h"
+
+typedef struct
+{
+  char *str;
+  size_t len;
+  ul_fmt_t *fmt;   /* Compiled when first used as a format */
+} decode_string_t;
+
+/* Largest string ID accepted, to keep a corrupt file from making us
+   allocate all the memory there is. */
+#define MAX_STRING_ID (16 * 1024 * 1024)
+
+typedef struct
+{
+  const char *name;
+  int valid;           /* Seen a header */
+  decode_string_t *strings;
+  size_t nstrings;
+  int64_t last_ns;
+  int context_valid;
+  int flags, fields, facility, timestamp_mode;
+  int gmtoff_valid;    /* If not, local time is the reader's */
+  long gmtoff;
+  uint64_t pid, uid, gid;
+  char *host;
+  char *program;
+  ul_buffer_t json, text, tmp;
+} decoder_t;
+
+static void
+decoder_reset (decoder_t *d)
+{
+  size_t i;
+
+  for (i = 0; i < d->nstrings; i++)
+    {
+      free (d->strings[i].str);
+      ul_fmt_free (d->strings[i].fmt);
+    }
+  free (d->strings);
+  d->strings = NULL;
+  d->nstrings = 0;
+  d->last_ns = 0;
+  d->context_valid = 0;
+}
+
+static int
+decode_string (decoder_t *d, const char *p, const char *end)
+{
+  uint64_t id;
+  decode_string_t *s;
+
+  if (ul_binlog_get_varint (&p, end, &id) != 0 || id == 0 ||
+      id > MAX_STRING_ID)
+    return -1;
+
+  if (id >= d->nstrings)
+    {
+      size_t n = id + 1 + d->nstrings;
+
+      s = realloc (d->strings, n * sizeof (*s));
+      if (s == NULL)
+        return -1;
+      memset (s + d->nstrings, 0, (n - d->nstrings) * sizeof (*s));
+      d->strings = s;
+      d->nstrings = n;
+    }
+
+  s = &d->strings[id];
+  free (s->str);
+  ul_fmt_free (s->fmt);
+  s->fmt = NULL;
+  s->len = end - p;
+  s->str = malloc (s->len + 1);
+  if (s->str == NULL)
+    return -1;
+  memcpy (s->str, p, s->len);
+  s->str[s->len] = '\0';
+
+  return 0;
+}
+
+static int
+decode_bytes (const char **p, const char *end, const char **str,
+              size_t *len)
+{
+  uint64_t l;
+
+  if (ul_binlog_get_varint (p, end, &l) != 0 || l > (uint64_t)(end - *p))
+    return -1;
+  *str = *p;
+  *len = l;
+  *p += l;
+  return 0;
+}
+
+static char *
+decode_strndup (const char *str, size_t len)
+{
+  char *s = malloc (len + 1);
+
+  if (s == NULL)
+    return NULL;
+  memcpy (s, str, len);
+  s[len] = '\0';
+  return s;
+}
+
+static int
+decode_context (decoder_t *d, const char *p, const char *end)
+{
+  uint64_t flags, facility, mode, program_len, fields = LOG_UL_FIELD_ALL;
+  uint64_t gmtoff;
+  const char *str;
+  size_t len;
+
+  if (ul_binlog_get_varint (&p, end, &flags) != 0 ||
+      ul_binlog_get_varint (&p, end, &facility) != 0 ||
+      ul_binlog_get_varint (&p, end, &mode) != 0 ||
+      ul_binlog_get_varint (&p, end, &d->pid) != 0 ||
+      ul_binlog_get_varint (&p, end, &d->uid) != 0 ||
+      ul_binlog_get_varint (&p, end, &d->gid) != 0 ||
+      decode_bytes (&p, end, &str, &len) != 0)
+    return -1;
+  d->flags = flags;
+  d->facility = facility;
+  d->timestamp_mode = mode;
+
+  free (d->host);
+  free (d->program);
+  d->program = NULL;
+  d->host = decode_strndup (str, len);
+  if (d->host == NULL)
+    return -1;
+
+  if (ul_binlog_get_varint (&p, end, &program_len) != 0 ||
+      program_len > (uint64_t)(end - p) + 1)
+    return -1;
+  if (program_len > 0 &&
+      (d->program = decode_strndup (p, program_len - 1)) == NULL)
+    return -1;
+  p += (program_len > 0) ? program_len - 1 : 0;
+  if (p < end && ul_binlog_get_varint (&p, end, &fields) != 0)
+    return -1;
+  d->fields = fields;
+  d->gmtoff_valid = 0;
+  if (p < end)
+    {
+      if (ul_binlog_get_varint (&p, end, &gmtoff) != 0)
+        return -1;
+      d->gmtoff = (long)(int64_t)((gmtoff >> 1) ^ -(gmtoff & 1));
+      d->gmtoff_valid = 1;
+    }
+
+  d->context_valid = 1;
+  return 0;
+}
+
+/* Resolve a string reference. Strings stored in the record itself are
+   copied to TMP, so that they are NUL-terminated too. */
+static decode_string_t *
+decode_string_ref (decoder_t *d, const char **p, const char *end,
+                   decode_string_t *tmp)
+{
+  uint64_t id;
+  const char *str;
+  size_t len;
+
+  if (ul_binlog_get_varint (p, end, &id) != 0)
+    return NULL;
+  if (id != 0)
+    {
+      if (id >= d->nstrings || d->strings[id].str == NULL)
+        return NULL;
+      return &d->strings[id];
+    }
+
+  if (decode_bytes (p, end, &str, &len) != 0)
+    return NULL;
+  d->tmp.ptr = d->tmp.msg;
+  if (ul_buffer_append_raw (&d->tmp, str, len) == NULL ||
+      ul_buffer_append_raw (&d->tmp, "", 1) == NULL)
+    return NULL;
+  tmp->str = d->tmp.msg;
+  tmp->len = len;
+  tmp->fmt = NULL;
+  return tmp;
+}
+
+static const char *
+find_name (const CODE *names, int value)
+{
+  int i;
+
+  for (i = 0; names[i].c_name != NULL; i++)
+    if (names[i].c_val == value)
+      return names[i].c_name;
+  return "<unknown>";
+}
+
+/* Keep in sync with the timestamp renderers in umberlog.c. */
+static ul_buffer_t *
+decode_timestamp (decoder_t *d, ul_buffer_t *buffer, int64_t ns)
+{
+  struct timespec ts;
+  char stamp[64], *p;
+  struct tm tm;
+  time_t local;
+  long offset;
+
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  if (ts.tv_nsec < 0)
+    {
+      ts.tv_sec--;
+      ts.tv_nsec += 1000000000;
+    }
+
+  switch (d->timestamp_mode)
+    {
+    case LOG_UL_TIME_EPOCH_S:
+      return ul_buffer_append_number (buffer, "timestamp", ts.tv_sec);
+    case LOG_UL_TIME_EPOCH_MS:
+      return ul_buffer_append_number (buffer, "timestamp",
+                                      (uintmax_t)ts.tv_sec * 1000 +
+                                      ts.tv_nsec / 1000000);
+    case LOG_UL_TIME_EPOCH_NS:
+      return ul_buffer_append_number (buffer, "timestamp",
+                                      (uintmax_t)ts.tv_sec * 1000000000 +
+                                      ts.tv_nsec);
+    case LOG_UL_TIME_UTC:
+      if (gmtime_r (&ts.tv_sec, &tm) == NULL)
+        return NULL;
+      p = stamp + strftime (stamp, sizeof (stamp), "%FT%T", &tm);
+      snprintf (p, sizeof (stamp) - (p - stamp), ".%09ldZ", ts.tv_nsec);
+      break;
+    default:
+      if (!d->gmtoff_valid)
+        {
+          if (localtime_r (&ts.tv_sec, &tm) == NULL)
+            return NULL;
+          p = stamp + strftime (stamp, sizeof (stamp), "%FT%T", &tm);
+          p += snprintf (p, sizeof (stamp) - (p - stamp), ".%09ld",
+                         ts.tv_nsec);
+          strftime (p, sizeof (stamp) - (p - stamp), "%z", &tm);
+          break;
+        }
+
+      /* The local time of the writer, whatever ours is. */
+      local = ts.tv_sec + d->gmtoff;
+      if (gmtime_r (&local, &tm) == NULL)
+        return NULL;
+      offset = d->gmtoff < 0 ? -d->gmtoff : d->gmtoff;
+      p = stamp + strftime (stamp, sizeof (stamp), "%FT%T", &tm);
+      snprintf (p, sizeof (stamp) - (p - stamp), ".%09ld%c%02ld%02ld",
+                ts.tv_nsec, d->gmtoff < 0 ? '-' : '+', offset / 3600,
+                offset / 60 % 60);
+      break;
+    }
+
+  return ul_buffer_append (buffer, "timestamp", stamp);
+}
+
+/* Render a record the same way _ul_vformat() and _ul_discover() in
+   umberlog.c would. */
+static const char *
+decode_record (decoder_t *d, const char *p, const char *end)
+{
+  uint64_t priority, ts_delta, sample_rate, saved_errno, nfields, i;
+  ul_buffer_t *buffer = &d->json;
+  int64_t ns;
+
+  if (!d->context_valid ||
+      ul_binlog_get_varint (&p, end, &priority) != 0 ||
+      ul_binlog_get_varint (&p, end, &ts_delta) != 0 ||
+      ul_binlog_get_varint (&p, end, &sample_rate) != 0 ||
+      ul_binlog_get_varint (&p, end, &saved_errno) != 0 ||
+      ul_binlog_get_varint (&p, end, &nfields) != 0)
+    return NULL;
+
+  ns = d->last_ns + (int64_t)((ts_delta >> 1) ^ -(ts_delta & 1));
+  d->last_ns = ns;
+
+  if (ul_buffer_reset (buffer) != 0)
+    return NULL;
+
+  for (i = 0; i < nfields; i++)
+    {
+      decode_string_t key_tmp, fmt_tmp, *key = NULL, *format;
+      const ul_fmt_t *fmt;
+      ul_fmt_t *compiled = NULL;
+      ssize_t size;
+
+      if (i > 0 && (key = decode_string_ref (d, &p, end, &key_tmp)) == NULL)
+        return NULL;
+      /* An inline key lives in d->tmp, which an inline format would
+         overwrite. */
+      if (key == &key_tmp && (key_tmp.str = strdup (key_tmp.str)) == NULL)
+        return NULL;
+
+      format = decode_string_ref (d, &p, end, &fmt_tmp);
+      if (format != NULL)
+        {
+          if (format->fmt == NULL)
+            format->fmt = compiled = ul_fmt_compile (format->str);
+          if (format != &fmt_tmp)
+            compiled = NULL;
+        }
+      fmt = format ? format->fmt : NULL;
+
+      if (fmt == NULL ||
+          (size = ul_fmt_captured_size (fmt, p, end)) < 0)
+        buffer = NULL;
+      else if (fmt->trivial_string)
+        {
+          const char *str = ul_fmt_captured_string (&p);
+
+          buffer = ul_buffer_append (buffer, key ? key->str : "msg",
+                                     str ? str : "(null)");
+        }
+      else
+        {
+          d->text.ptr = d->text.msg;
+          if (ul_fmt_render (fmt, &p, saved_errno, &d->text) != 0)
+            buffer = NULL;
+          else
+            buffer = ul_buffer_append (buffer, key ? key->str : "msg",
+                                       d->text.msg);
+        }
+
+      ul_fmt_free (compiled);
+      if (key == &key_tmp)
+        free (key_tmp.str);
+      if (buffer == NULL)
+        return NULL;
+    }
+
+  if (!(d->flags & LOG_UL_NOIMPLICIT))
+    {
+      int fac = priority & LOG_FACMASK;
+
+      if (fac == 0)
+        fac = d->facility;
+
+      if ((d->fields & LOG_UL_FIELD_PID &&
+           (buffer = ul_buffer_append_int (buffer, "pid",
+                                           d->pid)) == NULL) ||
+          (d->fields & LOG_UL_FIELD_FACILITY &&
+           (buffer = ul_buffer_append (buffer, "facility",
+                                       find_name (facilitynames,
+                                                  fac))) == NULL) ||
+          (d->fields & LOG_UL_FIELD_PRIORITY &&
+           (buffer = ul_buffer_append (buffer, "priority",
+                                       find_name (prioritynames,
+                                                  LOG_PRI (priority))))
+           == NULL) ||
+          (d->fields & LOG_UL_FIELD_UID &&
+           (buffer = ul_buffer_append_uint (buffer, "uid",
+                                            d->uid)) == NULL) ||
+          (d->fields & LOG_UL_FIELD_GID &&
+           (buffer = ul_buffer_append_uint (buffer, "gid",
+                                            d->gid)) == NULL) ||
+          (d->fields & LOG_UL_FIELD_HOST &&
+           (buffer = ul_buffer_append (buffer, "host", d->host)) == NULL))
+        return NULL;
+
+      if (d->flags & LOG_UL_THREADINFO)
+        {
+          decode_string_t tmp, *thread;
+          uint64_t seq;
+
+          if ((thread = decode_string_ref (d, &p, end, &tmp)) == NULL ||
+              ul_binlog_get_varint (&p, end, &seq) != 0 ||
+              (buffer = ul_buffer_append_raw (buffer, thread->str,
+                                              thread->len)) == NULL ||
+              (buffer = ul_buffer_append_uint (buffer, "seq", seq)) == NULL)
+            return NULL;
+        }
+
+      if (d->fields & LOG_UL_FIELD_PROGRAM && d->program != NULL &&
+          (buffer = ul_buffer_append (buffer, "program", d->program)) == NULL)
+        return NULL;
+
+      if (!(d->flags & LOG_UL_NOTIME) && d->fields & LOG_UL_FIELD_TIMESTAMP &&
+          (buffer = decode_timestamp (d, buffer, ns)) == NULL)
+        return NULL;
+    }
+
+  if (sample_rate > 1 &&
+      (buffer = ul_buffer_append_uint (buffer, "sample_rate",
+                                       sample_rate)) == NULL)
+    return NULL;
+
+  return ul_buffer_finalize (buffer);
+}
+
+static int
+decode_file (decoder_t *d, FILE *in)
+{
+  ul_buffer_t frame = { NULL, NULL, NULL };
+  int type, ret;
+
+  while ((ret = ul_binlog_read_frame (in, &frame, &type)) > 0)
+    {
+      const char *p = frame.msg, *end = frame.ptr, *msg = NULL;
+      uint64_t priority;
+
+      if (type != UL_BINLOG_HEADER && !d->valid)
+        goto corrupt;
+
+      switch (type)
+        {
+        case UL_BINLOG_HEADER:
+          if (ul_binlog_check_header (p, end - p) != 0)
+            {
+              fprintf (stderr, "%s: unsupported format, or written on "
+                       "a different architecture\n", d->name);
+              goto err;
+            }
+          decoder_reset (d);
+          d->valid = 1;
+          break;
+        case UL_BINLOG_CONTEXT:
+          if (decode_context (d, p, end) != 0)
+            goto corrupt;
+          break;
+        case UL_BINLOG_STRING:
+          if (decode_string (d, p, end) != 0)
+            goto corrupt;
+          break;
+        case UL_BINLOG_RECORD:
+          if ((msg = decode_record (d, p, end)) == NULL)
+            goto corrupt;
+          break;
+        case UL_BINLOG_JSON:
+          if (ul_binlog_get_varint (&p, end, &priority) != 0)
+            goto corrupt;
+          msg = p;
+          break;
+        default:
+          /* Unknown frames are skipped. */
+          break;
+        }
+
+      if (msg != NULL)
+        printf ("@cee:%s\n", msg);
+    }
+  free (frame.msg);
+
+  if (ret < 0)
+    {
+      fprintf (stderr, "%s: truncated file\n", d->name);
+      return -1;
+    }
+  return 0;
+
+ corrupt:
+  fprintf (stderr, "%s: corrupt file\n", d->name);
+ err:
+  free (frame.msg);
+  return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  decoder_t d;
+  int i, status = 0;
+
+  memset (&d, 0, sizeof (d));
+
+  if (argc > 1 && (strcmp (argv[1], "-h") == 0 ||
+                   strcmp (argv[1], "--help") == 0))
+    {
+      printf ("Usage: %s [FILE]...\n"
+              "Render binary logs written by libumberlog as CEE-JSON.\n"
+              "With no FILE, or when FILE is -, read standard input.\n",
+              argv[0]);
+      return 0;
+    }
+
+  for (i = 1; i < argc || i == 1; i++)
+    {
+      FILE *in = stdin;
+
+      d.name = (i < argc) ? argv[i] : "-";
+      if (strcmp (d.name, "-") != 0 && (in = fopen (d.name, "r")) == NULL)
+        {
+          fprintf (stderr, "%s: %s\n", d.name, strerror (errno));
+          status = 1;
+          continue;
+        }
+
+      d.valid = 0;
+      if (decode_file (&d, in) != 0)
+        status = 1;
+      if (in != stdin)
+        fclose (in);
+    }
+
+  decoder_reset (&d);
+  free (d.host);
+  free (d.program);
+  free (d.json.msg);
+  free (d.text.msg);
+  free (d.tmp.msg);
+
+  return status;
+}